@@ -0,0 +1,81 @@
+"""Read the column tables (.ctab) written by `tiffo table`.
+
+Raw columns are numpy views straight onto a memory map of the file, so
+opening a table costs only the header, however many cells it holds.
+zlib columns are inflated the first time they are used.
+
+    t = TiffoTable("CRC01_quantification.ctab")
+    x = t["X_centroid"]          # numpy array, no copy
+    df = t.to_pandas(["CellID", "CD3", "X_centroid", "Y_centroid"])
+
+The layout is described in src/tiff_table.h.
+"""
+
+import mmap
+import struct
+import zlib
+
+import numpy as np
+
+MAGIC = b"TIFFOTAB"
+VERSION = 1
+HEADER_BYTES = 32
+ENTRY_BYTES = 80
+NAME_BYTES = 48
+
+DTYPES = {1: np.dtype("<i4"), 2: np.dtype("<i8"), 3: np.dtype("<f4"), 4: np.dtype("<f8")}
+
+RAW = 0
+ZLIB = 1
+
+
+class TiffoTable:
+
+    def __init__(self, path):
+        self.path = str(path)
+        with open(self.path, "rb") as f:
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        magic, version, ncols, self.rows = struct.unpack_from("<8sIIQ", self._map, 0)
+        if magic != MAGIC or version != VERSION:
+            raise ValueError(f"{self.path} is not a version {VERSION} column table")
+
+        self._columns = {}
+        self.columns = []
+        for c in range(ncols):
+            base = HEADER_BYTES + c * ENTRY_BYTES
+            name = bytes(self._map[base:base + NAME_BYTES]).split(b"\0", 1)[0].decode()
+            dtype, comp = struct.unpack_from("<BB", self._map, base + NAME_BYTES)
+            offset, stored, raw = struct.unpack_from("<QQQ", self._map, base + 56)
+            if dtype not in DTYPES or comp not in (RAW, ZLIB) or raw != self.rows * DTYPES[dtype].itemsize:
+                raise ValueError(f"column {c} of {self.path} is corrupt")
+            self.columns.append(name)
+            self._columns[name] = (DTYPES[dtype], comp, offset, stored)
+        self._inflated = {}
+
+    def __len__(self):
+        return self.rows
+
+    def __contains__(self, name):
+        return name in self._columns
+
+    def __getitem__(self, name):
+        dtype, comp, offset, stored = self._columns[name]
+        if comp == RAW:
+            return np.frombuffer(self._map, dtype=dtype, count=self.rows, offset=offset)
+        if name not in self._inflated:
+            data = zlib.decompress(self._map[offset:offset + stored])
+            self._inflated[name] = np.frombuffer(data, dtype=dtype, count=self.rows)
+        return self._inflated[name]
+
+    def to_dict(self, columns=None):
+        return {name: self[name] for name in (columns or self.columns)}
+
+    def to_pandas(self, columns=None):
+        import pandas as pd
+        return pd.DataFrame(self.to_dict(columns), copy=False)
+
+
+def read_table(path, columns=None):
+    """Columns of a .ctab as a dict of numpy arrays."""
+    return TiffoTable(path).to_dict(columns)
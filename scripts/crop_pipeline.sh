@@ -3,28 +3,29 @@
 # software paths
 WIPSHOME=${HOME}/git/wips
 TIFFO=${WIPSHOME}/src/tiffo
-CROPSCRIPT=${WIPSHOME}/scripts/crop_random.sh
 
 # input options
 MULTICHANNEL=$1
 COLORIZED=$2
 PALETTE=$3
 CHANNELS=$4
+UM_PER_PIXEL=$5 # optional, overrides the resolution tags for the scale bar
 
 requested_channels=(${CHANNELS//,/ })
 
 # hard coded options
-SCALE=0.325
-image_width=1846 # 1846 = 600 um at 0.325
+image_width=1846 # 1846 = 600 um at 0.325 um per pixel
 image_height=1846
 
-# Check if COLORIZED file already exists
-if [ -f "$COLORIZED" ]; then
-    echo " - $COLORIZED already exists. Delete first to re-run colorize."
-else
-    # run the colorize tiffo
-    echo "###### RUNNING COLORIZE (tiffo.cpp) ######"
-    ${TIFFO} colorize ${MULTICHANNEL} ${COLORIZED} -C ${CHANNELS} -p $PALETTE
+# the crop reads the multichannel image itself, so the full-slide
+# colorize is only run when asked for with FULL_SLIDE=1
+if [ "${FULL_SLIDE}" = "1" ]; then
+    if [ -f "$COLORIZED" ]; then
+	echo " - $COLORIZED already exists. Delete first to re-run colorize."
+    else
+	echo "###### RUNNING COLORIZE (tiffo.cpp) ######"
+	${TIFFO} colorize ${MULTICHANNEL} ${COLORIZED} -C ${CHANNELS} -p $PALETTE
+    fi
 fi
 
 # create a folder to put crops in
@@ -33,6 +34,12 @@ mkdir -p ${color_base}
 random_number=$((RANDOM % 90000 + 10000))
 output=${color_base}/${color_base}_crop${random_number}.jpg
 
-# run the crop thing
-echo "###### RUNNING CROP (crop_random.sh) -- to ${output} ######"
-${CROPSCRIPT} ${COLORIZED} $image_width $image_height $PALETTE $CHANNELS ${output}
+# the scale bar takes its pixel size from the resolution tags unless given
+scale_opt=""
+if [ -n "${UM_PER_PIXEL}" ]; then
+    scale_opt="-u ${UM_PER_PIXEL}"
+fi
+
+# crop, colorize and label straight from the multichannel image
+echo "###### RUNNING CROP (tiffo crop) -- to ${output} ######"
+${TIFFO} crop ${MULTICHANNEL} ${output} -w $image_width -h $image_height -C ${CHANNELS} -p $PALETTE -a ${scale_opt}
@@ -3,37 +3,133 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cstdio>
+#include <cctype>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
 
 Channel::Channel(int num, const std::string& name, RGBColor col, uint16_t lower, uint16_t upper) 
   : channelNumber(num), channelName(name), color(col), lowerBound(lower), upperBound(upper) {}
 
+// the next comma-separated field of line from pos, as an integer
+static int __next_int(const std::string& line, size_t& pos) {
+  if (pos > line.size())
+    throw std::invalid_argument("too few fields");
+  size_t end = std::min(line.find(',', pos), line.size());
+  const char* p = line.data() + pos;
+  const char* e = line.data() + end;
+  while (p < e && isspace(static_cast<unsigned char>(*p)))
+    p++;
+  while (e > p && isspace(static_cast<unsigned char>(e[-1])))
+    e--;
+  int v = 0;
+  auto r = std::from_chars(p, e, v);
+  if (r.ec != std::errc() || r.ptr != e)
+    throw std::invalid_argument("not an integer: " + std::string(p, e));
+  pos = end + 1;
+  return v;
+}
+
 Channel::Channel(const std::string& csvLine) {
-  
-  std::istringstream iss(csvLine);
-  std::string token;
-  
-  std::getline(iss, token, ',');
-  channelNumber = std::stoi(token);
-  
-  std::getline(iss, channelName, ',');
-  
-  std::getline(iss, token, ',');
-  color.r = static_cast<uint8_t>(std::stoi(token));
-  
-  std::getline(iss, token, ',');
-  color.g = static_cast<uint8_t>(std::stoi(token));
-  
-  std::getline(iss, token, ',');
-  color.b = static_cast<uint8_t>(std::stoi(token));
-  
-  std::getline(iss, token, ',');
-  lowerBound = static_cast<uint16_t>(std::stoi(token));
-  
-  std::getline(iss, token);
-  upperBound = static_cast<uint16_t>(std::stoi(token));
-  
+
+  size_t pos = 0;
+  channelNumber = __next_int(csvLine, pos);
+
+  size_t end = std::min(csvLine.find(',', pos), csvLine.size());
+  channelName = csvLine.substr(pos, end - pos);
+  pos = end + 1;
+
+  color.r = static_cast<uint8_t>(__next_int(csvLine, pos));
+  color.g = static_cast<uint8_t>(__next_int(csvLine, pos));
+  color.b = static_cast<uint8_t>(__next_int(csvLine, pos));
+  lowerBound = static_cast<uint16_t>(__next_int(csvLine, pos));
+  upperBound = static_cast<uint16_t>(__next_int(csvLine, pos));
+
+}
+
+int ReadPalette(const std::string& file, ChannelVector& channels) {
+
+  std::ifstream in(file);
+  if (!in) {
+    fprintf(stderr, "ERROR: unable to open palette %s\n", file.c_str());
+    return 1;
+  }
+
+  std::string line;
+  size_t n = 0;
+  bool first = true;
+  while (std::getline(in, line)) {
+    n++;
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line.at(0) == '#')
+      continue;
+    // only the first row can be a header, and only if it isn't a number
+    if (first) {
+      first = false;
+      size_t c = line.find_first_not_of(" \t");
+      if (c != std::string::npos && !isdigit(static_cast<unsigned char>(line.at(c))))
+	continue;
+    }
+    try {
+      channels.emplace_back(line);
+    } catch (const std::exception& e) {
+      fprintf(stderr, "ERROR: bad palette line %zu in %s (%s): %s\n", n, file.c_str(), e.what(),
+	      line.c_str());
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
+int ReadMarkerNames(const std::string& file, std::vector<std::string>& names) {
+
+  std::ifstream in(file);
+  if (!in) {
+    fprintf(stderr, "ERROR: unable to open marker file %s\n", file.c_str());
+    return 1;
+  }
+
+  // column of marker_name, or -1 for a plain list
+  int column = -1;
+  bool first = true;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line.at(0) == '#')
+      continue;
+
+    std::vector<std::string> fields;
+    std::istringstream iss(line);
+    std::string token;
+    while (std::getline(iss, token, ','))
+      fields.push_back(token);
+
+    if (first) {
+      first = false;
+      for (size_t i = 0; i < fields.size(); i++)
+	if (fields[i] == "marker_name")
+	  column = i;
+      if (column >= 0)
+	continue;
+    }
+
+    if (column < 0)
+      names.push_back(line);
+    else if (column < fields.size())
+      names.push_back(fields[column]);
+    else {
+      fprintf(stderr, "ERROR: marker file %s has a row without marker_name: %s\n",
+	      file.c_str(), line.c_str());
+      return 1;
+    }
+  }
+
+  return 0;
+}
 
 // Overload the << operator for RGBColor
 std::ostream& operator<<(std::ostream& os, const RGBColor& color) {
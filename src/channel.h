@@ -1,3 +1,6 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -33,3 +36,15 @@ struct Channel {
 };
 
 typedef std::vector<Channel> ChannelVector;
+
+// read a palette csv of number,name,r,g,b,lower,upper. Blank lines,
+// comments (#) and a header (a first row not starting with a number) are
+// skipped. Any other row that doesn't parse is an error. Returns 0 on success
+int ReadPalette(const std::string& file, ChannelVector& channels);
+
+// read marker names, one per image channel. Either an MCMICRO markers.csv
+// (a header with a marker_name column) or a plain list of one name per
+// line. Returns 0 on success
+int ReadMarkerNames(const std::string& file, std::vector<std::string>& names);
+
+#endif
@@ -0,0 +1,275 @@
+#include "tiff_afsub.h"
+#include "tiff_reader.h"
+#include "tiff_writer.h"
+#include "tiff_pyramid.h"
+#include "tiff_buffer_pool.h"
+
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+// grid step for a tw x th tile
+uint64_t __sample_step(uint64_t tw, uint64_t th) {
+  uint64_t step = AFSUB_SAMPLE_STEP;
+  while ((tw / step) * (th / step) > AFSUB_TILE_SAMPLES)
+    step++;
+  return step;
+}
+
+// pixels of a w x h block on the grid, appended to out. stride is in pixels
+template <typename T>
+void __sample(const T* p, uint64_t stride, uint64_t w, uint64_t h, uint64_t step,
+	      std::vector<float>& out) {
+  for (uint64_t y = step / 2; y < h; y += step)
+    for (uint64_t x = step / 2; x < w; x += step)
+      out.push_back(p[y * stride + x]);
+}
+
+void __sample(const uint8_t* p, uint64_t bps, uint64_t stride, uint64_t w, uint64_t h,
+	      uint64_t step, std::vector<float>& out) {
+  if (bps == 8)
+    __sample(p, stride, w, h, step, out);
+  else
+    __sample(reinterpret_cast<const uint16_t*>(p), stride, w, h, step, out);
+}
+
+// marker - k * af, rounded and clamped at 0, over marker. In float lanes
+// so the loop vectorises whatever the size of k
+template <typename T>
+void __subtract(T* m, const T* a, uint64_t n, float k) {
+#pragma omp simd
+  for (uint64_t i = 0; i < n; i++) {
+    float v = m[i] - k * a[i];
+    m[i] = static_cast<T>(v > 0 ? v + 0.5f : 0);
+  }
+}
+
+// af and marker pixels on the grid of up to AFSUB_SAMPLE_TILES tiles,
+// spaced evenly through the image in tiles of tw x th
+int __sample_image(const TiffReader& reader, size_t af, const std::vector<size_t>& markers,
+		   uint64_t tw, uint64_t th, size_t threads, std::vector<float>& af_samples,
+		   std::vector<std::vector<float>>& marker_samples) {
+
+  const TiffIFD& ifd = reader.IFD(af);
+  uint64_t bps = ifd.bits_per_sample;
+  uint64_t across = (ifd.width + tw - 1) / tw;
+  uint64_t num_tiles = across * ((ifd.height + th - 1) / th);
+  uint64_t n = std::min<uint64_t>(num_tiles, AFSUB_SAMPLE_TILES);
+  uint64_t step = __sample_step(tw, th);
+
+  marker_samples.assign(markers.size(), std::vector<float>());
+  std::atomic<int> err(0);
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (uint64_t i = 0; i < n; i++) {
+
+    if (err)
+      continue;
+
+    uint64_t t = i * num_tiles / n;
+    uint64_t x = (t % across) * tw, y = (t / across) * th;
+    uint64_t w = std::min(tw, ifd.width - x), h = std::min(th, ifd.height - y);
+
+    TileBuffer block = TileBufferPool::Global().Get(tw * th * bps / 8);
+    if (!block || reader.ReadRegion(af, x, y, tw, th, block.data())) {
+      err = 1;
+      continue;
+    }
+    std::vector<float> a;
+    __sample(block.data(), bps, tw, w, h, step, a);
+
+    std::vector<std::vector<float>> m(markers.size());
+    for (size_t j = 0; j < markers.size() && !err; j++) {
+      if (reader.ReadRegion(markers[j], x, y, tw, th, block.data()))
+	err = 1;
+      else
+	__sample(block.data(), bps, tw, w, h, step, m[j]);
+    }
+
+    // the fit is a median, so the order pixels come in doesn't matter
+#pragma omp critical
+    {
+      af_samples.insert(af_samples.end(), a.begin(), a.end());
+      for (size_t j = 0; j < markers.size(); j++)
+	marker_samples[j].insert(marker_samples[j].end(), m[j].begin(), m[j].end());
+    }
+  }
+
+  return err;
+}
+
+}
+
+double FitAutofluorescenceScale(const std::vector<float>& marker, const std::vector<float>& af,
+				float af_floor, float saturated, size_t min_pairs,
+				std::vector<float>& ratios) {
+
+  ratios.clear();
+  for (size_t i = 0; i < af.size(); i++)
+    if (af[i] >= af_floor && af[i] > 0 && af[i] < saturated && marker[i] < saturated)
+      ratios.push_back(marker[i] / af[i]);
+
+  if (ratios.empty() || ratios.size() < min_pairs)
+    return -1;
+
+  std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+  return ratios[ratios.size() / 2];
+}
+
+int SubtractAutofluorescence(const TiffReader& reader, size_t af,
+			     const std::vector<size_t>& markers, TIFF* out, double scale,
+			     bool per_tile, bool verbose, size_t threads) {
+
+  threads = std::max<size_t>(threads, 1);
+  const TiffIFD& aifd = reader.IFD(af);
+  if ((aifd.bits_per_sample != 8 && aifd.bits_per_sample != 16) ||
+      aifd.samples_per_pixel != 1 || aifd.sample_format == SAMPLEFORMAT_IEEEFP ||
+      aifd.sample_format == SAMPLEFORMAT_INT) {
+    fprintf(stderr, "ERROR: the AF channel must be single-sample 8 or 16-bit unsigned\n");
+    return 1;
+  }
+  for (auto d : markers) {
+    const TiffIFD& o = reader.IFD(d);
+    if (d == af) {
+      fprintf(stderr, "ERROR: channel %zu is the AF channel\n", d);
+      return 1;
+    }
+    if (o.width != aifd.width || o.height != aifd.height || o.samples_per_pixel != 1 ||
+	o.bits_per_sample != aifd.bits_per_sample || o.sample_format != aifd.sample_format) {
+      fprintf(stderr, "ERROR: channel %zu does not match the size and type of AF channel %zu\n",
+	      d, af);
+      return 1;
+    }
+  }
+  for (size_t d = 0; d < reader.NumDirs(); d++) {
+    const TiffIFD& o = reader.IFD(d);
+    if ((o.bits_per_sample * o.samples_per_pixel) % 8 ||
+	(o.samples_per_pixel > 1 && o.planar == PLANARCONFIG_SEPARATE)) {
+      fprintf(stderr, "ERROR: directory %zu needs whole-byte, interleaved pixels\n", d);
+      return 1;
+    }
+  }
+
+  uint64_t bps = aifd.bits_per_sample;
+  float saturated = static_cast<float>((1u << bps) - 1);
+  uint64_t atw = aifd.tile_width ? aifd.tile_width : 256;
+  uint64_t ath = aifd.tile_height ? aifd.tile_height : 256;
+
+  // one scale per marker, from the sample grid unless given
+  std::vector<double> scales(markers.size(), scale);
+  float af_floor = 0;
+  if (scale < 0) {
+
+    std::vector<float> af_samples;
+    std::vector<std::vector<float>> marker_samples;
+    if (__sample_image(reader, af, markers, atw, ath, threads, af_samples, marker_samples)) {
+      fprintf(stderr, "ERROR: unable to sample %s\n", reader.filename().c_str());
+      return 1;
+    }
+
+    // the brighter half of the AF channel is tissue, where AF is well
+    // above the noise and the ratios mean something
+    std::vector<float> ratios(af_samples);
+    if (!ratios.empty()) {
+      std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+      af_floor = ratios[ratios.size() / 2];
+    }
+
+    for (size_t j = 0; j < markers.size(); j++) {
+      scales[j] = FitAutofluorescenceScale(marker_samples[j], af_samples, af_floor, saturated,
+					   AFSUB_MIN_SAMPLES, ratios);
+      if (scales[j] < 0) {
+	fprintf(stderr, "ERROR: too few AF pixels in %s to fit channel %zu, give a scale with -s\n",
+		reader.filename().c_str(), markers[j]);
+	return 1;
+      }
+      if (verbose) {
+	const std::vector<std::string>& names = reader.ChannelNames();
+	std::cerr << "...channel " << markers[j];
+	if (markers[j] < names.size())
+	  std::cerr << " (" << names[markers[j]] << ")";
+	std::cerr << ": AF scale " << scales[j] << " from " << ratios.size() << " pixels" << std::endl;
+      }
+    }
+    if (verbose)
+      std::cerr << "...AF floor " << af_floor << " from " << af_samples.size() << " pixels" << std::endl;
+  } else {
+    per_tile = false;
+  }
+
+  TiffPtr in = OpenTagHandle(reader);
+  if (!in)
+    return 1;
+
+  for (size_t d = 0; d < reader.NumDirs(); d++) {
+
+    const TiffIFD& ifd = reader.IFD(d);
+    uint32_t tw = ifd.tile_width ? ifd.tile_width : 256;
+    uint32_t th = ifd.tile_height ? ifd.tile_height : 256;
+    uint64_t bytes_pp = ifd.bits_per_sample * ifd.samples_per_pixel / 8;
+    uint32_t tiles_across = (ifd.width + tw - 1) / tw;
+    uint64_t num_tiles = static_cast<uint64_t>(tiles_across) * ((ifd.height + th - 1) / th);
+    std::unique_ptr<PyramidBuilder> pyramid;
+    if (!TIFFSetDirectory(in.get(), d) || CopyTileTags(in.get(), out, tw, th, 0, pyramid))
+      return 1;
+
+    auto it = std::find(markers.begin(), markers.end(), d);
+    size_t j = it - markers.begin();
+    std::atomic<uint64_t> own_fits(0);
+
+    TileFillFunc fill = [&](uint32_t tile, uint8_t* buf) {
+
+      uint64_t x = static_cast<uint64_t>(tile % tiles_across) * tw;
+      uint64_t y = static_cast<uint64_t>(tile / tiles_across) * th;
+      if (reader.ReadRegion(d, x, y, tw, th, buf))
+	return 1;
+      if (it == markers.end())
+	return 0;
+
+      TileBuffer a = TileBufferPool::Global().Get(static_cast<uint64_t>(tw) * th * bytes_pp);
+      if (!a || reader.ReadRegion(af, x, y, tw, th, a.data()))
+	return 1;
+
+      double k = scales[j];
+      if (per_tile) {
+	uint64_t w = std::min<uint64_t>(tw, ifd.width - x), h = std::min<uint64_t>(th, ifd.height - y);
+	uint64_t step = __sample_step(tw, th);
+	std::vector<float> ms, as, ratios;
+	__sample(buf, bps, tw, w, h, step, ms);
+	__sample(a.data(), bps, tw, w, h, step, as);
+	double kt = FitAutofluorescenceScale(ms, as, af_floor, saturated, AFSUB_MIN_SAMPLES, ratios);
+	if (kt >= 0) {
+	  k = kt;
+	  own_fits++;
+	}
+      }
+
+      uint64_t n = static_cast<uint64_t>(tw) * th;
+      if (bps == 8)
+	__subtract(buf, a.data(), n, static_cast<float>(k));
+      else
+	__subtract(reinterpret_cast<uint16_t*>(buf), a.as<uint16_t>(), n, static_cast<float>(k));
+      return 0;
+    };
+
+    if (WriteTilesParallel(out, fill, threads, pyramid ? pyramid->Sink() : TileSinkFunc()) ||
+	!TIFFWriteDirectory(out) || (pyramid && pyramid->WriteLevels(out, threads))) {
+      fprintf(stderr, "ERROR: unable to write directory %zu\n", d);
+      return 1;
+    }
+
+    if (verbose) {
+      std::cerr << "...wrote directory " << d;
+      if (it != markers.end() && per_tile)
+	std::cerr << ", " << own_fits << " of " << num_tiles << " tiles fit on their own";
+      std::cerr << std::endl;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef TIFF_AFSUB_H
+#define TIFF_AFSUB_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <tiffio.h>
+
+class TiffReader;
+
+// most tiles read to fit the global scale factors
+#define AFSUB_SAMPLE_TILES 256
+
+// pixel step of the sample grid, each way. Large tiles take a coarser
+// grid so no tile gives more than AFSUB_TILE_SAMPLES pixels
+#define AFSUB_SAMPLE_STEP 4
+#define AFSUB_TILE_SAMPLES 4096
+
+// fewest pixels a tile needs above the AF floor for a fit of its own.
+// Tiles with fewer (background, tissue edges) use the global fit
+#define AFSUB_MIN_SAMPLES 256
+
+// robust slope through the origin of marker against af: the median of
+// marker / af over the pixels with af at least af_floor, and neither
+// channel saturated (a Theil-Sen fit with the intercept pinned at 0).
+// Cells that stain for the marker sit above the line and pull the median
+// only as far as they are a minority of the pixels. Reorders ratios.
+// Returns -1 if fewer than min_pairs pixels qualify
+double FitAutofluorescenceScale(const std::vector<float>& marker, const std::vector<float>& af,
+				float af_floor, float saturated, size_t min_pairs,
+				std::vector<float>& ratios);
+
+// write every directory of reader to out, with af times a scale factor
+// subtracted from each of markers (clamped at 0). af and markers must be
+// single-sample, 8 or 16-bit unsigned and the same size. Scale factors
+// are scale if it is at least 0, otherwise fit per marker on a grid of
+// pixels from up to AFSUB_SAMPLE_TILES tiles spread over the image, and
+// with per_tile also refit on each tile's own pixels. Every directory is
+// written tile by tile in parallel, in one pass over the image, with its
+// tags copied by CopyTileTags and any SubIFD pyramid rebuilt. Returns 0
+// on success
+int SubtractAutofluorescence(const TiffReader& reader, size_t af,
+			     const std::vector<size_t>& markers, TIFF* out, double scale,
+			     bool per_tile, bool verbose, size_t threads);
+
+#endif
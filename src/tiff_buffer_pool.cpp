@@ -0,0 +1,161 @@
+#include "tiff_buffer_pool.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_BYTES (2ULL * 1024 * 1024)
+
+TileBuffer& TileBuffer::operator=(TileBuffer&& o) noexcept {
+  if (this != &o) {
+    release();
+    m_pool = o.m_pool;
+    m_data = o.m_data;
+    m_size = o.m_size;
+    m_class = o.m_class;
+    o.m_pool = nullptr;
+    o.m_data = nullptr;
+    o.m_size = 0;
+    o.m_class = -1;
+  }
+  return *this;
+}
+
+void TileBuffer::release() {
+  if (m_data) {
+    if (m_class < 0)
+      free(m_data);
+    else
+      m_pool->__return(m_data, m_class);
+  }
+  m_pool = nullptr;
+  m_data = nullptr;
+  m_size = 0;
+  m_class = -1;
+}
+
+// per-thread free lists. Whatever is left when the thread exits goes
+// to the shared lists
+struct TileBufferPool::Local {
+
+  TileBufferPool* pool = nullptr;
+  std::vector<uint8_t*> free[NUM_CLASSES];
+
+  ~Local() {
+    if (!pool)
+      return;
+    std::lock_guard<std::mutex> lock(pool->m_mutex);
+    for (int c = 0; c < NUM_CLASSES; c++)
+      pool->m_free[c].insert(pool->m_free[c].end(), free[c].begin(), free[c].end());
+  }
+};
+
+TileBufferPool& TileBufferPool::Global() {
+  // never destroyed, since buffers held by other statics (the tile
+  // cache) and by thread-local lists come back during exit
+  static TileBufferPool* pool = new TileBufferPool();
+  return *pool;
+}
+
+TileBufferPool::Local& TileBufferPool::__local() {
+  thread_local Local local;
+  local.pool = this;
+  return local;
+}
+
+static int __size_class(size_t bytes) {
+  int c = TileBufferPool::MIN_CLASS;
+  while (c <= TileBufferPool::MAX_CLASS && (1ULL << c) < bytes)
+    c++;
+  return c;
+}
+
+uint8_t* TileBufferPool::__alloc(int c) {
+
+  size_t bytes = 1ULL << c;
+  bool huge = m_huge && bytes >= HUGE_PAGE_BYTES;
+
+  void* p = nullptr;
+  if (posix_memalign(&p, huge ? HUGE_PAGE_BYTES : TILE_BUFFER_ALIGN, bytes))
+    return nullptr;
+
+#ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+
+  ++m_allocs;
+  uint64_t now = (m_bytes += bytes);
+  uint64_t peak = m_peak;
+  while (now > peak && !m_peak.compare_exchange_weak(peak, now)) {}
+  
+  return static_cast<uint8_t*>(p);
+}
+
+TileBuffer TileBufferPool::Get(size_t bytes, bool zero) {
+
+  ++m_gets;
+  
+  TileBuffer b;
+  b.m_pool = this;
+  b.m_size = bytes;
+
+  int c = __size_class(bytes);
+  if (c > MAX_CLASS) {
+    // too big to be worth keeping around
+    void* p = nullptr;
+    if (posix_memalign(&p, TILE_BUFFER_ALIGN, bytes)) {
+      fprintf(stderr, "ERROR: unable to allocate buffer of %zu bytes\n", bytes);
+      return TileBuffer();
+    }
+    b.m_data = static_cast<uint8_t*>(p);
+  } else {
+
+    b.m_class = c;
+    
+    // this thread's list, then the shared list, then the system
+    Local& local = __local();
+    if (!local.free[c].empty()) {
+      b.m_data = local.free[c].back();
+      local.free[c].pop_back();
+    } else {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_free[c].empty()) {
+	  b.m_data = m_free[c].back();
+	  m_free[c].pop_back();
+	}
+      }
+      if (!b.m_data)
+	b.m_data = __alloc(c);
+    }
+
+    if (!b.m_data) {
+      fprintf(stderr, "ERROR: unable to allocate buffer of %zu bytes\n", bytes);
+      return TileBuffer();
+    }
+  }
+
+  if (zero)
+    memset(b.m_data, 0, bytes);
+  
+  return b;
+}
+
+void TileBufferPool::__return(uint8_t* p, int c) {
+
+  Local& local = __local();
+  if (local.free[c].size() < LOCAL_MAX) {
+    local.free[c].push_back(p);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_free[c].push_back(p);
+}
+
+void TileBufferPool::PrintStats(std::ostream& out) const {
+  out << "Tile buffers: " << m_gets << " checkouts " << m_allocs <<
+    " allocations, holding " << (m_bytes / 1e6) << " MB, peak " <<
+    (m_peak / 1e6) << " MB" << std::endl;
+}
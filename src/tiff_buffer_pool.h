@@ -0,0 +1,119 @@
+#ifndef TIFF_BUFFER_POOL_H
+#define TIFF_BUFFER_POOL_H
+
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+// alignment of every pooled buffer, enough for any SIMD load
+#define TILE_BUFFER_ALIGN 64
+
+class TileBufferPool;
+
+// a tile-sized scratch buffer checked out of a TileBufferPool. It goes
+// back to the pool (not to the system) when it is destroyed. Move-only
+class TileBuffer {
+
+ public:
+
+  TileBuffer() {}
+
+  ~TileBuffer() { release(); }
+
+  TileBuffer(TileBuffer&& o) noexcept { *this = std::move(o); }
+
+  TileBuffer& operator=(TileBuffer&& o) noexcept;
+
+  TileBuffer(const TileBuffer&) = delete;
+  TileBuffer& operator=(const TileBuffer&) = delete;
+
+  uint8_t* data() const { return m_data; }
+
+  template <typename T>
+  T* as() const { return reinterpret_cast<T*>(m_data); }
+
+  // bytes asked for (the buffer itself may be bigger)
+  size_t size() const { return m_size; }
+
+  explicit operator bool() const { return m_data != nullptr; }
+
+  // give the buffer back to the pool early
+  void release();
+
+ private:
+
+  friend class TileBufferPool;
+
+  TileBufferPool* m_pool = nullptr;
+  uint8_t* m_data = nullptr;
+  size_t m_size = 0;
+  int m_class = -1;
+
+};
+
+// pool of 64-byte aligned buffers in power-of-two size classes. Each
+// thread keeps a few free buffers of each class to itself, so checkout
+// and return don't take a lock on the hot path. A buffer is its size
+// rounded up to the next class, so in the worst case (one byte over a
+// power of two) it holds nearly 2x the bytes asked for. Memory is only
+// ever reused, never given back, so peak use is the most buffers ever
+// out at once
+class TileBufferPool {
+
+ public:
+
+  // smallest and largest pooled class (4 KB and 1 GB)
+  static const int MIN_CLASS = 12;
+  static const int MAX_CLASS = 30;
+
+  // free buffers a thread holds per class before handing them to the
+  // shared list
+  static const size_t LOCAL_MAX = 8;
+
+  static TileBufferPool& Global();
+
+  // buffer of at least bytes bytes. Zeroed if zero is true
+  TileBuffer Get(size_t bytes, bool zero = false);
+
+  // back classes of 2 MB and up with transparent huge pages (tiffo -H).
+  // Only buffers allocated afterwards are affected
+  void SetHugePages(bool on) { m_huge = on; }
+
+  // bytes held by the pool, both out and free, and the most ever held
+  uint64_t bytes() const { return m_bytes; }
+  uint64_t peak() const { return m_peak; }
+
+  void PrintStats(std::ostream& out) const;
+
+ private:
+
+  friend class TileBuffer;
+
+  TileBufferPool() {}
+
+  static const int NUM_CLASSES = MAX_CLASS + 1;
+
+  std::mutex m_mutex;
+  std::vector<uint8_t*> m_free[NUM_CLASSES];
+
+  std::atomic<bool> m_huge{false};
+
+  std::atomic<uint64_t> m_bytes{0};
+  std::atomic<uint64_t> m_peak{0};
+  std::atomic<uint64_t> m_gets{0};
+  std::atomic<uint64_t> m_allocs{0};
+
+  uint8_t* __alloc(int c);
+
+  void __return(uint8_t* p, int c);
+
+  // this thread's free lists
+  struct Local;
+  Local& __local();
+
+};
+
+#endif
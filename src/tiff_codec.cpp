@@ -0,0 +1,184 @@
+#include "tiff_codec.h"
+
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+// TIFF LZW constants (see libtiff tif_lzw.c)
+#define LZW_BITS_MIN 9
+#define LZW_BITS_MAX 12
+#define LZW_CODE_CLEAR 256
+#define LZW_CODE_EOI 257
+#define LZW_CODE_FIRST 258
+#define LZW_MAXCODE(n) ((1L << (n)) - 1)
+#define LZW_CODE_MAX LZW_MAXCODE(LZW_BITS_MAX)
+
+// hash table size used by the libtiff encoder (prime, ~90% occupancy)
+#define LZW_HSIZE 9001
+
+bool TiffCanEncodeTile(TIFF* tif) {
+
+  if (!TIFFIsTiled(tif))
+    return false;
+
+  // libtiff would swab multi-byte samples for us, we don't
+  uint16_t bits_per_sample = 8;
+  TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
+  if (TIFFIsByteSwapped(tif) && bits_per_sample > 8)
+    return false;
+
+  uint16_t compression = COMPRESSION_NONE;
+  TIFFGetField(tif, TIFFTAG_COMPRESSION, &compression);
+
+  switch (compression) {
+  case COMPRESSION_NONE:
+    return true;
+  case COMPRESSION_LZW:
+  case COMPRESSION_ADOBE_DEFLATE:
+  case COMPRESSION_DEFLATE:
+    {
+      // predictors are not implemented here
+      uint16_t predictor = PREDICTOR_NONE;
+      TIFFGetField(tif, TIFFTAG_PREDICTOR, &predictor);
+      return predictor == PREDICTOR_NONE;
+    }
+  default:
+    return false;
+  }
+
+}
+
+// MSB-first bit packer for LZW codes
+struct LZWBitWriter {
+
+  std::vector<uint8_t>& out;
+  uint64_t data = 0;
+  int bits = 0;
+
+  LZWBitWriter(std::vector<uint8_t>& o) : out(o) {}
+
+  void put(long code, int nbits) {
+    data = (data << nbits) | static_cast<uint64_t>(code);
+    bits += nbits;
+    while (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<uint8_t>((data >> bits) & 0xff));
+    }
+  }
+
+  // zero the unused trailing bits
+  void flush() {
+    if (bits > 0)
+      out.push_back(static_cast<uint8_t>((data << (8 - bits)) & 0xff));
+    bits = 0;
+  }
+
+};
+
+// follows LZWEncode / LZWPostEncode in libtiff so that the
+// resulting strip is readable by any TIFF LZW decoder
+static void __lzw_encode(const uint8_t* in, size_t len, std::vector<uint8_t>& out) {
+
+  out.clear();
+  out.reserve(len / 2 + 16);
+  LZWBitWriter bw(out);
+
+  // open-addressed table of (prefix << 8 | byte) -> code
+  std::vector<int32_t> hkey(LZW_HSIZE, -1);
+  std::vector<uint16_t> hcode(LZW_HSIZE, 0);
+
+  int nbits = LZW_BITS_MIN;
+  long maxcode = LZW_MAXCODE(LZW_BITS_MIN);
+  long free_ent = LZW_CODE_FIRST;
+
+  bw.put(LZW_CODE_CLEAR, nbits);
+
+  if (len == 0) {
+    bw.put(LZW_CODE_EOI, nbits);
+    bw.flush();
+    return;
+  }
+
+  long ent = in[0];
+  for (size_t i = 1; i < len; ++i) {
+
+    uint8_t c = in[i];
+    int32_t fcode = static_cast<int32_t>((ent << 8) | c);
+
+    // look up the string ent+c
+    size_t h = static_cast<size_t>(fcode) % LZW_HSIZE;
+    while (hkey[h] != -1 && hkey[h] != fcode)
+      h = (h + 1 == LZW_HSIZE) ? 0 : h + 1;
+
+    if (hkey[h] == fcode) {
+      ent = hcode[h];
+      continue;
+    }
+
+    // new string: emit the prefix and add it to the table
+    bw.put(ent, nbits);
+    ent = c;
+    hkey[h] = fcode;
+    hcode[h] = static_cast<uint16_t>(free_ent++);
+
+    if (free_ent == LZW_CODE_MAX - 1) {
+      // table is full, emit clear code and reset
+      std::fill(hkey.begin(), hkey.end(), -1);
+      free_ent = LZW_CODE_FIRST;
+      bw.put(LZW_CODE_CLEAR, nbits);
+      nbits = LZW_BITS_MIN;
+      maxcode = LZW_MAXCODE(LZW_BITS_MIN);
+    } else if (free_ent > maxcode) {
+      nbits++;
+      maxcode = LZW_MAXCODE(nbits);
+    }
+  }
+
+  // flush the last string, accounting for the code the decoder will add
+  bw.put(ent, nbits);
+  free_ent++;
+  if (free_ent == LZW_CODE_MAX - 1) {
+    bw.put(LZW_CODE_CLEAR, nbits);
+    nbits = LZW_BITS_MIN;
+  } else if (free_ent > maxcode) {
+    nbits++;
+  }
+
+  bw.put(LZW_CODE_EOI, nbits);
+  bw.flush();
+}
+
+static int __deflate_encode(const uint8_t* in, size_t len, std::vector<uint8_t>& out, int level) {
+
+  uLongf olen = compressBound(len);
+  out.resize(olen);
+  // libtiff built with libdeflate takes levels up to 12, zlib stops at 9
+  int status = compress2(out.data(), &olen, in, len,
+			 level < 0 ? Z_DEFAULT_COMPRESSION : std::min(level, Z_BEST_COMPRESSION));
+  if (status != Z_OK) {
+    fprintf(stderr, "ERROR: zlib compression failed with status %d\n", status);
+    return 1;
+  }
+  out.resize(olen);
+  return 0;
+}
+
+int TiffEncodeTile(uint16_t compression, const uint8_t* in, size_t len,
+		   std::vector<uint8_t>& out, int zip_level) {
+
+  switch (compression) {
+  case COMPRESSION_NONE:
+    out.assign(in, in + len);
+    return 0;
+  case COMPRESSION_LZW:
+    __lzw_encode(in, len, out);
+    return 0;
+  case COMPRESSION_ADOBE_DEFLATE:
+  case COMPRESSION_DEFLATE:
+    return __deflate_encode(in, len, out, zip_level);
+  default:
+    fprintf(stderr, "ERROR: tile encoder does not support compression %d\n", compression);
+    return 1;
+  }
+
+}
@@ -0,0 +1,28 @@
+#ifndef TIFF_CODEC_H
+#define TIFF_CODEC_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <tiffio.h>
+
+// in-house tile encoders. LZW tiles are the exact byte streams libtiff
+// would write with TIFFWriteEncodedTile; deflate tiles match too when
+// libtiff uses zlib, but only decode the same when it uses libdeflate.
+// Unlike libtiff's codecs, these keep no state on the TIFF pointer, so
+// tiles can be compressed on worker threads and handed back to
+// TIFFWriteRawTile in order. tiff_codec_test (make test) checks both
+// against libtiff.
+
+// true if tiles for the current directory of tif can be encoded
+// with TiffEncodeTile (none, LZW or deflate, no predictor, native byte order)
+bool TiffCanEncodeTile(TIFF* tif);
+
+// encode a single tile of len bytes from in to out using compression
+// (one of COMPRESSION_NONE, COMPRESSION_LZW, COMPRESSION_ADOBE_DEFLATE or
+// COMPRESSION_DEFLATE). zip_level is the deflate level, as in
+// TIFFTAG_ZIPQUALITY (-1 for zlib's default). Returns 0 on success
+int TiffEncodeTile(uint16_t compression, const uint8_t* in, size_t len,
+		   std::vector<uint8_t>& out, int zip_level = -1);
+
+#endif
@@ -0,0 +1,168 @@
+// round trip of the in-house tile encoders through libtiff. Each tile is
+// written twice, once through libtiff's own codec and once as encoded by
+// TiffEncodeTile, then read back: both must decode to the source, and
+// LZW tiles must be byte for byte what libtiff wrote. Run by make test
+#include "tiff_codec.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <tiffio.h>
+
+namespace {
+
+struct TestTile {
+  std::string name;
+  uint32_t edge = 0;
+  uint16_t bps = 8;
+  std::vector<uint8_t> data;
+};
+
+std::vector<TestTile> __tiles() {
+
+  std::mt19937 rng(17);
+  std::vector<TestTile> tiles;
+  auto add = [&](const std::string& name, uint32_t edge, uint16_t bps) -> std::vector<uint8_t>& {
+    tiles.push_back(TestTile());
+    tiles.back().name = name;
+    tiles.back().edge = edge;
+    tiles.back().bps = bps;
+    tiles.back().data.assign(static_cast<size_t>(edge) * edge * bps / 8, 0);
+    return tiles.back().data;
+  };
+
+  add("zeros", 256, 16);
+
+  // uncompressible, so the LZW table fills and is cleared many times
+  for (auto& b : add("random", 512, 8))
+    b = rng() & 0xff;
+
+  // smooth 16-bit signal with noise, like a fluorescence channel
+  std::vector<uint8_t>& smooth = add("smooth", 256, 16);
+  uint16_t* p = reinterpret_cast<uint16_t*>(smooth.data());
+  for (uint32_t y = 0; y < 256; y++)
+    for (uint32_t x = 0; x < 256; x++)
+      p[y * 256 + x] = static_cast<uint16_t>(1000 + 8 * x + 4 * y + rng() % 64);
+
+  // mostly background with a few bright cells
+  std::vector<uint8_t>& sparse = add("sparse", 256, 16);
+  p = reinterpret_cast<uint16_t*>(sparse.data());
+  for (int i = 0; i < 400; i++)
+    p[rng() % (256 * 256)] = static_cast<uint16_t>(rng());
+
+  // long repeats, which grow LZW strings to their longest
+  std::vector<uint8_t>& runs = add("runs", 64, 8);
+  for (size_t i = 0; i < runs.size(); i++)
+    runs[i] = static_cast<uint8_t>((i / 7) % 3);
+
+  return tiles;
+}
+
+// one single-tile directory of t, written by libtiff or from enc
+bool __write(TIFF* tif, const TestTile& t, uint16_t compression, int zip_level,
+	     const std::vector<uint8_t>* enc) {
+  TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, t.edge);
+  TIFFSetField(tif, TIFFTAG_IMAGELENGTH, t.edge);
+  TIFFSetField(tif, TIFFTAG_TILEWIDTH, t.edge);
+  TIFFSetField(tif, TIFFTAG_TILELENGTH, t.edge);
+  TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, t.bps);
+  TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, static_cast<uint16_t>(1));
+  TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+  if (zip_level >= 0)
+    TIFFSetField(tif, TIFFTAG_ZIPQUALITY, zip_level);
+
+  std::vector<uint8_t> copy(t.data);
+  tmsize_t status = enc ?
+    TIFFWriteRawTile(tif, 0, const_cast<uint8_t*>(enc->data()), enc->size()) :
+    TIFFWriteEncodedTile(tif, 0, copy.data(), copy.size());
+  return status >= 0 && TIFFWriteDirectory(tif);
+}
+
+std::vector<uint8_t> __read_raw(TIFF* tif) {
+  std::vector<uint8_t> raw(TIFFGetStrileByteCount(tif, 0));
+  if (TIFFReadRawTile(tif, 0, raw.data(), raw.size()) != static_cast<tmsize_t>(raw.size()))
+    raw.clear();
+  return raw;
+}
+
+}
+
+int main() {
+
+  char file[] = "/tmp/tiff_codec_testXXXXXX";
+  int fd = mkstemp(file);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: unable to make a temporary file\n");
+    return 1;
+  }
+  close(fd);
+
+  struct Codec {
+    const char* name;
+    uint16_t compression;
+    int zip_level;
+  } codecs[] = {
+    {"none", COMPRESSION_NONE, -1},
+    {"lzw", COMPRESSION_LZW, -1},
+    {"deflate", COMPRESSION_ADOBE_DEFLATE, -1},
+    {"deflate-1", COMPRESSION_ADOBE_DEFLATE, 1},
+    {"deflate-9", COMPRESSION_ADOBE_DEFLATE, 9},
+  };
+
+  std::vector<TestTile> tiles = __tiles();
+  int failed = 0;
+
+  for (auto& c : codecs) {
+    for (auto& t : tiles) {
+
+      std::vector<uint8_t> enc;
+      if (TiffEncodeTile(c.compression, t.data.data(), t.data.size(), enc, c.zip_level)) {
+	fprintf(stderr, "FAIL %s %s: encoder error\n", c.name, t.name.c_str());
+	failed++;
+	continue;
+      }
+
+      TIFF* out = TIFFOpen(file, "w");
+      bool ok = out && __write(out, t, c.compression, c.zip_level, NULL) &&
+	__write(out, t, c.compression, c.zip_level, &enc);
+      if (out)
+	TIFFClose(out);
+
+      std::string why;
+      TIFF* in = ok ? TIFFOpen(file, "r") : NULL;
+      if (!in) {
+	why = "unable to write or reopen";
+      } else {
+	std::vector<uint8_t> theirs = __read_raw(in);
+	std::vector<uint8_t> decoded(t.data.size());
+	if (!TIFFSetDirectory(in, 1))
+	  why = "missing directory";
+	else if (__read_raw(in) != enc)
+	  why = "stored bytes differ from the encoder's";
+	else if (TIFFReadEncodedTile(in, 0, decoded.data(), decoded.size()) !=
+		 static_cast<tmsize_t>(decoded.size()) || decoded != t.data)
+	  why = "libtiff decodes it to different pixels";
+	else if (c.compression != COMPRESSION_ADOBE_DEFLATE && theirs != enc)
+	  why = "not the bytes libtiff writes";
+	TIFFClose(in);
+      }
+
+      if (why.empty()) {
+	printf("ok   %-10s %-7s %zu -> %zu bytes\n", c.name, t.name.c_str(), t.data.size(),
+	       enc.size());
+      } else {
+	printf("FAIL %-10s %-7s %s\n", c.name, t.name.c_str(), why.c_str());
+	failed++;
+      }
+    }
+  }
+
+  unlink(file);
+  if (failed)
+    printf("%d failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+#include "tiff_colorize.h"
+#include "tiff_reader.h"
+#include "tiff_prefetch.h"
+#include "tiff_buffer_pool.h"
+#include "tiff_encode.h"
+#include "tiff_raster.h"
+
+#include <atomic>
+#include <cstring>
+#include <algorithm>
+
+ColorizeKernel::ColorizeKernel(const ChannelVector& channels) : m_channels(channels) {
+
+  m_window.resize(m_channels.size());
+  for (size_t c = 0; c < m_channels.size(); c++) {
+    
+    uint64_t A = m_channels[c].lowerBound, B = m_channels[c].upperBound;
+    double scale = (B > A) ? 255.0 / (B - A) : 0;
+
+    std::vector<uint8_t>& lut = m_window[c];
+    lut.resize(65536);
+    for (uint64_t v = 0; v < 65536; v++) {
+      if (v <= A)
+	lut[v] = 0;
+      else if (v >= B)
+	lut[v] = 255;
+      else
+	lut[v] = static_cast<uint8_t>((v - A) * scale);
+    }
+  }
+}
+
+void ColorizeKernel::Apply(const uint16_t* const* planes, size_t n, uint8_t* rgb) const {
+
+  size_t nc = m_channels.size();
+  
+  for (size_t i = 0; i < n; i++) {
+    uint32_t r = 0, g = 0, b = 0;
+    for (size_t c = 0; c < nc; c++) {
+      uint32_t v = m_window[c][planes[c][i]];
+      r += m_channels[c].color.r * v;
+      g += m_channels[c].color.g * v;
+      b += m_channels[c].color.b * v;
+    }
+    rgb[i * 3    ] = std::min<uint32_t>(r, 255 * 255) / 255;
+    rgb[i * 3 + 1] = std::min<uint32_t>(g, 255 * 255) / 255;
+    rgb[i * 3 + 2] = std::min<uint32_t>(b, 255 * 255) / 255;
+  }
+}
+
+const Channel* FindPaletteRow(const ChannelVector& palette, size_t n,
+			      const std::vector<std::string>& names) {
+
+  if (n < names.size() && !names[n].empty())
+    for (auto& row : palette)
+      if (row.channelName == names[n])
+	return &row;
+  return n < palette.size() ? &palette[n] : NULL;
+}
+
+int SelectPaletteChannels(const std::string& palette_file, const std::vector<int>& channels,
+			  size_t num_dirs, ChannelVector& selected,
+			  const std::vector<std::string>& names) {
+
+  ChannelVector pal;
+  if (ReadPalette(palette_file, pal))
+    return 1;
+
+  if (channels.empty()) {
+    fprintf(stderr, "Error: no channels selected\n");
+    return 1;
+  }
+  
+  for (auto n : channels) {
+    if (n < 0 || n >= num_dirs) {
+      fprintf(stderr, "Error: channel %d is not in the image of %zu channels\n", n, num_dirs);
+      return 1;
+    }
+    const Channel* row = FindPaletteRow(pal, n, names);
+    if (!row) {
+      fprintf(stderr, "Error: channel %d is not in the palette of %zu channels\n", n, pal.size());
+      return 1;
+    }
+    if (n < names.size() && !names[n].empty() && !row->channelName.empty() &&
+	row->channelName != names[n])
+      fprintf(stderr, "Warning: channel %d is %s, but is colored by palette row %s\n", n,
+	      names[n].c_str(), row->channelName.c_str());
+    selected.push_back(*row);
+    selected.back().channelNumber = n;
+  }
+  
+  return 0;
+}
+
+int ColorizeRegion(const TiffReader& reader, const std::vector<size_t>& dirs,
+		   const ColorizeKernel& kernel, uint64_t x, uint64_t y,
+		   uint64_t w, uint64_t h, uint8_t* rgb, size_t threads) {
+
+  if (dirs.size() != kernel.size()) {
+    fprintf(stderr, "ERROR: %zu channels for a palette of %zu\n", dirs.size(), kernel.size());
+    return 1;
+  }
+  for (auto d : dirs) {
+    const TiffIFD& ifd = reader.IFD(d);
+    if (ifd.bits_per_sample != 16 || ifd.samples_per_pixel != 1) {
+      fprintf(stderr, "ERROR: colorize needs 16-bit single sample channels, dir %zu is not\n", d);
+      return 1;
+    }
+  }
+  
+  threads = std::max<size_t>(threads, 1);
+  
+  // warm the tile cache with as few reads as the layout allows
+  ReadPlan plan = PlanReads(reader, TileOrderRegion(reader, dirs, x, y, w, h), SIZE_MAX);
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (size_t r = 0; r < plan.size(); r++)
+    reader.ReadTileRun(plan[r]);
+
+  // then cut each channel out of the cached tiles
+  size_t nc = dirs.size();
+  std::vector<TileBuffer> planes(nc);
+  std::vector<const uint16_t*> ptrs(nc);
+  int err = 0;
+  for (size_t c = 0; c < nc; c++) {
+    planes[c] = TileBufferPool::Global().Get(w * h * sizeof(uint16_t));
+    if (!planes[c])
+      return 1;
+    ptrs[c] = planes[c].as<uint16_t>();
+  }
+  
+#pragma omp parallel for num_threads(threads) reduction(|:err)
+  for (size_t c = 0; c < nc; c++)
+    err |= reader.ReadRegion(dirs[c], x, y, w, h, planes[c].data());
+  if (err)
+    return 1;
+
+#pragma omp parallel for num_threads(threads) schedule(static)
+  for (uint64_t row = 0; row < h; row++) {
+    std::vector<const uint16_t*> p(nc);
+    for (size_t c = 0; c < nc; c++)
+      p[c] = ptrs[c] + row * w;
+    kernel.Apply(p.data(), w, rgb + row * w * 3);
+  }
+
+  return 0;
+}
+
+// out.jpg -> out_3_7.jpg
+static std::string __tile_file(const std::string& file, uint32_t row, uint32_t col) {
+  size_t dot = file.find_last_of('.');
+  return file.substr(0, dot) + "_" + std::to_string(row) + "_" + std::to_string(col) + file.substr(dot);
+}
+
+int ColorizeToImage(const TiffReader& reader, const std::vector<size_t>& dirs,
+		    const ColorizeKernel& kernel, const std::string& outfile,
+		    bool tiles, int quality, bool verbose, size_t threads) {
+
+  if (dirs.size() != kernel.size() || dirs.empty()) {
+    fprintf(stderr, "ERROR: %zu channels for a palette of %zu\n", dirs.size(), kernel.size());
+    return 1;
+  }
+  
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  if (!ifd.tile_width || !ifd.tile_height) {
+    fprintf(stderr, "ERROR: colorize needs a tiled image\n");
+    return 1;
+  }
+  for (auto d : dirs) {
+    const TiffIFD& o = reader.IFD(d);
+    if (o.bits_per_sample != 16 || o.samples_per_pixel != 1 || o.width != ifd.width ||
+	o.height != ifd.height || o.tile_width != ifd.tile_width || o.tile_height != ifd.tile_height) {
+      fprintf(stderr, "ERROR: dir %zu does not match the layout of dir %zu\n", d, dirs[0]);
+      return 1;
+    }
+  }
+
+  // before hours of colorizing into a raster the encoder can't take
+  uint64_t max_dim = RGBImageMaxDimension(outfile);
+  if (!tiles && max_dim && (ifd.width > max_dim || ifd.height > max_dim)) {
+    fprintf(stderr, "ERROR: %llu x %llu is too large for %s (at most %llu a side), "
+	    "write tiles with -T instead\n", static_cast<unsigned long long>(ifd.width),
+	    static_cast<unsigned long long>(ifd.height), outfile.c_str(),
+	    static_cast<unsigned long long>(max_dim));
+    return 1;
+  }
+
+  threads = std::max<size_t>(threads, 1);
+  uint64_t tw = ifd.tile_width, th = ifd.tile_height;
+  uint32_t across = (ifd.width + tw - 1) / tw;
+  uint32_t down = (ifd.height + th - 1) / th;
+  uint32_t num_tiles = across * down;
+  size_t nc = dirs.size();
+  
+  // whole image: colorized tiles land here, then it is encoded in one go
+  uint8_t* image = NULL;
+  if (!tiles) {
+    image = static_cast<uint8_t*>(RasterAlloc(ifd.width * ifd.height * 3));
+    if (!image)
+      return 1;
+  }
+  
+  TilePrefetcher prefetch(reader, TileOrderRowMajor(reader, dirs, true), threads);
+  std::atomic<int> err(0);
+  
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (uint32_t t = 0; t < num_tiles; t++) {
+
+    if (err)
+      continue;
+
+    std::vector<TiffTilePtr> in(nc);
+    std::vector<const uint16_t*> planes(nc);
+    for (size_t c = 0; c < nc; c++) {
+      in[c] = prefetch.Get(static_cast<size_t>(t) * nc + c);
+      if (!in[c]) {
+	fprintf(stderr, "Error reading channel %zu tile %u\n", dirs[c], t);
+	err = 1;
+	break;
+      }
+      planes[c] = reinterpret_cast<const uint16_t*>(in[c]->data);
+    }
+    if (err)
+      continue;
+
+    TileBuffer rgb = TileBufferPool::Global().Get(tw * th * 3);
+    if (!rgb) {
+      err = 1;
+      continue;
+    }
+    kernel.Apply(planes.data(), tw * th, rgb.data());
+
+    // edge tiles are cut down to the image
+    uint32_t row = t / across, col = t % across;
+    uint64_t vw = std::min<uint64_t>(tw, ifd.width - col * tw);
+    uint64_t vh = std::min<uint64_t>(th, ifd.height - row * th);
+    
+    if (tiles) {
+      for (uint64_t y = 1; y < vh && vw < tw; y++)
+	memmove(rgb.data() + y * vw * 3, rgb.data() + y * tw * 3, vw * 3);
+      if (WriteRGBImage(__tile_file(outfile, row, col), rgb.data(), vw, vh, quality))
+	err = 1;
+    } else {
+      for (uint64_t y = 0; y < vh; y++)
+	memcpy(image + ((row * th + y) * ifd.width + col * tw) * 3,
+	       rgb.data() + y * tw * 3, vw * 3);
+    }
+
+    if (verbose && col == 0) {
+#pragma omp critical
+      std::cerr << "...colorized tile row " << (row + 1) << " of " << down << std::endl;
+    }
+  }
+
+  if (!tiles) {
+    if (!err && WriteRGBImage(outfile, image, ifd.width, ifd.height, quality, threads))
+      err = 1;
+    RasterFree(image);
+  }
+  
+  return err;
+}
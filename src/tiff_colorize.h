@@ -0,0 +1,67 @@
+#ifndef TIFF_COLORIZE_H
+#define TIFF_COLORIZE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "channel.h"
+
+class TiffReader;
+
+// blends 16-bit channels into 8-bit RGB with a palette, the same way as
+// combineChannelsToRGB, but with the windowing of each channel looked up
+// in a table built once up front
+class ColorizeKernel {
+
+ public:
+
+  // one entry of channels per plane passed to Apply
+  ColorizeKernel(const ChannelVector& channels);
+
+  size_t size() const { return m_channels.size(); }
+
+  const ChannelVector& channels() const { return m_channels; }
+  
+  // colorize n pixels. planes[c] holds the n values of channel c
+  void Apply(const uint16_t* const* planes, size_t n, uint8_t* rgb) const;
+
+ private:
+
+  ChannelVector m_channels;
+
+  // windowed 8-bit value of every 16-bit input, per channel
+  std::vector<std::vector<uint8_t>> m_window;
+  
+};
+
+// the palette row for directory n. If the image names its channels
+// (names, one per directory) and a row has the name of channel n, that
+// row, otherwise row n. NULL if there is neither
+const Channel* FindPaletteRow(const ChannelVector& palette, size_t n,
+			      const std::vector<std::string>& names);
+
+// the palette rows for channels (see FindPaletteRow), checked against the
+// palette and the num_dirs of the image. A row picked by number whose name
+// differs from the channel's is warned about. Returns 0 on success
+int SelectPaletteChannels(const std::string& palette_file, const std::vector<int>& channels,
+			  size_t num_dirs, ChannelVector& selected,
+			  const std::vector<std::string>& names = std::vector<std::string>());
+
+// colorize the w x h window at (x, y) of dirs (one per kernel channel)
+// into rgb, w * h * 3 bytes. Only the tiles under the window are read,
+// with adjacent tiles fetched together
+int ColorizeRegion(const TiffReader& reader, const std::vector<size_t>& dirs,
+		   const ColorizeKernel& kernel, uint64_t x, uint64_t y,
+		   uint64_t w, uint64_t h, uint8_t* rgb, size_t threads);
+
+// colorize every tile of dirs straight to JPEG/PNG/WebP (by the extension
+// of outfile) rather than a TIFF. Either one image of the whole slide, or
+// with tiles, one image per TIFF tile named <outfile base>_<row>_<col>.<ext>,
+// encoded in parallel
+int ColorizeToImage(const TiffReader& reader, const std::vector<size_t>& dirs,
+		    const ColorizeKernel& kernel, const std::string& outfile,
+		    bool tiles, int quality, bool verbose, size_t threads);
+
+#endif
@@ -0,0 +1,363 @@
+#include "tiff_csv.h"
+
+#include <cmath>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <condition_variable>
+#include <zlib.h>
+
+namespace {
+
+struct Chunk {
+  size_t index = 0;
+  std::string text;
+};
+
+// the columns of one chunk, by slot (position in the table)
+struct ParsedChunk {
+  size_t rows = 0;
+  size_t lines = 0;
+  std::vector<std::vector<double>> values;
+  std::vector<char> integer;
+  std::vector<char> numeric;
+
+  // first line (within the chunk) missing a kept field, and its field count
+  size_t short_line = SIZE_MAX;
+  size_t short_fields = 0;
+};
+
+// chunks from the inflating thread to the parsers. Push blocks while
+// the queue is full, so only a few chunks are ever in memory
+class ChunkQueue {
+
+ public:
+
+  ChunkQueue(size_t capacity) : m_capacity(capacity) {}
+
+  void Push(Chunk&& c) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_queue.size() < m_capacity || m_closed; });
+    if (m_closed)
+      return;
+    m_queue.push_back(std::move(c));
+    m_cv.notify_all();
+  }
+
+  // false once closed and drained
+  bool Pop(Chunk& c) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return !m_queue.empty() || m_closed; });
+    if (m_queue.empty())
+      return false;
+    c = std::move(m_queue.front());
+    m_queue.pop_front();
+    m_cv.notify_all();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+    m_cv.notify_all();
+  }
+
+ private:
+
+  size_t m_capacity;
+  bool m_closed = false;
+  std::deque<Chunk> m_queue;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+};
+
+// field [p, end) as a number. Surrounding spaces and quotes are ignored,
+// and an empty field is NaN
+inline bool __parse_field(const char* p, const char* end, double& v, bool& integer) {
+
+  while (p < end && (*p == ' ' || *p == '"'))
+    p++;
+  while (end > p && (end[-1] == ' ' || end[-1] == '"'))
+    end--;
+  if (p == end) {
+    v = NAN;
+    integer = false;
+    return true;
+  }
+  if (*p == '+')
+    p++;
+
+  auto r = std::from_chars(p, end, v);
+  if (r.ec != std::errc() || r.ptr != end)
+    return false;
+
+  for (const char* q = p; q < end && integer; q++)
+    integer = (*q >= '0' && *q <= '9') || *q == '-';
+  return true;
+}
+
+void __parse_chunk(const std::string& text, const std::vector<int>& slots, size_t num_slots,
+		   size_t min_fields, ParsedChunk& out) {
+
+  out.values.assign(num_slots, std::vector<double>());
+  out.integer.assign(num_slots, 1);
+  out.numeric.assign(num_slots, 1);
+
+  // about how many rows, from the first line
+  const char* p = text.data();
+  const char* end = p + text.size();
+  const char* first = static_cast<const char*>(memchr(p, '\n', end - p));
+  if (first && first > p)
+    for (auto& v : out.values)
+      v.reserve(text.size() / (first - p + 1) + 16);
+
+  while (p < end) {
+
+    const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+    if (!eol)
+      eol = end;
+    const char* line_end = eol;
+    if (line_end > p && line_end[-1] == '\r')
+      line_end--;
+    out.lines++;
+
+    if (line_end > p) {
+      size_t col = 0;
+      const char* f = p;
+      while (true) {
+	const char* fe = static_cast<const char*>(memchr(f, ',', line_end - f));
+	if (!fe)
+	  fe = line_end;
+	int slot = col < slots.size() ? slots[col] : -1;
+	if (slot >= 0) {
+	  double v;
+	  bool integer = true;
+	  if (!__parse_field(f, fe, v, integer)) {
+	    out.numeric[slot] = 0;
+	    v = NAN;
+	  }
+	  if (!integer)
+	    out.integer[slot] = 0;
+	  out.values[slot].push_back(v);
+	}
+	col++;
+	if (fe == line_end)
+	  break;
+	f = fe + 1;
+      }
+
+      if (col < min_fields) {
+	if (out.short_line == SIZE_MAX) {
+	  out.short_line = out.lines;
+	  out.short_fields = col;
+	}
+	// keep the columns the same length
+	for (auto& v : out.values)
+	  v.resize(out.rows + 1, NAN);
+      }
+      out.rows++;
+    }
+
+    p = eol + 1;
+  }
+}
+
+// header names, with quotes and spaces trimmed
+std::vector<std::string> __split_header(std::string line) {
+  if (!line.empty() && line.back() == '\r')
+    line.pop_back();
+  std::vector<std::string> names;
+  size_t pos = 0;
+  while (pos <= line.size()) {
+    size_t end = std::min(line.find(',', pos), line.size());
+    std::string name = line.substr(pos, end - pos);
+    size_t a = name.find_first_not_of(" \""), b = name.find_last_not_of(" \"");
+    names.push_back(a == std::string::npos ? "" : name.substr(a, b - a + 1));
+    pos = end + 1;
+  }
+  return names;
+}
+
+}
+
+int CsvTable::Find(const std::string& name) const {
+  for (size_t i = 0; i < columns.size(); i++)
+    if (columns[i].name == name)
+      return i;
+  return -1;
+}
+
+int ReadCsvTable(const std::string& file, CsvTable& table,
+		 const std::vector<std::string>& select, size_t threads) {
+
+  // gzopen reads plain files as they are
+  gzFile gz = gzopen(file.c_str(), "rb");
+  if (!gz) {
+    fprintf(stderr, "ERROR: unable to open %s\n", file.c_str());
+    return 1;
+  }
+  gzbuffer(gz, 1 << 20);
+
+  // the header, and whatever came after it
+  std::string carry;
+  size_t nl;
+  while ((nl = carry.find('\n')) == std::string::npos) {
+    char buf[65536];
+    int n = gzread(gz, buf, sizeof(buf));
+    if (n <= 0)
+      break;
+    carry.append(buf, n);
+  }
+  if (carry.empty()) {
+    fprintf(stderr, "ERROR: %s is empty or unreadable\n", file.c_str());
+    gzclose(gz);
+    return 1;
+  }
+  if (nl == std::string::npos)
+    nl = carry.size();
+  std::vector<std::string> header = __split_header(carry.substr(0, nl));
+  carry.erase(0, std::min(nl + 1, carry.size()));
+
+  // which slot each field goes to
+  std::vector<int> slots(header.size(), -1);
+  std::vector<std::string> names;
+  if (select.empty()) {
+    for (size_t c = 0; c < header.size(); c++) {
+      slots[c] = c;
+      names.push_back(header[c]);
+    }
+  } else {
+    for (auto& s : select) {
+      auto it = std::find(header.begin(), header.end(), s);
+      if (it == header.end()) {
+	fprintf(stderr, "ERROR: %s has no column %s\n", file.c_str(), s.c_str());
+	gzclose(gz);
+	return 1;
+      }
+      slots[it - header.begin()] = names.size();
+      names.push_back(s);
+    }
+  }
+  size_t min_fields = 0;
+  for (size_t c = 0; c < slots.size(); c++)
+    if (slots[c] >= 0)
+      min_fields = c + 1;
+
+  threads = std::max<size_t>(threads, 1);
+  ChunkQueue queue(threads + 1);
+  bool read_error = false;
+
+  // inflate and cut at the last line end of each block
+  std::thread reader([&]() {
+      size_t index = 0;
+      while (true) {
+	std::string text = std::move(carry);
+	size_t have = text.size();
+	text.resize(have + CSV_CHUNK_BYTES);
+	int n = gzread(gz, &text[have], CSV_CHUNK_BYTES);
+	if (n < 0) {
+	  int errnum;
+	  fprintf(stderr, "ERROR: unable to read %s: %s\n", file.c_str(), gzerror(gz, &errnum));
+	  read_error = true;
+	  break;
+	}
+	text.resize(have + n);
+	if (n == 0) {
+	  if (!text.empty())
+	    queue.Push(Chunk{index++, std::move(text)});
+	  break;
+	}
+	size_t last = text.rfind('\n');
+	if (last == std::string::npos) {
+	  carry = std::move(text);
+	  continue;
+	}
+	carry = text.substr(last + 1);
+	text.resize(last + 1);
+	queue.Push(Chunk{index++, std::move(text)});
+      }
+      queue.Close();
+    });
+
+  std::vector<ParsedChunk> parsed;
+  std::mutex parsed_mutex;
+  auto parse = [&]() {
+    Chunk c;
+    while (queue.Pop(c)) {
+      ParsedChunk out;
+      __parse_chunk(c.text, slots, names.size(), min_fields, out);
+      std::lock_guard<std::mutex> lock(parsed_mutex);
+      if (parsed.size() <= c.index)
+	parsed.resize(c.index + 1);
+      parsed[c.index] = std::move(out);
+    }
+  };
+
+  std::vector<std::thread> parsers;
+  for (size_t t = 1; t < threads; t++)
+    parsers.emplace_back(parse);
+  parse();
+  for (auto& t : parsers)
+    t.join();
+  reader.join();
+  gzclose(gz);
+
+  if (read_error)
+    return 1;
+
+  // report the first short line by its line in the file
+  size_t line = 1;
+  for (auto& p : parsed) {
+    if (p.short_line != SIZE_MAX) {
+      fprintf(stderr, "ERROR: line %zu of %s has %zu fields, expected at least %zu\n",
+	      line + p.short_line, file.c_str(), p.short_fields, min_fields);
+      return 1;
+    }
+    line += p.lines;
+  }
+
+  // join the chunks column by column
+  size_t rows = 0;
+  for (auto& p : parsed)
+    rows += p.rows;
+
+  std::vector<CsvColumn> columns(names.size());
+  std::vector<char> keep(names.size(), 1);
+  int err = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1) reduction(|:err)
+  for (size_t s = 0; s < names.size(); s++) {
+    CsvColumn& col = columns[s];
+    col.name = names[s];
+    for (auto& p : parsed) {
+      col.integer = col.integer && p.integer[s];
+      if (!p.numeric[s])
+	keep[s] = 0;
+    }
+    if (!keep[s]) {
+      if (!select.empty()) {
+	fprintf(stderr, "ERROR: column %s of %s is not numeric\n", col.name.c_str(), file.c_str());
+	err = 1;
+      }
+      continue;
+    }
+    col.values.reserve(rows);
+    for (auto& p : parsed) {
+      col.values.insert(col.values.end(), p.values[s].begin(), p.values[s].end());
+      std::vector<double>().swap(p.values[s]);
+    }
+  }
+  if (err)
+    return 1;
+
+  table.columns.clear();
+  for (size_t s = 0; s < names.size(); s++)
+    if (keep[s])
+      table.columns.push_back(std::move(columns[s]));
+
+  return 0;
+}
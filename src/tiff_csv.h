@@ -0,0 +1,42 @@
+#ifndef TIFF_CSV_H
+#define TIFF_CSV_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// bytes of text handed to a parser at a time
+#define CSV_CHUNK_BYTES (8ULL * 1024 * 1024)
+
+// one numeric column. integer is true if every value was written without
+// a fraction or exponent (CellID, Area), which the values hold exactly
+struct CsvColumn {
+  std::string name;
+  bool integer = true;
+  std::vector<double> values;
+};
+
+// a numeric CSV table held by column, as quantification tables are
+struct CsvTable {
+
+  std::vector<CsvColumn> columns;
+
+  size_t rows() const { return columns.empty() ? 0 : columns[0].values.size(); }
+
+  // index of the column called name, or -1
+  int Find(const std::string& name) const;
+};
+
+// read a CSV with a header line, plain or gzipped. One thread inflates
+// and cuts the text into chunks at line ends while threads parse the
+// chunks with from_chars into per-chunk columns, which are joined in
+// order at the end. Only the columns named in select are kept (every
+// column if it is empty), and they are returned in that order. Empty
+// fields are NaN. Kept columns must hold numbers, and when reading every
+// column, the ones that don't are left out. Returns 0 on success
+int ReadCsvTable(const std::string& file, CsvTable& table,
+		 const std::vector<std::string>& select = std::vector<std::string>(),
+		 size_t threads = 1);
+
+#endif
@@ -0,0 +1,229 @@
+#include "tiff_dzi.h"
+#include "tiff_reader.h"
+#include "tiff_colorize.h"
+#include "tiff_encode.h"
+#include "tiff_scale.h"
+#include "tiff_buffer_pool.h"
+
+#include <cmath>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <sys/stat.h>
+
+namespace {
+
+struct DZILevel {
+  uint64_t width = 0;
+  uint64_t height = 0;
+  uint64_t across = 0;
+  uint64_t down = 0;
+
+  // the tile row being reduced into from the level above
+  std::vector<uint8_t> row;
+  uint64_t row_index = 0;
+};
+
+class DeepZoomWriter {
+
+ public:
+
+  DeepZoomWriter(const TiffReader& reader, const std::vector<size_t>& dirs,
+		 const ColorizeKernel& kernel, const std::string& files_dir,
+		 uint32_t tile_size, const std::string& ext, int quality, bool verbose,
+		 size_t threads) :
+    m_reader(reader), m_dirs(dirs), m_kernel(kernel), m_files(files_dir),
+    m_size(tile_size), m_ext(ext), m_quality(quality), m_verbose(verbose),
+    m_threads(threads) {}
+
+  int Run(uint64_t width, uint64_t height);
+
+  uint64_t tiles() const { return m_tiles; }
+  
+ private:
+
+  const TiffReader& m_reader;
+  const std::vector<size_t>& m_dirs;
+  const ColorizeKernel& m_kernel;
+  std::string m_files;
+  uint64_t m_size;
+  std::string m_ext;
+  int m_quality;
+  bool m_verbose;
+  size_t m_threads;
+
+  // level 0 is 1 x 1, the last level is full resolution
+  std::vector<DZILevel> m_levels;
+  
+  std::atomic<uint64_t> m_tiles{0};
+  
+  // produce, write and reduce tile row ty of level l
+  int __row(size_t l, uint64_t ty);
+  
+};
+
+int DeepZoomWriter::Run(uint64_t width, uint64_t height) {
+
+  size_t num_levels = DeepZoomLevels(width, height);
+  m_levels.resize(num_levels);
+  uint64_t w = width, h = height;
+  for (size_t l = num_levels; l-- > 0;) {
+    DZILevel& lev = m_levels[l];
+    lev.width = w;
+    lev.height = h;
+    lev.across = (w + m_size - 1) / m_size;
+    lev.down = (h + m_size - 1) / m_size;
+    if (l + 1 < num_levels)
+      lev.row.assign(m_size * w * 3, 0);
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+
+    std::string dir = m_files + "/" + std::to_string(l);
+    if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+      fprintf(stderr, "ERROR: unable to make directory %s\n", dir.c_str());
+      return 1;
+    }
+  }
+
+  size_t top = num_levels - 1;
+  for (uint64_t ty = 0; ty < m_levels[top].down; ty++) {
+    if (__row(top, ty))
+      return 1;
+    if (m_verbose)
+      std::cerr << "...finished tile row " << (ty + 1) << " of " << m_levels[top].down << std::endl;
+  }
+
+  return 0;
+}
+
+int DeepZoomWriter::__row(size_t l, uint64_t ty) {
+
+  DZILevel& lev = m_levels[l];
+  bool full = l + 1 == m_levels.size();
+  std::atomic<int> err(0);
+  
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic, 1)
+  for (uint64_t tx = 0; tx < lev.across; tx++) {
+
+    if (err)
+      continue;
+    
+    uint64_t vw = std::min(m_size, lev.width - tx * m_size);
+    uint64_t vh = std::min(m_size, lev.height - ty * m_size);
+    TileBuffer tile = TileBufferPool::Global().Get(vw * vh * 3);
+    if (!tile) {
+      err = 1;
+      continue;
+    }
+
+    // full resolution tiles are colorized, the rest come from the row
+    // reduced out of the level above
+    if (full) {
+      if (ColorizeRegion(m_reader, m_dirs, m_kernel, tx * m_size, ty * m_size, vw, vh,
+			 tile.data(), 1)) {
+	err = 1;
+	continue;
+      }
+    } else {
+      for (uint64_t y = 0; y < vh; y++)
+	memcpy(tile.data() + y * vw * 3, lev.row.data() + (y * lev.width + tx * m_size) * 3, vw * 3);
+    }
+
+    std::string file = m_files + "/" + std::to_string(l) + "/" + std::to_string(tx) + "_" +
+      std::to_string(ty) + "." + m_ext;
+    if (WriteRGBImage(file, tile.data(), vw, vh, m_quality)) {
+      err = 1;
+      continue;
+    }
+    m_tiles++;
+
+    // this tile is a quarter of a tile of the level below
+    if (l > 0) {
+      DZILevel& below = m_levels[l - 1];
+      uint8_t* dst = below.row.data() +
+	(((ty % 2) * (m_size / 2)) * below.width + tx * (m_size / 2)) * 3;
+      if (ScaleBuffer(tile.data(), vw, vw, vh, 3, 8, 2, false, dst, below.width))
+	err = 1;
+    }
+  }
+
+  if (err)
+    return 1;
+
+  // the row below is done once it has both of its halves
+  if (l > 0 && (ty % 2 == 1 || ty + 1 == lev.down)) {
+    DZILevel& below = m_levels[l - 1];
+    if (__row(l - 1, below.row_index++))
+      return 1;
+    std::fill(below.row.begin(), below.row.end(), 0);
+  }
+
+  return 0;
+}
+
+}
+
+size_t DeepZoomLevels(uint64_t width, uint64_t height) {
+  // levels until the image is a single pixel
+  return static_cast<size_t>(std::ceil(std::log2(std::max<uint64_t>({width, height, 1})))) + 1;
+}
+
+std::string DeepZoomDescriptor(uint64_t width, uint64_t height, uint32_t tile_size,
+			       const std::string& ext) {
+  std::ostringstream dzi;
+  dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\""
+      << tile_size << "\" Overlap=\"0\" Format=\"" << ext << "\">\n"
+      << "  <Size Width=\"" << width << "\" Height=\"" << height << "\"/>\n"
+      << "</Image>\n";
+  return dzi.str();
+}
+
+int WriteDeepZoom(const TiffReader& reader, const std::vector<size_t>& dirs,
+		  const ColorizeKernel& kernel, const std::string& outbase,
+		  uint32_t tile_size, const std::string& ext, int quality,
+		  bool verbose, size_t threads) {
+
+  if (dirs.empty() || dirs.size() != kernel.size()) {
+    fprintf(stderr, "ERROR: %zu channels for a palette of %zu\n", dirs.size(), kernel.size());
+    return 1;
+  }
+  if (!tile_size || tile_size % 2) {
+    fprintf(stderr, "ERROR: Deep Zoom tiles must have an even size, got %u\n", tile_size);
+    return 1;
+  }
+  if (!IsRGBImageFile("." + ext)) {
+    fprintf(stderr, "ERROR: unknown tile format %s, use jpg, png or webp\n", ext.c_str());
+    return 1;
+  }
+
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  
+  std::string files_dir = outbase + "_files";
+  if (mkdir(files_dir.c_str(), 0755) && errno != EEXIST) {
+    fprintf(stderr, "ERROR: unable to make directory %s\n", files_dir.c_str());
+    return 1;
+  }
+
+  DeepZoomWriter writer(reader, dirs, kernel, files_dir, tile_size, ext, quality,
+			verbose, std::max<size_t>(threads, 1));
+  if (writer.Run(ifd.width, ifd.height))
+    return 1;
+
+  // the descriptor goes last, so a viewer never sees a half-written image
+  std::ofstream dzi(outbase + ".dzi");
+  dzi << DeepZoomDescriptor(ifd.width, ifd.height, tile_size, ext);
+  if (!dzi) {
+    fprintf(stderr, "ERROR: unable to write %s.dzi\n", outbase.c_str());
+    return 1;
+  }
+
+  if (verbose)
+    std::cerr << "...wrote " << writer.tiles() << " tiles" << std::endl;
+  
+  return 0;
+}
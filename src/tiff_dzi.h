@@ -0,0 +1,36 @@
+#ifndef TIFF_DZI_H
+#define TIFF_DZI_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TiffReader;
+class ColorizeKernel;
+
+// default edge of a Deep Zoom tile
+#define DZI_TILE_SIZE 256
+
+// number of Deep Zoom levels of a width x height image. Level 0 is a
+// single pixel, the last is full resolution, and each level is half of
+// the next, rounded up
+size_t DeepZoomLevels(uint64_t width, uint64_t height);
+
+// the .dzi XML descriptor
+std::string DeepZoomDescriptor(uint64_t width, uint64_t height, uint32_t tile_size,
+			       const std::string& ext);
+
+// colorize dirs of reader into a Deep Zoom image: outbase.dzi and the
+// tiles under outbase_files/<level>/<col>_<row>.<ext>, with no overlap.
+// Works down the full resolution level one row of tiles at a time, and
+// each finished tile is reduced 2x into a single row buffer of the level
+// below, so every level comes out of the one pass over the file. The
+// tiles of a row are colorized, reduced and encoded in parallel.
+// ext is jpg, png or webp. Returns 0 on success
+int WriteDeepZoom(const TiffReader& reader, const std::vector<size_t>& dirs,
+		  const ColorizeKernel& kernel, const std::string& outbase,
+		  uint32_t tile_size, const std::string& ext, int quality,
+		  bool verbose, size_t threads);
+
+#endif
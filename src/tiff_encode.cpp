@@ -0,0 +1,286 @@
+#include "tiff_encode.h"
+
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <algorithm>
+
+#include <zlib.h>
+#include <jpeglib.h>
+
+#ifdef HAVE_WEBP
+#include <webp/encode.h>
+#endif
+
+// libjpeg reports errors through exit() unless we jump out ourselves
+struct JPEGError {
+  jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void __jpeg_error_exit(j_common_ptr cinfo) {
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  fprintf(stderr, "ERROR: JPEG encoding failed: %s\n", msg);
+  longjmp(reinterpret_cast<JPEGError*>(cinfo->err)->jump, 1);
+}
+
+int EncodeJPEG(const uint8_t* rgb, uint32_t w, uint32_t h, int quality,
+	       std::vector<uint8_t>& out) {
+
+  if (w > JPEG_MAX_DIMENSION || h > JPEG_MAX_DIMENSION) {
+    fprintf(stderr, "ERROR: %u x %u is too large for a JPEG, write tiles instead\n", w, h);
+    return 1;
+  }
+  
+  jpeg_compress_struct cinfo;
+  JPEGError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = __jpeg_error_exit;
+
+  // libjpeg owns (and may grow) the output buffer
+  unsigned char* mem = NULL;
+  unsigned long mem_size = 0;
+  
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&cinfo);
+    free(mem);
+    return 1;
+  }
+  
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest(&cinfo, &mem, &mem_size);
+  
+  cinfo.image_width = w;
+  cinfo.image_height = h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = const_cast<JSAMPROW>(rgb + static_cast<size_t>(cinfo.next_scanline) * w * 3);
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+  
+  jpeg_finish_compress(&cinfo);
+  out.assign(mem, mem + mem_size);
+  jpeg_destroy_compress(&cinfo);
+  free(mem);
+  
+  return 0;
+}
+
+// rows per independently deflated band. Big enough that the lost
+// history at each band edge costs nothing
+#define PNG_BAND_BYTES (1ULL << 20)
+
+// largest IDAT chunk we write
+#define PNG_MAX_CHUNK (1ULL << 30)
+
+static void __put32(std::vector<uint8_t>& out, uint32_t v) {
+  out.push_back(v >> 24);
+  out.push_back(v >> 16);
+  out.push_back(v >> 8);
+  out.push_back(v);
+}
+
+static void __png_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t len) {
+  __put32(out, len);
+  size_t start = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data, data + len);
+  __put32(out, crc32(0, out.data() + start, len + 4));
+}
+
+// raw deflate of rows [y0, y1) with the Sub filter. The last band
+// finishes the stream, the others end on a byte boundary so the bands
+// can be joined. adler gets the checksum of the filtered bytes
+static int __png_band(const uint8_t* rgb, uint32_t w, uint32_t y0, uint32_t y1, bool last,
+		      int level, std::vector<uint8_t>& out, uLong& adler) {
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 1;
+
+  size_t row_bytes = static_cast<size_t>(w) * 3;
+  std::vector<uint8_t> row(row_bytes + 1);
+  out.resize(deflateBound(&zs, (row_bytes + 1) * (y1 - y0)) + 64);
+  zs.next_out = out.data();
+  zs.avail_out = out.size();
+  adler = adler32(0, Z_NULL, 0);
+
+  int status = Z_OK;
+  for (uint32_t y = y0; y < y1 && status == Z_OK; y++) {
+
+    // filter type 1: each byte less the byte one pixel to the left
+    const uint8_t* in = rgb + y * row_bytes;
+    row[0] = 1;
+    for (size_t i = 0; i < 3 && i < row_bytes; i++)
+      row[1 + i] = in[i];
+    for (size_t i = 3; i < row_bytes; i++)
+      row[1 + i] = in[i] - in[i - 3];
+    adler = adler32(adler, row.data(), row.size());
+
+    zs.next_in = row.data();
+    zs.avail_in = row.size();
+    int flush = y + 1 < y1 ? Z_NO_FLUSH : (last ? Z_FINISH : Z_SYNC_FLUSH);
+    status = deflate(&zs, flush);
+    if (status == Z_STREAM_END || (status == Z_BUF_ERROR && zs.avail_in == 0))
+      status = Z_OK;
+  }
+  
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return status == Z_OK ? 0 : 1;
+}
+
+int EncodePNG(const uint8_t* rgb, uint32_t w, uint32_t h, std::vector<uint8_t>& out,
+	      int level, size_t threads) {
+
+  if (!w || !h) {
+    fprintf(stderr, "ERROR: empty PNG\n");
+    return 1;
+  }
+  
+  threads = std::max<size_t>(threads, 1);
+  size_t row_bytes = static_cast<size_t>(w) * 3 + 1;
+  uint32_t band_rows = std::max<uint64_t>(1, PNG_BAND_BYTES / row_bytes);
+  if (threads == 1)
+    band_rows = h;
+  uint32_t num_bands = (h + band_rows - 1) / band_rows;
+  
+  std::vector<std::vector<uint8_t>> bands(num_bands);
+  std::vector<uLong> adlers(num_bands);
+  int err = 0;
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1) reduction(|:err)
+  for (uint32_t b = 0; b < num_bands; b++) {
+    uint32_t y0 = b * band_rows, y1 = std::min<uint64_t>(h, y0 + static_cast<uint64_t>(band_rows));
+    err |= __png_band(rgb, w, y0, y1, b + 1 == num_bands, level, bands[b], adlers[b]);
+  }
+  if (err) {
+    fprintf(stderr, "ERROR: PNG compression failed\n");
+    return 1;
+  }
+
+  // one zlib stream: header, the bands back to back, checksum of them all
+  std::vector<uint8_t> z = { 0x78, 0x01 };
+  uLong adler = adlers[0];
+  for (uint32_t b = 0; b < num_bands; b++) {
+    z.insert(z.end(), bands[b].begin(), bands[b].end());
+    if (b)
+      adler = adler32_combine(adler, adlers[b],
+			      static_cast<z_off_t>(row_bytes) * (std::min<uint64_t>(h, (b + 1) * static_cast<uint64_t>(band_rows)) - b * static_cast<uint64_t>(band_rows)));
+    std::vector<uint8_t>().swap(bands[b]);
+  }
+  __put32(z, adler);
+
+  out.clear();
+  const uint8_t sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  out.insert(out.end(), sig, sig + 8);
+
+  // 8-bit RGB, no interlace
+  std::vector<uint8_t> ihdr;
+  __put32(ihdr, w);
+  __put32(ihdr, h);
+  ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });
+  __png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+  for (size_t off = 0; off < z.size(); off += PNG_MAX_CHUNK)
+    __png_chunk(out, "IDAT", z.data() + off, std::min<size_t>(PNG_MAX_CHUNK, z.size() - off));
+  __png_chunk(out, "IEND", NULL, 0);
+  
+  return 0;
+}
+
+int EncodeWebP(const uint8_t* rgb, uint32_t w, uint32_t h, int quality,
+	       std::vector<uint8_t>& out) {
+
+#ifdef HAVE_WEBP
+  if (w > WEBP_MAX_DIMENSION || h > WEBP_MAX_DIMENSION) {
+    fprintf(stderr, "ERROR: %u x %u is too large for a WebP, write tiles instead\n", w, h);
+    return 1;
+  }
+  
+  uint8_t* mem = NULL;
+  size_t len = quality >= 100 ?
+    WebPEncodeLosslessRGB(rgb, w, h, w * 3, &mem) :
+    WebPEncodeRGB(rgb, w, h, w * 3, quality, &mem);
+  if (!len) {
+    fprintf(stderr, "ERROR: WebP encoding failed\n");
+    return 1;
+  }
+  out.assign(mem, mem + len);
+  WebPFree(mem);
+  return 0;
+#else
+  fprintf(stderr, "ERROR: tiffo was built without WebP support (build with WEBP=1)\n");
+  return 1;
+#endif
+}
+
+// lower-cased extension of file, without the dot
+static std::string __extension(const std::string& file) {
+  size_t dot = file.find_last_of('.');
+  if (dot == std::string::npos)
+    return "";
+  std::string ext = file.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext;
+}
+
+bool IsRGBImageFile(const std::string& file) {
+  std::string ext = __extension(file);
+  return ext == "jpg" || ext == "jpeg" || ext == "png" || ext == "webp";
+}
+
+uint64_t RGBImageMaxDimension(const std::string& file) {
+  std::string ext = __extension(file);
+  if (ext == "jpg" || ext == "jpeg")
+    return JPEG_MAX_DIMENSION;
+  if (ext == "png")
+    return 0x7fffffffULL;
+  if (ext == "webp")
+    return 16383; // WEBP_MAX_DIMENSION, which needs the WebP headers
+  return 0;
+}
+
+int EncodeRGB(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	      std::vector<uint8_t>& out, int quality, size_t threads) {
+
+  std::string ext = __extension(file);
+  if (ext == "jpg" || ext == "jpeg")
+    return EncodeJPEG(rgb, w, h, quality, out);
+  if (ext == "png")
+    return EncodePNG(rgb, w, h, out, ENCODE_PNG_LEVEL, threads);
+  if (ext == "webp")
+    return EncodeWebP(rgb, w, h, quality, out);
+
+  fprintf(stderr, "ERROR: unknown image type for %s, use .jpg, .png or .webp\n", file.c_str());
+  return 1;
+}
+
+int WriteRGBImage(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+		  int quality, size_t threads) {
+
+  std::vector<uint8_t> buf;
+  if (EncodeRGB(file, rgb, w, h, buf, quality, threads))
+    return 1;
+
+  FILE* fp = fopen(file.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "ERROR: unable to open %s for writing\n", file.c_str());
+    return 1;
+  }
+  bool ok = fwrite(buf.data(), 1, buf.size(), fp) == buf.size();
+  ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "ERROR: unable to write %s\n", file.c_str());
+    return 1;
+  }
+  return 0;
+}
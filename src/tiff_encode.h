@@ -0,0 +1,46 @@
+#ifndef TIFF_ENCODE_H
+#define TIFF_ENCODE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// default JPEG (and lossy WebP) quality, as the crop scripts used
+#define ENCODE_JPEG_QUALITY 85
+
+// zlib level for PNG. Fast, since these are previews, not archives
+#define ENCODE_PNG_LEVEL 1
+
+// encode w x h 8-bit RGB pixels as a JPEG. Returns 0 on success
+int EncodeJPEG(const uint8_t* rgb, uint32_t w, uint32_t h, int quality,
+	       std::vector<uint8_t>& out);
+
+// encode w x h 8-bit RGB pixels as a PNG. Bands of rows are deflated
+// independently on threads and joined into one zlib stream
+int EncodePNG(const uint8_t* rgb, uint32_t w, uint32_t h, std::vector<uint8_t>& out,
+	      int level = ENCODE_PNG_LEVEL, size_t threads = 1);
+
+// encode w x h 8-bit RGB pixels as a WebP, lossless if quality is 100
+// or more. Only when built with HAVE_WEBP, otherwise an error
+int EncodeWebP(const uint8_t* rgb, uint32_t w, uint32_t h, int quality,
+	       std::vector<uint8_t>& out);
+
+// true if file has an extension we can encode (.jpg, .jpeg, .png, .webp)
+bool IsRGBImageFile(const std::string& file);
+
+// largest width or height the format of file can hold (JPEG 65500,
+// WebP 16383, PNG 2^31 - 1), so callers can check before rendering.
+// 0 for an unknown extension
+uint64_t RGBImageMaxDimension(const std::string& file);
+
+// encode by the extension of file (see IsRGBImageFile). quality is for
+// JPEG and WebP only
+int EncodeRGB(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+	      std::vector<uint8_t>& out, int quality = ENCODE_JPEG_QUALITY, size_t threads = 1);
+
+// encode and write w x h 8-bit RGB pixels to file
+int WriteRGBImage(const std::string& file, const uint8_t* rgb, uint32_t w, uint32_t h,
+		  int quality = ENCODE_JPEG_QUALITY, size_t threads = 1);
+
+#endif
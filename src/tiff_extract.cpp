@@ -0,0 +1,246 @@
+#include "tiff_extract.h"
+#include "tiff_cp.h"
+#include "tiff_writer.h"
+#include "tiff_ome.h"
+#include "tiff_read_plan.h"
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <tiffio.h>
+
+namespace {
+
+// tiles or strips that sit back to back on disk, fetched with one read
+struct RawRun {
+  uint32_t first = 0;
+  uint32_t count = 0;
+  uint64_t offset = 0;
+  uint64_t length = 0;
+};
+
+int __pread_all(int fd, uint8_t* buf, uint64_t length, uint64_t offset) {
+  uint64_t done = 0;
+  while (done < length) {
+    ssize_t n = pread(fd, buf + done, length - done, offset + done);
+    if (n <= 0)
+      return 1;
+    done += n;
+  }
+  return 0;
+}
+
+// tags of the current directory of in onto out. tiffcp sets out up to be
+// re-encoded, so the tags that describe the stored bytes are put back
+void __copy_tags(TIFF* in, TIFF* out) {
+
+  tiffcp(in, out, false);
+
+  uint16_t v;
+  if (TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &v))
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, v);
+  if (TIFFGetField(in, TIFFTAG_ORIENTATION, &v))
+    TIFFSetField(out, TIFFTAG_ORIENTATION, v);
+  if (TIFFGetField(in, TIFFTAG_PREDICTOR, &v))
+    TIFFSetField(out, TIFFTAG_PREDICTOR, v);
+
+  uint32_t count;
+  void* tables;
+  if (TIFFGetField(in, TIFFTAG_JPEGTABLES, &count, &tables))
+    TIFFSetField(out, TIFFTAG_JPEGTABLES, count, tables);
+}
+
+// copy the stored tiles (or strips) of the current directory of in to
+// out. Each run is read while the one before it is being written.
+// Sparse (zero byte) tiles stay sparse
+int __copy_raw(TIFF* in, TIFF* out, int fd, uint64_t& copied) {
+
+  bool tiled = TIFFIsTiled(in);
+  uint32_t n = tiled ? TIFFNumberOfTiles(in) : TIFFNumberOfStrips(in);
+
+  std::vector<RawRun> runs;
+  for (uint32_t s = 0; s < n; s++) {
+    uint64_t offset = TIFFGetStrileOffset(in, s);
+    uint64_t bytes = TIFFGetStrileByteCount(in, s);
+    if (!bytes)
+      continue;
+    if (!runs.empty()) {
+      RawRun& r = runs.back();
+      if (r.first + r.count == s && r.offset + r.length == offset &&
+	  r.length + bytes <= READ_PLAN_MAX_BYTES) {
+	r.count++;
+	r.length += bytes;
+	continue;
+      }
+    }
+    RawRun r;
+    r.first = s;
+    r.count = 1;
+    r.offset = offset;
+    r.length = bytes;
+    runs.push_back(r);
+  }
+
+  std::vector<uint8_t> bufs[2];
+  auto fetch = [&](size_t r) {
+    std::vector<uint8_t>& buf = bufs[r % 2];
+    buf.resize(runs[r].length);
+    return __pread_all(fd, buf.data(), runs[r].length, runs[r].offset);
+  };
+
+  std::future<int> next;
+  if (!runs.empty())
+    next = std::async(std::launch::async, fetch, 0);
+  for (size_t r = 0; r < runs.size(); r++) {
+
+    if (next.get()) {
+      fprintf(stderr, "ERROR: unable to read %llu bytes at %llu of %s\n",
+	      runs[r].length, runs[r].offset, TIFFFileName(in));
+      return 1;
+    }
+    if (r + 1 < runs.size())
+      next = std::async(std::launch::async, fetch, r + 1);
+
+    uint8_t* p = bufs[r % 2].data();
+    for (uint32_t s = runs[r].first; s < runs[r].first + runs[r].count; s++) {
+      tmsize_t bytes = TIFFGetStrileByteCount(in, s);
+      tmsize_t written = tiled ? TIFFWriteRawTile(out, s, p, bytes) :
+	TIFFWriteRawStrip(out, s, p, bytes);
+      if (written != bytes) {
+	fprintf(stderr, "ERROR: unable to write %s %u to %s\n", tiled ? "tile" : "strip", s,
+		TIFFFileName(out));
+	return 1;
+      }
+      p += bytes;
+    }
+    copied += runs[r].length;
+  }
+
+  return 0;
+}
+
+// dirs of in, with their SubIFD levels, onto out. xml replaces the
+// OME-XML of the first directory, and any other copy of it is dropped
+int __copy_dirs(TIFF* in, TIFF* out, int fd, const std::vector<size_t>& dirs, bool ome,
+		const std::string& xml, uint64_t& copied) {
+
+  char* desc = NULL;
+  for (size_t i = 0; i < dirs.size(); i++) {
+
+    if (!TIFFSetDirectory(in, dirs[i])) {
+      fprintf(stderr, "ERROR: unable to read directory %zu of %s\n", dirs[i], TIFFFileName(in));
+      return 1;
+    }
+    __copy_tags(in, out);
+
+    // only the first directory carries the OME-XML
+    if (ome) {
+      if (i == 0 && !xml.empty())
+	TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, xml.c_str());
+      else if (TIFFGetField(in, TIFFTAG_IMAGEDESCRIPTION, &desc) && desc && IsOmeXml(desc))
+	TIFFUnsetField(out, TIFFTAG_IMAGEDESCRIPTION);
+    }
+
+    // pyramid levels, whose offsets libtiff fills in as they are written
+    uint16_t num_sub = 0;
+    toff_t* sub = NULL;
+    std::vector<toff_t> levels;
+    if (TIFFGetField(in, TIFFTAG_SUBIFD, &num_sub, &sub) && num_sub) {
+      levels.assign(sub, sub + num_sub);
+      std::vector<toff_t> offsets(num_sub, 0);
+      TIFFSetField(out, TIFFTAG_SUBIFD, num_sub, offsets.data());
+    }
+
+    if (__copy_raw(in, out, fd, copied) || !TIFFWriteDirectory(out)) {
+      fprintf(stderr, "ERROR: unable to copy directory %zu of %s\n", dirs[i], TIFFFileName(in));
+      return 1;
+    }
+
+    for (size_t l = 0; l < levels.size(); l++) {
+      if (!TIFFSetSubDirectory(in, levels[l])) {
+	fprintf(stderr, "ERROR: unable to read level %zu of directory %zu of %s\n", l + 1, dirs[i],
+		TIFFFileName(in));
+	return 1;
+      }
+      __copy_tags(in, out);
+      if (__copy_raw(in, out, fd, copied) || !TIFFWriteDirectory(out)) {
+	fprintf(stderr, "ERROR: unable to copy level %zu of directory %zu of %s\n", l + 1, dirs[i],
+		TIFFFileName(in));
+	return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+}
+
+int ExtractChannels(const std::string& infile, const std::vector<size_t>& dirs,
+		    const std::string& outfile, bool verbose) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  TiffPtr in(TIFFOpen(infile.c_str(), "r"), TIFFClose);
+  if (!in) {
+    fprintf(stderr, "ERROR: unable to open %s\n", infile.c_str());
+    return 1;
+  }
+  size_t num_dirs = TIFFNumberOfDirectories(in.get());
+  for (auto d : dirs) {
+    if (d >= num_dirs) {
+      fprintf(stderr, "ERROR: channel %zu is not in %s of %zu channels\n", d, infile.c_str(),
+	      num_dirs);
+      return 1;
+    }
+  }
+
+  // the OME-XML of the first directory, cut down to the chosen channels
+  bool ome = false;
+  std::string xml;
+  char* desc = NULL;
+  if (TIFFGetField(in.get(), TIFFTAG_IMAGEDESCRIPTION, &desc) && desc && IsOmeXml(desc)) {
+    ome = true;
+    std::string why;
+    xml = SubsetOmeChannels(desc, dirs, why);
+    if (xml.empty())
+      fprintf(stderr, "Warning: dropping the OME-XML of %s, since %s\n", infile.c_str(),
+	      why.c_str());
+  }
+
+  // same flavour of tiff as the input, so the stored bytes read the same
+  std::string mode = "w";
+  if (TIFFIsBigTIFF(in.get()))
+    mode += "8";
+  mode += TIFFIsBigEndian(in.get()) ? "b" : "l";
+  TiffPtr out(TIFFOpen(outfile.c_str(), mode.c_str()), TIFFClose);
+  if (!out) {
+    fprintf(stderr, "ERROR: unable to open %s for writing\n", outfile.c_str());
+    return 1;
+  }
+
+  int fd = open(infile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: unable to open %s\n", infile.c_str());
+    return 1;
+  }
+  uint64_t copied = 0;
+  int status = __copy_dirs(in.get(), out.get(), fd, dirs, ome, xml, copied);
+  close(fd);
+  if (status)
+    return 1;
+
+  // closing writes the last of the directory chain
+  out.reset();
+
+  if (verbose) {
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "...copied %.1f MB in %.2f s (%.0f MB/s)\n", copied / 1e6, s,
+	    copied / 1e6 / s);
+  }
+
+  return 0;
+}
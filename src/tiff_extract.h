@@ -0,0 +1,17 @@
+#ifndef TIFF_EXTRACT_H
+#define TIFF_EXTRACT_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// write directories dirs of infile, in that order, to outfile. Tiles (or
+// strips) of each directory and of the SubIFD levels under it are copied
+// as they are stored, without decoding, in reads of up to
+// READ_PLAN_MAX_BYTES that overlap the writes. Tags go through tiffcp,
+// and OME-XML in the first directory is cut down to the chosen channels.
+// Returns 0 on success
+int ExtractChannels(const std::string& infile, const std::vector<size_t>& dirs,
+		    const std::string& outfile, bool verbose);
+
+#endif
@@ -0,0 +1,409 @@
+#include "tiff_flatfield.h"
+#include "tiff_reader.h"
+#include "tiff_writer.h"
+#include "tiff_pyramid.h"
+#include "tiff_buffer_pool.h"
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+
+namespace {
+
+// sample types pixels can be read as
+enum PixelType { PIXEL_NONE, PIXEL_U8, PIXEL_U16, PIXEL_U32, PIXEL_F32 };
+
+PixelType __pixel_type(const TiffIFD& ifd) {
+  if (ifd.samples_per_pixel != 1 || ifd.sample_format == SAMPLEFORMAT_INT)
+    return PIXEL_NONE;
+  if (ifd.sample_format == SAMPLEFORMAT_IEEEFP)
+    return ifd.bits_per_sample == 32 ? PIXEL_F32 : PIXEL_NONE;
+  switch (ifd.bits_per_sample) {
+  case 8: return PIXEL_U8;
+  case 16: return PIXEL_U16;
+  case 32: return PIXEL_U32;
+  default: return PIXEL_NONE;
+  }
+}
+
+template <typename T>
+void __to_float(const T* in, uint64_t n, float* out) {
+#pragma omp simd
+  for (uint64_t i = 0; i < n; i++)
+    out[i] = in[i];
+}
+
+// n pixels of type t from in as floats
+void __to_float(const uint8_t* in, PixelType t, uint64_t n, float* out) {
+  switch (t) {
+  case PIXEL_U8: __to_float(in, n, out); break;
+  case PIXEL_U16: __to_float(reinterpret_cast<const uint16_t*>(in), n, out); break;
+  case PIXEL_U32: __to_float(reinterpret_cast<const uint32_t*>(in), n, out); break;
+  case PIXEL_F32: memcpy(out, in, n * sizeof(float)); break;
+  default: break;
+  }
+}
+
+// (in - dark) * gain, rounded and clamped to 16 bits. Float lanes, so
+// the loop vectorises for every input type
+template <typename T>
+void __correct(const T* in, uint64_t n, const float* gain, const float* dark, uint16_t* out) {
+#pragma omp simd
+  for (uint64_t i = 0; i < n; i++) {
+    float v = (in[i] - dark[i]) * gain[i];
+    v = v < 0 ? 0 : v;
+    v = v > 65535.f ? 65535.f : v;
+    out[i] = static_cast<uint16_t>(v + 0.5f);
+  }
+}
+
+void __correct(const uint8_t* in, PixelType t, uint64_t n, const float* gain, const float* dark,
+	       uint16_t* out) {
+  switch (t) {
+  case PIXEL_U8: __correct(in, n, gain, dark, out); break;
+  case PIXEL_U16: __correct(reinterpret_cast<const uint16_t*>(in), n, gain, dark, out); break;
+  case PIXEL_U32: __correct(reinterpret_cast<const uint32_t*>(in), n, gain, dark, out); break;
+  case PIXEL_F32: __correct(reinterpret_cast<const float*>(in), n, gain, dark, out); break;
+  default: break;
+  }
+}
+
+// correct a tw x th tile at (x, y) of the image. Rows are cut where they
+// wrap from one field of view to the next, so each run is contiguous in
+// the profile
+void __correct_tile(const uint8_t* in, PixelType t, uint64_t bytes_ps, uint64_t x, uint64_t y,
+		    uint64_t tw, uint64_t th, const FlatField& ff, uint16_t* out) {
+  for (uint64_t r = 0; r < th; r++) {
+    uint64_t fy = (y + r + ff.fh - ff.oy) % ff.fh;
+    const float* gain = ff.gain.data() + fy * ff.fw;
+    const float* dark = ff.dark.data() + fy * ff.fw;
+    for (uint64_t c = 0; c < tw;) {
+      uint64_t fx = (x + c + ff.fw - ff.ox) % ff.fw;
+      uint64_t n = std::min(tw - c, ff.fw - fx);
+      uint64_t i = r * tw + c;
+      __correct(in + i * bytes_ps, t, n, gain + fx, dark + fx, out + i);
+      c += n;
+    }
+  }
+}
+
+// 3 x 3 box blur of a w x h grid, edges clamped
+void __smooth(std::vector<float>& grid, uint64_t w, uint64_t h) {
+  std::vector<float> src(grid);
+  for (uint64_t y = 0; y < h; y++) {
+    for (uint64_t x = 0; x < w; x++) {
+      float sum = 0;
+      for (int64_t dy = -1; dy <= 1; dy++) {
+	uint64_t yy = std::min<int64_t>(std::max<int64_t>(y + dy, 0), h - 1);
+	for (int64_t dx = -1; dx <= 1; dx++) {
+	  uint64_t xx = std::min<int64_t>(std::max<int64_t>(x + dx, 0), w - 1);
+	  sum += src[yy * w + xx];
+	}
+      }
+      grid[y * w + x] = sum / 9;
+    }
+  }
+}
+
+// per-pixel gain of a fw x fh field from a flat of bins, by bilinear
+// interpolation between bin centres
+void __upsample_gain(const std::vector<float>& flat, uint64_t bw, uint64_t bh, FlatField& ff) {
+
+  auto weights = [](uint64_t p, uint64_t nb, uint64_t& b0, uint64_t& b1, float& f) {
+    float t = (p + 0.5f) / FLATFIELD_BIN - 0.5f;
+    t = std::max(t, 0.f);
+    b0 = std::min<uint64_t>(static_cast<uint64_t>(t), nb - 1);
+    b1 = std::min<uint64_t>(b0 + 1, nb - 1);
+    f = std::min(t - b0, 1.f);
+  };
+
+  ff.gain.resize(ff.fw * ff.fh);
+  for (uint64_t y = 0; y < ff.fh; y++) {
+    uint64_t y0, y1;
+    float fy;
+    weights(y, bh, y0, y1, fy);
+    for (uint64_t x = 0; x < ff.fw; x++) {
+      uint64_t x0, x1;
+      float fx;
+      weights(x, bw, x0, x1, fx);
+      float top = flat[y0 * bw + x0] * (1 - fx) + flat[y0 * bw + x1] * fx;
+      float bottom = flat[y1 * bw + x0] * (1 - fx) + flat[y1 * bw + x1] * fx;
+      ff.gain[y * ff.fw + x] = 1.f / (top * (1 - fy) + bottom * fy);
+    }
+  }
+}
+
+// the centred cw x ch window of a w x h plane, in place
+void __centre_window(std::vector<float>& plane, uint64_t w, uint64_t h, uint64_t cw, uint64_t ch) {
+  uint64_t x0 = (w - cw) / 2, y0 = (h - ch) / 2;
+  for (uint64_t y = 0; y < ch; y++)
+    memmove(&plane[y * cw], &plane[(y0 + y) * w + x0], cw * sizeof(float));
+  plane.resize(cw * ch);
+}
+
+// flat scaled to a mean of 1 and floored, into gain
+void __flat_to_gain(std::vector<float>& flat) {
+  double sum = 0;
+  for (auto f : flat)
+    sum += f;
+  float mean = flat.empty() ? 1 : static_cast<float>(sum / flat.size());
+  for (auto& f : flat)
+    f = 1.f / std::max(f / mean, FLATFIELD_MIN_GAIN);
+}
+
+}
+
+int ReadFieldImage(const std::string& file, size_t dir, std::vector<float>& plane,
+		   uint64_t& fw, uint64_t& fh) {
+
+  TiffReader field(file.c_str());
+  if (!field.get())
+    return 1;
+  if (field.NumDirs() == 1)
+    dir = 0;
+  if (dir >= field.NumDirs()) {
+    fprintf(stderr, "ERROR: %s has %zu planes, needs one per channel or one for all\n",
+	    file.c_str(), field.NumDirs());
+    return 1;
+  }
+
+  const TiffIFD& ifd = field.IFD(dir);
+  PixelType t = __pixel_type(ifd);
+  if (t == PIXEL_NONE) {
+    fprintf(stderr, "ERROR: %s must be single-sample unsigned or 32-bit float\n", file.c_str());
+    return 1;
+  }
+
+  fw = ifd.width;
+  fh = ifd.height;
+  std::vector<uint8_t> buf(fw * fh * ifd.bits_per_sample / 8);
+  if (field.ReadRegion(dir, 0, 0, fw, fh, buf.data()))
+    return 1;
+  plane.resize(fw * fh);
+  __to_float(buf.data(), t, fw * fh, plane.data());
+  return 0;
+}
+
+int EstimateFlatField(const TiffReader& reader, size_t dir, FlatField& ff,
+		      bool verbose, size_t threads) {
+
+  const TiffIFD& ifd = reader.IFD(dir);
+  PixelType t = __pixel_type(ifd);
+  uint64_t bytes_ps = ifd.bits_per_sample / 8;
+  uint64_t fw = ff.fw, fh = ff.fh;
+
+  // whole fields of view only
+  uint64_t across = ifd.width > ff.ox ? (ifd.width - ff.ox) / fw : 0;
+  uint64_t down = ifd.height > ff.oy ? (ifd.height - ff.oy) / fh : 0;
+  uint64_t num_fovs = across * down;
+  if (num_fovs < FLATFIELD_MIN_FOVS) {
+    fprintf(stderr, "ERROR: %llu fields of view of %llu x %llu in directory %zu, "
+	    "too few to estimate a flat field\n", num_fovs, fw, fh, dir);
+    return 1;
+  }
+
+  uint64_t bw = (fw + FLATFIELD_BIN - 1) / FLATFIELD_BIN;
+  uint64_t bh = (fh + FLATFIELD_BIN - 1) / FLATFIELD_BIN;
+  uint64_t nb = bw * bh;
+  uint64_t n = std::min<uint64_t>(num_fovs, FLATFIELD_SAMPLE_FOVS);
+
+  // bin means of each sampled field, and the field's mean
+  std::vector<float> bins(n * nb);
+  std::vector<float> means(n);
+  std::vector<float> counts(nb, 0);
+  for (uint64_t y = 0; y < fh; y++)
+    for (uint64_t x = 0; x < fw; x++)
+      counts[(y / FLATFIELD_BIN) * bw + x / FLATFIELD_BIN]++;
+
+  std::atomic<int> err(0);
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (uint64_t i = 0; i < n; i++) {
+
+    if (err)
+      continue;
+
+    uint64_t f = i * num_fovs / n;
+    uint64_t x0 = ff.ox + (f % across) * fw, y0 = ff.oy + (f / across) * fh;
+    TileBuffer block = TileBufferPool::Global().Get(fw * fh * bytes_ps);
+    if (!block || reader.ReadRegion(dir, x0, y0, fw, fh, block.data())) {
+      err = 1;
+      continue;
+    }
+
+    float* b = &bins[i * nb];
+    std::vector<float> row(fw);
+    double total = 0;
+    for (uint64_t y = 0; y < fh; y++) {
+      __to_float(block.data() + y * fw * bytes_ps, t, fw, row.data());
+      const float* dark = ff.dark.data() + y * fw;
+      float* brow = b + (y / FLATFIELD_BIN) * bw;
+      for (uint64_t x = 0; x < fw; x++) {
+	float v = std::max(row[x] - dark[x], 0.f);
+	brow[x / FLATFIELD_BIN] += v;
+	total += v;
+      }
+    }
+    for (uint64_t k = 0; k < nb; k++)
+      b[k] /= counts[k];
+    means[i] = static_cast<float>(total / (fw * fh));
+  }
+
+  if (err) {
+    fprintf(stderr, "ERROR: unable to read fields of view of directory %zu\n", dir);
+    return 1;
+  }
+
+  // the brighter half of the fields hold tissue, the rest is mostly
+  // offset and noise, where shading hardly shows
+  std::vector<float> sorted(means);
+  std::nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.end());
+  float floor = std::max(sorted[n / 2], std::numeric_limits<float>::min());
+  std::vector<uint64_t> kept;
+  for (uint64_t i = 0; i < n; i++)
+    if (means[i] >= floor)
+      kept.push_back(i);
+  if (kept.size() < FLATFIELD_MIN_FOVS) {
+    fprintf(stderr, "ERROR: only %zu fields of view of directory %zu hold signal, "
+	    "too few to estimate a flat field\n", kept.size(), dir);
+    return 1;
+  }
+
+  std::vector<float> flat(nb);
+  std::vector<float> ratios(kept.size());
+  for (uint64_t k = 0; k < nb; k++) {
+    for (size_t j = 0; j < kept.size(); j++)
+      ratios[j] = bins[kept[j] * nb + k] / means[kept[j]];
+    std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, ratios.end());
+    flat[k] = ratios[ratios.size() / 2];
+  }
+  for (int pass = 0; pass < 2; pass++)
+    __smooth(flat, bw, bh);
+
+  // scale to a mean of 1 (on the bins, weighted by the pixels they
+  // cover), and floor, then interpolate
+  double sum = 0;
+  for (uint64_t k = 0; k < nb; k++)
+    sum += flat[k] * counts[k];
+  float mean = static_cast<float>(sum / (fw * fh));
+  float lo = 1e30f, hi = 0;
+  for (auto& f : flat) {
+    f = std::max(f / mean, FLATFIELD_MIN_GAIN);
+    lo = std::min(lo, f);
+    hi = std::max(hi, f);
+  }
+  __upsample_gain(flat, bw, bh, ff);
+
+  if (verbose) {
+    const std::vector<std::string>& names = reader.ChannelNames();
+    std::cerr << "...channel " << dir;
+    if (dir < names.size())
+      std::cerr << " (" << names[dir] << ")";
+    std::cerr << ": flat field from " << kept.size() << " of " << num_fovs
+	      << " fields of view, " << lo << " to " << hi << " of the mean" << std::endl;
+  }
+
+  return 0;
+}
+
+int CorrectFlatField(const TiffReader& reader, const std::vector<size_t>& dirs, TIFF* out,
+		     const std::string& flatfile, const std::string& darkfile,
+		     uint64_t fw, uint64_t fh, uint64_t ox, uint64_t oy,
+		     bool verbose, size_t threads) {
+
+  threads = std::max<size_t>(threads, 1);
+  for (size_t d = 0; d < reader.NumDirs(); d++) {
+    if (__pixel_type(reader.IFD(d)) == PIXEL_NONE) {
+      fprintf(stderr, "ERROR: directory %zu must be single-sample unsigned or 32-bit float\n", d);
+      return 1;
+    }
+  }
+
+  TiffPtr in = OpenTagHandle(reader);
+  if (!in)
+    return 1;
+
+  for (size_t d = 0; d < reader.NumDirs(); d++) {
+
+    const TiffIFD& ifd = reader.IFD(d);
+    bool correct = std::find(dirs.begin(), dirs.end(), d) != dirs.end();
+    uint32_t tw = ifd.tile_width ? ifd.tile_width : 256;
+    uint32_t th = ifd.tile_height ? ifd.tile_height : 256;
+
+    // the profile of this channel, given or estimated
+    FlatField ff;
+    ff.fw = fw;
+    ff.fh = fh;
+    for (const std::string* file : {&darkfile, &flatfile}) {
+      if (!correct || file->empty())
+	continue;
+      uint64_t w = 0, h = 0;
+      std::vector<float>& plane = file == &darkfile ? ff.dark : ff.gain;
+      if (ReadFieldImage(*file, d, plane, w, h))
+	return 1;
+      if (!ff.fw) {
+	ff.fw = w;
+	ff.fh = h;
+      }
+      if (w < ff.fw || h < ff.fh) {
+	fprintf(stderr, "ERROR: %s is %llu x %llu, smaller than the field of view step %llu x %llu\n",
+		file->c_str(), w, h, ff.fw, ff.fh);
+	return 1;
+      }
+      // scaled over the whole camera field, then trimmed to the step
+      if (file == &flatfile)
+	__flat_to_gain(plane);
+      __centre_window(plane, w, h, ff.fw, ff.fh);
+    }
+    if (correct) {
+      if (!ff.fw || !ff.fh) {
+	fprintf(stderr, "ERROR: no field of view size, give one or a flat field\n");
+	return 1;
+      }
+      ff.ox = ox % ff.fw;
+      ff.oy = oy % ff.fh;
+      if (ff.dark.empty())
+	ff.dark.assign(ff.fw * ff.fh, 0);
+      if (ff.gain.empty() && EstimateFlatField(reader, d, ff, verbose, threads))
+	return 1;
+    } else {
+      // a profile that changes nothing, one tile row wide
+      ff.fw = tw;
+      ff.fh = 1;
+      ff.gain.assign(tw, 1.f);
+      ff.dark.assign(tw, 0.f);
+    }
+
+    uint64_t bytes_ps = ifd.bits_per_sample / 8;
+    uint32_t tiles_across = (ifd.width + tw - 1) / tw;
+    PixelType t = __pixel_type(ifd);
+    std::unique_ptr<PyramidBuilder> pyramid;
+    if (!TIFFSetDirectory(in.get(), d) || CopyTileTags(in.get(), out, tw, th, 16, pyramid))
+      return 1;
+
+    TileFillFunc fill = [&](uint32_t tile, uint8_t* buf) {
+      uint64_t x = static_cast<uint64_t>(tile % tiles_across) * tw;
+      uint64_t y = static_cast<uint64_t>(tile / tiles_across) * th;
+      TileBuffer src = TileBufferPool::Global().Get(static_cast<uint64_t>(tw) * th * bytes_ps);
+      if (!src || reader.ReadRegion(d, x, y, tw, th, src.data()))
+	return 1;
+      __correct_tile(src.data(), t, bytes_ps, x, y, tw, th, ff, reinterpret_cast<uint16_t*>(buf));
+      return 0;
+    };
+
+    if (WriteTilesParallel(out, fill, threads, pyramid ? pyramid->Sink() : TileSinkFunc()) ||
+	!TIFFWriteDirectory(out) || (pyramid && pyramid->WriteLevels(out, threads))) {
+      fprintf(stderr, "ERROR: unable to write directory %zu\n", d);
+      return 1;
+    }
+    if (verbose)
+      std::cerr << "...wrote directory " << d << (correct ? ", corrected" : "") << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef TIFF_FLATFIELD_H
+#define TIFF_FLATFIELD_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <tiffio.h>
+
+class TiffReader;
+
+// edge of the square bins a profile is estimated on. Shading is smooth,
+// so bins keep single cells out of it and the fit small
+#define FLATFIELD_BIN 16
+
+// most field-of-view blocks read to estimate a channel's profile, and
+// fewest that must hold tissue
+#define FLATFIELD_SAMPLE_FOVS 256
+#define FLATFIELD_MIN_FOVS 8
+
+// flats are floored here (as a fraction of their mean) so dead corners
+// don't blow up
+#define FLATFIELD_MIN_GAIN 0.05f
+
+// illumination profile of one channel over a fw x fh field of view,
+// repeated across the image on a grid with its origin at (ox, oy), each
+// less than the step. Pixels are corrected as (pixel - dark) * gain,
+// where gain is 1 / flat with the flat scaled to a mean of 1, so
+// corrected images keep their overall brightness. Both are fw * fh,
+// row-major
+struct FlatField {
+  uint64_t fw = 0;
+  uint64_t fh = 0;
+  uint64_t ox = 0;
+  uint64_t oy = 0;
+  std::vector<float> gain;
+  std::vector<float> dark;
+};
+
+// one fw x fh plane of a flat or dark field image as floats: directory
+// dir, or 0 if the file has only one. 8, 16 or 32-bit unsigned, or
+// 32-bit float. Returns 0 on success
+int ReadFieldImage(const std::string& file, size_t dir, std::vector<float>& plane,
+		   uint64_t& fw, uint64_t& fh);
+
+// estimate ff.gain for directory dir of reader, with the grid and ff.dark
+// already set. Up to FLATFIELD_SAMPLE_FOVS whole fields of view
+// spread over the image are binned, and the brighter half (tissue) kept.
+// Each bin's flat is the median over those of its mean over its field's
+// mean, which lets cells and tissue edges come and go. The bins are
+// smoothed and interpolated back up to a gain per pixel. Returns 0 on success
+int EstimateFlatField(const TiffReader& reader, size_t dir, FlatField& ff,
+		      bool verbose, size_t threads);
+
+// write every directory of reader to out as 16-bit, with dirs corrected
+// by a flat field read from flatfile or estimated, less a dark field
+// from darkfile if given. Field images hold one plane per directory of
+// reader or one for all. Fields of view step fw x fh across the image
+// from (ox, oy), or by the size of the field images if fw is 0. Field
+// images larger than the step (overlapping fields of view) are trimmed
+// evenly on each side to it, as stitching keeps the middle of each.
+// Every directory is written tile by tile in parallel, with its tags
+// copied by CopyTileTags and any SubIFD pyramid rebuilt, and only the
+// profile of the one being written is held. Returns 0 on success
+int CorrectFlatField(const TiffReader& reader, const std::vector<size_t>& dirs, TIFF* out,
+		     const std::string& flatfile, const std::string& darkfile,
+		     uint64_t fw, uint64_t fh, uint64_t ox, uint64_t oy,
+		     bool verbose, size_t threads);
+
+#endif
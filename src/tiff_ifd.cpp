@@ -1,5 +1,7 @@
 #include "tiff_ifd.h"
 #include "tiff_utils.h"
+#include "tiff_raster.h"
+#include "tiff_buffer_pool.h"
 #include <cstring>
 #include <cassert>
 
@@ -90,9 +92,62 @@ TiffIFD::TiffIFD(TIFF* tif) {
   
   // store other image properties to keep them handye
   __get_tag(TIFFTAG_SAMPLEFORMAT, sample_format);
+  __get_tag(TIFFTAG_COMPRESSION, compression);
+  __get_tag(TIFFTAG_PREDICTOR, predictor);
   __get_tag(TIFFTAG_TILEWIDTH, tile_width);
   __get_tag(TIFFTAG_TILELENGTH, tile_height);      
 
+  __get_tag(TIFFTAG_XRESOLUTION, x_resolution);
+  __get_tag(TIFFTAG_YRESOLUTION, y_resolution);
+  if (!TIFFGetField(m_tif, TIFFTAG_RESOLUTIONUNIT, &resolution_unit))
+    resolution_unit = RESUNIT_INCH;
+
+  uint16_t num_sub = 0;
+  toff_t* sub = NULL;
+  if (TIFFGetField(m_tif, TIFFTAG_SUBIFD, &num_sub, &sub) && sub)
+    subifd_offsets.assign(sub, sub + num_sub);
+
+}
+
+TiffIFD::TiffIFD(TIFF* tif, TIFF* parent) : TiffIFD(tif) {
+  m_tif = parent;
+}
+
+void TiffIFD::LoadTileIndex(TIFF* tif) {
+
+  // tile-offset index, so reads can be planned without the handle
+  if (!TIFFIsTiled(tif))
+    return;
+  
+  uint32_t num_tiles = TIFFNumberOfTiles(tif);
+  tile_offsets.resize(num_tiles);
+  tile_bytecounts.resize(num_tiles);
+  for (uint32_t t = 0; t < num_tiles; t++) {
+    tile_offsets[t] = TIFFGetStrileOffset(tif, t);
+    tile_bytecounts[t] = TIFFGetStrileByteCount(tif, t);
+  }
+  
+}
+
+double TiffIFD::MicronsPerPixel() const {
+
+  if (x_resolution <= 0)
+    return 0;
+  switch (resolution_unit) {
+  case RESUNIT_CENTIMETER:
+    return 1e4 / x_resolution;
+  case RESUNIT_INCH:
+    return 25400 / x_resolution;
+  default:
+    return 0;
+  }
+}
+
+bool TiffIFD::RGBAImageOK() const {
+
+  uint16_t tmp_dir = TIFFCurrentDirectory(m_tif);
+  TIFFSetDirectory(m_tif, dir);
+  
   /*
    * Check the image to see if TIFFReadRGBAImage can deal with it.
    * 1/0 is returned according to whether or not the image can
@@ -105,7 +160,9 @@ TiffIFD::TiffIFD(TIFF* tif) {
     fprintf(stderr, "%s", emsg);
   }
 
+  TIFFSetDirectory(m_tif, tmp_dir);
   
+  return rgba_ok;
 }
 
 bool TiffIFD::isTiled() {
@@ -131,14 +188,10 @@ std::vector<double> TiffIFD::mean() {
   
   uint8_t mode = GetMode();
     
-  void* buf;
-  
-  if (isTiled()) {
-    // allocate memory for a single tile
-    buf  = _TIFFmalloc(TIFFTileSize(m_tif));
-  } else {
-    buf  = _TIFFmalloc(TIFFScanlineSize(m_tif));
-  }
+  // a single tile or line, given back to the pool on return
+  TileBuffer tbuf = TileBufferPool::Global().Get(isTiled() ? TIFFTileSize(m_tif) :
+						 TIFFScanlineSize(m_tif));
+  void* buf = tbuf.data();
 
   // loop through the tiles
   int x, y;
@@ -286,18 +339,19 @@ void* TiffIFD::__alloc() {
   uint64_t pixels = static_cast<uint64_t>(width) * height;
   
   void* data; 
-  
+
+  // large rasters go to a scratch file (see tiff_raster.h)
   switch (mode) {
       case 8:
-	data = calloc(pixels, sizeof(uint8_t));
+	data = RasterAlloc(pixels * sizeof(uint8_t));
 	//fprintf(stderr, "alloc size %f GB\n", m_pixels / 1e9);
 	break;
       case 4:
-        data = calloc(pixels, sizeof(uint32_t));
+        data = RasterAlloc(pixels * sizeof(uint32_t));
 	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
 	break;
       case 3:
-        data = calloc(pixels*3, sizeof(uint8_t));
+        data = RasterAlloc(pixels * 3 * sizeof(uint8_t));
 	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
 	break;
   default:
@@ -324,13 +378,15 @@ void* TiffIFD::__tiled_read() {
   uint8_t mode = GetMode();
   
   // allocate memory for a single tile
-  void* tile = (void*)calloc(TIFFTileSize(m_tif), sizeof(uint8_t));
+  TileBuffer tbuf = TileBufferPool::Global().Get(TIFFTileSize(m_tif), true);
+  void* tile = tbuf.data();
 
   // allocate the memory for this buffer
   // IFD object is NOT in charge of storing this
   void* data = __alloc();
 
   uint64_t tile_size = static_cast<uint64_t>(tile_height) * tile_width;						 
+  uint64_t row_bytes = static_cast<uint64_t>(width) * bits_per_sample * samples_per_pixel / 8;
 
   // loop through the tiles
   uint64_t x, y;
@@ -385,10 +441,12 @@ void* TiffIFD::__tiled_read() {
       } // tile y loop
 
     } // image x loop
+
+    // this band of rows is finished
+    RasterRelease(data, y * row_bytes, tile_height * row_bytes);
+    
   } // image y loop
   
-  _TIFFfree(tile);
-
   // and put it back
   TIFFSetDirectory(m_tif, tmp_dir); 
   
@@ -409,7 +467,8 @@ void* TiffIFD::__lined_read() {
   uint64_t ls = TIFFScanlineSize(m_tif);
 
   // allocate memory for a single line
-  uint8_t* buf = static_cast<uint8_t*>(_TIFFmalloc(TIFFScanlineSize(m_tif)));
+  TileBuffer lbuf = TileBufferPool::Global().Get(TIFFScanlineSize(m_tif));
+  uint8_t* buf = lbuf.data();
 
   size_t offset = 0;
   uint64_t m_pix = 0;
@@ -426,10 +485,15 @@ void* TiffIFD::__lined_read() {
 
     offset += ls;
 
+    // let finished rows go every so often
+    if ((y + 1) % 1024 == 0)
+      RasterRelease(data, offset - 1024 * ls, 1024 * ls);
+
   }
-  
-  _TIFFfree(buf);
 
+  // and the rows after the last full block
+  RasterRelease(data, offset - height % 1024 * ls, height % 1024 * ls);
+  
   // and put it back
   TIFFSetDirectory(m_tif, tmp_dir); 
   
@@ -15,6 +15,21 @@ class TiffIFD {
 
   TiffIFD(TIFF* tif);
 
+  // read the tags from tif (set to this directory), but keep parent as
+  // the handle that later calls (print, mean, ReadRaster) work through
+  TiffIFD(TIFF* tif, TIFF* parent);
+
+  // fill tile_offsets and tile_bytecounts from tif, set to this directory
+  void LoadTileIndex(TIFF* tif);
+
+  // true if TIFFReadRGBAImage can handle this directory. Prints the
+  // reason if not. Not run by default, since it is slow and chatty
+  bool RGBAImageOK() const;
+
+  // pixel width in microns from the resolution tags, or 0 if they
+  // are missing or have no unit
+  double MicronsPerPixel() const;
+
   // this directory id
   uint16_t dir = 0;
 
@@ -29,12 +44,28 @@ class TiffIFD {
 
   uint16_t photometric = 0;
   uint16_t planar = 0;
+  uint16_t compression = 0;
+  uint16_t predictor = 0;
   
   // optional fields
   uint64_t tile_height = 0;
   uint64_t tile_width  = 0;  
   uint64_t sample_format = 0;
 
+  // pixels per resolution unit, as stored
+  float x_resolution = 0;
+  float y_resolution = 0;
+  uint16_t resolution_unit = 0;
+
+  // offsets of the reduced-resolution SubIFDs (a pyramid) of this
+  // directory, largest first. Empty if there are none
+  std::vector<uint64_t> subifd_offsets;
+
+  // on-disk location of each tile (empty for scanline images, and
+  // until LoadTileIndex is called)
+  std::vector<uint64_t> tile_offsets;
+  std::vector<uint64_t> tile_bytecounts;
+
   //friend std::ostream& operator<<(std::ostream& out, const TiffIFD& o);
 
   // print libtiff style info to stdout
@@ -1,5 +1,7 @@
 #include "tiff_image.h"
 #include "tiff_utils.h"
+#include "tiff_raster.h"
+#include "tiff_scale.h"
 #include <cassert>
 #include <iostream>
 
@@ -119,138 +121,67 @@ double TiffImage::mean() const {
   return (sum / m_pixels);
 
 }
-/*
-int TiffImage::Scale(double scale, bool ismode, int threads) {
 
-  if (scale > 1) {
-    fprintf(stderr, "Scale must be < 1\n");
+int TiffImage::Scale(uint32_t factor, bool ismode) {
+
+  if (!__is_rasterized())
+    return 1;
+  
+  if (factor == 0) {
+    fprintf(stderr, "Scale factor must be at least 1\n");
     return 1;
   }
+  if (factor == 1)
+    return 0;
 
-  //debug
-  //  for (int x = 0; x < 100; x++)
-  //  std::cerr << (unsigned int)static_cast<uint8_t*>(m_data)[x] << std::endl;
-  
-  size_t mode = GetMode();
-  
-  // New image as a row-major vector
-  void* new_image;
-
-  // New image dimensions
-  uint64_t new_width = std::ceil(scale * m_width);
-  uint64_t new_height = std::ceil(scale * m_height);
-  uint64_t w_chunk = std::ceil(1/scale);
-  uint64_t h_chunk = std::ceil(1/scale);
-
-  // store the values you see
-  std::vector<uint8_t*> sum3(3);
-  uint8_t* sum8;
-  uint64_t chunk_pixels = h_chunk * w_chunk;
+  uint64_t spp = m_samples_per_pixel;
+  uint64_t bps = m_bits_per_sample;
+  uint64_t bytes_pp = spp * bps / 8;
   
-  switch (mode) {
-  case 8:
-    new_image = calloc(new_width * new_height, sizeof(uint8_t));
-    sum8 = (uint8_t*)calloc(chunk_pixels, sizeof(int));    
-    break;
-  case 3:
-    new_image = calloc(new_width * new_height, sizeof(uint8_t) * 3);
-    for (int x = 0; x < 3; x++)
-      sum3[x] = (uint8_t*)calloc(chunk_pixels, sizeof(int));
-    break;
-  default:
-    fprintf(stderr, "not able to understand mode %d\n", mode);
-    assert(false);
+  uint64_t new_width = (m_width + factor - 1) / factor;
+  uint64_t new_height = (m_height + factor - 1) / factor;
+
+  void* new_image = RasterAlloc(new_width * new_height * bytes_pp);
+  if (new_image == NULL) {
+    fprintf(stderr, "ERROR: unable to allocate scaled raster\n");
+    return 1;
   }
+
+  if (verbose)
+    std::cerr << "new dim " << new_width << " x " << new_height <<
+      " factor " << factor << (ismode ? " (mode)" : " (mean)") << std::endl;
   
-  std::cerr << "new dim " << new_width << " x " << new_height <<
-    " chunk " << w_chunk << " x " << h_chunk << std::endl;
-  
-  size_t debugint = 0;
+  // each thread takes a band of output rows, and the source rows under it
+  const uint64_t band = 64;
+  const uint8_t* src = static_cast<const uint8_t*>(m_data);
+  uint8_t* dst = static_cast<uint8_t*>(new_image);
+  int err = 0;
   
-  // Iterate over the new image
-  #pragma omp parallel for num_threads(m_threads)
-  for (uint64_t i = 0; i < new_height; i++) {
-    for (uint64_t j = 0; j < new_width; j++) {
-      ++debugint;
-      if (debugint % 10000 == 0)
-	std::cerr << " debugint " << AddCommas(debugint) << " of " << AddCommas(new_height * new_width)<< std::endl;
-      size_t count = 0;
-      
-      // loop and do the averaging
-      uint64_t ii_s = std::round(static_cast<double>(i) / scale);
-      uint64_t jj_s = std::round(static_cast<double>(j) / scale);
-      for (uint64_t ii = ii_s; ii < ii_s + h_chunk; ii++) {
-	for (uint64_t jj = jj_s; jj < jj_s + w_chunk; jj++) {
-	  //std::cout << "OLD: " << PAIRSTRING(ii,jj) << std::endl;
-	  if (jj < m_width && ii < m_height) {
-	    switch(mode) {
-	    case 8:
-	      sum8[count] = static_cast<uint8_t*>(m_data)[ii * m_width + jj];
-	      break;
-	    case 3:
-	      for (int x = 0; x < 3; ++x) 
-		sum3[x][count] = static_cast<uint8_t*>(m_data)[(ii * m_width + jj)*3 + x];
-	      break;
-	    }
-	    ++count;
-	  }
-	}
-      }
-      
-      funcmm_t mmfunc = ismode ? getMode : getMean;
-      
-      switch(mode) {
-      case 8:
-	static_cast<uint8_t*>(new_image)[i * new_width + j] = mmfunc(sum8, count);
-	memset(sum8, 0, chunk_pixels * sizeof(uint8_t));
-	break;
-      case 3:
-	for (int x = 0; x < 3; ++x) {
-	  static_cast<uint8_t*>(new_image)[(i * new_width + j)*3 + x] = mmfunc(sum3[x], count);
-	  memset(sum3[x], 0, chunk_pixels * sizeof(uint8_t));
-	}
-	break;
-      }
-      
-    }// end new image j
-  }// end new image i
+#pragma omp parallel for num_threads(m_threads) schedule(dynamic, 1) reduction(|:err)
+  for (uint64_t oy = 0; oy < new_height; oy += band) {
+    uint64_t sy = oy * factor;
+    uint64_t rows = std::min<uint64_t>(band * factor, m_height - sy);
+    err |= ScaleBuffer(src + sy * m_width * bytes_pp, m_width, m_width, rows,
+		       spp, bps, factor, ismode,
+		       dst + oy * new_width * bytes_pp, new_width);
+  }
 
-  switch(mode) {
-    case 8:
-      free(sum8);
-      break;
-  case 3:
-    for (int x = 0; x < 3; ++x)
-      free(sum3[x]);
-    break;
+  if (err) {
+    RasterFree(new_image);
+    return 1;
   }
   
   // transfer the data
-  free(m_data);
+  RasterFree(m_data);
   m_data = new_image;
 
   m_width = new_width;
   m_height = new_height;
   m_pixels = static_cast<uint64_t>(m_width) * m_height;
-  std::cerr << "New " << PAIRSTRING(new_width, new_height) << " pixels " << m_pixels << std::endl;
-  
-  // set the new width and height
-  //if (!TIFFSetField(m_outtif, TIFFTAG_IMAGEWIDTH, new_width)) {
-  //  fprintf(stderr, "ERROR: image (shrunk) failed to set width\n");
-  //  m_width = 0;
-  //  return 1;
- // }
-  
- // if (!TIFFSetField(m_outtif, TIFFTAG_IMAGELENGTH, new_height)) {
- //   fprintf(stderr, "ERROR: image (shrunk) failed to set height\n");
-  //  m_height = 0;
-  //  return 1;
-   // }
   
   return 0;
   
 }
-*/
 
 int TiffImage::__alloc() {
 
@@ -260,23 +191,25 @@ int TiffImage::__alloc() {
 
   if (m_data) {
     std::cerr << "m_data not empty, freeing. Are you sure you want this?" << std::endl;
-    free(m_data);
+    RasterFree(m_data);
+    m_data = NULL;
   }
 
   //debug
   //std::cerr << "m_pixels " << m_pixels << " mode " << mode << std::endl;
   
+  // large rasters go to a scratch file (see tiff_raster.h)
   switch (mode) {
       case 8:
-	m_data = calloc(m_pixels, sizeof(uint8_t));
+	m_data = RasterAlloc(m_pixels * sizeof(uint8_t));
 	//fprintf(stderr, "alloc size %f GB\n", m_pixels / 1e9);
 	break;
       case 32:
-        m_data = calloc(m_pixels, sizeof(uint32_t));
+        m_data = RasterAlloc(m_pixels * sizeof(uint32_t));
 	//fprintf(stderr, "alloc size %f GB\n", m_pixels * 4 / 1e9);
 	break;
   case 3:
-    m_data = calloc(m_pixels * 3, sizeof(uint8_t));
+    m_data = RasterAlloc(m_pixels * 3 * sizeof(uint8_t));
     break;
   default:
     fprintf(stderr, "not able to understand mode %zu\n", mode);
@@ -320,7 +253,7 @@ void TiffImage::clear_raster() {
     return;
   }
 
-  _TIFFfree(m_data);
+  RasterFree(m_data);
 
   m_data = NULL;
 
@@ -84,8 +84,10 @@ class TiffImage {
   // set the verbose output flag
   void setverbose(bool v) { verbose = v; }
 
-  // scale the image downx
-  int Scale(double scale, bool ismode, int threads);
+  // shrink the image by an integer factor, averaging each factor x factor
+  // box (or taking its most common value if ismode, for label images).
+  // Runs on setthreads threads
+  int Scale(uint32_t factor, bool ismode);
 
   // get the mode (gray 8-bit, RBG etc)
   uint8_t GetMode() const;
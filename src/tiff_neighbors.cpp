@@ -0,0 +1,319 @@
+#include "tiff_neighbors.h"
+#include "tiff_npz.h"
+#include "tiff_csv.h"
+#include "tiff_table.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+namespace {
+
+// points bucketed by a counting sort into square cells. The coordinates
+// are copied in bucket order so a cell's points are contiguous
+class PointGrid {
+
+ public:
+
+  PointGrid(const std::vector<double>& x, const std::vector<double>& y, double cell);
+
+  double cell;
+  double x0 = 0, y0 = 0;
+  int64_t nx = 1, ny = 1;
+
+  // points of cell (gx, gy) are start[gy * nx + gx] up to the next start
+  std::vector<uint64_t> start;
+  std::vector<uint32_t> ids;
+  std::vector<double> px;
+  std::vector<double> py;
+
+  int64_t gx(double v) const {
+    return std::min<int64_t>(std::max<int64_t>(std::floor((v - x0) / cell), 0), nx - 1);
+  }
+  int64_t gy(double v) const {
+    return std::min<int64_t>(std::max<int64_t>(std::floor((v - y0) / cell), 0), ny - 1);
+  }
+
+};
+
+PointGrid::PointGrid(const std::vector<double>& x, const std::vector<double>& y, double c) :
+  cell(c) {
+
+  size_t n = x.size();
+  if (!n) {
+    start.assign(2, 0);
+    return;
+  }
+
+  double x1 = x[0], y1 = y[0];
+  x0 = x[0];
+  y0 = y[0];
+  for (size_t i = 1; i < n; i++) {
+    x0 = std::min(x0, x[i]);
+    x1 = std::max(x1, x[i]);
+    y0 = std::min(y0, y[i]);
+    y1 = std::max(y1, y[i]);
+  }
+
+  // never more cells than about twice the points. Any size is correct,
+  // small cells only waste memory on empty ones
+  double area = std::max(x1 - x0, 1.0) * std::max(y1 - y0, 1.0);
+  cell = std::max({cell, std::sqrt(area / (2.0 * n)), 1e-9});
+  nx = static_cast<int64_t>((x1 - x0) / cell) + 1;
+  ny = static_cast<int64_t>((y1 - y0) / cell) + 1;
+
+  std::vector<uint64_t> bucket(n);
+  start.assign(nx * ny + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    bucket[i] = gy(y[i]) * nx + gx(x[i]);
+    start[bucket[i] + 1]++;
+  }
+  for (size_t b = 1; b < start.size(); b++)
+    start[b] += start[b - 1];
+
+  ids.resize(n);
+  px.resize(n);
+  py.resize(n);
+  std::vector<uint64_t> next(start.begin(), start.end() - 1);
+  for (size_t i = 0; i < n; i++) {
+    uint64_t p = next[bucket[i]]++;
+    ids[p] = i;
+    px[p] = x[i];
+    py[p] = y[i];
+  }
+}
+
+// call f(j, d2) for every other point j within r of point i
+template <typename F>
+void __within(const PointGrid& grid, double x, double y, uint32_t i, double r, F f) {
+  double r2 = r * r;
+  int64_t ax = grid.gx(x - r), bx = grid.gx(x + r);
+  int64_t ay = grid.gy(y - r), by = grid.gy(y + r);
+  for (int64_t gy = ay; gy <= by; gy++) {
+    for (int64_t gx = ax; gx <= bx; gx++) {
+      uint64_t b = gy * grid.nx + gx;
+      for (uint64_t p = grid.start[b]; p < grid.start[b + 1]; p++) {
+	double dx = grid.px[p] - x, dy = grid.py[p] - y;
+	double d2 = dx * dx + dy * dy;
+	if (d2 <= r2 && grid.ids[p] != i)
+	  f(grid.ids[p], d2);
+      }
+    }
+  }
+}
+
+// put a row in column order
+void __sort_row(std::vector<std::pair<uint32_t, float>>& row, uint32_t* indices, float* distances) {
+  std::sort(row.begin(), row.end());
+  for (size_t k = 0; k < row.size(); k++) {
+    indices[k] = row[k].first;
+    distances[k] = row[k].second;
+  }
+}
+
+int __check(const std::vector<double>& x, const std::vector<double>& y) {
+  if (x.size() != y.size()) {
+    fprintf(stderr, "ERROR: %zu x and %zu y coordinates\n", x.size(), y.size());
+    return 1;
+  }
+  if (x.size() >= UINT32_MAX) {
+    fprintf(stderr, "ERROR: too many cells for a neighbour graph: %zu\n", x.size());
+    return 1;
+  }
+  return 0;
+}
+
+}
+
+int ReadCentroids(const std::string& file, std::vector<double>& x, std::vector<double>& y,
+		  size_t threads) {
+
+  if (ColumnTable::IsColumnTable(file)) {
+    ColumnTable table;
+    if (table.Open(file))
+      return 1;
+    int xc = table.Find("X_centroid"), yc = table.Find("Y_centroid");
+    if (xc < 0 || yc < 0) {
+      fprintf(stderr, "ERROR: %s has no X_centroid and Y_centroid columns\n", file.c_str());
+      return 1;
+    }
+    x = table.Doubles(xc);
+    y = table.Doubles(yc);
+    if (x.size() != table.rows() || y.size() != table.rows())
+      return 1;
+  } else {
+    CsvTable table;
+    if (ReadCsvTable(file, table, {"X_centroid", "Y_centroid"}, threads))
+      return 1;
+    x = std::move(table.columns[0].values);
+    y = std::move(table.columns[1].values);
+  }
+  for (size_t i = 0; i < x.size(); i++) {
+    if (std::isnan(x[i]) || std::isnan(y[i])) {
+      fprintf(stderr, "ERROR: row %zu of %s has no centroid\n", i + 1, file.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int RadiusNeighbors(const std::vector<double>& x, const std::vector<double>& y,
+		    double radius, NeighborGraph& graph, size_t threads) {
+
+  if (__check(x, y))
+    return 1;
+  if (!(radius > 0)) {
+    fprintf(stderr, "ERROR: radius must be positive, got %g\n", radius);
+    return 1;
+  }
+
+  threads = std::max<size_t>(threads, 1);
+  size_t n = x.size();
+  PointGrid grid(x, y, radius);
+
+  // count, then fill each row where it belongs. Rows are visited in
+  // grid order, so neighbouring searches touch the same cells
+  graph.n = n;
+  graph.indptr.assign(n + 1, 0);
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1024)
+  for (size_t q = 0; q < n; q++) {
+    size_t i = grid.ids[q];
+    uint64_t count = 0;
+    __within(grid, x[i], y[i], i, radius, [&count](uint32_t, double) { count++; });
+    graph.indptr[i + 1] = count;
+  }
+  for (size_t i = 0; i < n; i++)
+    graph.indptr[i + 1] += graph.indptr[i];
+
+  graph.indices.resize(graph.indptr[n]);
+  graph.distances.resize(graph.indptr[n]);
+#pragma omp parallel num_threads(threads)
+  {
+    std::vector<std::pair<uint32_t, float>> row;
+#pragma omp for schedule(dynamic, 1024)
+    for (size_t q = 0; q < n; q++) {
+      size_t i = grid.ids[q];
+      row.clear();
+      __within(grid, x[i], y[i], i, radius, [&row](uint32_t j, double d2) {
+	  row.emplace_back(j, std::sqrt(d2));
+	});
+      __sort_row(row, graph.indices.data() + graph.indptr[i],
+		 graph.distances.data() + graph.indptr[i]);
+    }
+  }
+
+  return 0;
+}
+
+int NearestNeighbors(const std::vector<double>& x, const std::vector<double>& y,
+		     size_t k, NeighborGraph& graph, size_t threads) {
+
+  if (__check(x, y))
+    return 1;
+  if (!k) {
+    fprintf(stderr, "ERROR: k must be at least 1\n");
+    return 1;
+  }
+
+  threads = std::max<size_t>(threads, 1);
+  size_t n = x.size();
+  size_t kk = n ? std::min(k, n - 1) : 0;
+
+  // cells holding about k points each, so the first ring usually does it
+  double x0 = n ? *std::min_element(x.begin(), x.end()) : 0;
+  double x1 = n ? *std::max_element(x.begin(), x.end()) : 0;
+  double y0 = n ? *std::min_element(y.begin(), y.end()) : 0;
+  double y1 = n ? *std::max_element(y.begin(), y.end()) : 0;
+  double area = std::max(x1 - x0, 1.0) * std::max(y1 - y0, 1.0);
+  PointGrid grid(x, y, std::sqrt(area * std::max<size_t>(kk, 1) / std::max<size_t>(n, 1)));
+
+  graph.n = n;
+  graph.indptr.resize(n + 1);
+  for (size_t i = 0; i <= n; i++)
+    graph.indptr[i] = i * kk;
+  graph.indices.resize(n * kk);
+  graph.distances.resize(n * kk);
+  if (!kk)
+    return 0;
+
+#pragma omp parallel num_threads(threads)
+  {
+    // max-heap on distance of the best so far
+    std::vector<std::pair<double, uint32_t>> heap;
+    std::vector<std::pair<uint32_t, float>> row;
+
+    // in grid order, so neighbouring searches touch the same cells
+#pragma omp for schedule(dynamic, 1024)
+    for (size_t q = 0; q < n; q++) {
+
+      size_t i = grid.ids[q];
+      heap.clear();
+      int64_t cx = grid.gx(x[i]), cy = grid.gy(y[i]);
+
+      // nothing outside ring s is closer than this plus s cells
+      double edge = std::min({x[i] - (grid.x0 + cx * grid.cell),
+			      grid.x0 + (cx + 1) * grid.cell - x[i],
+			      y[i] - (grid.y0 + cy * grid.cell),
+			      grid.y0 + (cy + 1) * grid.cell - y[i]});
+      edge = std::max(edge, 0.0);
+      int64_t max_ring = std::max(grid.nx, grid.ny);
+
+      for (int64_t s = 0; s <= max_ring; s++) {
+	for (int64_t gy = cy - s; gy <= cy + s; gy++) {
+	  if (gy < 0 || gy >= grid.ny)
+	    continue;
+	  // the top and bottom rows of the ring in full, the sides only at the ends
+	  int64_t step = (gy == cy - s || gy == cy + s) ? 1 : 2 * s;
+	  for (int64_t gx = cx - s; gx <= cx + s; gx += std::max<int64_t>(step, 1)) {
+	    if (gx < 0 || gx >= grid.nx)
+	      continue;
+	    uint64_t b = gy * grid.nx + gx;
+	    for (uint64_t p = grid.start[b]; p < grid.start[b + 1]; p++) {
+	      if (grid.ids[p] == i)
+		continue;
+	      double dx = grid.px[p] - x[i], dy = grid.py[p] - y[i];
+	      double d2 = dx * dx + dy * dy;
+	      if (heap.size() < kk) {
+		heap.emplace_back(d2, grid.ids[p]);
+		std::push_heap(heap.begin(), heap.end());
+	      } else if (d2 < heap.front().first) {
+		std::pop_heap(heap.begin(), heap.end());
+		heap.back() = std::make_pair(d2, grid.ids[p]);
+		std::push_heap(heap.begin(), heap.end());
+	      }
+	    }
+	  }
+	}
+	double reach = s * grid.cell + edge;
+	if (heap.size() == kk && heap.front().first <= reach * reach)
+	  break;
+      }
+
+      row.clear();
+      for (auto& h : heap)
+	row.emplace_back(h.second, std::sqrt(h.first));
+      __sort_row(row, graph.indices.data() + i * kk, graph.distances.data() + i * kk);
+    }
+  }
+
+  return 0;
+}
+
+int WriteNeighborGraph(const NeighborGraph& graph, const std::string& file) {
+
+  // the layout scipy.sparse.save_npz writes for a csr_matrix
+  const char format[3] = {'c', 's', 'r'};
+  int64_t shape[2] = {static_cast<int64_t>(graph.n), static_cast<int64_t>(graph.n)};
+  uint64_t nnz = graph.indices.size();
+
+  NpzWriter npz;
+  if (npz.Open(file) ||
+      npz.Add("indices", "<i4", {nnz}, graph.indices.data(), nnz * sizeof(uint32_t)) ||
+      npz.Add("indptr", "<i8", {graph.n + 1}, graph.indptr.data(), graph.indptr.size() * sizeof(uint64_t)) ||
+      npz.Add("format", "|S3", {}, format, sizeof(format)) ||
+      npz.Add("shape", "<i8", {2}, shape, sizeof(shape)) ||
+      npz.Add("data", "<f4", {nnz}, graph.distances.data(), nnz * sizeof(float)))
+    return 1;
+
+  return npz.Close();
+}
@@ -0,0 +1,37 @@
+#ifndef TIFF_NEIGHBORS_H
+#define TIFF_NEIGHBORS_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// a spatial neighbour graph as a CSR sparse matrix, n x n. Row i lists
+// the neighbours of cell i by increasing index, with their distances
+struct NeighborGraph {
+  uint64_t n = 0;
+  std::vector<uint64_t> indptr;
+  std::vector<uint32_t> indices;
+  std::vector<float> distances;
+};
+
+// X_centroid and Y_centroid of a quantification table, either a column
+// table or a plain or gzipped CSV (see ReadCsvTable), in row order. Returns 0 on success
+int ReadCentroids(const std::string& file, std::vector<double>& x, std::vector<double>& y,
+		  size_t threads = 1);
+
+// every other cell within radius of each cell. Cells are bucketed on a
+// uniform grid of radius-sized cells, and rows are found in parallel
+int RadiusNeighbors(const std::vector<double>& x, const std::vector<double>& y,
+		    double radius, NeighborGraph& graph, size_t threads);
+
+// the k nearest other cells of each cell (fewer if there aren't k),
+// searched ring by ring out from the cell's grid cell
+int NearestNeighbors(const std::vector<double>& x, const std::vector<double>& y,
+		     size_t k, NeighborGraph& graph, size_t threads);
+
+// write graph for scipy.sparse.load_npz, with the distances as the data.
+// The connectivities are the same matrix with every entry set to 1
+int WriteNeighborGraph(const NeighborGraph& graph, const std::string& file);
+
+#endif
@@ -0,0 +1,201 @@
+#include "tiff_npz.h"
+
+#include <zlib.h>
+
+// zip record signatures
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP64_END_RECORD 0x06064b50
+#define ZIP64_END_LOCATOR 0x07064b50
+#define ZIP_END_RECORD 0x06054b50
+
+// version 4.5, the first with zip64
+#define ZIP_VERSION 45
+
+// 1980-01-01 00:00, the earliest DOS date
+#define ZIP_DOS_DATE 0x21
+
+static void __put16(std::string& s, uint16_t v) {
+  for (int i = 0; i < 2; i++)
+    s += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+static void __put32(std::string& s, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    s += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+static void __put64(std::string& s, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    s += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+// .npy version 1.0 header, padded so the data starts 64-byte aligned
+static std::string __npy_header(const std::string& descr, const std::vector<uint64_t>& shape) {
+
+  std::string dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': (";
+  for (size_t i = 0; i < shape.size(); i++)
+    dict += (i ? ", " : "") + std::to_string(shape[i]);
+  if (shape.size() == 1)
+    dict += ",";
+  dict += "), }";
+
+  size_t total = 10 + dict.size() + 1;
+  dict.append((64 - total % 64) % 64, ' ');
+  dict += '\n';
+
+  std::string h = "\x93NUMPY";
+  h += '\x01';
+  h += '\x00';
+  __put16(h, dict.size());
+  return h + dict;
+}
+
+static uint32_t __crc(uint32_t crc, const void* data, size_t bytes) {
+  const Bytef* p = static_cast<const Bytef*>(data);
+  while (bytes) {
+    uInt n = bytes > (1U << 30) ? (1U << 30) : static_cast<uInt>(bytes);
+    crc = crc32(crc, p, n);
+    p += n;
+    bytes -= n;
+  }
+  return crc;
+}
+
+NpzWriter::~NpzWriter() {
+  if (m_fp)
+    Close();
+}
+
+int NpzWriter::Open(const std::string& file) {
+  m_fp = fopen(file.c_str(), "wb");
+  if (!m_fp) {
+    fprintf(stderr, "ERROR: unable to open %s for writing\n", file.c_str());
+    return 1;
+  }
+  m_file = file;
+  m_entries.clear();
+  m_offset = 0;
+  return 0;
+}
+
+bool NpzWriter::__write(const void* data, size_t bytes) {
+  if (fwrite(data, 1, bytes, m_fp) != bytes)
+    return false;
+  m_offset += bytes;
+  return true;
+}
+
+int NpzWriter::Add(const std::string& name, const std::string& descr,
+		   const std::vector<uint64_t>& shape, const void* data, size_t bytes) {
+
+  if (!m_fp)
+    return 1;
+
+  Entry e;
+  e.name = name + ".npy";
+  e.offset = m_offset;
+
+  std::string npy = __npy_header(descr, shape);
+  e.size = npy.size() + bytes;
+  e.crc = __crc(__crc(crc32(0, Z_NULL, 0), npy.data(), npy.size()), data, bytes);
+
+  // sizes live in the zip64 extra field
+  std::string h;
+  __put32(h, ZIP_LOCAL_HEADER);
+  __put16(h, ZIP_VERSION);
+  __put16(h, 0);
+  __put16(h, 0);
+  __put16(h, 0);
+  __put16(h, ZIP_DOS_DATE);
+  __put32(h, e.crc);
+  __put32(h, 0xffffffff);
+  __put32(h, 0xffffffff);
+  __put16(h, e.name.size());
+  __put16(h, 20);
+  h += e.name;
+  __put16(h, 0x0001);
+  __put16(h, 16);
+  __put64(h, e.size);
+  __put64(h, e.size);
+
+  if (!__write(h.data(), h.size()) || !__write(npy.data(), npy.size()) ||
+      !__write(data, bytes)) {
+    fprintf(stderr, "ERROR: unable to write %s to %s\n", e.name.c_str(), m_file.c_str());
+    return 1;
+  }
+
+  m_entries.push_back(e);
+  return 0;
+}
+
+int NpzWriter::Close() {
+
+  if (!m_fp)
+    return 1;
+
+  std::string cd;
+  for (auto& e : m_entries) {
+    __put32(cd, ZIP_CENTRAL_HEADER);
+    __put16(cd, ZIP_VERSION);
+    __put16(cd, ZIP_VERSION);
+    __put16(cd, 0);
+    __put16(cd, 0);
+    __put16(cd, 0);
+    __put16(cd, ZIP_DOS_DATE);
+    __put32(cd, e.crc);
+    __put32(cd, 0xffffffff);
+    __put32(cd, 0xffffffff);
+    __put16(cd, e.name.size());
+    __put16(cd, 28);
+    __put16(cd, 0);
+    __put16(cd, 0);
+    __put16(cd, 0);
+    __put32(cd, 0);
+    __put32(cd, 0xffffffff);
+    cd += e.name;
+    __put16(cd, 0x0001);
+    __put16(cd, 24);
+    __put64(cd, e.size);
+    __put64(cd, e.size);
+    __put64(cd, e.offset);
+  }
+
+  uint64_t cd_offset = m_offset;
+  uint64_t end64_offset = cd_offset + cd.size();
+
+  std::string end;
+  __put32(end, ZIP64_END_RECORD);
+  __put64(end, 44);
+  __put16(end, ZIP_VERSION);
+  __put16(end, ZIP_VERSION);
+  __put32(end, 0);
+  __put32(end, 0);
+  __put64(end, m_entries.size());
+  __put64(end, m_entries.size());
+  __put64(end, cd.size());
+  __put64(end, cd_offset);
+
+  __put32(end, ZIP64_END_LOCATOR);
+  __put32(end, 0);
+  __put64(end, end64_offset);
+  __put32(end, 1);
+
+  __put32(end, ZIP_END_RECORD);
+  __put16(end, 0);
+  __put16(end, 0);
+  __put16(end, 0xffff);
+  __put16(end, 0xffff);
+  __put32(end, 0xffffffff);
+  __put32(end, 0xffffffff);
+  __put16(end, 0);
+
+  bool ok = __write(cd.data(), cd.size()) && __write(end.data(), end.size());
+  ok = fclose(m_fp) == 0 && ok;
+  m_fp = NULL;
+  if (!ok) {
+    fprintf(stderr, "ERROR: unable to write %s\n", m_file.c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef TIFF_NPZ_H
+#define TIFF_NPZ_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+// writes numpy .npz archives: an uncompressed (stored) zip of .npy
+// arrays, readable by numpy.load and scipy.sparse.load_npz. Zip64
+// records are used throughout, so arrays may be larger than 4 GB
+//
+//   NpzWriter npz;
+//   npz.Open("graph.npz");
+//   npz.Add("indptr", "<i8", {n + 1}, indptr.data(), indptr.size() * 8);
+//   npz.Close();
+class NpzWriter {
+
+ public:
+
+  NpzWriter() {}
+
+  // closes the file if still open
+  ~NpzWriter();
+
+  int Open(const std::string& file);
+
+  // add name.npy holding bytes of data with numpy dtype descr (e.g. "<f4")
+  // and shape (empty for a scalar). Returns 0 on success
+  int Add(const std::string& name, const std::string& descr,
+	  const std::vector<uint64_t>& shape, const void* data, size_t bytes);
+
+  // write the central directory. Returns 0 on success
+  int Close();
+
+ private:
+
+  struct Entry {
+    std::string name;
+    uint32_t crc;
+    uint64_t size;
+    uint64_t offset;
+  };
+
+  FILE* m_fp = NULL;
+  std::string m_file;
+  std::vector<Entry> m_entries;
+  uint64_t m_offset = 0;
+
+  bool __write(const void* data, size_t bytes);
+
+};
+
+#endif
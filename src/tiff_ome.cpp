@@ -0,0 +1,260 @@
+#include "tiff_ome.h"
+
+#include <cctype>
+#include <cstring>
+
+namespace {
+
+// true if an element called name starts at pos
+bool __is_element(const std::string& xml, size_t pos, const std::string& name) {
+  if (xml.compare(pos, name.size() + 1, "<" + name) != 0)
+    return false;
+  size_t after = pos + name.size() + 1;
+  return after < xml.size() && (isspace(xml[after]) || xml[after] == '/' || xml[after] == '>');
+}
+
+// start of the first element called name at or after pos, or npos
+size_t __find_element(const std::string& xml, const std::string& name, size_t pos) {
+  while ((pos = xml.find("<" + name, pos)) != std::string::npos) {
+    if (__is_element(xml, pos, name))
+      return pos;
+    pos++;
+  }
+  return std::string::npos;
+}
+
+// one past the end of the element called name starting at pos, which is
+// either self-closing or ends at its closing tag. npos if it never ends
+size_t __element_end(const std::string& xml, const std::string& name, size_t pos) {
+  size_t gt = xml.find('>', pos);
+  if (gt == std::string::npos)
+    return gt;
+  if (xml[gt - 1] == '/')
+    return gt + 1;
+  size_t close = xml.find("</" + name, gt);
+  if (close == std::string::npos)
+    return close;
+  size_t end = xml.find('>', close);
+  return end == std::string::npos ? end : end + 1;
+}
+
+// where the quoted value of attribute name sits in the opening tag of
+// element, as [start, end). False if the tag has no such attribute
+bool __find_attr(const std::string& element, const std::string& name, size_t& start, size_t& end) {
+  size_t gt = element.find('>');
+  size_t pos = 0;
+  while ((pos = element.find(name + "=", pos)) != std::string::npos && pos < gt) {
+    size_t q = pos + name.size() + 1;
+    if (pos > 0 && isspace(element[pos - 1]) && (element[q] == '"' || element[q] == '\'')) {
+      end = element.find(element[q], q + 1);
+      if (end == std::string::npos)
+	return false;
+      start = q + 1;
+      return true;
+    }
+    pos++;
+  }
+  return false;
+}
+
+bool __get_attr(const std::string& element, const std::string& name, std::string& value) {
+  size_t start, end;
+  if (!__find_attr(element, name, start, end))
+    return false;
+  value = element.substr(start, end - start);
+  return true;
+}
+
+// set attribute name in the opening tag of element, adding it if missing
+void __set_attr(std::string& element, const std::string& name, const std::string& value) {
+  size_t start, end;
+  if (__find_attr(element, name, start, end)) {
+    element.replace(start, end - start, value);
+    return;
+  }
+  size_t gt = element.find('>');
+  if (gt == std::string::npos)
+    return;
+  if (gt > 0 && element[gt - 1] == '/')
+    gt--;
+  element.insert(gt, " " + name + "=\"" + value + "\"");
+}
+
+// attribute value with the predefined XML entities replaced
+std::string __unescape(const std::string& v) {
+  static const std::pair<const char*, char> entities[] = {
+    {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}};
+  std::string out;
+  for (size_t i = 0; i < v.size(); i++) {
+    bool replaced = false;
+    for (auto& e : entities) {
+      size_t len = strlen(e.first);
+      if (v.compare(i, len, e.first) == 0) {
+	out += e.second;
+	i += len - 1;
+	replaced = true;
+	break;
+      }
+    }
+    if (!replaced)
+      out += v[i];
+  }
+  return out;
+}
+
+}
+
+bool IsOmeXml(const std::string& description) {
+  return __find_element(description, "OME", 0) != std::string::npos;
+}
+
+std::vector<std::string> OmeChannelNames(const std::string& xml) {
+
+  std::vector<std::string> names;
+  size_t p0 = __find_element(xml, "Pixels", 0);
+  if (p0 == std::string::npos)
+    return names;
+  size_t close = xml.find("</Pixels", p0);
+  if (close == std::string::npos)
+    return names;
+
+  size_t pos = p0;
+  while ((pos = __find_element(xml, "Channel", pos)) != std::string::npos && pos < close) {
+    size_t gt = xml.find('>', pos);
+    if (gt == std::string::npos)
+      break;
+    std::string name;
+    __get_attr(xml.substr(pos, gt + 1 - pos), "Name", name);
+    names.push_back(__unescape(name));
+    pos = gt;
+  }
+  return names;
+}
+
+std::string SetOmePixelType(const std::string& xml, const std::string& type, int bits) {
+
+  std::string out(xml);
+  size_t pos = 0;
+  while ((pos = __find_element(out, "Pixels", pos)) != std::string::npos) {
+    size_t gt = out.find('>', pos);
+    if (gt == std::string::npos)
+      break;
+    std::string pixels = out.substr(pos, gt + 1 - pos);
+    std::string sig;
+    __set_attr(pixels, "Type", type);
+    if (__get_attr(pixels, "SignificantBits", sig))
+      __set_attr(pixels, "SignificantBits", std::to_string(bits));
+    out.replace(pos, gt + 1 - pos, pixels);
+    pos += pixels.size();
+  }
+  return out;
+}
+
+std::string SubsetOmeChannels(const std::string& xml, const std::vector<size_t>& channels,
+			      std::string& why) {
+
+  size_t p0 = __find_element(xml, "Pixels", 0);
+  if (p0 == std::string::npos) {
+    why = "it has no Pixels element";
+    return "";
+  }
+  if (__find_element(xml, "Pixels", p0 + 1) != std::string::npos) {
+    why = "it describes more than one image";
+    return "";
+  }
+  size_t open_end = xml.find('>', p0);
+  size_t close = open_end == std::string::npos ? open_end : xml.find("</Pixels", open_end);
+  if (close == std::string::npos || xml[open_end - 1] == '/') {
+    why = "its Pixels element is malformed";
+    return "";
+  }
+  std::string pixels = xml.substr(p0, open_end + 1 - p0);
+
+  std::string nz, nt;
+  if ((__get_attr(pixels, "SizeZ", nz) && nz != "1") ||
+      (__get_attr(pixels, "SizeT", nt) && nt != "1")) {
+    why = "it has more than one Z or T plane";
+    return "";
+  }
+
+  // pull the Channel, TiffData and Plane elements out of the Pixels body
+  std::vector<std::string> found, planes;
+  std::string rest;
+  size_t pos = open_end + 1;
+  while (pos < close) {
+    size_t lt = xml.find('<', pos);
+    if (lt >= close) {
+      rest.append(xml, pos, close - pos);
+      break;
+    }
+    rest.append(xml, pos, lt - pos);
+
+    std::string name;
+    for (const char* n : {"Channel", "TiffData", "Plane"})
+      if (__is_element(xml, lt, n))
+	name = n;
+    if (name.empty()) {
+      rest += '<';
+      pos = lt + 1;
+      continue;
+    }
+
+    size_t end = __element_end(xml, name, lt);
+    if (end == std::string::npos || end > close) {
+      why = "its " + name + " element is malformed";
+      return "";
+    }
+    if (name == "Channel")
+      found.push_back(xml.substr(lt, end - lt));
+    else if (name == "Plane")
+      planes.push_back(xml.substr(lt, end - lt));
+    pos = end;
+  }
+  if (rest.find_first_not_of(" \t\r\n") == std::string::npos)
+    rest.clear();
+
+  std::string size_c;
+  if (found.empty() || !__get_attr(pixels, "SizeC", size_c) ||
+      size_c != std::to_string(found.size())) {
+    why = "its Channel list doesn't match SizeC";
+    return "";
+  }
+  for (auto& c : found) {
+    std::string spp;
+    if (__get_attr(c, "SamplesPerPixel", spp) && spp != "1") {
+      why = "it has channels of more than one sample";
+      return "";
+    }
+  }
+  for (auto c : channels) {
+    if (c >= found.size()) {
+      why = "it has no channel " + std::to_string(c);
+      return "";
+    }
+  }
+
+  // channels in their new order, then one TiffData for all of them
+  std::string body;
+  for (size_t i = 0; i < channels.size(); i++) {
+    std::string c = found[channels[i]];
+    std::string id;
+    size_t colon = __get_attr(c, "ID", id) ? id.rfind(':') : std::string::npos;
+    __set_attr(c, "ID", (colon == std::string::npos ? std::string("Channel:0:") :
+			 id.substr(0, colon + 1)) + std::to_string(i));
+    body += c;
+  }
+  body += "<TiffData IFD=\"0\" PlaneCount=\"" + std::to_string(channels.size()) + "\"/>";
+  body += rest;
+  for (size_t i = 0; i < channels.size(); i++) {
+    for (auto p : planes) {
+      std::string the_c;
+      if (__get_attr(p, "TheC", the_c) && the_c == std::to_string(channels[i])) {
+	__set_attr(p, "TheC", std::to_string(i));
+	body += p;
+      }
+    }
+  }
+
+  __set_attr(pixels, "SizeC", std::to_string(channels.size()));
+  return xml.substr(0, p0) + pixels + body + xml.substr(close);
+}
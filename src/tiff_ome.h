@@ -0,0 +1,27 @@
+#ifndef TIFF_OME_H
+#define TIFF_OME_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// true if an ImageDescription holds OME-XML
+bool IsOmeXml(const std::string& description);
+
+// Name of each Channel of the first image of xml, in order, with "" for
+// channels that have none. Empty if xml has no Pixels element
+std::vector<std::string> OmeChannelNames(const std::string& xml);
+
+// xml with the Type of every Pixels element set to type (e.g. "uint16"),
+// and its SignificantBits, if given, to bits. Everything else is kept
+std::string SetOmePixelType(const std::string& xml, const std::string& type, int bits);
+
+// OME-XML of a single-image, one-plane-per-channel OME-TIFF (SizeZ and
+// SizeT of 1) cut down to channels, in that order. Channel IDs and the
+// TheC of Planes are renumbered, SizeC is set and the TiffData becomes
+// one block of channels.size() IFDs from IFD 0. Returns the new XML, or
+// an empty string (with the reason in why) if xml can't be subset
+std::string SubsetOmeChannels(const std::string& xml, const std::vector<size_t>& channels,
+			      std::string& why);
+
+#endif
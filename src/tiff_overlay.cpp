@@ -0,0 +1,240 @@
+#include "tiff_overlay.h"
+
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+// 8 x 16 glyphs for printable ASCII (' ' to '~'), rasterized from DejaVu
+// Sans Mono Bold. Each byte is a row, most significant bit on the left
+static const uint8_t FONT_8X16[95][16] = {
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // ' '
+  {0x00,0x00,0x00,0x18,0x18,0x18,0x18,0x18,0x18,0x00,0x18,0x18,0x00,0x00,0x00,0x00}, // '!'
+  {0x00,0x00,0x00,0x66,0x66,0x66,0x66,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '"'
+  {0x00,0x00,0x00,0x00,0x12,0x16,0x7f,0x34,0x24,0xfe,0x68,0x48,0x00,0x00,0x00,0x00}, // '#'
+  {0x00,0x00,0x08,0x08,0x3e,0x6a,0x68,0x3e,0x0b,0x0b,0x6b,0x3e,0x08,0x08,0x00,0x00}, // '$'
+  {0x00,0x00,0x00,0x60,0x90,0x90,0x63,0x1c,0xe6,0x09,0x09,0x06,0x00,0x00,0x00,0x00}, // '%'
+  {0x00,0x00,0x00,0x1c,0x30,0x30,0x18,0x39,0x6d,0x67,0x66,0x3f,0x00,0x00,0x00,0x00}, // '&'
+  {0x00,0x00,0x00,0x18,0x18,0x18,0x18,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '\''
+  {0x00,0x08,0x18,0x10,0x30,0x30,0x30,0x30,0x30,0x30,0x10,0x18,0x08,0x00,0x00,0x00}, // '('
+  {0x00,0x10,0x18,0x08,0x0c,0x0c,0x0c,0x0c,0x0c,0x0c,0x08,0x18,0x10,0x00,0x00,0x00}, // ')'
+  {0x00,0x00,0x00,0x10,0xd6,0x7c,0x7c,0xd6,0x10,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '*'
+  {0x00,0x00,0x00,0x00,0x18,0x18,0x18,0xff,0xff,0x18,0x18,0x18,0x00,0x00,0x00,0x00}, // '+'
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x18,0x18,0x10,0x20,0x00,0x00}, // ','
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x3c,0x3c,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '-'
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x18,0x18,0x00,0x00,0x00,0x00}, // '.'
+  {0x00,0x00,0x00,0x02,0x04,0x04,0x08,0x08,0x18,0x10,0x10,0x20,0x20,0x40,0x00,0x00}, // '/'
+  {0x00,0x00,0x00,0x1c,0x36,0x63,0x6b,0x6b,0x63,0x63,0x36,0x1c,0x00,0x00,0x00,0x00}, // '0'
+  {0x00,0x00,0x00,0x78,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x7e,0x00,0x00,0x00,0x00}, // '1'
+  {0x00,0x00,0x00,0x3e,0x43,0x03,0x02,0x06,0x0c,0x18,0x30,0x7f,0x00,0x00,0x00,0x00}, // '2'
+  {0x00,0x00,0x00,0x3e,0x43,0x03,0x1c,0x07,0x03,0x03,0x47,0x3e,0x00,0x00,0x00,0x00}, // '3'
+  {0x00,0x00,0x00,0x0e,0x0e,0x1e,0x36,0x66,0x7f,0x06,0x06,0x06,0x00,0x00,0x00,0x00}, // '4'
+  {0x00,0x00,0x00,0x7e,0x60,0x60,0x7c,0x47,0x03,0x03,0x47,0x3c,0x00,0x00,0x00,0x00}, // '5'
+  {0x00,0x00,0x00,0x1c,0x32,0x60,0x7e,0x63,0x63,0x63,0x23,0x1e,0x00,0x00,0x00,0x00}, // '6'
+  {0x00,0x00,0x00,0x7f,0x03,0x06,0x06,0x0c,0x0c,0x18,0x18,0x30,0x00,0x00,0x00,0x00}, // '7'
+  {0x00,0x00,0x00,0x3e,0x63,0x63,0x1c,0x63,0x63,0x63,0x63,0x3e,0x00,0x00,0x00,0x00}, // '8'
+  {0x00,0x00,0x00,0x3c,0x62,0x63,0x63,0x63,0x3f,0x03,0x26,0x1c,0x00,0x00,0x00,0x00}, // '9'
+  {0x00,0x00,0x00,0x00,0x00,0x18,0x18,0x00,0x00,0x00,0x18,0x18,0x00,0x00,0x00,0x00}, // ':'
+  {0x00,0x00,0x00,0x00,0x00,0x18,0x18,0x00,0x00,0x00,0x18,0x18,0x10,0x20,0x00,0x00}, // ';'
+  {0x00,0x00,0x00,0x00,0x00,0x01,0x0f,0x3c,0x60,0x3c,0x0f,0x01,0x00,0x00,0x00,0x00}, // '<'
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x7f,0x7f,0x00,0x7f,0x7f,0x00,0x00,0x00,0x00,0x00}, // '='
+  {0x00,0x00,0x00,0x00,0x00,0x40,0x78,0x1e,0x03,0x1e,0x78,0x40,0x00,0x00,0x00,0x00}, // '>'
+  {0x00,0x00,0x00,0x1c,0x26,0x06,0x0c,0x18,0x18,0x00,0x18,0x18,0x00,0x00,0x00,0x00}, // '?'
+  {0x00,0x00,0x00,0x3c,0x62,0x5e,0xb6,0xa2,0xa2,0xa2,0xb6,0x5e,0x62,0x3e,0x00,0x00}, // '@'
+  {0x00,0x00,0x00,0x1c,0x1c,0x14,0x36,0x36,0x3e,0x36,0x63,0x63,0x00,0x00,0x00,0x00}, // 'A'
+  {0x00,0x00,0x00,0x7e,0x63,0x63,0x63,0x7c,0x63,0x63,0x63,0x7e,0x00,0x00,0x00,0x00}, // 'B'
+  {0x00,0x00,0x00,0x1e,0x31,0x60,0x60,0x60,0x60,0x60,0x31,0x1e,0x00,0x00,0x00,0x00}, // 'C'
+  {0x00,0x00,0x00,0x7c,0x66,0x63,0x63,0x63,0x63,0x63,0x66,0x7c,0x00,0x00,0x00,0x00}, // 'D'
+  {0x00,0x00,0x00,0x7f,0x60,0x60,0x60,0x7e,0x60,0x60,0x60,0x7f,0x00,0x00,0x00,0x00}, // 'E'
+  {0x00,0x00,0x00,0x7f,0x60,0x60,0x60,0x7e,0x60,0x60,0x60,0x60,0x00,0x00,0x00,0x00}, // 'F'
+  {0x00,0x00,0x00,0x1e,0x31,0x60,0x60,0x67,0x63,0x63,0x33,0x1f,0x00,0x00,0x00,0x00}, // 'G'
+  {0x00,0x00,0x00,0x63,0x63,0x63,0x63,0x7f,0x63,0x63,0x63,0x63,0x00,0x00,0x00,0x00}, // 'H'
+  {0x00,0x00,0x00,0x7e,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x7e,0x00,0x00,0x00,0x00}, // 'I'
+  {0x00,0x00,0x00,0x0f,0x03,0x03,0x03,0x03,0x03,0x03,0x43,0x3e,0x00,0x00,0x00,0x00}, // 'J'
+  {0x00,0x00,0x00,0x63,0x66,0x6c,0x78,0x7c,0x6c,0x66,0x66,0x63,0x00,0x00,0x00,0x00}, // 'K'
+  {0x00,0x00,0x00,0x60,0x60,0x60,0x60,0x60,0x60,0x60,0x60,0x7f,0x00,0x00,0x00,0x00}, // 'L'
+  {0x00,0x00,0x00,0x77,0x77,0x77,0x77,0x7f,0x6b,0x63,0x63,0x63,0x00,0x00,0x00,0x00}, // 'M'
+  {0x00,0x00,0x00,0x73,0x73,0x73,0x7b,0x6b,0x6f,0x67,0x67,0x67,0x00,0x00,0x00,0x00}, // 'N'
+  {0x00,0x00,0x00,0x1c,0x36,0x63,0x63,0x63,0x63,0x63,0x36,0x1c,0x00,0x00,0x00,0x00}, // 'O'
+  {0x00,0x00,0x00,0x7e,0x63,0x63,0x63,0x63,0x7e,0x60,0x60,0x60,0x00,0x00,0x00,0x00}, // 'P'
+  {0x00,0x00,0x00,0x1c,0x36,0x63,0x63,0x63,0x63,0x63,0x36,0x1e,0x06,0x02,0x00,0x00}, // 'Q'
+  {0x00,0x00,0x00,0x7e,0x63,0x63,0x63,0x63,0x7c,0x66,0x63,0x61,0x00,0x00,0x00,0x00}, // 'R'
+  {0x00,0x00,0x00,0x3e,0x61,0x60,0x70,0x3e,0x07,0x03,0x43,0x3e,0x00,0x00,0x00,0x00}, // 'S'
+  {0x00,0x00,0x00,0x7e,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x00,0x00,0x00,0x00}, // 'T'
+  {0x00,0x00,0x00,0x63,0x63,0x63,0x63,0x63,0x63,0x63,0x63,0x3e,0x00,0x00,0x00,0x00}, // 'U'
+  {0x00,0x00,0x00,0x63,0x63,0x22,0x36,0x36,0x36,0x14,0x1c,0x1c,0x00,0x00,0x00,0x00}, // 'V'
+  {0x00,0x00,0x00,0xc3,0xc3,0xdb,0xdb,0x5a,0x5e,0x66,0x66,0x66,0x00,0x00,0x00,0x00}, // 'W'
+  {0x00,0x00,0x00,0x63,0x36,0x36,0x1c,0x08,0x1c,0x36,0x36,0x63,0x00,0x00,0x00,0x00}, // 'X'
+  {0x00,0x00,0x00,0xc3,0x66,0x66,0x3c,0x3c,0x18,0x18,0x18,0x18,0x00,0x00,0x00,0x00}, // 'Y'
+  {0x00,0x00,0x00,0x7f,0x03,0x06,0x0c,0x1c,0x18,0x30,0x60,0x7f,0x00,0x00,0x00,0x00}, // 'Z'
+  {0x00,0x1e,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x1e,0x00,0x00,0x00}, // '['
+  {0x00,0x00,0x00,0x60,0x20,0x20,0x30,0x10,0x18,0x08,0x0c,0x04,0x04,0x06,0x00,0x00}, // '\\'
+  {0x00,0x38,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x18,0x38,0x00,0x00,0x00}, // ']'
+  {0x00,0x00,0x00,0x38,0x38,0x6c,0xc6,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '^'
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xff,0x00}, // '_'
+  {0x00,0x00,0x30,0x18,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '`'
+  {0x00,0x00,0x00,0x00,0x00,0x1c,0x26,0x06,0x3e,0x66,0x66,0x3e,0x00,0x00,0x00,0x00}, // 'a'
+  {0x00,0x60,0x60,0x60,0x60,0x7c,0x66,0x66,0x66,0x66,0x66,0x7c,0x00,0x00,0x00,0x00}, // 'b'
+  {0x00,0x00,0x00,0x00,0x00,0x1c,0x32,0x60,0x60,0x60,0x32,0x1c,0x00,0x00,0x00,0x00}, // 'c'
+  {0x00,0x06,0x06,0x06,0x06,0x3e,0x66,0x66,0x66,0x66,0x66,0x3e,0x00,0x00,0x00,0x00}, // 'd'
+  {0x00,0x00,0x00,0x00,0x00,0x3c,0x66,0x66,0x7e,0x60,0x62,0x3c,0x00,0x00,0x00,0x00}, // 'e'
+  {0x00,0x0e,0x18,0x18,0x18,0x7e,0x18,0x18,0x18,0x18,0x18,0x18,0x00,0x00,0x00,0x00}, // 'f'
+  {0x00,0x00,0x00,0x00,0x00,0x3e,0x66,0x66,0x66,0x66,0x66,0x3e,0x06,0x06,0x3c,0x00}, // 'g'
+  {0x00,0x60,0x60,0x60,0x60,0x7c,0x66,0x66,0x66,0x66,0x66,0x66,0x00,0x00,0x00,0x00}, // 'h'
+  {0x00,0x18,0x18,0x00,0x00,0x78,0x18,0x18,0x18,0x18,0x18,0x7e,0x00,0x00,0x00,0x00}, // 'i'
+  {0x00,0x0c,0x0c,0x00,0x00,0x3c,0x0c,0x0c,0x0c,0x0c,0x0c,0x0c,0x0c,0x0c,0x78,0x00}, // 'j'
+  {0x00,0x60,0x60,0x60,0x60,0x64,0x6c,0x78,0x78,0x6c,0x6c,0x66,0x00,0x00,0x00,0x00}, // 'k'
+  {0x00,0xf0,0x30,0x30,0x30,0x30,0x30,0x30,0x30,0x30,0x30,0x1e,0x00,0x00,0x00,0x00}, // 'l'
+  {0x00,0x00,0x00,0x00,0x00,0xff,0xdb,0xdb,0xdb,0xdb,0xdb,0xdb,0x00,0x00,0x00,0x00}, // 'm'
+  {0x00,0x00,0x00,0x00,0x00,0x7c,0x66,0x66,0x66,0x66,0x66,0x66,0x00,0x00,0x00,0x00}, // 'n'
+  {0x00,0x00,0x00,0x00,0x00,0x3c,0x66,0x66,0x66,0x66,0x66,0x3c,0x00,0x00,0x00,0x00}, // 'o'
+  {0x00,0x00,0x00,0x00,0x00,0x7c,0x66,0x66,0x66,0x66,0x66,0x7c,0x60,0x60,0x60,0x00}, // 'p'
+  {0x00,0x00,0x00,0x00,0x00,0x3e,0x66,0x66,0x66,0x66,0x66,0x3e,0x06,0x06,0x06,0x00}, // 'q'
+  {0x00,0x00,0x00,0x00,0x00,0x3e,0x30,0x30,0x30,0x30,0x30,0x30,0x00,0x00,0x00,0x00}, // 'r'
+  {0x00,0x00,0x00,0x00,0x00,0x3c,0x62,0x70,0x3c,0x06,0x46,0x3c,0x00,0x00,0x00,0x00}, // 's'
+  {0x00,0x00,0x00,0x18,0x18,0x7e,0x18,0x18,0x18,0x18,0x18,0x0e,0x00,0x00,0x00,0x00}, // 't'
+  {0x00,0x00,0x00,0x00,0x00,0x66,0x66,0x66,0x66,0x66,0x66,0x3e,0x00,0x00,0x00,0x00}, // 'u'
+  {0x00,0x00,0x00,0x00,0x00,0x66,0x66,0x24,0x3c,0x3c,0x18,0x18,0x00,0x00,0x00,0x00}, // 'v'
+  {0x00,0x00,0x00,0x00,0x00,0xc3,0xc3,0xdb,0x5a,0x5a,0x66,0x66,0x00,0x00,0x00,0x00}, // 'w'
+  {0x00,0x00,0x00,0x00,0x00,0x66,0x3c,0x18,0x18,0x3c,0x3c,0x66,0x00,0x00,0x00,0x00}, // 'x'
+  {0x00,0x00,0x00,0x00,0x00,0x66,0x66,0x2c,0x3c,0x3c,0x18,0x18,0x18,0x30,0x70,0x00}, // 'y'
+  {0x00,0x00,0x00,0x00,0x00,0x7e,0x06,0x0c,0x18,0x30,0x60,0x7e,0x00,0x00,0x00,0x00}, // 'z'
+  {0x00,0x0e,0x18,0x18,0x18,0x18,0x18,0x60,0x18,0x18,0x18,0x18,0x1e,0x00,0x00,0x00}, // '{'
+  {0x00,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x10,0x00,0x00}, // '|'
+  {0x00,0x70,0x18,0x18,0x18,0x18,0x18,0x06,0x18,0x18,0x18,0x18,0x78,0x00,0x00,0x00}, // '}'
+  {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x39,0x46,0x00,0x00,0x00,0x00,0x00,0x00,0x00}, // '~'
+};
+
+void FillRect(uint8_t* rgb, uint64_t w, uint64_t h, int64_t x0, int64_t y0,
+	      int64_t x1, int64_t y1, const RGBColor& color) {
+
+  x0 = std::max<int64_t>(x0, 0);
+  y0 = std::max<int64_t>(y0, 0);
+  x1 = std::min<int64_t>(x1, w);
+  y1 = std::min<int64_t>(y1, h);
+  for (int64_t y = y0; y < y1; y++) {
+    uint8_t* p = rgb + (y * w + x0) * 3;
+    for (int64_t x = x0; x < x1; x++, p += 3) {
+      p[0] = color.r;
+      p[1] = color.g;
+      p[2] = color.b;
+    }
+  }
+}
+
+uint64_t TextWidth(const std::string& text, int scale) {
+  return text.size() * FONT_WIDTH * scale;
+}
+
+void DrawText(uint8_t* rgb, uint64_t w, uint64_t h, int64_t x, int64_t y,
+	      const std::string& text, const RGBColor& color, int scale) {
+
+  scale = std::max(scale, 1);
+  for (size_t i = 0; i < text.size(); i++) {
+    
+    unsigned char c = text[i];
+    if (c < 32 || c > 126)
+      c = '?';
+    const uint8_t* glyph = FONT_8X16[c - 32];
+
+    // each set bit of the glyph is a scale x scale block
+    int64_t gx = x + static_cast<int64_t>(i) * FONT_WIDTH * scale;
+    for (int row = 0; row < FONT_HEIGHT; row++)
+      for (int col = 0; col < FONT_WIDTH; col++)
+	if (glyph[row] & (0x80 >> col))
+	  FillRect(rgb, w, h, gx + col * scale, y + row * scale,
+		   gx + (col + 1) * scale, y + (row + 1) * scale, color);
+  }
+}
+
+int DrawScaleBar(uint8_t* rgb, uint64_t w, uint64_t h, double um_per_pixel) {
+
+  if (um_per_pixel <= 0)
+    return 1;
+  
+  // the largest 1, 2 or 5 x 10^k microns that is under a fifth of the width
+  double target = w * um_per_pixel / 5;
+  double step = std::pow(10, std::floor(std::log10(target)));
+  double length = step;
+  for (double m : {2.0, 5.0})
+    if (m * step <= target)
+      length = m * step;
+
+  int64_t bar_w = std::llround(length / um_per_pixel);
+  int64_t bar_h = std::max<int64_t>(4, h / 90);
+  int64_t x0 = w - bar_w - w / 20;
+  int64_t y0 = h - bar_h - h / 20;
+  if (x0 < 0 || y0 < 0)
+    return 1;
+
+  const RGBColor white(255, 255, 255);
+  FillRect(rgb, w, h, x0, y0, x0 + bar_w, y0 + bar_h, white);
+
+  // label centered over the bar
+  char label[32];
+  if (length >= 1)
+    snprintf(label, sizeof(label), "%.0f um", length);
+  else
+    snprintf(label, sizeof(label), "%g um", length);
+  int scale = std::max<int>(1, h / 600);
+  int64_t tw = TextWidth(label, scale);
+  DrawText(rgb, w, h, x0 + (bar_w - tw) / 2, y0 - (FONT_HEIGHT + 2) * scale,
+	   label, white, scale);
+
+  return 0;
+}
+
+void DrawLegend(uint8_t* rgb, uint64_t w, uint64_t h, const ChannelVector& channels) {
+
+  // black band over the top tenth of the image
+  int64_t band = std::max<int64_t>(FONT_HEIGHT + 4, h / 10);
+  FillRect(rgb, w, h, 0, 0, w, band, RGBColor(0, 0, 0));
+
+  // as big as fits, both in the band and across the image
+  uint64_t chars = 0;
+  for (const auto& c : channels)
+    chars += c.channelName.size() + 1;
+  int scale = std::max<int64_t>(1, band * 6 / 10 / FONT_HEIGHT);
+  while (scale > 1 && 10 + chars * FONT_WIDTH * scale > w)
+    scale--;
+
+  int64_t x = 10;
+  int64_t y = (band - FONT_HEIGHT * scale) / 2;
+  for (const auto& c : channels) {
+    DrawText(rgb, w, h, x, y, c.channelName, c.color, scale);
+    x += TextWidth(c.channelName + " ", scale);
+  }
+}
+
+void DrawPaletteSheet(const ChannelVector& channels, uint64_t box_w, uint64_t box_h,
+		      std::vector<uint8_t>& rgb) {
+
+  uint64_t w = box_w, h = box_h * channels.size();
+  rgb.assign(w * h * 3, 0);
+
+  for (size_t i = 0; i < channels.size(); i++) {
+
+    const Channel& c = channels[i];
+    int64_t y0 = i * box_h;
+    FillRect(rgb.data(), w, h, 0, y0, w, y0 + box_h, c.color);
+
+    // one pixel black border
+    const RGBColor black(0, 0, 0);
+    FillRect(rgb.data(), w, h, 0, y0, w, y0 + 1, black);
+    FillRect(rgb.data(), w, h, 0, y0 + box_h - 1, w, y0 + box_h, black);
+    FillRect(rgb.data(), w, h, 0, y0, 1, y0 + box_h, black);
+    FillRect(rgb.data(), w, h, w - 1, y0, w, y0 + box_h, black);
+
+    char label[256];
+    snprintf(label, sizeof(label), "%d:%s (%d,%d,%d) [%d,%d]", c.channelNumber,
+	     c.channelName.c_str(), c.color.r, c.color.g, c.color.b, c.lowerBound, c.upperBound);
+
+    // centered, as large as fits, and white on dark colors
+    int scale = std::max<int64_t>(1, box_h * 4 / 10 / FONT_HEIGHT);
+    while (scale > 1 && TextWidth(label, scale) + 4 > box_w)
+      scale--;
+    bool dark = 299 * c.color.r + 587 * c.color.g + 114 * c.color.b < 128 * 1000;
+    DrawText(rgb.data(), w, h, (static_cast<int64_t>(box_w) - TextWidth(label, scale)) / 2,
+	     y0 + (static_cast<int64_t>(box_h) - FONT_HEIGHT * scale) / 2, label,
+	     dark ? RGBColor(255, 255, 255) : black, scale);
+  }
+}
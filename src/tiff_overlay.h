@@ -0,0 +1,42 @@
+#ifndef TIFF_OVERLAY_H
+#define TIFF_OVERLAY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "channel.h"
+
+// drawing straight into 8-bit RGB rasters (w x h, 3 bytes a pixel), so
+// labelled crops need only the one final encode. Anything drawn outside
+// the raster is clipped
+
+// size of a glyph of the built-in font at scale 1
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 16
+
+// fill [x0, x1) x [y0, y1)
+void FillRect(uint8_t* rgb, uint64_t w, uint64_t h, int64_t x0, int64_t y0,
+	      int64_t x1, int64_t y1, const RGBColor& color);
+
+// width in pixels of text drawn at scale
+uint64_t TextWidth(const std::string& text, int scale);
+
+// draw text with its top left at (x, y), each font pixel scale x scale
+void DrawText(uint8_t* rgb, uint64_t w, uint64_t h, int64_t x, int64_t y,
+	      const std::string& text, const RGBColor& color, int scale);
+
+// white scale bar of a round length in the bottom right corner, labelled
+// in microns. Returns 1 (and draws nothing) if um_per_pixel is unknown
+int DrawScaleBar(uint8_t* rgb, uint64_t w, uint64_t h, double um_per_pixel);
+
+// black band across the top with each channel name in its own color
+void DrawLegend(uint8_t* rgb, uint64_t w, uint64_t h, const ChannelVector& channels);
+
+// swatch sheet of a palette: one box_w x box_h box per channel, stacked
+// top to bottom, filled with its color and labelled
+// "number:name (r,g,b) [lower,upper]". rgb is resized to fit
+void DrawPaletteSheet(const ChannelVector& channels, uint64_t box_w, uint64_t box_h,
+		      std::vector<uint8_t>& rgb);
+
+#endif
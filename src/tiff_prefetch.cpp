@@ -0,0 +1,135 @@
+#include "tiff_prefetch.h"
+
+#include <algorithm>
+
+TileOrder TileOrderRowMajor(const TiffReader& reader, const std::vector<size_t>& dirs,
+			    bool interleave) {
+
+  TileOrder order;
+  if (dirs.empty())
+    return order;
+
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  if (!ifd.tile_width || !ifd.tile_height)
+    return order;
+
+  uint64_t num_tiles = ((ifd.width + ifd.tile_width - 1) / ifd.tile_width) *
+    ((ifd.height + ifd.tile_height - 1) / ifd.tile_height);
+  order.reserve(num_tiles * dirs.size());
+
+  if (interleave) {
+    for (uint64_t t = 0; t < num_tiles; t++)
+      for (auto d : dirs)
+	order.emplace_back(d, t);
+  } else {
+    for (auto d : dirs)
+      for (uint64_t t = 0; t < num_tiles; t++)
+	order.emplace_back(d, t);
+  }
+
+  return order;
+}
+
+TileOrder TileOrderRegion(const TiffReader& reader, const std::vector<size_t>& dirs,
+			  uint64_t x, uint64_t y, uint64_t w, uint64_t h) {
+
+  TileOrder order;
+  if (dirs.empty())
+    return order;
+
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  if (!ifd.tile_width || !ifd.tile_height)
+    return order;
+
+  uint64_t x1 = std::min<uint64_t>(x + w, ifd.width);
+  uint64_t y1 = std::min<uint64_t>(y + h, ifd.height);
+  for (uint64_t ty = (y / ifd.tile_height) * ifd.tile_height; ty < y1; ty += ifd.tile_height)
+    for (uint64_t tx = (x / ifd.tile_width) * ifd.tile_width; tx < x1; tx += ifd.tile_width)
+      for (auto d : dirs)
+	order.emplace_back(d, reader.TileIndex(d, tx, ty));
+
+  return order;
+}
+
+TilePrefetcher::TilePrefetcher(const TiffReader& reader, const TileOrder& order,
+			       size_t threads, size_t ahead) :
+  m_reader(reader), m_order(order), m_ahead(std::max<size_t>(ahead, 1)) {
+
+  // a run never spans more than the read-ahead window
+  m_plan = PlanReads(reader, m_order, m_ahead);
+  m_run_of.resize(m_order.size());
+  for (size_t r = 0; r < m_plan.size(); r++)
+    for (auto p : m_plan[r].pos)
+      m_run_of[p] = r;
+  m_reading.resize(m_plan.size(), false);
+
+  threads = std::max<size_t>(threads, 1);
+  for (size_t i = 0; i < threads; i++)
+    m_threads.emplace_back(&TilePrefetcher::__run, this);
+
+}
+
+TilePrefetcher::~TilePrefetcher() {
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_cv.notify_all();
+
+  for (auto& t : m_threads)
+    t.join();
+
+}
+
+TiffTilePtr TilePrefetcher::Get(size_t i) {
+
+  assert(i < m_order.size());
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (i > m_consumed) {
+      m_consumed = i;
+      m_cv.notify_all();
+    }
+
+    // if the run holding this tile is being read, wait for it rather
+    // than issue a second read for the same bytes
+    size_t r = m_run_of[i];
+    m_cv.wait(lock, [this, r]() { return !m_reading[r]; });
+  }
+
+  // either already cached, being read by a prefetch thread (and we wait
+  // on it), or we fell off the cache and read it ourselves
+  return m_reader.ReadTile(m_order[i].dir, m_order[i].tile);
+}
+
+void TilePrefetcher::__run() {
+
+  while (true) {
+
+    size_t r;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this]() {
+	  return m_stop || m_next >= m_plan.size() ||
+	    m_plan[m_next].pos.front() < m_consumed + m_ahead;
+	});
+      if (m_stop || m_next >= m_plan.size())
+	return;
+      r = m_next++;
+      m_reading[r] = true;
+    }
+
+    // the results go to the tile cache. On failure the consumer
+    // retries the tiles one by one and reports the error
+    m_reader.ReadTileRun(m_plan[r]);
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_reading[r] = false;
+    }
+    m_cv.notify_all();
+  }
+
+}
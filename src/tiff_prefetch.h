@@ -0,0 +1,75 @@
+#ifndef TIFF_PREFETCH_H
+#define TIFF_PREFETCH_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "tiff_reader.h"
+#include "tiff_read_plan.h"
+
+// every tile of dirs in row-major order. If interleave is true, all of
+// the dirs are visited at each tile position (colorize), otherwise each
+// directory is finished before the next (compress)
+TileOrder TileOrderRowMajor(const TiffReader& reader, const std::vector<size_t>& dirs,
+			    bool interleave);
+
+// only the tiles of dirs under the w x h window at (x, y), row-major
+TileOrder TileOrderRegion(const TiffReader& reader, const std::vector<size_t>& dirs,
+			  uint64_t x, uint64_t y, uint64_t w, uint64_t h);
+
+// reads tiles ahead of a consumer on background threads so that
+// I/O and decode overlap with compute. Tiles land in the shared tile
+// cache. The consumer walks the same order and tells the prefetcher
+// how far it has got with Get(), which bounds how far ahead we read.
+// Tiles that are adjacent on disk are fetched together (see PlanReads)
+class TilePrefetcher {
+
+ public:
+
+  // start threads reading at most ahead tiles past the consumer
+  TilePrefetcher(const TiffReader& reader, const TileOrder& order,
+		 size_t threads, size_t ahead = 64);
+
+  // stops the readers, abandoning anything not yet read
+  ~TilePrefetcher();
+
+  // tile at position i of the order. Blocks if it isn't read yet
+  TiffTilePtr Get(size_t i);
+
+  const TileOrder& order() const { return m_order; }
+
+ private:
+
+  const TiffReader& m_reader;
+
+  TileOrder m_order;
+
+  size_t m_ahead;
+
+  std::vector<std::thread> m_threads;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+  // coalesced reads, and which run each position of the order is in
+  ReadPlan m_plan;
+  std::vector<size_t> m_run_of;
+
+  // runs being read right now
+  std::vector<bool> m_reading;
+
+  // next run to hand to a reader thread
+  size_t m_next = 0;
+
+  // furthest position the consumer has asked for
+  size_t m_consumed = 0;
+
+  bool m_stop = false;
+
+  void __run();
+
+};
+
+#endif
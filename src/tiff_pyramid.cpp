@@ -0,0 +1,215 @@
+#include "tiff_pyramid.h"
+#include "tiff_scale.h"
+#include "tiff_buffer_pool.h"
+
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+
+PyramidBuilder::PyramidBuilder(TIFF* out, int levels, bool mode) : m_mode(mode) {
+
+  uint32_t w = 0, h = 0;
+  uint16_t spp = 1, bps = 8;
+  TIFFGetField(out, TIFFTAG_IMAGEWIDTH, &w);
+  TIFFGetField(out, TIFFTAG_IMAGELENGTH, &h);
+  TIFFGetField(out, TIFFTAG_TILEWIDTH, &m_tw);
+  TIFFGetField(out, TIFFTAG_TILELENGTH, &m_th);
+  TIFFGetField(out, TIFFTAG_SAMPLESPERPIXEL, &spp);
+  TIFFGetField(out, TIFFTAG_BITSPERSAMPLE, &bps);
+  TIFFGetField(out, TIFFTAG_PHOTOMETRIC, &m_photometric);
+  TIFFGetField(out, TIFFTAG_COMPRESSION, &m_compression);
+  TIFFGetField(out, TIFFTAG_SAMPLEFORMAT, &m_sample_format);
+  TIFFGetField(out, TIFFTAG_PREDICTOR, &m_predictor);
+
+  m_width = w;
+  m_height = h;
+  m_spp = spp;
+  m_bps = bps;
+
+  if (!m_tw || !m_th || m_tw % 2 || m_th % 2) {
+    fprintf(stderr, "ERROR: pyramids need a tiled output with even tile dims\n");
+    m_err = 1;
+    return;
+  }
+  if ((m_bps * m_spp) % 8) {
+    fprintf(stderr, "ERROR: pyramids need whole-byte pixels\n");
+    m_err = 1;
+    return;
+  }
+
+  m_tiles_across = (m_width + m_tw - 1) / m_tw;
+  m_tile_bytes = static_cast<uint64_t>(m_tw) * m_th * m_bps * m_spp / 8;
+  
+  if (levels < 0)
+    levels = NumLevels(m_width, m_height, m_tw, m_th);
+  
+  uint64_t lw = m_width, lh = m_height;
+  for (int l = 0; l < levels; l++) {
+    Level lev;
+    lev.width = lw = (lw + 1) / 2;
+    lev.height = lh = (lh + 1) / 2;
+    lev.tiles_across = (lev.width + m_tw - 1) / m_tw;
+    lev.tiles_down = (lev.height + m_th - 1) / m_th;
+    lev.row.assign(m_tile_bytes * lev.tiles_across, 0);
+    lev.spool = tmpfile();
+    if (!lev.spool) {
+      fprintf(stderr, "ERROR: unable to open a spool file for pyramid level %d\n", l + 1);
+      m_err = 1;
+    }
+    m_levels.push_back(std::move(lev));
+  }
+
+  // the SubIFD offsets are filled in by libtiff as the levels are written
+  if (!m_levels.empty()) {
+    std::vector<toff_t> offsets(m_levels.size(), 0);
+    TIFFSetField(out, TIFFTAG_SUBIFD, static_cast<uint16_t>(m_levels.size()), offsets.data());
+  }
+}
+
+PyramidBuilder::~PyramidBuilder() {
+  for (auto& l : m_levels)
+    if (l.spool)
+      fclose(l.spool);
+}
+
+int PyramidBuilder::NumLevels(uint64_t width, uint64_t height, uint32_t tw, uint32_t th) {
+  int n = 0;
+  while (width > tw || height > th) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    n++;
+  }
+  return n;
+}
+
+TileSinkFunc PyramidBuilder::Sink() {
+  return [this](uint32_t tile, const uint8_t* data) { return AddTile(tile, data); };
+}
+
+int PyramidBuilder::AddTile(uint32_t tile, const uint8_t* data) {
+
+  if (m_err)
+    return 1;
+  if (m_levels.empty())
+    return 0;
+  
+  uint32_t tx = tile % m_tiles_across;
+  uint32_t ty = tile / m_tiles_across;
+  uint64_t vw = std::min<uint64_t>(m_tw, m_width - static_cast<uint64_t>(tx) * m_tw);
+  uint64_t vh = std::min<uint64_t>(m_th, m_height - static_cast<uint64_t>(ty) * m_th);
+  
+  return m_err = __add(0, tx, ty, vw, vh, data);
+}
+
+int PyramidBuilder::__add(size_t l, uint32_t tx, uint32_t ty, uint64_t valid_w, uint64_t valid_h,
+			  const uint8_t* data) {
+
+  Level& lev = m_levels[l];
+  uint64_t bytes_pp = m_bps * m_spp / 8;
+  uint64_t row_stride = static_cast<uint64_t>(lev.tiles_across) * m_tw;
+
+  // rows of the source level, and whether this tile ends a pair of them
+  uint64_t src_h = l == 0 ? m_height : m_levels[l - 1].height;
+  uint32_t src_across = l == 0 ? m_tiles_across : m_levels[l - 1].tiles_across;
+  uint32_t src_down = (src_h + m_th - 1) / m_th;
+  
+  // quarter tile lands at (tx * tw/2, (ty % 2) * th/2) of the row
+  uint8_t* dst = lev.row.data() +
+    ((ty % 2) * (m_th / 2) * row_stride + static_cast<uint64_t>(tx) * (m_tw / 2)) * bytes_pp;
+  if (ScaleBuffer(data, m_tw, valid_w, valid_h, m_spp, m_bps, 2, m_mode, dst, row_stride))
+    return 1;
+
+  bool row_done = tx + 1 == src_across && (ty % 2 == 1 || ty + 1 == src_down);
+  return row_done ? __flush_row(l) : 0;
+}
+
+int PyramidBuilder::__flush_row(size_t l) {
+
+  Level& lev = m_levels[l];
+  uint64_t bytes_pp = m_bps * m_spp / 8;
+  uint64_t row_stride = static_cast<uint64_t>(lev.tiles_across) * m_tw;
+  uint64_t tile_row_bytes = static_cast<uint64_t>(m_tw) * bytes_pp;
+
+  TileBuffer tile = TileBufferPool::Global().Get(m_tile_bytes);
+  if (!tile)
+    return 1;
+  
+  uint32_t ty = lev.row_index;
+  for (uint32_t tx = 0; tx < lev.tiles_across; tx++) {
+
+    // cut the tile out of the row
+    for (uint32_t y = 0; y < m_th; y++)
+      memcpy(tile.data() + y * tile_row_bytes,
+	     lev.row.data() + (y * row_stride + static_cast<uint64_t>(tx) * m_tw) * bytes_pp,
+	     tile_row_bytes);
+
+    if (fwrite(tile.data(), 1, m_tile_bytes, lev.spool) != m_tile_bytes) {
+      fprintf(stderr, "ERROR: unable to spool pyramid level %zu\n", l + 1);
+      return 1;
+    }
+
+    // and on to the next level down
+    if (l + 1 < m_levels.size()) {
+      uint64_t vw = std::min<uint64_t>(m_tw, lev.width - static_cast<uint64_t>(tx) * m_tw);
+      uint64_t vh = std::min<uint64_t>(m_th, lev.height - static_cast<uint64_t>(ty) * m_th);
+      if (__add(l + 1, tx, ty, vw, vh, tile.data()))
+	return 1;
+    }
+  }
+
+  std::fill(lev.row.begin(), lev.row.end(), 0);
+  lev.row_index++;
+  return 0;
+}
+
+int PyramidBuilder::WriteLevels(TIFF* out, size_t threads) {
+
+  if (m_err)
+    return 1;
+  
+  for (size_t l = 0; l < m_levels.size(); l++) {
+
+    Level& lev = m_levels[l];
+    if (fflush(lev.spool)) {
+      fprintf(stderr, "ERROR: unable to flush pyramid level %zu\n", l + 1);
+      return 1;
+    }
+    int fd = fileno(lev.spool);
+
+    TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_REDUCEDIMAGE);
+    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(lev.width));
+    TIFFSetField(out, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(lev.height));
+    TIFFSetField(out, TIFFTAG_TILEWIDTH, m_tw);
+    TIFFSetField(out, TIFFTAG_TILELENGTH, m_th);
+    TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, static_cast<uint16_t>(m_spp));
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, static_cast<uint16_t>(m_bps));
+    TIFFSetField(out, TIFFTAG_PHOTOMETRIC, m_photometric);
+    TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(out, TIFFTAG_COMPRESSION, m_compression);
+    if (m_sample_format)
+      TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, m_sample_format);
+    if (m_predictor)
+      TIFFSetField(out, TIFFTAG_PREDICTOR, m_predictor);
+
+    // tiles come back out of the spool in any order
+    uint64_t tile_bytes = m_tile_bytes;
+    TileFillFunc fill = [fd, tile_bytes](uint32_t tile, uint8_t* buf) {
+      uint64_t off = static_cast<uint64_t>(tile) * tile_bytes;
+      uint64_t done = 0;
+      while (done < tile_bytes) {
+	ssize_t n = pread(fd, buf + done, tile_bytes - done, off + done);
+	if (n <= 0)
+	  return 1;
+	done += n;
+      }
+      return 0;
+    };
+
+    if (WriteTilesParallel(out, fill, threads) || !TIFFWriteDirectory(out)) {
+      fprintf(stderr, "ERROR: unable to write pyramid level %zu\n", l + 1);
+      return 1;
+    }
+  }
+
+  return 0;
+}
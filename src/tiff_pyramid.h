@@ -0,0 +1,98 @@
+#ifndef TIFF_PYRAMID_H
+#define TIFF_PYRAMID_H
+
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <tiffio.h>
+
+#include "tiff_writer.h"
+
+// builds 2x-reduced levels of an image from its tiles as they are
+// written, and writes them as SubIFDs of the full resolution directory.
+//
+// Each level holds a single tile row: a tile of level L-1 is reduced as
+// soon as it arrives into its quarter of the level L row, and when a row
+// is complete its tiles are spooled to a temporary file and fed on to
+// level L+1. Once the full resolution directory is written, the spooled
+// levels are written (and compressed) in parallel.
+//
+//   PyramidBuilder pyr(out);      // after the tags of out are set
+//   WriteTilesParallel(out, fill, threads, pyr.Sink());
+//   TIFFWriteDirectory(out);
+//   pyr.WriteLevels(out, threads);
+class PyramidBuilder {
+
+ public:
+
+  // levels for the current directory of out, whose size, tiling and pixel
+  // tags must already be set. With levels < 0, reduce until a level fits
+  // in a single tile. Sets TIFFTAG_SUBIFD on out. If mode is true levels
+  // take the most common value of each 2x2 box (label images)
+  PyramidBuilder(TIFF* out, int levels = -1, bool mode = false);
+
+  ~PyramidBuilder();
+
+  // number of reduced levels needed before an image fits in a tile
+  static int NumLevels(uint64_t width, uint64_t height, uint32_t tw, uint32_t th);
+
+  int levels() const { return m_levels.size(); }
+
+  // add full resolution tile number tile. Tiles must come in order
+  int AddTile(uint32_t tile, const uint8_t* data);
+
+  // AddTile as a sink for WriteTilesParallel
+  TileSinkFunc Sink();
+
+  // write every level as a SubIFD. Call straight after TIFFWriteDirectory
+  // of the full resolution directory
+  int WriteLevels(TIFF* out, size_t threads);
+
+ private:
+
+  struct Level {
+    uint64_t width = 0;
+    uint64_t height = 0;
+    uint32_t tiles_across = 0;
+    uint32_t tiles_down = 0;
+
+    // the tile row being built, tiles_across tiles wide
+    std::vector<uint8_t> row;
+    uint32_t row_index = 0;
+
+    // finished tiles, uncompressed and in order
+    FILE* spool = NULL;
+  };
+
+  std::vector<Level> m_levels;
+
+  // full resolution size
+  uint64_t m_width = 0;
+  uint64_t m_height = 0;
+  uint32_t m_tiles_across = 0;
+
+  uint32_t m_tw = 0;
+  uint32_t m_th = 0;
+  uint64_t m_spp = 1;
+  uint64_t m_bps = 8;
+  uint64_t m_tile_bytes = 0;
+  bool m_mode = false;
+
+  // tags repeated on each level
+  uint16_t m_photometric = PHOTOMETRIC_MINISBLACK;
+  uint16_t m_compression = COMPRESSION_NONE;
+  uint16_t m_sample_format = 0;
+  uint16_t m_predictor = 0;
+
+  int m_err = 0;
+
+  // reduce a tile of level l - 1 (l = 0 is full resolution) into level l
+  int __add(size_t l, uint32_t tx, uint32_t ty, uint64_t valid_w, uint64_t valid_h,
+	    const uint8_t* data);
+
+  // spool the finished row of level l and pass its tiles on
+  int __flush_row(size_t l);
+  
+};
+
+#endif
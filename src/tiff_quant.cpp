@@ -0,0 +1,351 @@
+#include "tiff_quant.h"
+#include "tiff_reader.h"
+#include "tiff_buffer_pool.h"
+
+#include <mutex>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <zlib.h>
+
+// block edge when the image isn't tiled
+#define QUANT_BLOCK 1024
+
+// rows of the table formatted per task when writing
+#define QUANT_WRITE_ROWS 4096
+
+namespace {
+
+// sums over the cells of one block, before they are merged
+struct BlockCells {
+  std::vector<uint32_t> labels;
+  std::vector<uint64_t> area;
+  std::vector<double> sx;
+  std::vector<double> sy;
+  std::vector<double> sums;
+};
+
+// running totals over every block
+struct CellSums {
+  std::mutex mutex;
+  std::unordered_map<uint32_t, size_t> index;
+  std::vector<uint32_t> labels;
+  std::vector<uint64_t> area;
+  std::vector<double> sx;
+  std::vector<double> sy;
+  std::vector<double> sums;
+};
+
+template <typename T>
+void __to_labels(const void* in, size_t n, uint32_t* out) {
+  const T* p = static_cast<const T*>(in);
+  for (size_t i = 0; i < n; i++)
+    out[i] = static_cast<uint32_t>(p[i]);
+}
+
+// add channel c of the block to the sums of the cell under each pixel
+template <typename T>
+void __accumulate(const void* plane, const int32_t* cell, size_t n, size_t nc, size_t c,
+		  double* sums) {
+  const T* p = static_cast<const T*>(plane);
+  for (size_t i = 0; i < n; i++)
+    if (cell[i] >= 0)
+      sums[cell[i] * nc + c] += p[i];
+}
+
+int __accumulate(const TiffIFD& ifd, const void* plane, const int32_t* cell, size_t n,
+		 size_t nc, size_t c, double* sums) {
+  bool is_float = ifd.sample_format == SAMPLEFORMAT_IEEEFP;
+  bool is_signed = ifd.sample_format == SAMPLEFORMAT_INT;
+  switch (ifd.bits_per_sample) {
+  case 8:
+    is_signed ? __accumulate<int8_t>(plane, cell, n, nc, c, sums) :
+      __accumulate<uint8_t>(plane, cell, n, nc, c, sums);
+    return 0;
+  case 16:
+    is_signed ? __accumulate<int16_t>(plane, cell, n, nc, c, sums) :
+      __accumulate<uint16_t>(plane, cell, n, nc, c, sums);
+    return 0;
+  case 32:
+    if (is_float)
+      __accumulate<float>(plane, cell, n, nc, c, sums);
+    else
+      is_signed ? __accumulate<int32_t>(plane, cell, n, nc, c, sums) :
+	__accumulate<uint32_t>(plane, cell, n, nc, c, sums);
+    return 0;
+  default:
+    fprintf(stderr, "ERROR: unable to quantify %llu-bit channels\n", ifd.bits_per_sample);
+    return 1;
+  }
+}
+
+// measure the w x h block at (x, y)
+int __measure_block(const TiffReader& image, const std::vector<size_t>& dirs,
+		    const TiffReader& mask, uint64_t x, uint64_t y, uint64_t w, uint64_t h,
+		    BlockCells& cells) {
+
+  size_t n = w * h, nc = dirs.size();
+  const TiffIFD& mifd = mask.IFD(0);
+
+  TileBuffer raw = TileBufferPool::Global().Get(n * mifd.bits_per_sample / 8);
+  TileBuffer labels = TileBufferPool::Global().Get(n * sizeof(uint32_t));
+  TileBuffer cell = TileBufferPool::Global().Get(n * sizeof(int32_t));
+  if (!raw || !labels || !cell)
+    return 1;
+
+  if (mask.ReadRegion(0, x, y, w, h, raw.data()))
+    return 1;
+  uint32_t* lab = labels.as<uint32_t>();
+  switch (mifd.bits_per_sample) {
+  case 8: __to_labels<uint8_t>(raw.data(), n, lab); break;
+  case 16: __to_labels<uint16_t>(raw.data(), n, lab); break;
+  default: __to_labels<uint32_t>(raw.data(), n, lab); break;
+  }
+  raw.release();
+
+  // number the cells of the block. Labels come in runs along a row, so
+  // the last one is checked before the map
+  std::unordered_map<uint32_t, int32_t> local;
+  int32_t* ci = cell.as<int32_t>();
+  uint32_t last = 0;
+  int32_t last_cell = -1;
+  for (uint64_t row = 0; row < h; row++) {
+    for (uint64_t col = 0; col < w; col++) {
+      size_t i = row * w + col;
+      uint32_t l = lab[i];
+      if (!l) {
+	ci[i] = -1;
+	continue;
+      }
+      if (l != last || last_cell < 0) {
+	auto it = local.find(l);
+	if (it == local.end()) {
+	  it = local.emplace(l, cells.labels.size()).first;
+	  cells.labels.push_back(l);
+	  cells.area.push_back(0);
+	  cells.sx.push_back(0);
+	  cells.sy.push_back(0);
+	}
+	last = l;
+	last_cell = it->second;
+      }
+      ci[i] = last_cell;
+      cells.area[last_cell]++;
+      cells.sx[last_cell] += x + col;
+      cells.sy[last_cell] += y + row;
+    }
+  }
+
+  cells.sums.assign(cells.labels.size() * nc, 0);
+  if (cells.labels.empty())
+    return 0;
+
+  for (size_t c = 0; c < nc; c++) {
+    const TiffIFD& ifd = image.IFD(dirs[c]);
+    TileBuffer plane = TileBufferPool::Global().Get(n * ifd.bits_per_sample / 8);
+    if (!plane || image.ReadRegion(dirs[c], x, y, w, h, plane.data()) ||
+	__accumulate(ifd, plane.data(), ci, n, nc, c, cells.sums.data()))
+      return 1;
+  }
+
+  return 0;
+}
+
+void __merge(const BlockCells& cells, size_t nc, CellSums& total) {
+  std::lock_guard<std::mutex> lock(total.mutex);
+  for (size_t i = 0; i < cells.labels.size(); i++) {
+    auto it = total.index.find(cells.labels[i]);
+    if (it == total.index.end()) {
+      it = total.index.emplace(cells.labels[i], total.labels.size()).first;
+      total.labels.push_back(cells.labels[i]);
+      total.area.push_back(0);
+      total.sx.push_back(0);
+      total.sy.push_back(0);
+      total.sums.resize(total.sums.size() + nc, 0);
+    }
+    size_t g = it->second;
+    total.area[g] += cells.area[i];
+    total.sx[g] += cells.sx[i];
+    total.sy[g] += cells.sy[i];
+    for (size_t c = 0; c < nc; c++)
+      total.sums[g * nc + c] += cells.sums[i * nc + c];
+  }
+}
+
+}
+
+int QuantifyCells(const TiffReader& image, const std::vector<size_t>& dirs,
+		  const TiffReader& mask, const std::vector<std::string>& markers,
+		  CellTable& table, bool verbose, size_t threads) {
+
+  if (dirs.empty() || markers.size() != dirs.size()) {
+    fprintf(stderr, "ERROR: %zu marker names for %zu channels\n", markers.size(), dirs.size());
+    return 1;
+  }
+  if (!mask.NumDirs()) {
+    fprintf(stderr, "ERROR: mask has no directories\n");
+    return 1;
+  }
+
+  const TiffIFD& ifd = image.IFD(dirs[0]);
+  const TiffIFD& mifd = mask.IFD(0);
+  if (mifd.samples_per_pixel != 1 || mifd.sample_format == SAMPLEFORMAT_IEEEFP ||
+      (mifd.bits_per_sample != 8 && mifd.bits_per_sample != 16 && mifd.bits_per_sample != 32)) {
+    fprintf(stderr, "ERROR: mask must hold 8, 16 or 32-bit integer labels\n");
+    return 1;
+  }
+  if (mifd.width != ifd.width || mifd.height != ifd.height) {
+    fprintf(stderr, "ERROR: mask is %llu x %llu, image is %llu x %llu\n",
+	    mifd.width, mifd.height, ifd.width, ifd.height);
+    return 1;
+  }
+  for (auto d : dirs) {
+    const TiffIFD& o = image.IFD(d);
+    if (o.samples_per_pixel != 1 || o.width != ifd.width || o.height != ifd.height) {
+      fprintf(stderr, "ERROR: dir %zu does not match the size of dir %zu\n", d, dirs[0]);
+      return 1;
+    }
+  }
+
+  // blocks follow the image tiles, so each tile of every channel is
+  // decoded exactly once
+  threads = std::max<size_t>(threads, 1);
+  uint64_t bw = ifd.tile_width ? ifd.tile_width : QUANT_BLOCK;
+  uint64_t bh = ifd.tile_height ? ifd.tile_height : QUANT_BLOCK;
+  uint64_t across = (ifd.width + bw - 1) / bw;
+  uint64_t down = (ifd.height + bh - 1) / bh;
+  uint64_t num_blocks = across * down;
+  size_t nc = dirs.size();
+
+  CellSums total;
+  std::atomic<int> err(0);
+  std::atomic<uint64_t> done(0);
+
+#pragma omp parallel for num_threads(threads) schedule(dynamic, 1)
+  for (uint64_t b = 0; b < num_blocks; b++) {
+
+    if (err)
+      continue;
+
+    uint64_t x = (b % across) * bw, y = (b / across) * bh;
+    uint64_t w = std::min(bw, ifd.width - x), h = std::min(bh, ifd.height - y);
+
+    BlockCells cells;
+    if (__measure_block(image, dirs, mask, x, y, w, h, cells)) {
+      fprintf(stderr, "ERROR: unable to quantify block at %llu,%llu\n", x, y);
+      err = 1;
+      continue;
+    }
+    __merge(cells, nc, total);
+
+    uint64_t d = ++done;
+    if (verbose && (d % across == 0 || d == num_blocks))
+      std::cerr << "...quantified " << d << " of " << num_blocks << " blocks" << std::endl;
+  }
+
+  if (err)
+    return 1;
+
+  // rows by label
+  std::vector<size_t> order(total.labels.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&total](size_t a, size_t b) {
+      return total.labels[a] < total.labels[b];
+    });
+
+  size_t n = order.size();
+  table.markers = markers;
+  table.id.resize(n);
+  table.x.resize(n);
+  table.y.resize(n);
+  table.area.resize(n);
+  table.means.resize(n * nc);
+  for (size_t i = 0; i < n; i++) {
+    size_t g = order[i];
+    double a = total.area[g];
+    table.id[i] = total.labels[g];
+    table.x[i] = total.sx[g] / a;
+    table.y[i] = total.sy[g] / a;
+    table.area[i] = total.area[g];
+    for (size_t c = 0; c < nc; c++)
+      table.means[i * nc + c] = total.sums[g * nc + c] / a;
+  }
+
+  if (verbose)
+    std::cerr << "...measured " << n << " cells over " << nc << " channels" << std::endl;
+
+  return 0;
+}
+
+int WriteCellTable(const CellTable& table, const std::string& file, size_t threads) {
+
+  bool gz = file.size() > 3 && file.compare(file.size() - 3, 3, ".gz") == 0;
+  FILE* fp = NULL;
+  gzFile gp = NULL;
+  if (gz)
+    gp = gzopen(file.c_str(), "wb6");
+  else
+    fp = fopen(file.c_str(), "wb");
+  if (!fp && !gp) {
+    fprintf(stderr, "ERROR: unable to open %s for writing\n", file.c_str());
+    return 1;
+  }
+
+  auto write = [&](const std::string& s) {
+    if (gz)
+      return gzwrite(gp, s.data(), s.size()) == static_cast<int>(s.size());
+    return fwrite(s.data(), 1, s.size(), fp) == s.size();
+  };
+
+  std::string header = "CellID";
+  for (auto& m : table.markers)
+    header += "," + m;
+  header += ",X_centroid,Y_centroid,Area\n";
+  bool ok = write(header);
+
+  // rows are formatted in parallel a chunk at a time, then written in order
+  size_t nc = table.markers.size();
+  size_t n = table.size();
+  threads = std::max<size_t>(threads, 1);
+  std::vector<std::string> chunks(threads);
+  for (size_t start = 0; start < n && ok; start += threads * QUANT_WRITE_ROWS) {
+
+#pragma omp parallel for num_threads(threads) schedule(static, 1)
+    for (size_t t = 0; t < threads; t++) {
+      std::string& s = chunks[t];
+      s.clear();
+      char buf[64];
+      size_t r0 = start + t * QUANT_WRITE_ROWS;
+      size_t r1 = std::min(n, r0 + QUANT_WRITE_ROWS);
+      for (size_t i = r0; i < r1; i++) {
+	s += std::to_string(table.id[i]);
+	for (size_t c = 0; c < nc; c++) {
+	  snprintf(buf, sizeof(buf), ",%.8g", table.means[i * nc + c]);
+	  s += buf;
+	}
+	snprintf(buf, sizeof(buf), ",%.8g,%.8g,%llu\n", table.x[i], table.y[i],
+		 static_cast<unsigned long long>(table.area[i]));
+	s += buf;
+      }
+    }
+
+    for (auto& s : chunks)
+      if (ok && !s.empty())
+	ok = write(s);
+  }
+
+  if (gz)
+    ok = gzclose(gp) == Z_OK && ok;
+  else
+    ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "ERROR: unable to write %s\n", file.c_str());
+    return 1;
+  }
+
+  return 0;
+}
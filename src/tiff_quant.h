@@ -0,0 +1,44 @@
+#ifndef TIFF_QUANT_H
+#define TIFF_QUANT_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TiffReader;
+
+// per-cell measurements of a segmentation, one row per label, sorted by
+// label. Centroids are the mean pixel position, as MCMICRO reports them
+struct CellTable {
+
+  // column names of means, one per quantified channel
+  std::vector<std::string> markers;
+
+  std::vector<uint32_t> id;
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<uint64_t> area;
+
+  // mean intensity, row-major: cell i, marker m at i * markers.size() + m
+  std::vector<double> means;
+
+  size_t size() const { return id.size(); }
+};
+
+// measure every labeled cell of mask (directory 0, 8, 16 or 32-bit
+// unsigned, 0 is background) against dirs of image, which must be the
+// same size. Both are streamed in blocks of the image tile size, and
+// blocks are measured in parallel and merged. markers names the columns,
+// one per dir. Returns 0 on success
+int QuantifyCells(const TiffReader& image, const std::vector<size_t>& dirs,
+		  const TiffReader& mask, const std::vector<std::string>& markers,
+		  CellTable& table, bool verbose, size_t threads);
+
+// write table as an MCMICRO quantification CSV:
+//   CellID,<markers>,X_centroid,Y_centroid,Area
+// gzipped if file ends in .gz. Rows are formatted on threads. Returns 0
+// on success
+int WriteCellTable(const CellTable& table, const std::string& file, size_t threads = 1);
+
+#endif
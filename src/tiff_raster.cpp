@@ -0,0 +1,169 @@
+#include "tiff_raster.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <fstream>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static std::mutex s_mutex;
+
+// scratch rasters and their sizes, for munmap
+static std::unordered_map<const void*, uint64_t> s_scratch;
+
+// a byte count from the first line of file, UINT64_MAX if it has none
+// (or says "max")
+static uint64_t __read_limit(const std::string& file) {
+  std::ifstream in(file);
+  std::string line;
+  if (!std::getline(in, line) || line.empty() || !isdigit(line[0]))
+    return UINT64_MAX;
+  return std::stoull(line);
+}
+
+// the tightest memory limit of the cgroups this process is in, walking
+// up from its own (v2, or the v1 memory controller). UINT64_MAX if none
+static uint64_t __cgroup_limit() {
+  uint64_t limit = UINT64_MAX;
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(in, line)) {
+    // hierarchy:controllers:path
+    size_t a = line.find(':'), b = line.find(':', a + 1);
+    if (a == std::string::npos || b == std::string::npos)
+      continue;
+    std::string controllers = line.substr(a + 1, b - a - 1);
+    std::string path = line.substr(b + 1);
+    std::string root, file;
+    if (controllers.empty()) {
+      root = "/sys/fs/cgroup";
+      file = "/memory.max";
+    } else if (("," + controllers + ",").find(",memory,") != std::string::npos) {
+      root = "/sys/fs/cgroup/memory";
+      file = "/memory.limit_in_bytes";
+    } else {
+      continue;
+    }
+    while (true) {
+      limit = std::min(limit, __read_limit(root + path + file));
+      size_t slash = path.find_last_of('/');
+      if (slash == std::string::npos || path.size() <= 1)
+	break;
+      path = slash ? path.substr(0, slash) : "/";
+    }
+  }
+  return limit;
+}
+
+// TIFFO_SCRATCH_MB if set, otherwise half of physical memory or of the
+// cgroup (e.g. SLURM job) limit, whichever is less
+static uint64_t __threshold() {
+  const char* mb = getenv("TIFFO_SCRATCH_MB");
+  if (mb && *mb)
+    return strtoull(mb, NULL, 10) << 20;
+  uint64_t memory = __cgroup_limit();
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page > 0)
+    memory = std::min<uint64_t>(memory, static_cast<uint64_t>(pages) * page);
+  return memory == UINT64_MAX ? memory : memory / 2;
+}
+
+static std::string __default_dir() {
+  const char* t = getenv("TMPDIR");
+  return t && *t ? std::string(t) : std::string("/tmp");
+}
+
+static void* __scratch_alloc(uint64_t bytes, const std::string& dir) {
+
+  std::string tmpl = dir + "/tiffo_raster_XXXXXX";
+  std::vector<char> name(tmpl.begin(), tmpl.end());
+  name.push_back('\0');
+
+  int fd = mkstemp(name.data());
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: unable to create scratch file in %s\n", dir.c_str());
+    return NULL;
+  }
+
+  // nobody else needs to see it, and it goes away with the mapping
+  unlink(name.data());
+
+  // a sparse file reads back as zeros
+  if (ftruncate(fd, bytes)) {
+    fprintf(stderr, "ERROR: unable to size scratch file to %llu bytes\n",
+	    static_cast<unsigned long long>(bytes));
+    close(fd);
+    return NULL;
+  }
+
+  void* p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "ERROR: unable to map scratch raster of %llu bytes\n",
+	    static_cast<unsigned long long>(bytes));
+    return NULL;
+  }
+
+  return p;
+}
+
+void* RasterAlloc(uint64_t bytes) {
+
+  static const uint64_t threshold = __threshold();
+  static const std::string dir = __default_dir();
+
+  if (bytes == 0 || bytes < threshold)
+    return calloc(bytes ? bytes : 1, 1);
+
+  void* p = __scratch_alloc(bytes, dir);
+  if (p == NULL)
+    return NULL;
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_scratch[p] = bytes;
+  return p;
+}
+
+void RasterFree(void* p) {
+
+  if (p == NULL)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto it = s_scratch.find(p);
+    if (it != s_scratch.end()) {
+      munmap(p, it->second);
+      s_scratch.erase(it);
+      return;
+    }
+  }
+
+  free(p);
+}
+
+void RasterRelease(void* p, uint64_t offset, uint64_t length) {
+
+  uint64_t size;
+  {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto it = s_scratch.find(p);
+    if (it == s_scratch.end())
+      return;
+    size = it->second;
+  }
+
+  // whole pages only, so neighbouring rows are left alone
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t start = (offset + page - 1) / page * page;
+  uint64_t end = std::min(offset + length, size) / page * page;
+  if (start < end)
+    madvise(static_cast<uint8_t*>(p) + start, end - start, MADV_DONTNEED);
+}
@@ -0,0 +1,27 @@
+#ifndef TIFF_RASTER_H
+#define TIFF_RASTER_H
+
+#include <cstdint>
+
+// Storage for whole-image rasters (TiffImage, TiffIFD::ReadRaster).
+// Small rasters come from the heap. Rasters at or above the scratch
+// threshold live in an unlinked temporary file that is memory mapped,
+// so the kernel can write pages back to disk and drop them instead of
+// the process running out of memory. Either way the raster is zeroed
+// and is used through a plain pointer. The scratch file goes in $TMPDIR
+// (or /tmp). The threshold is $TIFFO_SCRATCH_MB megabytes if set,
+// otherwise half of physical memory or of the memory limit of the
+// process's cgroup (as under SLURM), whichever is less
+
+// zeroed raster of bytes bytes, or NULL on failure
+void* RasterAlloc(uint64_t bytes);
+
+// free a raster from RasterAlloc. NULL is ignored
+void RasterFree(void* p);
+
+// done with a byte range of p for now. For scratch rasters the pages
+// are dropped from this process (the file keeps the data), which keeps
+// resident memory bounded on a single pass. Heap rasters are untouched
+void RasterRelease(void* p, uint64_t offset, uint64_t length);
+
+#endif
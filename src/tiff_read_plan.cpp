@@ -0,0 +1,56 @@
+#include "tiff_read_plan.h"
+#include "tiff_reader.h"
+
+#include <unordered_map>
+
+ReadPlan PlanReads(const TiffReader& reader, const TileOrder& order,
+		   size_t max_span, uint64_t max_bytes, uint64_t max_gap) {
+
+  ReadPlan plan;
+
+  // directory -> run that is still accepting tiles
+  std::unordered_map<uint32_t, size_t> open;
+  
+  for (size_t i = 0; i < order.size(); i++) {
+
+    const TileRef& r = order[i];
+    uint64_t offset = reader.TileOffset(r.dir, r.tile);
+    uint64_t bytes = reader.TileByteCount(r.dir, r.tile);
+
+    auto it = open.find(r.dir);
+    if (it != open.end()) {
+
+      TileRun& run = plan[it->second];
+
+      // so far only sparse tiles, so start the byte range here
+      if (run.length == 0)
+	run.offset = offset;
+      uint64_t end = run.offset + run.length;
+
+      // sparse tiles need no bytes, so they fit anywhere
+      bool fits = i - run.pos.front() < max_span &&
+	(bytes == 0 || (offset >= end && offset - end <= max_gap &&
+			offset + bytes - run.offset <= max_bytes));
+      
+      if (fits) {
+	if (bytes)
+	  run.length = offset + bytes - run.offset;
+	run.tiles.push_back(r.tile);
+	run.pos.push_back(i);
+	continue;
+      }
+    }
+
+    TileRun run;
+    run.dir = r.dir;
+    run.offset = offset;
+    run.length = bytes;
+    run.tiles.push_back(r.tile);
+    run.pos.push_back(i);
+    plan.push_back(run);
+
+    open[r.dir] = plan.size() - 1;
+  }
+  
+  return plan;
+}
@@ -0,0 +1,53 @@
+#ifndef TIFF_READ_PLAN_H
+#define TIFF_READ_PLAN_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TiffReader;
+
+// one tile of one directory
+struct TileRef {
+  uint32_t dir = 0;
+  uint32_t tile = 0;
+
+  TileRef() {}
+  TileRef(uint32_t d, uint32_t t) : dir(d), tile(t) {}
+};
+
+typedef std::vector<TileRef> TileOrder;
+
+// tiles of one directory that sit back to back on disk, fetched with
+// a single positioned read and split up in memory for decode
+struct TileRun {
+
+  uint32_t dir = 0;
+
+  // byte range covering every tile of the run
+  uint64_t offset = 0;
+  uint64_t length = 0;
+
+  // tile numbers, and where each one sits in the tile order
+  std::vector<uint32_t> tiles;
+  std::vector<size_t> pos;
+};
+
+typedef std::vector<TileRun> ReadPlan;
+
+// largest single read the planner will make
+#define READ_PLAN_MAX_BYTES (64ULL * 1024 * 1024)
+
+// holes up to this size are read through rather than split on
+#define READ_PLAN_MAX_GAP (64ULL * 1024)
+
+// merge runs of adjacent tiles in order into large reads. A tile joins the
+// open run of its directory if it starts where that run ends (give or take
+// max_gap), the run stays under max_bytes and the tile is no more than
+// max_span positions after the start of the run. Runs come out in order of
+// their first position
+ReadPlan PlanReads(const TiffReader& reader, const TileOrder& order,
+		   size_t max_span, uint64_t max_bytes = READ_PLAN_MAX_BYTES,
+		   uint64_t max_gap = READ_PLAN_MAX_GAP);
+
+#endif
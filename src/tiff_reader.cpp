@@ -1,27 +1,201 @@
 #include "tiff_reader.h"
+#include "tiff_buffer_pool.h"
+#include "tiff_ome.h"
+#include "channel.h"
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TiffHandlePool::TiffHandlePool(const std::string& filename) : m_filename(filename) {
+  m_fd = open(filename.c_str(), O_RDONLY);
+  if (m_fd < 0)
+    fprintf(stderr, "Error opening %s for raw reads\n", filename.c_str());
+}
+
+TiffHandlePool::~TiffHandlePool() {
+  for (auto& d : m_free)
+    for (auto tif : d.second)
+      TIFFClose(tif);
+  if (m_fd >= 0)
+    close(m_fd);
+}
+
+TiffMapping::TiffMapping(int fd) {
+
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size == 0)
+    return;
+
+  void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    return;
+
+  m_data = static_cast<const uint8_t*>(p);
+  m_size = st.st_size;
+
+  // most reads walk the file front to back
+  madvise(p, m_size, MADV_SEQUENTIAL);
+}
+
+TiffMapping::~TiffMapping() {
+  if (m_data)
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+}
+
+static uint64_t __page_size() {
+  static const uint64_t page = sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+void TiffMapping::WillNeed(uint64_t offset, uint64_t length) const {
+  uint64_t page = __page_size();
+  uint64_t start = offset / page * page;
+  uint64_t end = std::min(offset + length, m_size);
+  if (m_data && start < end)
+    madvise(const_cast<uint8_t*>(m_data) + start, end - start, MADV_WILLNEED);
+}
+
+void TiffMapping::DontNeed(uint64_t offset, uint64_t length) const {
+  // round inwards so neighbouring tiles keep their pages
+  uint64_t page = __page_size();
+  uint64_t start = (offset + page - 1) / page * page;
+  uint64_t end = std::min(offset + length, m_size) / page * page;
+  if (m_data && start < end)
+    madvise(const_cast<uint8_t*>(m_data) + start, end - start, MADV_DONTNEED);
+}
+
+TiffTilePtr TiffMapping::Tile(uint64_t offset, uint64_t length) {
+
+  // let go of any stale tile after the lock, its deleter takes it too
+  TiffTilePtr held;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto it = m_tiles.find(offset);
+  if (it != m_tiles.end()) {
+    held = it->second.lock();
+    if (held && held->size == length)
+      return held;
+  }
+
+  // the mapping stays alive for as long as the tile is held. The last
+  // holder drops the pages, unless the range was handed out again since
+  std::shared_ptr<TiffMapping> self = shared_from_this();
+  auto t = std::make_shared<TiffTile>();
+  t->data = m_data + offset;
+  t->size = length;
+  t->owner = std::shared_ptr<void>(const_cast<uint8_t*>(t->data), [self, offset, length](void*) {
+      std::lock_guard<std::mutex> lock(self->m_mutex);
+      auto it = self->m_tiles.find(offset);
+      if (it != self->m_tiles.end() && !it->second.expired())
+	return;
+      if (it != self->m_tiles.end())
+	self->m_tiles.erase(it);
+      self->DontNeed(offset, length);
+    });
+  m_tiles[offset] = t;
+  return t;
+}
+
+// read exactly len bytes at offset, retrying short reads
+static int __pread_full(int fd, void* buf, size_t len, uint64_t offset) {
+  uint8_t* b = static_cast<uint8_t*>(buf);
+  while (len > 0) {
+    ssize_t n = pread(fd, b, len, offset);
+    if (n <= 0)
+      return 1;
+    b += n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+// point tif at directory dir, or at the SubIFD at sub if it is one
+static bool __set_dir(TIFF* tif, size_t dir, uint64_t sub) {
+  return sub ? TIFFSetSubDirectory(tif, sub) : TIFFSetDirectory(tif, dir);
+}
+
+TIFF* TiffHandlePool::checkout(size_t dir, bool any) {
+
+  TIFF* moved = NULL;
+  uint64_t sub = 0;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto s = m_subdirs.find(dir);
+    if (s != m_subdirs.end())
+      sub = s->second;
+    
+    auto& v = m_free[dir];
+    if (!v.empty()) {
+      TIFF* tif = v.back();
+      v.pop_back();
+      return tif;
+    }
+
+    // borrow one from another directory
+    for (auto it = m_free.begin(); any && it != m_free.end() && !moved; it++) {
+      if (!it->second.empty()) {
+	moved = it->second.back();
+	it->second.pop_back();
+      }
+    }
+  }
+
+  if (moved) {
+    if (__set_dir(moved, dir, sub))
+      return moved;
+    TIFFClose(moved);
+  }
+
+  // nothing free on this directory, so open a new one
+  TIFF* tif = TIFFOpen(m_filename.c_str(), "rm");
+  if (!tif) {
+    fprintf(stderr, "Error opening %s for reading\n", m_filename.c_str());
+    return NULL;
+  }
+  if (!__set_dir(tif, dir, sub)) {
+    fprintf(stderr, "Error setting directory %zu of %s\n", dir, m_filename.c_str());
+    TIFFClose(tif);
+    return NULL;
+  }
+  return tif;
+}
+
+void TiffHandlePool::checkin(size_t dir, TIFF* tif) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_free[dir].push_back(tif);
+}
+
+void TiffHandlePool::SetSubDirectory(size_t dir, uint64_t offset) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_subdirs[dir] = offset;
+}
 
 void TiffReader::print_means() {
 
   std::cerr << " num dirs " << m_num_dirs << std::endl;
   for (int i = 0; i < m_num_dirs; i++) {
 
-    TiffIFD& ifd = m_ifds[i];
+    const TiffIFD& ifd = IFD(i);
     
     uint8_t mode = ifd.GetMode();
 
     switch(mode) {
     case 32:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;
+      std::cout << "Dir " << i << " Mean: " << mean(i)[3] << std::endl;
       break;
     case 16:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;      
+      std::cout << "Dir " << i << " Mean: " << mean(i)[3] << std::endl;      
       break;
     case 8:
-      std::cout << "Dir " << i << " Mean: " << ifd.mean()[3] << std::endl;            
+      std::cout << "Dir " << i << " Mean: " << mean(i)[3] << std::endl;            
       break;
     case 3:
       {
-      std::vector<double> d = ifd.mean();
+      std::vector<double> d = mean(i);
       std::cout << "Mean: (R) " << d[0] << " (G) " << d[1] <<
 	" (B) " << d[2] << std::endl;
       }
@@ -35,9 +209,16 @@ void TiffReader::print_means() {
 
 }
 
+static double __ms_since(std::chrono::steady_clock::time_point t0) {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
 TiffReader::TiffReader(const char* c) {
 
+  auto t0 = std::chrono::steady_clock::now();
+  
   m_tif = std::shared_ptr<TIFF>(TIFFOpen(c, "rm"), TIFFClose);
+  m_open_ms = __ms_since(t0);
   
   // Open the input TIFF file
   if (!m_tif) {
@@ -45,30 +226,205 @@ TiffReader::TiffReader(const char* c) {
     return;
   }
   
-  // set the number of directories
+  // set the number of directories. This only follows the chain of
+  // IFD offsets, the directories themselves are read on first use
+  t0 = std::chrono::steady_clock::now();
   m_num_dirs = TIFFNumberOfDirectories(m_tif.get());
+  m_count_ms = __ms_since(t0);
 
   // set the filename
   m_filename = std::string(c);
+
+  t0 = std::chrono::steady_clock::now();
   
-  // store the pointers to the individual directories
-  for (size_t i = 0; i < m_num_dirs; i++) {
-    assert(TIFFSetDirectory(m_tif.get(), i));
-    m_ifds.push_back(TiffIFD(m_tif.get()));
-    //std::cerr << " getting pointer for " << i << " with value " << m_ifds.back() << std::endl;    
+  // extra handles for tile decoding, and our id in the tile cache
+  m_pool = std::make_shared<TiffHandlePool>(m_filename);
+  m_file_id = TileCache::Global().FileId(m_filename);
+
+  m_dirs = std::make_shared<std::vector<DirInfo>>(m_num_dirs);
+  m_levels = std::make_shared<LevelDirs>();
+  m_swab = TIFFIsByteSwapped(m_tif.get());
+
+  // uncompressed tiles are already pixels, so they can be handed out
+  // straight from a mapping of the file. libtiff's own mapping is off
+  // ("m") since it would keep the whole file resident on a single pass.
+  // Mapping costs nothing until pages are touched
+  m_map = std::make_shared<TiffMapping>(m_pool->fd());
+  if (!m_map->ok())
+    m_map.reset();
+
+  m_setup_ms = __ms_since(t0);
+
+  // channel names, if the OME-XML names every directory
+  char* desc = NULL;
+  if (TIFFGetField(m_tif.get(), TIFFTAG_IMAGEDESCRIPTION, &desc) && desc && IsOmeXml(desc)) {
+    std::vector<std::string> names = OmeChannelNames(desc);
+    if (names.size() == m_num_dirs)
+      m_channel_names.swap(names);
+  }
+}
+
+int TiffReader::LoadMarkerNames(const std::string& file) {
+
+  std::vector<std::string> names;
+  if (ReadMarkerNames(file, names))
+    return 1;
+  if (names.size() != m_num_dirs) {
+    fprintf(stderr, "Error: marker file %s names %zu channels, %s has %zu\n", file.c_str(),
+	    names.size(), m_filename.c_str(), m_num_dirs);
+    return 1;
   }
-  // set back to 0
-  assert(TIFFSetDirectory(m_tif.get(), 0));
+  m_channel_names.swap(names);
+  return 0;
+}
+
+int TiffReader::ResolveChannels(const std::vector<std::string>& tokens,
+				std::vector<int>& dirs) const {
+
+  for (auto& t : tokens) {
+
+    // numbers are directories, as they always were
+    if (!t.empty() && t.find_first_not_of("0123456789") == std::string::npos) {
+      size_t d = t.size() < 10 ? std::stoul(t) : SIZE_MAX;
+      if (d >= m_num_dirs) {
+	fprintf(stderr, "Error: channel %s is not in %s of %zu channels\n", t.c_str(),
+		m_filename.c_str(), m_num_dirs);
+	return 1;
+      }
+      dirs.push_back(d);
+      continue;
+    }
+
+    if (m_channel_names.empty()) {
+      fprintf(stderr, "Error: %s has no channel names to find %s by, give a marker file\n",
+	      m_filename.c_str(), t.c_str());
+      return 1;
+    }
+    auto it = std::find(m_channel_names.begin(), m_channel_names.end(), t);
+    if (it == m_channel_names.end()) {
+      fprintf(stderr, "Error: no channel named %s in %s\n", t.c_str(), m_filename.c_str());
+      return 1;
+    }
+    if (std::find(it + 1, m_channel_names.end(), t) != m_channel_names.end()) {
+      fprintf(stderr, "Error: more than one channel of %s is named %s\n", m_filename.c_str(),
+	      t.c_str());
+      return 1;
+    }
+    dirs.push_back(it - m_channel_names.begin());
+  }
+
+  return 0;
+}
+
+TiffReader::DirInfo& TiffReader::__info(size_t dir) const {
+  assert(m_dirs);
+  if (dir < m_num_dirs)
+    return m_dirs->at(dir);
+  std::lock_guard<std::mutex> lock(m_levels->mutex);
+  return *m_levels->dirs.at(dir);
+}
+
+size_t TiffReader::NumLevels(size_t dir) const {
+  return std::min<size_t>(IFD(dir).subifd_offsets.size(), TIFF_READER_MAX_LEVELS);
+}
+
+size_t TiffReader::LevelDir(size_t dir, size_t level) const {
+
+  assert(level >= 1 && level <= NumLevels(dir));
   
+  // the same number for the same level in every reader of the file,
+  // since it keys the tile cache
+  size_t id = m_num_dirs + dir * TIFF_READER_MAX_LEVELS + level - 1;
+
+  std::lock_guard<std::mutex> lock(m_levels->mutex);
+  std::unique_ptr<DirInfo>& d = m_levels->dirs[id];
+  if (!d) {
+    d.reset(new DirInfo());
+    m_pool->SetSubDirectory(id, IFD(dir).subifd_offsets.at(level - 1));
+  }
+  return id;
+}
+
+const TiffIFD& TiffReader::IFD(size_t dir) const {
+
+  DirInfo& d = __info(dir);
+
+  std::call_once(d.tags_once, [&]() {
+      auto t0 = std::chrono::steady_clock::now();
+
+      // read it on a spare handle so m_tif stays where the caller left it
+      TIFF* tif = m_pool->checkout(dir, true);
+      if (!tif) {
+	fprintf(stderr, "Error reading directory %zu of %s\n", dir, m_filename.c_str());
+	return;
+      }
+      d.ifd = TiffIFD(tif, m_tif.get());
+      m_pool->checkin(dir, tif);
+      
+      d.tags_ms = __ms_since(t0);
+    });
+
+  return d.ifd;
+}
+
+const TiffIFD& TiffReader::__indexed(size_t dir) const {
+
+  const TiffIFD& ifd = IFD(dir);
+  DirInfo& d = __info(dir);
+
+  std::call_once(d.index_once, [&]() {
+      auto t0 = std::chrono::steady_clock::now();
+      TIFF* tif = m_pool->checkout(dir, true);
+      if (!tif) {
+	fprintf(stderr, "Error reading directory %zu of %s\n", dir, m_filename.c_str());
+	return;
+      }
+      d.ifd.LoadTileIndex(tif);
+      m_pool->checkin(dir, tif);
+      d.index_ms = __ms_since(t0);
+    });
+
+  return ifd;
+}
+
+uint64_t TiffReader::TileOffset(size_t dir, uint32_t tile) const {
+  return __indexed(dir).tile_offsets.at(tile);
+}
+
+uint64_t TiffReader::TileByteCount(size_t dir, uint32_t tile) const {
+  return __indexed(dir).tile_bytecounts.at(tile);
+}
+
+void TiffReader::PrintOpenTiming(std::ostream& out) const {
+
+  out << "Open timing (ms): TIFFOpen " << m_open_ms << " count dirs " <<
+    m_count_ms << " setup " << m_setup_ms << std::endl;
+
+  if (!m_dirs)
+    return;
+
+  double tags = 0, index = 0;
+  size_t loaded = 0;
+  for (size_t i = 0; i < m_dirs->size(); i++) {
+    const DirInfo& d = m_dirs->at(i);
+    if (d.tags_ms == 0 && d.index_ms == 0)
+      continue;
+    ++loaded;
+    tags += d.tags_ms;
+    index += d.index_ms;
+    out << "  dir " << i << " tags " << d.tags_ms << " tile index " << d.index_ms << std::endl;
+  }
+  out << "  " << loaded << " of " << m_dirs->size() << " dirs loaded, tags " <<
+    tags << " tile index " << index << std::endl;
 }
 
 void TiffReader::print() {
 
   std::cout << "-- Image file: " << m_filename << std::endl;
   std::cout << "-- Num dirs: " << m_num_dirs << std::endl;
-  for (auto& i : m_ifds) {
-    std::cout << " ----- IFD " << i.dir << " -----" << std::endl;
-    i.print();
+  for (size_t i = 0; i < m_num_dirs; i++) {
+    std::cout << " ----- IFD " << i << " -----" << std::endl;
+    IFD(i).print();
   }
   
 }
@@ -91,3 +447,304 @@ uint32_t TiffReader::height() const {
 
 }
   
+
+uint32_t TiffReader::TileIndex(size_t dir, uint32_t x, uint32_t y) const {
+
+  const TiffIFD& ifd = IFD(dir);
+  assert(ifd.tile_width && ifd.tile_height);
+  uint64_t tiles_across = (ifd.width + ifd.tile_width - 1) / ifd.tile_width;
+  return static_cast<uint32_t>((y / ifd.tile_height) * tiles_across + x / ifd.tile_width);
+  
+}
+
+TiffTilePtr TiffReader::ReadTile(size_t dir, uint32_t x, uint32_t y) const {
+  return ReadTile(dir, TileIndex(dir, x, y));
+}
+
+TiffTilePtr TiffReader::ReadTile(size_t dir, uint32_t tile) const {
+
+  assert(m_pool);
+
+  TiffTilePtr mapped = __mapped_tile(dir, tile);
+  if (mapped)
+    return mapped;
+  
+  TileKey key;
+  key.file = m_file_id;
+  key.dir = dir;
+  key.tile = tile;
+
+  return TileCache::Global().GetOrLoad(key, [&]() { return __decode_tile(dir, tile); });
+}
+
+bool TiffReader::__mappable(size_t dir) const {
+  const TiffIFD& ifd = IFD(dir);
+  return ifd.tile_width && ifd.tile_height &&
+    ifd.compression == COMPRESSION_NONE && !(m_swab && ifd.bits_per_sample > 8);
+}
+
+TiffTilePtr TiffReader::__mapped_tile(size_t dir, uint32_t tile) const {
+
+  if (!m_map || !__mappable(dir))
+    return nullptr;
+
+  const TiffIFD& ifd = __indexed(dir);
+  uint64_t offset = ifd.tile_offsets.at(tile);
+  uint64_t bytes = ifd.tile_bytecounts.at(tile);
+
+  // short or sparse tiles still need libtiff to pad them out
+  uint64_t tile_bytes = ifd.tile_width * ifd.tile_height *
+    ifd.bits_per_sample * (ifd.planar == PLANARCONFIG_SEPARATE ? 1 : ifd.samples_per_pixel) / 8;
+  if (bytes != tile_bytes || offset + bytes > m_map->size())
+    return nullptr;
+
+  // callers read samples in place, so they have to be aligned
+  uint64_t sample_bytes = std::max<uint64_t>(ifd.bits_per_sample / 8, 1);
+  if (offset % sample_bytes)
+    return nullptr;
+
+  // not cached, the mapping hands out one shared tile per range
+  return m_map->Tile(offset, bytes);
+}
+
+TiffTilePtr TiffReader::__decode_tile(size_t dir, uint32_t tile) const {
+
+  const TiffIFD& ifd = __indexed(dir);
+  uint64_t offset = ifd.tile_offsets.at(tile);
+  uint64_t bytes = ifd.tile_bytecounts.at(tile);
+
+  if (bytes == 0 || m_pool->fd() < 0)
+    return __decode_raw(dir, tile, NULL, bytes);
+  
+  // pull the raw bytes with a positioned read (no shared file offset, so
+  // any number of threads can read at once), then let libtiff decode them
+  std::vector<uint8_t> raw(bytes);
+  if (__pread_full(m_pool->fd(), raw.data(), bytes, offset)) {
+    fprintf(stderr, "Error reading tile %u of directory %zu\n", tile, dir);
+    return nullptr;
+  }
+  
+  return __decode_raw(dir, tile, raw.data(), bytes);
+}
+
+TiffTilePtr TiffReader::__decode_raw(size_t dir, uint32_t tile, uint8_t* raw, uint64_t bytes) const {
+
+  TIFF* tif = m_pool->checkout(dir);
+  if (!tif)
+    return nullptr;
+  
+  // the tile keeps its pooled buffer until the last holder lets go
+  tmsize_t ts = TIFFTileSize(tif);
+  auto tbuf = std::make_shared<TileBuffer>(TileBufferPool::Global().Get(ts));
+  if (!*tbuf) {
+    m_pool->checkin(dir, tif);
+    return nullptr;
+  }
+  uint8_t* buf = tbuf->data();
+
+  int status = 0;
+  if (bytes == 0) {
+    // sparse tile
+    memset(buf, 0, ts);
+  } else if (raw == NULL) {
+    status = TIFFReadEncodedTile(tif, tile, buf, ts) < 0;
+  } else {
+    // note that libtiff may modify raw while decoding
+    status = !TIFFReadFromUserBuffer(tif, tile, raw, bytes, buf, ts);
+  }
+  m_pool->checkin(dir, tif);
+  
+  if (status) {
+    fprintf(stderr, "Error reading tile %u of directory %zu\n", tile, dir);
+    return nullptr;
+  }
+  
+  auto t = std::make_shared<TiffTile>();
+  t->owner = tbuf;
+  t->data = buf;
+  t->size = ts;
+  return t;
+}
+
+int TiffReader::ReadTileRun(const TileRun& run) const {
+
+  assert(m_pool);
+  assert(run.tiles.size());
+
+  // mapped tiles are never copied, just start paging them in
+  if (m_map && __mappable(run.dir)) {
+    m_map->WillNeed(run.offset, run.length);
+    return 0;
+  }
+
+  TileKey key;
+  key.file = m_file_id;
+  key.dir = run.dir;
+
+  // nothing to do if everything is already in
+  bool all_cached = true;
+  for (auto t : run.tiles) {
+    key.tile = t;
+    if (!TileCache::Global().Contains(key)) {
+      all_cached = false;
+      break;
+    }
+  }
+  if (all_cached)
+    return 0;
+
+  // one read for the whole run
+  std::vector<uint8_t> raw;
+  if (run.length && m_pool->fd() >= 0) {
+    raw.resize(run.length);
+    if (__pread_full(m_pool->fd(), raw.data(), run.length, run.offset)) {
+      fprintf(stderr, "Error reading %llu bytes at %llu of directory %u\n",
+	      static_cast<unsigned long long>(run.length),
+	      static_cast<unsigned long long>(run.offset), run.dir);
+      return 1;
+    }
+  }
+
+  // split it up and decode each tile
+  const TiffIFD& ifd = __indexed(run.dir);
+  for (auto t : run.tiles) {
+
+    key.tile = t;
+    uint64_t bytes = ifd.tile_bytecounts.at(t);
+    // each slice is decoded at most once, so it's fine if libtiff scribbles on it
+    uint8_t* p = raw.empty() || bytes == 0 ? NULL :
+      raw.data() + (ifd.tile_offsets.at(t) - run.offset);
+
+    TiffTilePtr tile = TileCache::Global().GetOrLoad(key, [&]() {
+	return __decode_raw(run.dir, t, p, bytes);
+      });
+    if (!tile)
+      return 1;
+  }
+  
+  return 0;
+}
+
+int TiffReader::ReadRegion(size_t dir, uint64_t x, uint64_t y, uint64_t w, uint64_t h, void* out) const {
+
+  const TiffIFD& ifd = IFD(dir);
+
+  uint64_t bpp = ifd.bits_per_sample * ifd.samples_per_pixel;
+  if (bpp % 8) {
+    fprintf(stderr, "ERROR: region reads need whole-byte pixels, got %llu bits\n", bpp);
+    return 1;
+  }
+  bpp /= 8;
+
+  uint8_t* o = static_cast<uint8_t*>(out);
+  memset(o, 0, w * h * bpp);
+
+  // clip to the image
+  uint64_t x1 = std::min<uint64_t>(x + w, ifd.width);
+  uint64_t y1 = std::min<uint64_t>(y + h, ifd.height);
+  if (x >= x1 || y >= y1)
+    return 0;
+
+  // scanline image, read the rows one at a time
+  if (!ifd.tile_width || !ifd.tile_height) {
+    TIFF* tif = m_pool->checkout(dir);
+    if (!tif)
+      return 1;
+    std::vector<uint8_t> line(TIFFScanlineSize(tif));
+    int status = 0;
+    for (uint64_t yy = y; yy < y1 && !status; yy++) {
+      if (TIFFReadScanline(tif, line.data(), yy, 0) < 0) {
+	fprintf(stderr, "Error reading line at row %llu\n", yy);
+	status = 1;
+      } else {
+	memcpy(o + (yy - y) * w * bpp, line.data() + x * bpp, (x1 - x) * bpp);
+      }
+    }
+    m_pool->checkin(dir, tif);
+    return status;
+  }
+
+  uint64_t tw = ifd.tile_width, th = ifd.tile_height;
+  for (uint64_t ty0 = (y / th) * th; ty0 < y1; ty0 += th) {
+    for (uint64_t tx0 = (x / tw) * tw; tx0 < x1; tx0 += tw) {
+
+      TiffTilePtr tile = ReadTile(dir, tx0, ty0);
+      if (!tile)
+	return 1;
+
+      // overlap of the tile and the region
+      uint64_t cx0 = std::max(tx0, x), cx1 = std::min(tx0 + tw, x1);
+      uint64_t cy0 = std::max(ty0, y), cy1 = std::min(ty0 + th, y1);
+      for (uint64_t yy = cy0; yy < cy1; yy++)
+	memcpy(o + ((yy - y) * w + (cx0 - x)) * bpp,
+	       tile->data + ((yy - ty0) * tw + (cx0 - tx0)) * bpp,
+	       (cx1 - cx0) * bpp);
+    }
+  }
+
+  return 0;
+}
+
+std::vector<double> TiffReader::mean(size_t dir) const {
+
+  const TiffIFD& ifd = IFD(dir);
+
+  // scanline images don't go through the tile cache
+  if (!ifd.tile_width || !ifd.tile_height) {
+    TiffIFD copy = ifd;
+    return copy.mean();
+  }
+
+  uint8_t mode = ifd.GetMode();
+  std::vector<double> out = {0,0,0,0};
+
+  uint64_t tw = ifd.tile_width, th = ifd.tile_height;
+  for (uint64_t y = 0; y < ifd.height; y += th) {
+    for (uint64_t x = 0; x < ifd.width; x += tw) {
+
+      TiffTilePtr tile = ReadTile(dir, x, y);
+      if (!tile) {
+	fprintf(stderr, "Error reading tile at (%llu, %llu)\n", x, y);
+	return {-1};
+      }
+      const uint8_t* buf = tile->data;
+
+      uint64_t rows = std::min(th, ifd.height - y);
+      uint64_t cols = std::min(tw, ifd.width - x);
+      for (uint64_t ty = 0; ty < rows; ty++) {
+	uint64_t row = ty * tw;
+	switch (mode) {
+	case 8:
+	  for (uint64_t tx = 0; tx < cols; tx++)
+	    out[3] += buf[row + tx];
+	  break;
+	case 3:
+	  for (uint64_t tx = 0; tx < cols; tx++) {
+	    out[0] += buf[(row + tx) * 3    ];
+	    out[1] += buf[(row + tx) * 3 + 1];
+	    out[2] += buf[(row + tx) * 3 + 2];
+	  }
+	  break;
+	case 16:
+	  for (uint64_t tx = 0; tx < cols; tx++)
+	    out[3] += reinterpret_cast<const uint16_t*>(buf)[row + tx];
+	  break;
+	case 32:
+	  for (uint64_t tx = 0; tx < cols; tx++)
+	    out[3] += reinterpret_cast<const uint32_t*>(buf)[row + tx];
+	  break;
+	default:
+	  std::cerr << "tiffo means - mode of " << static_cast<int>(mode) << " not supported " << std::endl;
+	  return {-1};
+	}
+      }
+    }
+  }
+
+  double np = static_cast<double>(ifd.width) * ifd.height;
+  for (auto& a : out) {
+    a /= np;
+  }
+  
+  return out;
+}
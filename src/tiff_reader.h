@@ -7,8 +7,97 @@
 #include <tiffio.h>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
 
 #include "tiff_ifd.h"
+#include "tiff_tile_cache.h"
+#include "tiff_read_plan.h"
+
+// most SubIFD levels of a directory the reader will use
+#define TIFF_READER_MAX_LEVELS 32
+
+// libtiff handles are not thread-safe and switching directories re-reads
+// the IFD. This keeps a set of extra handles on the same file, each parked
+// on one directory, so any thread can decode from any directory
+class TiffHandlePool {
+
+ public:
+
+  TiffHandlePool(const std::string& filename);
+
+  ~TiffHandlePool();
+
+  // plain file descriptor for positioned (pread) raw reads
+  int fd() const { return m_fd; }
+
+  // get a handle set to directory dir. Must be given back with checkin.
+  // If any is true, a free handle parked on another directory is moved
+  // over rather than opening a new one
+  TIFF* checkout(size_t dir, bool any = false);
+
+  void checkin(size_t dir, TIFF* tif);
+
+  // handles for dir are set to the SubIFD at offset rather than to
+  // directory number dir
+  void SetSubDirectory(size_t dir, uint64_t offset);
+  
+ private:
+
+  std::string m_filename;
+
+  int m_fd = -1;
+
+  std::mutex m_mutex;
+
+  std::unordered_map<size_t, std::vector<TIFF*>> m_free;
+
+  // SubIFD offsets of the directory numbers that stand for them
+  std::unordered_map<size_t, uint64_t> m_subdirs;
+  
+};
+
+// read-only mapping of a whole file, for handing out uncompressed tiles
+// without a copy. Tiles give their pages back when they are let go, so
+// resident memory tracks the tiles in use rather than the file size
+class TiffMapping : public std::enable_shared_from_this<TiffMapping> {
+
+ public:
+
+  TiffMapping(int fd);
+
+  ~TiffMapping();
+
+  bool ok() const { return m_data != NULL; }
+
+  const uint8_t* data() const { return m_data; }
+
+  uint64_t size() const { return m_size; }
+
+  // start paging in a byte range ahead of use
+  void WillNeed(uint64_t offset, uint64_t length) const;
+
+  // drop the pages that lie entirely inside a byte range
+  void DontNeed(uint64_t offset, uint64_t length) const;
+
+  // the tile stored at a byte range, pointing into the mapping. Everyone
+  // holding the same range shares one tile, so its pages are only dropped
+  // once the last holder lets go
+  TiffTilePtr Tile(uint64_t offset, uint64_t length);
+
+ private:
+
+  std::mutex m_mutex;
+
+  // live tiles by offset
+  std::unordered_map<uint64_t, std::weak_ptr<const TiffTile>> m_tiles;
+
+  const uint8_t* m_data = NULL;
+
+  uint64_t m_size = 0;
+
+};
 
 // this class does not store pixel data, but
 // does contain the TIFF pointer to the original image.
@@ -35,8 +124,8 @@ class TiffReader {
   friend std::ostream& operator<<(std::ostream& out, const TiffReader& o);
 
   TiffIFD CurrentIFD() const {
-    assert(curr_ifd < m_ifds.size());
-    return m_ifds.at(curr_ifd);
+    assert(curr_ifd < m_num_dirs);
+    return IFD(curr_ifd);
   }
 
   void light_mean();
@@ -49,18 +138,131 @@ class TiffReader {
   uint32_t height() const;
 
   TIFF* get() const { return m_tif.get(); }
+
+  // decoded tile number tile of directory dir, from the shared tile cache.
+  // Uncompressed tiles are instead pointers into a mapping of the file.
+  // Safe to call from multiple threads
+  TiffTilePtr ReadTile(size_t dir, uint32_t tile) const;
+
+  // fetch every tile of run with one read and decode them into the
+  // tile cache. Tiles already cached are skipped. Returns 0 on success
+  int ReadTileRun(const TileRun& run) const;
+
+  // decoded tile holding pixel (x, y) of directory dir
+  TiffTilePtr ReadTile(size_t dir, uint32_t x, uint32_t y) const;
+
+  // tile number holding pixel (x, y) of directory dir
+  uint32_t TileIndex(size_t dir, uint32_t x, uint32_t y) const;
+  
+  // copy a w x h region at (x, y) of directory dir into out (row-major,
+  // packed pixels). Pixels off the image are zeroed. Returns 0 on success
+  int ReadRegion(size_t dir, uint64_t x, uint64_t y, uint64_t w, uint64_t h, void* out) const;
+
+  // mean pixel value of a directory, in the same layout as TiffIFD::mean
+  std::vector<double> mean(size_t dir) const;
+
+  // IFD info for directory dir. Read from the file the first time it is
+  // asked for, so opening a reader costs nothing per directory
+  const TiffIFD& IFD(size_t dir) const;
+
+  // reduced-resolution levels stored as SubIFDs of directory dir (the
+  // pyramid written by -P), or 0
+  size_t NumLevels(size_t dir) const;
+
+  // directory number standing for SubIFD level (1 to NumLevels) of dir.
+  // It is past NumDirs, but works anywhere a directory does (IFD,
+  // ReadTile, ReadRegion, ...)
+  size_t LevelDir(size_t dir, size_t level) const;
+
+  // on-disk location of a tile. The tile index of a directory is also
+  // read on first use
+  uint64_t TileOffset(size_t dir, uint32_t tile) const;
+  uint64_t TileByteCount(size_t dir, uint32_t tile) const;
+
+  // print where the time to open the file and its directories went
+  void PrintOpenTiming(std::ostream& out) const;
+
+  const std::string& filename() const { return m_filename; }
+
+  // channel names, one per directory, from the OME-XML of the first
+  // directory or a marker file. Empty if neither names every directory
+  const std::vector<std::string>& ChannelNames() const { return m_channel_names; }
+
+  // take the channel names from a marker file (see ReadMarkerNames)
+  // instead, which must name every directory. Returns 0 on success
+  int LoadMarkerNames(const std::string& file);
+
+  // directories for a channel list whose entries are either directory
+  // numbers or channel names. Returns 0 on success
+  int ResolveChannels(const std::vector<std::string>& tokens, std::vector<int>& dirs) const;
   
  private:
   
   std::string m_filename;
 
-  size_t m_num_dirs;
+  size_t m_num_dirs = 0;
 
   std::shared_ptr<TIFF> m_tif;
 
-  std::vector<TiffIFD> m_ifds;
+  // metadata for one directory, filled in on first use
+  struct DirInfo {
+    TiffIFD ifd;
+    std::once_flag tags_once;
+    std::once_flag index_once;
+    double tags_ms = 0;
+    double index_ms = 0;
+  };
+
+  // shared between copies, since it never changes once loaded
+  std::shared_ptr<std::vector<DirInfo>> m_dirs;
+
+  // SubIFD levels by the directory number that stands for them, added
+  // as they are first asked for
+  struct LevelDirs {
+    std::mutex mutex;
+    std::unordered_map<size_t, std::unique_ptr<DirInfo>> dirs;
+  };
+  std::shared_ptr<LevelDirs> m_levels;
+
+  // metadata of a directory or level
+  DirInfo& __info(size_t dir) const;
+
+  // cost of the eager part of opening, in ms
+  double m_open_ms = 0;
+  double m_count_ms = 0;
+  double m_setup_ms = 0;
+
+  // multi-byte samples need swapping, so tiles can't be used as is
+  bool m_swab = false;
 
   size_t curr_ifd = 0;
+
+  std::vector<std::string> m_channel_names;
+
+  // extra handles used to decode tiles, shared between copies
+  std::shared_ptr<TiffHandlePool> m_pool;
+
+  // mapping of the file, for directories that can be served from it
+  std::shared_ptr<TiffMapping> m_map;
+
+  // IFD of dir with its tile index loaded
+  const TiffIFD& __indexed(size_t dir) const;
+
+  // true if tiles of dir are raw pixels in file order
+  bool __mappable(size_t dir) const;
+
+  // tile straight out of the mapping, or NULL if it can't be
+  TiffTilePtr __mapped_tile(size_t dir, uint32_t tile) const;
+
+  // id of this file in the tile cache
+  uint32_t m_file_id = 0;
+
+  // decode a tile, bypassing the cache
+  TiffTilePtr __decode_tile(size_t dir, uint32_t tile) const;
+
+  // decode a tile from raw bytes already read from the file (which
+  // may be modified). If raw is NULL, libtiff reads the tile itself
+  TiffTilePtr __decode_raw(size_t dir, uint32_t tile, uint8_t* raw, uint64_t bytes) const;
   
 };
 
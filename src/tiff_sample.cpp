@@ -0,0 +1,100 @@
+#include "tiff_sample.h"
+#include "tiff_reader.h"
+
+#include <algorithm>
+
+// a tile is blank if it is no more than this many times the smallest
+#define SIGNAL_BLANK_FACTOR 2
+
+// and only if the smallest is this many times under the median
+#define SIGNAL_MEDIAN_FACTOR 8
+
+TileSignalIndex::TileSignalIndex(const TiffReader& reader, const std::vector<size_t>& dirs) {
+
+  if (dirs.empty())
+    return;
+  
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  m_width = ifd.width;
+  m_height = ifd.height;
+  m_dirs = dirs.size();
+
+  // scanline images are one tile
+  m_tw = ifd.tile_width ? ifd.tile_width : m_width;
+  m_th = ifd.tile_height ? ifd.tile_height : m_height;
+  m_across = (m_width + m_tw - 1) / m_tw;
+  m_down = (m_height + m_th - 1) / m_th;
+
+  std::vector<uint32_t> count(m_across * m_down, 0);
+  for (auto d : dirs) {
+
+    if (!ifd.tile_width) {
+      for (auto& c : count)
+	c++;
+      continue;
+    }
+    
+    std::vector<uint64_t> bytes(count.size());
+    for (size_t t = 0; t < bytes.size(); t++)
+      bytes[t] = reader.TileByteCount(d, t);
+
+    std::vector<uint64_t> sorted(bytes);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    uint64_t median = sorted[sorted.size() / 2];
+    uint64_t smallest = *std::min_element(bytes.begin(), bytes.end());
+
+    bool has_blank = smallest * SIGNAL_MEDIAN_FACTOR < median;
+    for (size_t t = 0; t < bytes.size(); t++)
+      if (!has_blank || bytes[t] > smallest * SIGNAL_BLANK_FACTOR)
+	count[t]++;
+  }
+
+  m_sum.assign((m_across + 1) * (m_down + 1), 0);
+  for (uint64_t ty = 0; ty < m_down; ty++)
+    for (uint64_t tx = 0; tx < m_across; tx++)
+      m_sum[(ty + 1) * (m_across + 1) + tx + 1] = count[ty * m_across + tx] +
+	m_sum[ty * (m_across + 1) + tx + 1] + m_sum[(ty + 1) * (m_across + 1) + tx] -
+	m_sum[ty * (m_across + 1) + tx];
+}
+
+double TileSignalIndex::Fraction(uint64_t x, uint64_t y, uint64_t w, uint64_t h) const {
+
+  if (!m_dirs || !w || !h)
+    return 0;
+  
+  uint64_t tx0 = x / m_tw, ty0 = y / m_th;
+  uint64_t tx1 = std::min((x + w + m_tw - 1) / m_tw, m_across);
+  uint64_t ty1 = std::min((y + h + m_th - 1) / m_th, m_down);
+  if (tx0 >= tx1 || ty0 >= ty1)
+    return 0;
+
+  uint64_t s = m_sum[ty1 * (m_across + 1) + tx1] - m_sum[ty0 * (m_across + 1) + tx1] -
+    m_sum[ty1 * (m_across + 1) + tx0] + m_sum[ty0 * (m_across + 1) + tx0];
+  return static_cast<double>(s) / ((tx1 - tx0) * (ty1 - ty0) * m_dirs);
+}
+
+std::vector<CropWindow> SampleWindows(const TileSignalIndex& index, size_t n,
+				      uint64_t w, uint64_t h, double min_fraction,
+				      std::mt19937_64& rng, size_t max_tries) {
+
+  std::vector<CropWindow> out;
+  if (w > index.width() || h > index.height())
+    return out;
+
+  std::uniform_int_distribution<uint64_t> rx(0, index.width() - w);
+  std::uniform_int_distribution<uint64_t> ry(0, index.height() - h);
+  for (size_t i = 0; i < max_tries && out.size() < n; i++) {
+    CropWindow c;
+    c.x = rx(rng);
+    c.y = ry(rng);
+    c.w = w;
+    c.h = h;
+    if (index.Fraction(c.x, c.y, c.w, c.h) >= min_fraction)
+      out.push_back(c);
+  }
+
+  std::sort(out.begin(), out.end(), [](const CropWindow& a, const CropWindow& b) {
+      return a.y != b.y ? a.y < b.y : a.x < b.x;
+    });
+  return out;
+}
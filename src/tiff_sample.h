@@ -0,0 +1,59 @@
+#ifndef TIFF_SAMPLE_H
+#define TIFF_SAMPLE_H
+
+#include <random>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TiffReader;
+
+// a w x h window of an image at (x, y)
+struct CropWindow {
+  uint64_t x = 0;
+  uint64_t y = 0;
+  uint64_t w = 0;
+  uint64_t h = 0;
+};
+
+// which tiles of a set of directories hold anything, judged from the tile
+// index alone. Blank tiles (zeroed by compress, or never written)
+// compress to almost nothing, so a tile is empty if its byte count is
+// close to the smallest in its directory. Directories where nothing is
+// much smaller than the median (uncompressed, or no blank tiles) count
+// every tile as holding signal
+class TileSignalIndex {
+
+ public:
+
+  TileSignalIndex(const TiffReader& reader, const std::vector<size_t>& dirs);
+
+  // fraction of (tile, directory) pairs under the window that hold signal
+  double Fraction(uint64_t x, uint64_t y, uint64_t w, uint64_t h) const;
+
+  uint64_t width() const { return m_width; }
+  uint64_t height() const { return m_height; }
+
+ private:
+
+  uint64_t m_width = 0;
+  uint64_t m_height = 0;
+  uint64_t m_tw = 1;
+  uint64_t m_th = 1;
+  uint64_t m_across = 0;
+  uint64_t m_down = 0;
+  size_t m_dirs = 0;
+
+  // summed-area table of signal tiles over all dirs, (across + 1) x (down + 1)
+  std::vector<uint64_t> m_sum;
+  
+};
+
+// draw up to n random w x h windows inside the image whose signal fraction
+// is at least min_fraction, trying at most max_tries candidates. Windows
+// come back sorted top to bottom so they are read in file order
+std::vector<CropWindow> SampleWindows(const TileSignalIndex& index, size_t n,
+				      uint64_t w, uint64_t h, double min_fraction,
+				      std::mt19937_64& rng, size_t max_tries);
+
+#endif
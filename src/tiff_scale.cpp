@@ -0,0 +1,345 @@
+#include "tiff_scale.h"
+#include "tiff_reader.h"
+#include "tiff_writer.h"
+#include "tiff_buffer_pool.h"
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+// add one row of samples into the running column sums
+template <typename T, typename A>
+static inline void __add_row(const T* s, uint64_t row_len, A* a) {
+#pragma omp simd
+  for (uint64_t i = 0; i < row_len; i++)
+    a[i] += s[i];
+}
+
+// one output row from the column sums of a band of rows rows high
+template <typename T, typename A>
+static void __box_row(const A* a, uint64_t w, uint64_t rows, uint64_t spp, uint32_t f,
+		      T* d) {
+  uint64_t ow = (w + f - 1) / f;
+  for (uint64_t ox = 0; ox < ow; ox++) {
+    uint64_t x0 = ox * f;
+    uint64_t x1 = std::min<uint64_t>(x0 + f, w);
+    A n = (x1 - x0) * rows;
+    for (uint64_t c = 0; c < spp; c++) {
+      A sum = 0;
+      for (uint64_t x = x0; x < x1; x++)
+	sum += a[x * spp + c];
+      d[ox * spp + c] = static_cast<T>((sum + n / 2) / n);
+    }
+  }
+}
+
+// box average. Rows are summed down into acc first (contiguous, so the
+// compiler vectorises it), then each box is summed across
+template <typename T, typename A>
+static void __box(const T* src, uint64_t ss, uint64_t w, uint64_t h, uint64_t spp,
+		  uint32_t f, T* dst, uint64_t ds) {
+
+  uint64_t oh = (h + f - 1) / f;
+  uint64_t row_len = w * spp;
+  
+  std::vector<A> acc(row_len);
+  for (uint64_t oy = 0; oy < oh; oy++) {
+
+    uint64_t y0 = oy * f;
+    uint64_t y1 = std::min<uint64_t>(y0 + f, h);
+
+    std::fill(acc.begin(), acc.end(), 0);
+    for (uint64_t y = y0; y < y1; y++)
+      __add_row(src + y * ss * spp, row_len, acc.data());
+
+    __box_row(acc.data(), w, y1 - y0, spp, f, dst + oy * ds * spp);
+  }
+}
+
+// most common value in a box. 8-bit data uses a 256 bin histogram,
+// wider labels a small open-addressed table sized to the box. Both are
+// reset by generation stamps rather than cleared per box
+template <typename T>
+static void __mode(const T* src, uint64_t ss, uint64_t w, uint64_t h, uint64_t spp,
+		   uint32_t f, T* dst, uint64_t ds) {
+
+  uint64_t ow = (w + f - 1) / f;
+  uint64_t oh = (h + f - 1) / f;
+
+  size_t slots = 256;
+  if (sizeof(T) > 1)
+    while (slots < 2ULL * f * f)
+      slots <<= 1;
+  
+  std::vector<T> key(slots);
+  std::vector<uint32_t> count(slots);
+  std::vector<uint32_t> stamp(slots, 0);
+  uint32_t gen = 0;
+  
+  for (uint64_t oy = 0; oy < oh; oy++) {
+    uint64_t y0 = oy * f;
+    uint64_t y1 = std::min<uint64_t>(y0 + f, h);
+    for (uint64_t ox = 0; ox < ow; ox++) {
+      uint64_t x0 = ox * f;
+      uint64_t x1 = std::min<uint64_t>(x0 + f, w);
+      for (uint64_t c = 0; c < spp; c++) {
+
+	++gen;
+	T best = 0;
+	uint32_t best_count = 0;
+	
+	for (uint64_t y = y0; y < y1; y++) {
+	  const T* s = src + (y * ss + x0) * spp + c;
+	  for (uint64_t x = x0; x < x1; x++, s += spp) {
+	    
+	    T v = *s;
+	    size_t slot;
+	    if (sizeof(T) == 1) {
+	      slot = v;
+	    } else {
+	      slot = (static_cast<uint64_t>(v) * 0x9E3779B97F4A7C15ULL >> 32) & (slots - 1);
+	      while (stamp[slot] == gen && key[slot] != v)
+		slot = (slot + 1) & (slots - 1);
+	    }
+	    if (stamp[slot] != gen) {
+	      stamp[slot] = gen;
+	      key[slot] = v;
+	      count[slot] = 0;
+	    }
+	    uint32_t k = ++count[slot];
+	    if (k > best_count || (k == best_count && v < best)) {
+	      best = v;
+	      best_count = k;
+	    }
+	  }
+	}
+	dst[(oy * ds + ox) * spp + c] = best;
+      }
+    }
+  }
+}
+
+template <typename T>
+static void __scale(const void* src, uint64_t ss, uint64_t w, uint64_t h, uint64_t spp,
+		    uint32_t f, bool mode, void* dst, uint64_t ds) {
+  
+  const T* s = static_cast<const T*>(src);
+  T* d = static_cast<T*>(dst);
+  
+  if (mode)
+    __mode<T>(s, ss, w, h, spp, f, d, ds);
+  else if (sizeof(T) <= 2 && f <= 256)
+    __box<T, uint32_t>(s, ss, w, h, spp, f, d, ds); // f*f*65535 fits
+  else
+    __box<T, uint64_t>(s, ss, w, h, spp, f, d, ds);
+}
+
+int ScaleBuffer(const void* src, uint64_t src_stride, uint64_t w, uint64_t h,
+		uint64_t spp, uint64_t bps, uint32_t factor, bool mode,
+		void* dst, uint64_t dst_stride) {
+
+  if (factor == 0) {
+    fprintf(stderr, "ERROR: scale factor must be at least 1\n");
+    return 1;
+  }
+  
+  switch (bps) {
+  case 8:
+    __scale<uint8_t>(src, src_stride, w, h, spp, factor, mode, dst, dst_stride);
+    break;
+  case 16:
+    __scale<uint16_t>(src, src_stride, w, h, spp, factor, mode, dst, dst_stride);
+    break;
+  case 32:
+    __scale<uint32_t>(src, src_stride, w, h, spp, factor, mode, dst, dst_stride);
+    break;
+  default:
+    fprintf(stderr, "ERROR: unable to scale %llu bits per sample\n",
+	    static_cast<unsigned long long>(bps));
+    return 1;
+  }
+  
+  return 0;
+}
+
+// box average of the w x h source block at (sx, sy), read a strip of
+// rows at a time. Each row goes into the column sums and is dropped, and
+// a box row is written out every f rows
+template <typename T, typename A>
+static int __box_region(const TiffReader& reader, size_t dir, uint64_t sx, uint64_t sy,
+			uint64_t w, uint64_t h, uint64_t spp, uint32_t f, T* dst, uint64_t ds) {
+
+  uint64_t row_len = w * spp;
+  uint64_t rows = std::max<uint64_t>(1, SCALE_STRIP_BYTES / (row_len * sizeof(T)));
+  rows = std::min(rows, h);
+  
+  TileBuffer strip = TileBufferPool::Global().Get(rows * row_len * sizeof(T));
+  if (!strip)
+    return 1;
+
+  std::vector<A> acc(row_len, 0);
+  for (uint64_t y0 = 0; y0 < h; y0 += rows) {
+
+    uint64_t n = std::min(rows, h - y0);
+    if (reader.ReadRegion(dir, sx, sy + y0, w, n, strip.data()))
+      return 1;
+
+    const T* s = strip.as<T>();
+    for (uint64_t y = y0; y < y0 + n; y++, s += row_len) {
+      __add_row(s, row_len, acc.data());
+      if ((y + 1) % f == 0 || y + 1 == h) {
+	__box_row(acc.data(), w, y % f + 1, spp, f, dst + y / f * ds * spp);
+	std::fill(acc.begin(), acc.end(), 0);
+      }
+    }
+  }
+
+  return 0;
+}
+
+// mode of the w x h source block at (sx, sy). A box is needed whole, so
+// this reads whole rows of boxes, or runs of boxes along a row when a
+// row of them is over the strip size (always at least one box)
+template <typename T>
+static int __mode_region(const TiffReader& reader, size_t dir, uint64_t sx, uint64_t sy,
+			 uint64_t w, uint64_t h, uint64_t spp, uint32_t f, T* dst, uint64_t ds) {
+
+  uint64_t box_row_bytes = static_cast<uint64_t>(f) * w * spp * sizeof(T);
+  uint64_t box_bytes = static_cast<uint64_t>(f) * f * spp * sizeof(T);
+
+  uint64_t rows = f, cols = w;
+  if (box_row_bytes <= SCALE_STRIP_BYTES)
+    rows = SCALE_STRIP_BYTES / box_row_bytes * f;
+  else
+    cols = std::max<uint64_t>(1, SCALE_STRIP_BYTES / box_bytes) * f;
+  rows = std::min(rows, h);
+  cols = std::min(cols, w);
+
+  TileBuffer strip = TileBufferPool::Global().Get(rows * cols * spp * sizeof(T));
+  if (!strip)
+    return 1;
+
+  for (uint64_t y0 = 0; y0 < h; y0 += rows) {
+    for (uint64_t x0 = 0; x0 < w; x0 += cols) {
+      uint64_t bw = std::min(cols, w - x0);
+      uint64_t bh = std::min(rows, h - y0);
+      if (reader.ReadRegion(dir, sx + x0, sy + y0, bw, bh, strip.data()))
+	return 1;
+      __mode<T>(strip.as<T>(), bw, bw, bh, spp, f, dst + (y0 / f * ds + x0 / f) * spp, ds);
+    }
+  }
+
+  return 0;
+}
+
+template <typename T>
+static int __scale_region(const TiffReader& reader, size_t dir, uint64_t sx, uint64_t sy,
+			  uint64_t w, uint64_t h, uint64_t spp, uint32_t f, bool mode,
+			  void* dst, uint64_t ds) {
+
+  T* d = static_cast<T*>(dst);
+  
+  if (mode)
+    return __mode_region<T>(reader, dir, sx, sy, w, h, spp, f, d, ds);
+  else if (sizeof(T) <= 2 && f <= 256)
+    return __box_region<T, uint32_t>(reader, dir, sx, sy, w, h, spp, f, d, ds);
+  return __box_region<T, uint64_t>(reader, dir, sx, sy, w, h, spp, f, d, ds);
+}
+
+int ScaleRegion(const TiffReader& reader, size_t dir, uint64_t x, uint64_t y,
+		uint64_t w, uint64_t h, uint32_t factor, bool mode, void* dst,
+		uint64_t dst_stride) {
+
+  const TiffIFD& ifd = reader.IFD(dir);
+  uint64_t spp = ifd.samples_per_pixel;
+
+  if (factor == 0) {
+    fprintf(stderr, "ERROR: scale factor must be at least 1\n");
+    return 1;
+  }
+  
+  switch (ifd.bits_per_sample) {
+  case 8:
+    return __scale_region<uint8_t>(reader, dir, x, y, w, h, spp, factor, mode, dst, dst_stride);
+  case 16:
+    return __scale_region<uint16_t>(reader, dir, x, y, w, h, spp, factor, mode, dst, dst_stride);
+  case 32:
+    return __scale_region<uint32_t>(reader, dir, x, y, w, h, spp, factor, mode, dst, dst_stride);
+  default:
+    fprintf(stderr, "ERROR: unable to scale %llu bits per sample\n",
+	    static_cast<unsigned long long>(ifd.bits_per_sample));
+    return 1;
+  }
+}
+
+int ScaleTiles(const TiffReader& reader, size_t dir, TIFF* out, uint32_t factor,
+	       bool mode, size_t threads) {
+
+  const TiffIFD& ifd = reader.IFD(dir);
+
+  if (factor == 0) {
+    fprintf(stderr, "ERROR: scale factor must be at least 1\n");
+    return 1;
+  }
+  if (ifd.sample_format == SAMPLEFORMAT_IEEEFP || ifd.sample_format == SAMPLEFORMAT_INT) {
+    fprintf(stderr, "ERROR: scaling only supports unsigned integer samples\n");
+    return 1;
+  }
+  if (ifd.samples_per_pixel > 1 && ifd.planar == PLANARCONFIG_SEPARATE) {
+    fprintf(stderr, "ERROR: scaling needs interleaved (contiguous) samples\n");
+    return 1;
+  }
+
+  uint64_t bps = ifd.bits_per_sample;
+  uint64_t spp = ifd.samples_per_pixel;
+  uint64_t width = (ifd.width + factor - 1) / factor;
+  uint64_t height = (ifd.height + factor - 1) / factor;
+
+  // same tiling as the source if it has one
+  uint32_t tw = ifd.tile_width ? ifd.tile_width : 256;
+  uint32_t th = ifd.tile_height ? ifd.tile_height : 256;
+
+  TIFFSetField(out, TIFFTAG_IMAGEWIDTH, static_cast<uint32_t>(width));
+  TIFFSetField(out, TIFFTAG_IMAGELENGTH, static_cast<uint32_t>(height));
+  TIFFSetField(out, TIFFTAG_TILEWIDTH, tw);
+  TIFFSetField(out, TIFFTAG_TILELENGTH, th);
+  TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, static_cast<uint16_t>(bps));
+  TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, static_cast<uint16_t>(spp));
+  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, ifd.photometric);
+  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  if (ifd.sample_format)
+    TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, static_cast<uint16_t>(ifd.sample_format));
+
+  // the source's compression and predictor
+  TIFFSetField(out, TIFFTAG_COMPRESSION, ifd.compression ? ifd.compression : COMPRESSION_NONE);
+  if (ifd.predictor)
+    TIFFSetField(out, TIFFTAG_PREDICTOR, ifd.predictor);
+  KeepTileCompression(out);
+  
+  uint64_t bytes_pp = bps * spp / 8;
+  uint32_t tiles_across = (width + tw - 1) / tw;
+  uint64_t src_w = static_cast<uint64_t>(tw) * factor;
+  uint64_t src_h = static_cast<uint64_t>(th) * factor;
+
+  if (bps != 8 && bps != 16 && bps != 32) {
+    fprintf(stderr, "ERROR: unable to scale %llu bits per sample\n",
+	    static_cast<unsigned long long>(bps));
+    return 1;
+  }
+  
+  TileFillFunc fill = [&](uint32_t tile, uint8_t* buf) {
+
+    uint64_t ox = static_cast<uint64_t>(tile % tiles_across) * tw;
+    uint64_t oy = static_cast<uint64_t>(tile / tiles_across) * th;
+
+    // the source pixels under this output tile, clipped to the image
+    uint64_t sx = ox * factor, sy = oy * factor;
+    uint64_t w = std::min<uint64_t>(src_w, ifd.width - sx);
+    uint64_t h = std::min<uint64_t>(src_h, ifd.height - sy);
+
+    memset(buf, 0, static_cast<uint64_t>(tw) * th * bytes_pp);
+    return ScaleRegion(reader, dir, sx, sy, w, h, factor, mode, buf, tw);
+  };
+
+  return WriteTilesParallel(out, fill, threads);
+}
@@ -0,0 +1,40 @@
+#ifndef TIFF_SCALE_H
+#define TIFF_SCALE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <tiffio.h>
+
+class TiffReader;
+
+// most source bytes ScaleTiles reads at once for an output tile. Box
+// sums are carried from strip to strip, so this bounds the memory per
+// tile whatever the factor (mode needs whole boxes, so one box is the floor)
+#define SCALE_STRIP_BYTES (4ULL << 20)
+
+// downsample a w x h block of interleaved pixels (spp samples of bps bits)
+// by an integer factor, into a ceil(w/f) x ceil(h/f) block. Box mode
+// averages each f x f box (rounded), mode mode takes its most common
+// value (for label images, ties go to the smaller value). Boxes cut off
+// by the edge only use the pixels they cover. Strides are in pixels.
+// bps must be 8, 16 or 32 (unsigned). Returns 0 on success
+int ScaleBuffer(const void* src, uint64_t src_stride, uint64_t w, uint64_t h,
+		uint64_t spp, uint64_t bps, uint32_t factor, bool mode,
+		void* dst, uint64_t dst_stride);
+
+// downsample the w x h region at (x, y) of directory dir of reader by
+// factor, as ScaleBuffer, into dst (dst_stride pixels a row). The region
+// is read in strips of at most SCALE_STRIP_BYTES and must lie inside the
+// image. Returns 0 on success
+int ScaleRegion(const TiffReader& reader, size_t dir, uint64_t x, uint64_t y,
+		uint64_t w, uint64_t h, uint32_t factor, bool mode, void* dst,
+		uint64_t dst_stride);
+
+// write directory dir of reader, downsampled by factor, to the current
+// directory of out. Works one output tile at a time, reading the source
+// under it in strips of at most SCALE_STRIP_BYTES. Sets the size,
+// tiling and pixel tags on out. Returns 0 on success
+int ScaleTiles(const TiffReader& reader, size_t dir, TIFF* out, uint32_t factor,
+	       bool mode, size_t threads);
+
+#endif
@@ -0,0 +1,546 @@
+#include "tiff_serve.h"
+#include "tiff_reader.h"
+#include "tiff_colorize.h"
+#include "tiff_encode.h"
+#include "tiff_scale.h"
+#include "tiff_dzi.h"
+#include "tiff_tile_cache.h"
+#include "tiff_buffer_pool.h"
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cstring>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// longest request we read, headers included
+#define SERVE_MAX_REQUEST 16384
+
+// give up on a client that stops sending
+#define SERVE_TIMEOUT_SEC 10
+
+namespace {
+
+// a palette resolved against the image, and the key it is cached under
+struct Style {
+  std::string key;
+  std::vector<size_t> dirs;
+  std::unique_ptr<ColorizeKernel> kernel;
+};
+
+typedef std::shared_ptr<const Style> StylePtr;
+
+struct RenderedTile {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<uint8_t> rgb;
+  std::vector<uint8_t> encoded;
+};
+
+typedef std::shared_ptr<const RenderedTile> RenderedTilePtr;
+
+struct Response {
+  int status = 200;
+  std::string type = "text/plain";
+  std::string body;
+  RenderedTilePtr tile;
+};
+
+static std::string __url_decode(const std::string& s) {
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++) {
+    if (s[i] == '+')
+      out += ' ';
+    else if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) && isxdigit(s[i + 2])) {
+      out += static_cast<char>(std::stoi(s.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else
+      out += s[i];
+  }
+  return out;
+}
+
+// name=value pairs of a query string, decoded
+static std::vector<std::pair<std::string, std::string>> __parse_query(const std::string& q) {
+  std::vector<std::pair<std::string, std::string>> params;
+  std::istringstream in(q);
+  std::string pair;
+  while (std::getline(in, pair, '&')) {
+    size_t eq = pair.find('=');
+    if (eq == std::string::npos)
+      params.emplace_back(__url_decode(pair), "");
+    else
+      params.emplace_back(__url_decode(pair.substr(0, eq)), __url_decode(pair.substr(eq + 1)));
+  }
+  return params;
+}
+
+static const char* __status_text(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 400: return "Bad Request";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  default: return "Internal Server Error";
+  }
+}
+
+static const char* __content_type(const std::string& ext) {
+  if (ext == "png")
+    return "image/png";
+  if (ext == "webp")
+    return "image/webp";
+  return "image/jpeg";
+}
+
+static bool __send_all(int fd, const char* data, size_t len) {
+  while (len) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+class TileServer {
+
+ public:
+
+  TileServer(const TiffReader& reader, const ChannelVector& palette,
+	     const std::vector<int>& channels, uint32_t tile_size, const std::string& ext,
+	     int quality, size_t cache_mb, bool verbose);
+
+  int Init();
+
+  void Handle(int fd);
+
+ private:
+
+  const TiffReader& m_reader;
+  const ChannelVector& m_palette;
+  std::vector<int> m_channels;
+  uint32_t m_size;
+  std::string m_ext;
+  int m_quality;
+  bool m_verbose;
+
+  // width and height of every level, full resolution last
+  std::vector<std::pair<uint64_t, uint64_t>> m_levels;
+
+  std::string m_descriptor;
+
+  // kernels by palette, and tiles by palette, level and position
+  LRUCache<std::string, StylePtr> m_styles;
+  LRUCache<std::string, RenderedTilePtr> m_tiles;
+
+  // palette of a request, or an error message
+  StylePtr __style(const std::string& query, std::string& error);
+
+  RenderedTilePtr __tile(const StylePtr& style, size_t l, uint64_t tx, uint64_t ty);
+
+  RenderedTilePtr __render(const StylePtr& style, size_t l, uint64_t tx, uint64_t ty);
+
+  // the most 2x reductions of the image's SubIFD pyramid (0 for full
+  // resolution) that every one of dirs has, up to a reduction of f
+  size_t __pyramid_level(const std::vector<size_t>& dirs, uint32_t f) const;
+
+  Response __route(const std::string& method, const std::string& target);
+
+};
+
+TileServer::TileServer(const TiffReader& reader, const ChannelVector& palette,
+		       const std::vector<int>& channels, uint32_t tile_size,
+		       const std::string& ext, int quality, size_t cache_mb, bool verbose) :
+  m_reader(reader), m_palette(palette), m_channels(channels), m_size(tile_size), m_ext(ext),
+  m_quality(quality), m_verbose(verbose),
+  // palettes are counted rather than sized, the tables are small
+  m_styles(64, [](const StylePtr& s) { return s ? 1 : 0; }),
+  m_tiles(cache_mb * 1024 * 1024, [](const RenderedTilePtr& t) {
+      return t ? t->rgb.size() + t->encoded.size() : 0; }) {}
+
+int TileServer::Init() {
+
+  if (!m_reader.NumDirs()) {
+    fprintf(stderr, "ERROR: no directories to serve\n");
+    return 1;
+  }
+
+  const TiffIFD& ifd = m_reader.IFD(0);
+  size_t num_levels = DeepZoomLevels(ifd.width, ifd.height);
+  m_levels.resize(num_levels);
+  uint64_t w = ifd.width, h = ifd.height;
+  for (size_t l = num_levels; l-- > 0;) {
+    m_levels[l] = std::make_pair(w, h);
+    w = (w + 1) / 2;
+    h = (h + 1) / 2;
+  }
+
+  m_descriptor = DeepZoomDescriptor(ifd.width, ifd.height, m_size, m_ext);
+
+  // the default palette has to work, or nothing will
+  std::string error;
+  if (!__style("", error)) {
+    fprintf(stderr, "ERROR: %s\n", error.c_str());
+    return 1;
+  }
+
+  return 0;
+}
+
+StylePtr TileServer::__style(const std::string& query, std::string& error) {
+
+  ChannelVector selected;
+  std::vector<size_t> dirs;
+  std::string palette, channels;
+  for (auto& p : __parse_query(query)) {
+    if (p.first == "palette")
+      palette = p.second;
+    else if (p.first == "channels")
+      channels = p.second;
+  }
+
+  try {
+    if (!palette.empty()) {
+      // rows separated by ; or newlines, each row naming its directory
+      std::replace(palette.begin(), palette.end(), ';', '\n');
+      std::istringstream in(palette);
+      std::string row;
+      while (std::getline(in, row)) {
+	if (!row.empty() && row.back() == '\r')
+	  row.pop_back();
+	if (row.empty())
+	  continue;
+	selected.emplace_back(row);
+	dirs.push_back(selected.back().channelNumber);
+      }
+    } else {
+      // channels by number or name, colored by the palette row of their name
+      std::vector<int> rows = m_channels;
+      if (!channels.empty()) {
+	rows.clear();
+	std::istringstream in(channels);
+	std::vector<std::string> tokens;
+	std::string token;
+	while (std::getline(in, token, ','))
+	  tokens.push_back(token);
+	if (m_reader.ResolveChannels(tokens, rows)) {
+	  error = "unknown channel in " + channels;
+	  return StylePtr();
+	}
+      } else if (rows.empty()) {
+	for (size_t n = 0; n < m_palette.size() && n < m_reader.NumDirs(); n++)
+	  rows.push_back(n);
+      }
+      for (auto n : rows) {
+	const Channel* row = n < 0 ? NULL : FindPaletteRow(m_palette, n, m_reader.ChannelNames());
+	if (!row) {
+	  error = "channel " + std::to_string(n) + " is not in the palette";
+	  return StylePtr();
+	}
+	selected.push_back(*row);
+	dirs.push_back(n);
+      }
+    }
+  } catch (const std::exception& e) {
+    error = "bad palette or channels";
+    return StylePtr();
+  }
+
+  if (selected.empty()) {
+    error = "no channels selected";
+    return StylePtr();
+  }
+  const TiffIFD& full = m_reader.IFD(0);
+  for (auto d : dirs) {
+    if (d >= m_reader.NumDirs()) {
+      error = "channel " + std::to_string(d) + " is not in the image of " +
+	std::to_string(m_reader.NumDirs()) + " channels";
+      return StylePtr();
+    }
+    // every level renders from 16-bit planes the size of the first
+    const TiffIFD& ifd = m_reader.IFD(d);
+    if (ifd.bits_per_sample != 16 || ifd.samples_per_pixel != 1 ||
+	ifd.width != full.width || ifd.height != full.height) {
+      error = "channel " + std::to_string(d) + " is not 16-bit single sample at full size";
+      return StylePtr();
+    }
+  }
+
+  // the same palette spelled differently shares its tiles
+  std::ostringstream key;
+  for (size_t i = 0; i < selected.size(); i++) {
+    const Channel& c = selected[i];
+    key << dirs[i] << ":" << int(c.color.r) << "," << int(c.color.g) << "," <<
+      int(c.color.b) << "," << c.lowerBound << "," << c.upperBound << ";";
+  }
+
+  return m_styles.GetOrLoad(key.str(), [&]() {
+      std::shared_ptr<Style> s = std::make_shared<Style>();
+      s->key = key.str();
+      s->dirs = dirs;
+      s->kernel.reset(new ColorizeKernel(selected));
+      return StylePtr(s);
+    });
+}
+
+RenderedTilePtr TileServer::__tile(const StylePtr& style, size_t l, uint64_t tx, uint64_t ty) {
+  std::string key = style->key + std::to_string(l) + "/" + std::to_string(tx) + "_" +
+    std::to_string(ty);
+  return m_tiles.GetOrLoad(key, [&]() { return __render(style, l, tx, ty); });
+}
+
+size_t TileServer::__pyramid_level(const std::vector<size_t>& dirs, uint32_t f) const {
+
+  // only levels every channel has, of the size a 2x pyramid gives
+  const TiffIFD& full = m_reader.IFD(0);
+  size_t k = 0;
+  while ((2u << k) <= f) {
+    uint64_t w = (full.width + (2ULL << k) - 1) >> (k + 1);
+    uint64_t h = (full.height + (2ULL << k) - 1) >> (k + 1);
+    for (auto d : dirs) {
+      if (m_reader.NumLevels(d) <= k)
+	return k;
+      const TiffIFD& ifd = m_reader.IFD(m_reader.LevelDir(d, k + 1));
+      if (ifd.width != w || ifd.height != h || ifd.bits_per_sample != 16 ||
+	  ifd.samples_per_pixel != 1)
+	return k;
+    }
+    k++;
+  }
+  return k;
+}
+
+RenderedTilePtr TileServer::__render(const StylePtr& style, size_t l, uint64_t tx, uint64_t ty) {
+
+  uint64_t lw = m_levels[l].first, lh = m_levels[l].second;
+
+  std::shared_ptr<RenderedTile> tile = std::make_shared<RenderedTile>();
+  tile->width = std::min<uint64_t>(m_size, lw - tx * m_size);
+  tile->height = std::min<uint64_t>(m_size, lh - ty * m_size);
+  tile->rgb.assign(static_cast<size_t>(tile->width) * tile->height * 3, 0);
+
+  if (l + 1 == m_levels.size()) {
+    // only the image tiles under this one are decoded, and they stay in
+    // the tile cache for the next palette
+    if (ColorizeRegion(m_reader, style->dirs, *style->kernel, tx * m_size, ty * m_size,
+		       tile->width, tile->height, tile->rgb.data(), 1))
+      return RenderedTilePtr();
+  } else {
+
+    // a pixel here is f x f at full resolution. Start from the pyramid
+    // level nearest that and box-reduce by what is left, one channel at
+    // a time, then colorize
+    uint32_t f = 1u << (m_levels.size() - 1 - l);
+    size_t k = __pyramid_level(style->dirs, f);
+    uint32_t r = f >> k;
+
+    size_t nc = style->dirs.size();
+    uint64_t n = static_cast<uint64_t>(tile->width) * tile->height;
+    std::vector<TileBuffer> planes(nc);
+    std::vector<const uint16_t*> ptrs(nc);
+    for (size_t c = 0; c < nc; c++) {
+      size_t dir = k ? m_reader.LevelDir(style->dirs[c], k) : style->dirs[c];
+      const TiffIFD& ifd = m_reader.IFD(dir);
+      uint64_t sx = tx * m_size * r, sy = ty * m_size * r;
+      uint64_t sw = std::min<uint64_t>(static_cast<uint64_t>(m_size) * r, ifd.width - sx);
+      uint64_t sh = std::min<uint64_t>(static_cast<uint64_t>(m_size) * r, ifd.height - sy);
+      planes[c] = TileBufferPool::Global().Get(n * sizeof(uint16_t));
+      if (!planes[c] ||
+	  ScaleRegion(m_reader, dir, sx, sy, sw, sh, r, false, planes[c].data(), tile->width))
+	return RenderedTilePtr();
+      ptrs[c] = planes[c].as<uint16_t>();
+    }
+    style->kernel->Apply(ptrs.data(), n, tile->rgb.data());
+  }
+
+  if (EncodeRGB("." + m_ext, tile->rgb.data(), tile->width, tile->height, tile->encoded,
+		m_quality))
+    return RenderedTilePtr();
+
+  return tile;
+}
+
+Response TileServer::__route(const std::string& method, const std::string& target) {
+
+  Response r;
+  if (method != "GET") {
+    r.status = 405;
+    r.body = "only GET is supported\n";
+    return r;
+  }
+
+  size_t qpos = target.find('?');
+  std::string path = target.substr(0, qpos);
+  std::string query = qpos == std::string::npos ? "" : target.substr(qpos + 1);
+
+  if (path == "/image.dzi") {
+    r.type = "application/xml";
+    r.body = m_descriptor;
+    return r;
+  }
+
+  // /image_files/<level>/<col>_<row>.<ext>
+  const std::string prefix = "/image_files/";
+  unsigned long l, tx, ty;
+  char ext[8] = {0};
+  char tail;
+  if (path.compare(0, prefix.size(), prefix) != 0 ||
+      sscanf(path.c_str() + prefix.size(), "%lu/%lu_%lu.%7[a-z]%c", &l, &tx, &ty, ext, &tail) != 4 ||
+      m_ext != ext || l >= m_levels.size() ||
+      tx * m_size >= m_levels[l].first || ty * m_size >= m_levels[l].second) {
+    r.status = 404;
+    r.body = "no such tile or file: " + path + "\n";
+    return r;
+  }
+
+  std::string error;
+  StylePtr style = __style(query, error);
+  if (!style) {
+    r.status = 400;
+    r.body = error + "\n";
+    return r;
+  }
+
+  r.tile = __tile(style, l, tx, ty);
+  if (!r.tile) {
+    r.status = 500;
+    r.body = "unable to render tile\n";
+    return r;
+  }
+  r.type = __content_type(m_ext);
+  return r;
+}
+
+void TileServer::Handle(int fd) {
+
+  auto start = std::chrono::steady_clock::now();
+
+  timeval tv = {SERVE_TIMEOUT_SEC, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // we only need the request line, but read the headers so the
+  // client isn't reset when we close
+  std::string req;
+  char buf[4096];
+  while (req.find("\r\n\r\n") == std::string::npos && req.size() < SERVE_MAX_REQUEST) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+      return;
+    req.append(buf, n);
+  }
+
+  std::istringstream line(req.substr(0, req.find("\r\n")));
+  std::string method, target;
+  line >> method >> target;
+
+  Response r;
+  if (target.empty() || target[0] != '/') {
+    r.status = 400;
+    r.body = "bad request\n";
+  } else
+    r = __route(method, target);
+
+  const char* body = r.tile ? reinterpret_cast<const char*>(r.tile->encoded.data()) : r.body.data();
+  size_t len = r.tile ? r.tile->encoded.size() : r.body.size();
+
+  // tile URLs carry their palette, so a tile never changes
+  std::ostringstream head;
+  head << "HTTP/1.1 " << r.status << " " << __status_text(r.status) << "\r\n"
+       << "Content-Type: " << r.type << "\r\n"
+       << "Content-Length: " << len << "\r\n"
+       << "Access-Control-Allow-Origin: *\r\n"
+       << (r.status == 200 ? "Cache-Control: max-age=3600\r\n" : "Cache-Control: no-store\r\n")
+       << "Connection: close\r\n\r\n";
+  std::string h = head.str();
+  if (__send_all(fd, h.data(), h.size()))
+    __send_all(fd, body, len);
+
+  if (m_verbose) {
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << method << " " << target.substr(0, target.find('?')) << " " << r.status <<
+      " " << ms << " ms" << std::endl;
+  }
+}
+
+}
+
+int ServeTiles(const TiffReader& reader, const std::string& palette_file,
+	       const std::vector<int>& channels, int port, uint32_t tile_size,
+	       const std::string& ext, int quality, size_t cache_mb, bool verbose,
+	       size_t threads) {
+
+  if (!tile_size || tile_size % 2) {
+    fprintf(stderr, "ERROR: Deep Zoom tiles must have an even size, got %u\n", tile_size);
+    return 1;
+  }
+  if (!IsRGBImageFile("." + ext)) {
+    fprintf(stderr, "ERROR: unknown tile format %s, use jpg, png or webp\n", ext.c_str());
+    return 1;
+  }
+
+  ChannelVector palette;
+  if (ReadPalette(palette_file, palette))
+    return 1;
+
+  threads = std::max<size_t>(threads, 1);
+  TileServer server(reader, palette, channels, tile_size, ext, quality, cache_mb, verbose);
+  if (server.Init())
+    return 1;
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    fprintf(stderr, "ERROR: unable to open socket: %s\n", strerror(errno));
+    return 1;
+  }
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  // loopback only, this is for a viewer on the same machine
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) || listen(sock, 64)) {
+    fprintf(stderr, "ERROR: unable to listen on 127.0.0.1:%d: %s\n", port, strerror(errno));
+    close(sock);
+    return 1;
+  }
+
+  if (verbose)
+    std::cerr << "Serving on http://127.0.0.1:" << port << "/image.dzi with " << threads <<
+      " threads" << std::endl;
+
+  // every thread takes its own connections
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads; i++)
+    workers.emplace_back([&server, sock]() {
+	while (true) {
+	  int fd = accept(sock, nullptr, nullptr);
+	  if (fd < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+	      continue;
+	    fprintf(stderr, "ERROR: accept failed: %s\n", strerror(errno));
+	    return;
+	  }
+	  server.Handle(fd);
+	  close(fd);
+	}
+      });
+
+  for (auto& w : workers)
+    w.join();
+
+  close(sock);
+  return 1;
+}
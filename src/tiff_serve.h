@@ -0,0 +1,37 @@
+#ifndef TIFF_SERVE_H
+#define TIFF_SERVE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class TiffReader;
+
+// default port of the tile server, always on the loopback address
+#define SERVE_PORT 8080
+
+// default budget for rendered tiles, in MB
+#define SERVE_CACHE_MB 256
+
+// serve reader as a Deep Zoom image over HTTP on 127.0.0.1:port, rendering
+// tiles on demand. Answers
+//   GET /image.dzi                          the descriptor
+//   GET /image_files/<level>/<col>_<row>.<ext>  a tile
+// Tiles take the palette from the query string, so a viewer can change
+// it without a restart:
+//   palette=<row>;<row>...   rows as in a palette file, number,name,r,g,b,lower,upper,
+//                            where number is the directory
+//   channels=0,2,3           rows of palette_file instead
+// and otherwise use the rows of palette_file picked by channels (every
+// row if channels is empty). Full resolution tiles are colorized from the
+// shared tile cache. The rest are box-reduced from the SubIFD pyramid
+// level nearest them (from full resolution if there is none), and then
+// colorized. Rendered tiles are kept per palette in an LRU cache of cache_mb.
+// threads connections are handled at once. Only returns on error
+int ServeTiles(const TiffReader& reader, const std::string& palette_file,
+	       const std::vector<int>& channels, int port, uint32_t tile_size,
+	       const std::string& ext, int quality, size_t cache_mb, bool verbose,
+	       size_t threads);
+
+#endif
@@ -0,0 +1,284 @@
+#include "tiff_table.h"
+#include "tiff_csv.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// a deflated column is only kept if it is at most this much of the raw
+#define TABLE_ZLIB_KEEP 0.9
+
+static size_t __type_size(TableType t) {
+  return t == TABLE_INT32 || t == TABLE_FLOAT32 ? 4 : 8;
+}
+
+static uint32_t __get32(const uint8_t* p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t __get64(const uint8_t* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void __put32(uint8_t* p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static void __put64(uint8_t* p, uint64_t v) {
+  for (int i = 0; i < 8; i++)
+    p[i] = (v >> (8 * i)) & 0xff;
+}
+
+ColumnTable::~ColumnTable() {
+  if (m_map)
+    munmap(const_cast<uint8_t*>(m_map), m_size);
+}
+
+bool ColumnTable::IsColumnTable(const std::string& file) {
+  char magic[8];
+  FILE* fp = fopen(file.c_str(), "rb");
+  if (!fp)
+    return false;
+  bool is = fread(magic, 1, 8, fp) == 8 && memcmp(magic, TABLE_MAGIC, 8) == 0;
+  fclose(fp);
+  return is;
+}
+
+int ColumnTable::Open(const std::string& file) {
+
+  m_file = file;
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: unable to open %s\n", file.c_str());
+    return 1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < TABLE_HEADER_BYTES) {
+    fprintf(stderr, "ERROR: %s is too small to be a column table\n", file.c_str());
+    close(fd);
+    return 1;
+  }
+  m_size = st.st_size;
+  void* map = mmap(NULL, m_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ERROR: unable to map %s\n", file.c_str());
+    m_size = 0;
+    return 1;
+  }
+  m_map = static_cast<const uint8_t*>(map);
+
+  if (memcmp(m_map, TABLE_MAGIC, 8) != 0 || __get32(m_map + 8) != TABLE_VERSION) {
+    fprintf(stderr, "ERROR: %s is not a version %d column table\n", file.c_str(), TABLE_VERSION);
+    return 1;
+  }
+  uint32_t num_columns = __get32(m_map + 12);
+  m_rows = __get64(m_map + 16);
+  if (TABLE_HEADER_BYTES + static_cast<uint64_t>(num_columns) * TABLE_ENTRY_BYTES > m_size) {
+    fprintf(stderr, "ERROR: %s is truncated\n", file.c_str());
+    return 1;
+  }
+
+  for (uint32_t c = 0; c < num_columns; c++) {
+    const uint8_t* e = m_map + TABLE_HEADER_BYTES + c * TABLE_ENTRY_BYTES;
+    std::unique_ptr<Column> col(new Column);
+    col->name.assign(reinterpret_cast<const char*>(e),
+		     strnlen(reinterpret_cast<const char*>(e), TABLE_NAME_BYTES));
+    col->type = static_cast<TableType>(e[TABLE_NAME_BYTES]);
+    col->compression = static_cast<TableCompression>(e[TABLE_NAME_BYTES + 1]);
+    col->offset = __get64(e + 56);
+    col->stored = __get64(e + 64);
+    col->raw = __get64(e + 72);
+    if (col->type < TABLE_INT32 || col->type > TABLE_FLOAT64 ||
+	col->compression > TABLE_ZLIB || col->raw != m_rows * __type_size(col->type) ||
+	col->offset + col->stored > m_size ||
+	(col->compression == TABLE_RAW && col->stored != col->raw)) {
+      fprintf(stderr, "ERROR: column %u of %s is corrupt\n", c, file.c_str());
+      return 1;
+    }
+    m_columns.push_back(std::move(col));
+  }
+
+  return 0;
+}
+
+int ColumnTable::Find(const std::string& name) const {
+  for (size_t c = 0; c < m_columns.size(); c++)
+    if (m_columns[c]->name == name)
+      return c;
+  return -1;
+}
+
+const void* ColumnTable::data(size_t c) const {
+
+  const Column& col = *m_columns[c];
+  if (col.compression == TABLE_RAW)
+    return m_map + col.offset;
+
+  std::call_once(col.once, [this, &col]() {
+      col.inflated.resize(col.raw);
+      uLongf len = col.raw;
+      if (uncompress(col.inflated.data(), &len, m_map + col.offset, col.stored) != Z_OK ||
+	  len != col.raw) {
+	fprintf(stderr, "ERROR: unable to inflate column %s of %s\n", col.name.c_str(),
+		m_file.c_str());
+	std::vector<uint8_t>().swap(col.inflated);
+      }
+    });
+  return col.inflated.empty() && col.raw ? NULL : col.inflated.data();
+}
+
+std::vector<double> ColumnTable::Doubles(size_t c) const {
+
+  std::vector<double> out;
+  const void* p = data(c);
+  if (!p)
+    return out;
+
+  out.resize(m_rows);
+  switch (type(c)) {
+  case TABLE_INT32:
+    std::copy_n(static_cast<const int32_t*>(p), m_rows, out.begin());
+    break;
+  case TABLE_INT64:
+    std::copy_n(static_cast<const int64_t*>(p), m_rows, out.begin());
+    break;
+  case TABLE_FLOAT32:
+    std::copy_n(static_cast<const float*>(p), m_rows, out.begin());
+    break;
+  case TABLE_FLOAT64:
+    std::copy_n(static_cast<const double*>(p), m_rows, out.begin());
+    break;
+  }
+  return out;
+}
+
+// a column converted to its stored type, and deflated if that pays
+struct EncodedColumn {
+  TableType type;
+  TableCompression compression = TABLE_RAW;
+  std::vector<uint8_t> bytes;
+  uint64_t raw = 0;
+};
+
+static int __encode_column(const CsvColumn& in, bool doubles, int zip_level,
+			   EncodedColumn& out) {
+
+  size_t n = in.values.size();
+  if (in.integer) {
+    bool fits = true;
+    for (auto v : in.values)
+      fits = fits && v >= INT32_MIN && v <= INT32_MAX;
+    out.type = fits ? TABLE_INT32 : TABLE_INT64;
+  } else
+    out.type = doubles ? TABLE_FLOAT64 : TABLE_FLOAT32;
+
+  out.raw = n * __type_size(out.type);
+  out.bytes.resize(out.raw);
+  uint8_t* b = out.bytes.data();
+  for (size_t i = 0; i < n; i++) {
+    double v = in.values[i];
+    switch (out.type) {
+    case TABLE_INT32: { int32_t x = v; memcpy(b + i * 4, &x, 4); break; }
+    case TABLE_INT64: { int64_t x = v; memcpy(b + i * 8, &x, 8); break; }
+    case TABLE_FLOAT32: { float x = v; memcpy(b + i * 4, &x, 4); break; }
+    case TABLE_FLOAT64: memcpy(b + i * 8, &v, 8); break;
+    }
+  }
+
+  if (zip_level > 0 && out.raw) {
+    uLongf len = compressBound(out.raw);
+    std::vector<uint8_t> z(len);
+    int status = compress2(z.data(), &len, out.bytes.data(), out.raw, zip_level);
+    if (status != Z_OK) {
+      fprintf(stderr, "ERROR: zlib compression failed with status %d\n", status);
+      return 1;
+    }
+    if (len <= TABLE_ZLIB_KEEP * out.raw) {
+      z.resize(len);
+      out.bytes.swap(z);
+      out.compression = TABLE_ZLIB;
+    }
+  }
+
+  return 0;
+}
+
+int WriteColumnTable(const CsvTable& table, const std::string& file, bool doubles,
+		     int zip_level, size_t threads) {
+
+  size_t nc = table.columns.size();
+  for (auto& c : table.columns) {
+    if (c.name.size() >= TABLE_NAME_BYTES) {
+      fprintf(stderr, "ERROR: column name %s is longer than %d characters\n", c.name.c_str(),
+	      TABLE_NAME_BYTES - 1);
+      return 1;
+    }
+  }
+
+  std::vector<EncodedColumn> enc(nc);
+  int err = 0;
+#pragma omp parallel for num_threads(std::max<size_t>(threads, 1)) schedule(dynamic, 1) reduction(|:err)
+  for (size_t c = 0; c < nc; c++)
+    err |= __encode_column(table.columns[c], doubles, zip_level, enc[c]);
+  if (err)
+    return 1;
+
+  // lay the columns out after the header
+  std::vector<uint8_t> header(TABLE_HEADER_BYTES + nc * TABLE_ENTRY_BYTES, 0);
+  memcpy(header.data(), TABLE_MAGIC, 8);
+  __put32(header.data() + 8, TABLE_VERSION);
+  __put32(header.data() + 12, nc);
+  __put64(header.data() + 16, table.rows());
+
+  std::vector<uint64_t> offsets(nc);
+  uint64_t offset = header.size();
+  for (size_t c = 0; c < nc; c++) {
+    offset = (offset + TABLE_ALIGN - 1) / TABLE_ALIGN * TABLE_ALIGN;
+    offsets[c] = offset;
+    offset += enc[c].bytes.size();
+
+    uint8_t* e = header.data() + TABLE_HEADER_BYTES + c * TABLE_ENTRY_BYTES;
+    memcpy(e, table.columns[c].name.data(), table.columns[c].name.size());
+    e[TABLE_NAME_BYTES] = enc[c].type;
+    e[TABLE_NAME_BYTES + 1] = enc[c].compression;
+    __put64(e + 56, offsets[c]);
+    __put64(e + 64, enc[c].bytes.size());
+    __put64(e + 72, enc[c].raw);
+  }
+
+  FILE* fp = fopen(file.c_str(), "wb");
+  if (!fp) {
+    fprintf(stderr, "ERROR: unable to open %s for writing\n", file.c_str());
+    return 1;
+  }
+  bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size();
+  uint64_t pos = header.size();
+  static const uint8_t zeros[TABLE_ALIGN] = {0};
+  for (size_t c = 0; c < nc && ok; c++) {
+    ok = fwrite(zeros, 1, offsets[c] - pos, fp) == offsets[c] - pos &&
+      fwrite(enc[c].bytes.data(), 1, enc[c].bytes.size(), fp) == enc[c].bytes.size();
+    pos = offsets[c] + enc[c].bytes.size();
+  }
+  ok = fclose(fp) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "ERROR: unable to write %s\n", file.c_str());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,116 @@
+#ifndef TIFF_TABLE_H
+#define TIFF_TABLE_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+struct CsvTable;
+
+// A column table (.ctab) is a cell table laid out so that it can be
+// memory mapped and used in place. All values are little-endian:
+//
+//   0    char[8]   "TIFFOTAB"
+//   8    uint32    version (1)
+//   12   uint32    number of columns
+//   16   uint64    number of rows
+//   24   uint64    reserved
+//   32   one 80-byte entry per column:
+//          char[48] name, NUL padded
+//          uint8    type (TABLE_INT32, ...)
+//          uint8    compression (TABLE_RAW or TABLE_ZLIB)
+//          uint8[6] reserved
+//          uint64   offset of the data in the file
+//          uint64   bytes stored
+//          uint64   bytes once inflated (rows * size of type)
+//
+// Column data starts on a TABLE_ALIGN boundary. Raw columns are the
+// values themselves, zlib columns a zlib stream of them
+#define TABLE_MAGIC "TIFFOTAB"
+#define TABLE_VERSION 1
+#define TABLE_HEADER_BYTES 32
+#define TABLE_ENTRY_BYTES 80
+#define TABLE_NAME_BYTES 48
+#define TABLE_ALIGN 64
+
+enum TableType {
+  TABLE_INT32 = 1,
+  TABLE_INT64 = 2,
+  TABLE_FLOAT32 = 3,
+  TABLE_FLOAT64 = 4
+};
+
+enum TableCompression {
+  TABLE_RAW = 0,
+  TABLE_ZLIB = 1
+};
+
+// a column table opened for reading. Raw columns point straight into
+// the mapped file, zlib columns are inflated the first time they are
+// asked for. Safe to read from multiple threads
+class ColumnTable {
+
+ public:
+
+  ColumnTable() {}
+
+  ~ColumnTable();
+
+  ColumnTable(const ColumnTable&) = delete;
+  ColumnTable& operator=(const ColumnTable&) = delete;
+
+  // map file and check its header. Returns 0 on success
+  int Open(const std::string& file);
+
+  uint64_t rows() const { return m_rows; }
+  size_t columns() const { return m_columns.size(); }
+
+  const std::string& name(size_t c) const { return m_columns[c]->name; }
+  TableType type(size_t c) const { return m_columns[c]->type; }
+
+  // index of the column called name, or -1
+  int Find(const std::string& name) const;
+
+  // the values of column c, in its type, or NULL if it can't be inflated
+  const void* data(size_t c) const;
+
+  // column c converted to doubles
+  std::vector<double> Doubles(size_t c) const;
+
+  // true if file starts with the column table magic
+  static bool IsColumnTable(const std::string& file);
+
+ private:
+
+  struct Column {
+    std::string name;
+    TableType type;
+    TableCompression compression;
+    uint64_t offset;
+    uint64_t stored;
+    uint64_t raw;
+
+    // inflated values of a zlib column
+    mutable std::once_flag once;
+    mutable std::vector<uint8_t> inflated;
+  };
+
+  std::string m_file;
+  const uint8_t* m_map = NULL;
+  uint64_t m_size = 0;
+  uint64_t m_rows = 0;
+  std::vector<std::unique_ptr<Column>> m_columns;
+
+};
+
+// write table as a column table. Integer columns are stored as int32 (or
+// int64 if they don't fit) and the rest as float32, or float64 if doubles
+// is true. With a zip_level above 0 columns are deflated on threads, and
+// kept deflated when that saves space. Returns 0 on success
+int WriteColumnTable(const CsvTable& table, const std::string& file, bool doubles,
+		     int zip_level, size_t threads);
+
+#endif
@@ -0,0 +1,32 @@
+#include "tiff_tile_cache.h"
+
+#include <climits>
+#include <cstdlib>
+
+TileCache::TileCache() :
+  m_cache(DEFAULT_BUDGET, [](const TiffTilePtr& t) { return t ? t->size : 0; }) {}
+
+TileCache& TileCache::Global() {
+  // never destroyed: evicting at exit would hand tile buffers back to
+  // thread-local pool lists that are already gone
+  static TileCache* cache = new TileCache();
+  return *cache;
+}
+
+uint32_t TileCache::FileId(const std::string& filename) {
+
+  // resolve so that different spellings of a path share tiles
+  std::string key = filename;
+  char resolved[PATH_MAX];
+  if (realpath(filename.c_str(), resolved))
+    key = resolved;
+
+  std::lock_guard<std::mutex> lock(m_file_mutex);
+  auto it = m_file_ids.find(key);
+  if (it != m_file_ids.end())
+    return it->second;
+
+  uint32_t id = m_file_ids.size();
+  m_file_ids[key] = id;
+  return id;
+}
@@ -0,0 +1,224 @@
+#ifndef TIFF_TILE_CACHE_H
+#define TIFF_TILE_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <future>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <functional>
+#include <unordered_map>
+
+// a decoded tile. The pixels are owned by whatever owner points to,
+// so a tile stays valid for as long as someone holds on to it, even
+// after it has been evicted from the cache
+struct TiffTile {
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+  std::shared_ptr<void> owner;
+};
+
+typedef std::shared_ptr<const TiffTile> TiffTilePtr;
+
+// thread-safe LRU cache with a budget in bytes rather than entries.
+// Concurrent requests for the same missing key wait on a single load
+template <typename K, typename V, typename Hash = std::hash<K>>
+class LRUCache {
+
+ public:
+
+  typedef std::function<size_t(const V&)> SizeFunc;
+  typedef std::function<V()> LoadFunc;
+
+  LRUCache(size_t budget, SizeFunc sizer) : m_budget(budget), m_sizer(sizer) {}
+
+  // return the cached value for key, or load it with loader and cache it.
+  // Empty (false-y) values are handed back but never cached
+  V GetOrLoad(const K& key, const LoadFunc& loader) {
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    auto it = m_map.find(key);
+    if (it != m_map.end()) {
+      ++m_hits;
+      m_lru.splice(m_lru.begin(), m_lru, it->second);
+      return it->second->second;
+    }
+
+    // someone else is already loading this one
+    auto fl = m_loading.find(key);
+    if (fl != m_loading.end()) {
+      ++m_hits;
+      std::shared_future<V> f = fl->second;
+      lock.unlock();
+      return f.get();
+    }
+
+    ++m_misses;
+    std::promise<V> promise;
+    m_loading.emplace(key, promise.get_future().share());
+    lock.unlock();
+
+    V value = loader();
+
+    lock.lock();
+    if (value)
+      __insert(key, value);
+    m_loading.erase(key);
+    lock.unlock();
+
+    promise.set_value(value);
+    return value;
+  }
+
+  // add or replace a value without counting a hit or miss
+  void Put(const K& key, const V& value) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    __insert(key, value);
+  }
+
+  // true if key is currently cached (or being loaded)
+  bool Contains(const K& key) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_map.count(key) || m_loading.count(key);
+  }
+
+  // change the budget, evicting if we are now over it
+  void SetBudget(size_t budget) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = budget;
+    __evict();
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_map.clear();
+    m_bytes = 0;
+  }
+
+  size_t budget() const { return m_budget; }
+  size_t bytes() const { return m_bytes; }
+  uint64_t hits() const { return m_hits; }
+  uint64_t misses() const { return m_misses; }
+  uint64_t evictions() const { return m_evictions; }
+
+  friend std::ostream& operator<<(std::ostream& out, const LRUCache& c) {
+    uint64_t total = c.m_hits + c.m_misses;
+    out << "hits " << c.m_hits << " misses " << c.m_misses <<
+      " evictions " << c.m_evictions << " hit rate " <<
+      (total ? 100.0 * c.m_hits / total : 0) << "% resident " <<
+      (c.m_bytes / 1e6) << " of " << (c.m_budget / 1e6) << " MB";
+    return out;
+  }
+
+ private:
+
+  typedef std::list<std::pair<K, V>> List;
+
+  size_t m_budget;
+  size_t m_bytes = 0;
+  SizeFunc m_sizer;
+
+  mutable std::mutex m_mutex;
+
+  // front is most recently used
+  List m_lru;
+  std::unordered_map<K, typename List::iterator, Hash> m_map;
+  std::unordered_map<K, std::shared_future<V>, Hash> m_loading;
+
+  std::atomic<uint64_t> m_hits{0};
+  std::atomic<uint64_t> m_misses{0};
+  std::atomic<uint64_t> m_evictions{0};
+
+  // must hold the lock
+  void __insert(const K& key, const V& value) {
+    auto it = m_map.find(key);
+    if (it != m_map.end()) {
+      m_bytes -= m_sizer(it->second->second);
+      m_lru.erase(it->second);
+    }
+    m_lru.emplace_front(key, value);
+    m_map[key] = m_lru.begin();
+    m_bytes += m_sizer(value);
+    __evict();
+  }
+
+  // must hold the lock. Always keeps the most recent entry
+  void __evict() {
+    while (m_bytes > m_budget && m_lru.size() > 1) {
+      m_bytes -= m_sizer(m_lru.back().second);
+      m_map.erase(m_lru.back().first);
+      m_lru.pop_back();
+      ++m_evictions;
+    }
+  }
+
+};
+
+// identifies a decoded tile: which file, which directory, which tile
+struct TileKey {
+  uint32_t file = 0;
+  uint32_t dir = 0;
+  uint32_t tile = 0;
+
+  bool operator==(const TileKey& o) const {
+    return file == o.file && dir == o.dir && tile == o.tile;
+  }
+};
+
+struct TileKeyHash {
+  size_t operator()(const TileKey& k) const {
+    uint64_t h = (static_cast<uint64_t>(k.file) << 48) ^
+      (static_cast<uint64_t>(k.dir) << 32) ^ k.tile;
+    return std::hash<uint64_t>()(h);
+  }
+};
+
+// the process-wide cache of decoded tiles that sits under every
+// TiffReader, so that no module decodes the same tile twice
+class TileCache {
+
+ public:
+
+  // default budget for decoded tiles, changed with -K/--tile-cache
+  static const size_t DEFAULT_BUDGET = 512ULL * 1024 * 1024;
+
+  static TileCache& Global();
+
+  // id for a file, shared by every reader that opens the same path
+  uint32_t FileId(const std::string& filename);
+
+  TiffTilePtr GetOrLoad(const TileKey& key, const std::function<TiffTilePtr()>& loader) {
+    return m_cache.GetOrLoad(key, loader);
+  }
+
+  void Put(const TileKey& key, const TiffTilePtr& tile) { m_cache.Put(key, tile); }
+
+  bool Contains(const TileKey& key) const { return m_cache.Contains(key); }
+
+  void SetBudget(size_t bytes) { m_cache.SetBudget(bytes); }
+
+  uint64_t hits() const { return m_cache.hits(); }
+  uint64_t misses() const { return m_cache.misses(); }
+
+  // print the hit/miss counters
+  void PrintStats(std::ostream& out) const {
+    out << "Tile cache: " << m_cache << std::endl;
+  }
+
+ private:
+
+  TileCache();
+
+  LRUCache<TileKey, TiffTilePtr, TileKeyHash> m_cache;
+
+  std::mutex m_file_mutex;
+  std::unordered_map<std::string, uint32_t> m_file_ids;
+
+};
+
+#endif
@@ -6,10 +6,19 @@
 #include <sstream>
 #include <cstring>
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <algorithm> // for std::min and std::max
 #include <cstdint>   // for uint16_t and uint8_t
 
 #include "channel.h"
+#include "tiff_reader.h"
+#include "tiff_writer.h"
+#include "tiff_prefetch.h"
+#include "tiff_buffer_pool.h"
+#include "tiff_pyramid.h"
+#include "tiff_colorize.h"
 
 #define MEAN_THRESHOLD 200
 #define DIFF_THRESHOLD 100
@@ -84,42 +93,6 @@ RGBColor combineChannelsToRGB(const std::vector<uint16_t>& values, const std::ve
     return rgb;
 }
 
-// Function to allocate memory for N channels, each of a specified size
-uint16_t** allocateChannels(size_t numChannels, size_t tileSize) {
-    // Allocate an array of pointers to hold the addresses of the arrays for each channel
-    uint16_t** channels = (uint16_t**)calloc(numChannels, sizeof(uint16_t*));
-    if (channels == nullptr) {
-        std::cerr << "Failed to allocate memory for channel pointers." << std::endl;
-        return nullptr;
-    }
-
-    // Allocate memory for each channel
-    for (size_t i = 0; i < numChannels; ++i) {
-        channels[i] = (uint16_t*)calloc(tileSize, sizeof(uint16_t));
-        if (channels[i] == nullptr) {
-            std::cerr << "Failed to allocate memory for channel " << i << std::endl;
-            // Cleanup previously allocated memory before returning
-            for (size_t j = 0; j < i; ++j) {
-                free(channels[j]);
-            }
-            free(channels);
-            return nullptr;
-        }
-    }
-
-    return channels;
-}
-
-// Function to free the allocated memory for N channels
-void freeChannels(uint16_t** channels, size_t numChannels) {
-    if (channels != nullptr) {
-        for (size_t i = 0; i < numChannels; ++i) {
-            free(channels[i]); // Free each channel
-        }
-        free(channels); // Free the array of pointers
-    }
-}
-
 static void __gray8assert(TIFF* in) {
   
   uint16_t bps, photo;
@@ -130,11 +103,17 @@ static void __gray8assert(TIFF* in) {
   
 }
 
-int Compress(TIFF* in, TIFF* out) {
+int Compress(const TiffReader& reader, TIFF* out, size_t threads, bool pyramid) {
+
+  // the reader's own handle is only used for tags. Pixels go through the tile cache
+  TIFF* in = reader.get();
 
   // display number of directories / channels
   int num_dir = TIFFNumberOfDirectories(in);
   std::cerr << "Number of channels in image: " << num_dir << std::endl;
+
+  // levels of the previous channel, written straight after its directory
+  std::unique_ptr<PyramidBuilder> pyr;
   
   // loop each channel
   for (int n = 0; n < num_dir; n++) {
@@ -151,6 +130,9 @@ int Compress(TIFF* in, TIFF* out) {
 	std::cerr << "Error: Could not write output directory " << n << std::endl;
 	return 1;
       }
+      if (pyr && pyr->WriteLevels(out, threads))
+	return 1;
+      pyr.reset();
     }
     
     // get and copy image dimensions
@@ -312,76 +294,73 @@ int Compress(TIFF* in, TIFF* out) {
       }
       
       uint64_t ts = TIFFTileSize(in);
+      size_t num_tiles = tiles_per_image;
+      std::atomic<size_t> dropped(0);
+
+      // read this channel ahead of the workers
+      TilePrefetcher prefetch(reader, TileOrderRowMajor(reader, {static_cast<size_t>(n)}, false), threads);
       
-      // allocate memory for a single tile
-      uint16_t* itile = (uint16_t*)calloc(ts/ 2, sizeof(uint16_t));
-      
-      if (itile == nullptr) {
-	std::cerr << "Memory allocation for channels failed." << std::endl;
-	assert(false);
-      }
-      
-      // allocated the output tile
-      void*     otile = (void*)calloc(ts / 2, sizeof(uint16_t));  // div by 2 because uint16
-      
-      // loop through the tiles
-      uint64_t x, y;
-      uint64_t m_pix = 0;
-      size_t num_tiles = 0;
-      for (y = 0; y < m_height; y += tileheight) {
-	for (x = 0; x < m_width; x += tilewidth) {
-	  
-	  num_tiles++;
-	  // Read the input tile
-	  if (TIFFReadTile(in, itile, x, y, 0, 0) < 0) {
-	    fprintf(stderr, "Error reading input channel %d tile at (%llu, %llu)\n", n, x, y);
-	    return 1;
-	  }
-
-	  // sort a copy of this array to get quantiles
-	  int arrSize = ts / 2;
-	  uint16_t arrCopy[arrSize];
-	  std::memcpy(arrCopy, itile, arrSize * sizeof(uint16_t)); 
-	  std::sort(arrCopy, arrCopy + arrSize);
-
-	  uint16_t percentile_90 = arrCopy[static_cast<int>(0.9 * arrSize)];
-	  uint16_t percentile_10 = arrCopy[static_cast<int>(0.1 * arrSize)];
-	  uint16_t diff = percentile_90 - percentile_10;
-	  
-	  // get the mean for the tile
-	  uint64_t sum = 0;
-	  for (size_t i = 0; i < arrSize; i++) {
-	    sum += itile[i];
-	  }
-
-	  // if mean is above threshold, then copy data
-	  if ( (sum / arrSize) >= MEAN_THRESHOLD || diff > DIFF_THRESHOLD) {
-	    memcpy(otile, itile, (arrSize) * sizeof(uint16_t));
-	  } else {
+      // one tile in, one tile out
+      TileFillFunc fill = [&](uint32_t tile, uint8_t* otile) {
+
+	TiffTilePtr t = prefetch.Get(tile);
+	if (!t) {
+	  fprintf(stderr, "Error reading input channel %d tile %u\n", n, tile);
+	  return 1;
+	}
+	const uint16_t* itile = reinterpret_cast<const uint16_t*>(t->data);
+	
+	// sort a copy of this array to get quantiles
+	size_t arrSize = ts / 2;
+	TileBuffer copy = TileBufferPool::Global().Get(ts);
+	if (!copy)
+	  return 1;
+	uint16_t* arrCopy = copy.as<uint16_t>();
+	memcpy(arrCopy, itile, arrSize * sizeof(uint16_t));
+	std::sort(arrCopy, arrCopy + arrSize);
+	
+	uint16_t percentile_90 = arrCopy[static_cast<size_t>(0.9 * arrSize)];
+	uint16_t percentile_10 = arrCopy[static_cast<size_t>(0.1 * arrSize)];
+	uint16_t diff = percentile_90 - percentile_10;
+	
+	// get the mean for the tile
+	uint64_t sum = 0;
+	for (size_t i = 0; i < arrSize; i++) {
+	  sum += itile[i];
+	}
+	
+	// if mean is above threshold, then copy data, otherwise zero it out
+	if ( (sum / arrSize) >= MEAN_THRESHOLD || diff > DIFF_THRESHOLD) {
+	  memcpy(otile, itile, arrSize * sizeof(uint16_t));
+	} else {
+#pragma omp critical
 	  std::cerr << " mean: " << (sum / arrSize)  << " 10% " <<
 	    percentile_10 << " 90% " << percentile_90 <<  " diff " <<
 	    diff << std::endl;
-	    drop++;
-	  }
-
-	  // x2 is because two bytes
-	  //std::cout << (sum / ts * 2) << std::endl;
-	  
-	  // Write the tile to the TIFF file
-	  // this function will automatically calculate memory size from TIFF tags
-	  if (TIFFWriteTile(out, otile, x, y, 0, 0) < 0) { 
-	    fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
-	    return 1;
-	  }
-	} // end x loop
-      } // end y loop
-
+	  memset(otile, 0, arrSize * sizeof(uint16_t));
+	  dropped++;
+	}
+	return 0;
+      };
+
+      // levels are reduced from the tiles as they are written
+      TileSinkFunc sink;
+      if (pyramid) {
+	pyr.reset(new PyramidBuilder(out));
+	sink = pyr->Sink();
+      }
+      
+      // tiles are read, filtered and compressed in parallel, then written in order
+      if (WriteTilesParallel(out, fill, threads, sink)) {
+	fprintf(stderr, "Error writing channel %d\n", n);
+	return 1;
+      }
+      drop = dropped;
+      
       std::cerr << "...finished channel " << n << " - " <<
 	m_height << " x " << m_width << 
 	" drop rate " << (drop/num_tiles) << std::endl;
       
-      free(otile);
-      free(itile);
       
       // tile offsets and byte counts
       // bytes counts is number of (compressed) bytes per tile
@@ -424,13 +403,18 @@ int Compress(TIFF* in, TIFF* out) {
     std::cerr << "Could not write final output directory " << std::endl;
     return 1;
   }
+  if (pyr && pyr->WriteLevels(out, threads))
+    return 1;
   
   return 0;
 }
 
-int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
+int Colorize(const TiffReader& reader, TIFF* out, const std::string& palette_file,
 	     const std::vector<int>& channels_to_run,
-	     bool verbose) {
+	     bool verbose, size_t threads, bool pyramid) {
+
+  // the reader's own handle is only used for tags. Pixels go through the tile cache
+  TIFF* in = reader.get();
 
   // set compression
   TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
@@ -441,45 +425,16 @@ int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
     std::cerr << "Number of channels in image: " << num_dir << std::endl;
 
   ////// READ THE PALETTE
-  ChannelVector channels;
-  std::ifstream file(palette_file);
-  std::string line; 
-  std::vector<std::string> headerItems; 
-  while (std::getline(file, line)) {
-    if (!line.empty() || line.at(0) == '#') {
-      channels.emplace_back(line); 
-    }
-  }
-
-  // input checking
-  if (channels_to_run.size() == 0) {
-    std::cerr << "no channels selected" << std::endl;
-    return 0;
-  }
-
-  // subset to just the channels that we want to colorize
+  // and subset to just the channels that we want to colorize
   ChannelVector channels_to_run_map;
-  for (auto n : channels_to_run) {
-    channels_to_run_map.push_back(channels.at(n));
-  }
-
-  // error checking
-  int channel_max = *std::max_element(channels_to_run.begin(), channels_to_run.end());
-  if (channel_max >= channels.size()) {
-    fprintf(stderr, "Error: Max channel %d is larger than number of channels in the palette %zu\n", channel_max, channels.size());
-    return -1;
-  }
-
-  // error checking
-  if (num_dir <= channel_max) {
-    fprintf(stderr, "Error: Max channel %d is larger than number of channels in the image %d\n", channel_max, num_dir);
-    return -1;
-  }
+  if (SelectPaletteChannels(palette_file, channels_to_run, num_dir, channels_to_run_map,
+			    reader.ChannelNames()))
+    return 1;
 
   // print
   if (verbose)
-    for (const auto& i : channels_to_run)
-      std::cerr << "Channel: " << channels.at(i) << std::endl;
+    for (const auto& c : channels_to_run_map)
+      std::cerr << "Channel: " << c << std::endl;
 
 
   if (TIFFIsTiled(in)) {
@@ -516,79 +471,62 @@ int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
       return 1;
     }
     
-    // allocate memory for a single tile
-    uint16_t** channels = allocateChannels(channels_to_run.size(), ts / 2);
-    if (channels == nullptr) {
-      std::cerr << "Memory allocation for channels failed." << std::endl;
-      assert(false);
-    }
-
-    // allocated the RGB tile
-    void*     o_tile = (void*)calloc(ts / 2 * 3, sizeof(uint8_t));  // div by 2 because uint16 -> uint8, then *3 because R, G, B
-    
-    // storage for pixel values
-    std::vector<uint16_t> pixel_values;
-    pixel_values.resize(channels_to_run.size());
-    
-    // loop through the tiles
-    uint64_t x, y;
-    uint64_t m_pix = 0;
-    size_t tile_num = 1;
-
     // num tiles, using divisor trick to round up
-    int num_tiles = ((m_height + tileheight - 1) / tileheight) * ((m_width + tilewidth - 1) / tilewidth);
+    uint32_t tiles_across = (m_width + tilewidth - 1) / tilewidth;
+    uint32_t num_tiles = ((m_height + tileheight - 1) / tileheight) * tiles_across;
+
+    // every selected channel is read at each tile position, ahead of the workers
+    std::vector<size_t> dirs(channels_to_run.begin(), channels_to_run.end());
+    size_t nc = dirs.size();
+    TilePrefetcher prefetch(reader, TileOrderRowMajor(reader, dirs, true), threads);
+    ColorizeKernel kernel(channels_to_run_map);
     
-    for (y = 0; y < m_height; y += tileheight) {
-      if (verbose)
-	std::cerr << "...working on tile " << tile_num << " of " << num_tiles << std::endl;
-      for (x = 0; x < m_width; x += tilewidth) {
-	tile_num++;
-	// copy in the 3tiles from channels
-	size_t channel_num = 0;
-	for (const auto& m : channels_to_run) {
-	  
-	  // Read the red tile
-	  TIFFSetDirectory(in, m);
-	  if (TIFFReadTile(in, channels[channel_num], x, y, 0, 0) < 0) {
-	    fprintf(stderr, "Error reading channel %d tile at (%llu, %llu)\n", m, x, y);
-	    return 1;
-	  }
-	  channel_num++;
-	}
-	
-	// copy the tile to the RGB, pixel by pixel
-	for (size_t i = 0; i < (ts / 2); ++i) {
-	  
-	  // copy the channel number + values to a map
-	  int n = 0;
-	  for (const auto& m : channels_to_run) {
-	    pixel_values[n] = channels[n][i];
-	    n++;
-	  }
-
-	  //RGBColor rgb = RGBColor(0,0,0);
-	  RGBColor rgb =
-	    combineChannelsToRGB(pixel_values, channels_to_run_map);
-	  
-	  static_cast<uint8_t*>(o_tile)[i*3    ] = rgb.r;
-	  static_cast<uint8_t*>(o_tile)[i*3 + 1] = rgb.g; //affineTransformUint8(g_tile[i], 200, 1500);
-	  static_cast<uint8_t*>(o_tile)[i*3 + 2] = rgb.b; //ffineTransformUint8(b_tile[i], 400, 1500);
-	}
-	
-	// Write the tile to the TIFF file
-	// this function will automatically calculate memory size from TIFF tags
-	if (TIFFWriteTile(out, o_tile, x, y, 0, 0) < 0) { 
-	  fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
+    TileFillFunc fill = [&](uint32_t tile, uint8_t* o_tile) {
+
+      if (verbose && tile % tiles_across == 0) {
+#pragma omp critical
+	std::cerr << "...working on tile " << (tile + 1) << " of " << num_tiles << std::endl;
+      }
+      
+      // the tile of each channel at this position
+      std::vector<TiffTilePtr> channels(nc);
+      for (size_t c = 0; c < nc; c++) {
+	channels[c] = prefetch.Get(tile * nc + c);
+	if (!channels[c]) {
+	  fprintf(stderr, "Error reading channel %zu tile %u\n", dirs[c], tile);
 	  return 1;
 	}
-	
-      } // end x loop
-    } // end y loop
+      }
+      
+      // blend the channels into the RGB tile
+      std::vector<const uint16_t*> planes(nc);
+      for (size_t c = 0; c < nc; c++)
+	planes[c] = reinterpret_cast<const uint16_t*>(channels[c]->data);
+      kernel.Apply(planes.data(), ts / 2, o_tile);
+      return 0;
+    };
+
+    // levels are reduced from the tiles as they are written
+    std::unique_ptr<PyramidBuilder> pyr;
+    TileSinkFunc sink;
+    if (pyramid) {
+      pyr.reset(new PyramidBuilder(out));
+      sink = pyr->Sink();
+    }
 
-    // Free the allocated memory
-    freeChannels(channels, channels_to_run.size());
-    
-    free(o_tile);
+    // tiles are colored and compressed in parallel, then written in order
+    if (WriteTilesParallel(out, fill, threads, sink))
+      return 1;
+
+    // the levels go in as SubIFDs, so the full image has to be written first
+    if (pyr) {
+      if (!TIFFWriteDirectory(out)) {
+	std::cerr << "Could not write output directory" << std::endl;
+	return 1;
+      }
+      if (pyr->WriteLevels(out, threads))
+	return 1;
+    }
 
   }
 
@@ -651,10 +589,17 @@ int MergeGrayToRGB(TIFF* in, TIFF* out) {
     }
     
     // allocate memory for a single tile
-    uint8_t* r_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    uint8_t* g_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    uint8_t* b_tile = (uint8_t*)calloc(ts, sizeof(uint8_t));
-    void*    o_tile = (void*)calloc(ts* 3, sizeof(uint8_t));  
+    TileBufferPool& pool = TileBufferPool::Global();
+    TileBuffer r_buf = pool.Get(ts, true);
+    TileBuffer g_buf = pool.Get(ts, true);
+    TileBuffer b_buf = pool.Get(ts, true);
+    TileBuffer o_buf = pool.Get(ts * 3, true);
+    if (!r_buf || !g_buf || !b_buf || !o_buf)
+      return 1;
+    uint8_t* r_tile = r_buf.data();
+    uint8_t* g_tile = g_buf.data();
+    uint8_t* b_tile = b_buf.data();
+    void*    o_tile = o_buf.data();
 
     // loop through the tiles
     uint64_t x, y;
@@ -708,11 +653,6 @@ int MergeGrayToRGB(TIFF* in, TIFF* out) {
       } // end x loop
     } // end y loop
     
-    free(o_tile);
-    free(r_tile);
-    free(g_tile);
-    free(b_tile);
-
   }
 
   // lined image
@@ -728,10 +668,17 @@ int MergeGrayToRGB(TIFF* in, TIFF* out) {
     }
     
     // allocate memory for a single line
-    uint8_t* rbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* gbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* bbuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in));
-    uint8_t* obuf = (uint8_t*)_TIFFmalloc(TIFFScanlineSize(in) * 3);
+    TileBufferPool& pool = TileBufferPool::Global();
+    TileBuffer r_line = pool.Get(ls);
+    TileBuffer g_line = pool.Get(ls);
+    TileBuffer b_line = pool.Get(ls);
+    TileBuffer o_line = pool.Get(ls * 3);
+    if (!r_line || !g_line || !b_line || !o_line)
+      return 1;
+    uint8_t* rbuf = r_line.data();
+    uint8_t* gbuf = g_line.data();
+    uint8_t* bbuf = b_line.data();
+    uint8_t* obuf = o_line.data();
 
     uint64_t m_pix = 0;
     for (uint64_t y = 0; y < m_height; y++) {
@@ -779,10 +726,6 @@ int MergeGrayToRGB(TIFF* in, TIFF* out) {
       }
     } // end row loop
 
-    free(obuf);
-    free(rbuf);
-    free(gbuf);
-    free(bbuf);
 
     
   }
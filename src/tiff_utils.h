@@ -17,11 +17,13 @@ using funcmm_t = double (*)(uint8_t*, size_t); // mean vs mode function object
 
 #define PAIRSTRING(X_, Y_) "(" + std::to_string(X_) + ", " + std::to_string(Y_) +  ")"
 
+class TiffReader;
+
 int MergeGrayToRGB(TIFF* in, TIFF* out);
-int Compress(TIFF* in, TIFF* out);
-int Colorize(TIFF* in, TIFF* out, const std::string& palette_file,
+int Compress(const TiffReader& reader, TIFF* out, size_t threads, bool pyramid = false);
+int Colorize(const TiffReader& reader, TIFF* out, const std::string& palette_file,
 	     const std::vector<int>& channels_to_run,
-	     bool verbose);
+	     bool verbose, size_t threads, bool pyramid = false);
 
 static int cnt = 0; 
 #define DEBUGP do { std::cerr << "DEBUGP: " << cnt++ << std::endl; } while(0)
@@ -82,15 +84,16 @@ double inline getMean(uint8_t* vec, size_t len) {
 }
 
 double inline getMode(uint8_t* vec, size_t len) {
-    std::unordered_map<uint8_t, int> count;
-    for (int i = 0; i < len; i++) 
+    // fixed histogram, since there are only 256 possible values
+    uint32_t count[256] = {0};
+    for (size_t i = 0; i < len; i++) 
       count[vec[i]]++;
-    int mode = vec[0];
-    int maxCount = 0;
-    for (auto i : count) {
-      if (i.second > maxCount) {
-	mode = i.first;
-	maxCount = i.second;
+    int mode = 0;
+    uint32_t maxCount = 0;
+    for (int i = 0; i < 256; i++) {
+      if (count[i] > maxCount) {
+	mode = i;
+	maxCount = count[i];
       }
     }
     return mode;
@@ -1,4 +1,13 @@
 #include "tiff_writer.h"
+#include "tiff_codec.h"
+#include "tiff_buffer_pool.h"
+#include "tiff_pyramid.h"
+#include "tiff_cp.h"
+#include "tiff_ome.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 
 int TiffWriter::SetTag(uint32_t tag, ...) {
 
@@ -125,58 +134,51 @@ int TiffWriter::__tiled_write(const TiffImage& ti) const {
     return 1;
   }
 
-  // Allocate a buffer for the output tiles
-  void* buf = _TIFFmalloc(TIFFTileSize(m_tif.get()));
-  if (buf == NULL) {
-    fprintf(stderr, "Error allocating memory for tiles\n");
+  // work in bits per pixel so that any bit depth / sample count works.
+  // since tile widths are multiples of 16, every tile starts on a byte boundary
+  uint16_t bits_per_sample = 8, samples_per_pixel = 1;
+  TIFFGetField(m_tif.get(), TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
+  TIFFGetField(m_tif.get(), TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+  uint64_t bpp = static_cast<uint64_t>(bits_per_sample) * samples_per_pixel;
+  uint64_t ti_bpp = static_cast<uint64_t>(ti.m_bits_per_sample) * ti.m_samples_per_pixel;
+  if (bpp != ti_bpp) {
+    fprintf(stderr, "ERROR: writer has %llu bits per pixel, image has %llu\n", bpp, ti_bpp);
     return 1;
   }
+  if (!ti.__is_rasterized())
+    return 1;
+  
+  // only copy the part of the raster that is actually on both
+  uint64_t copy_width  = std::min<uint64_t>(m_width, ti.m_width);
+  uint64_t copy_height = std::min<uint64_t>(m_height, ti.m_height);
+  
+  uint64_t raster_row_bytes = (ti.m_width * bpp + 7) / 8;
+  uint64_t tile_row_bytes = (o_tile_width * bpp + 7) / 8;
+  uint32_t tiles_across = (m_width + o_tile_width - 1) / o_tile_width;
+  const uint8_t* raster = static_cast<const uint8_t*>(ti.m_data);
+
+  // copy the rows of the raster under this tile as blocks
+  TileFillFunc fill = [&](uint32_t tile, uint8_t* buf) {
+    uint64_t x = static_cast<uint64_t>(tile % tiles_across) * o_tile_width;
+    uint64_t y = static_cast<uint64_t>(tile / tiles_across) * o_tile_height;
+
+    uint64_t rows = y < copy_height ? std::min<uint64_t>(o_tile_height, copy_height - y) : 0;
+    uint64_t cols = x < copy_width  ? std::min<uint64_t>(o_tile_width,  copy_width  - x) : 0;
+    uint64_t row_bytes = (cols * bpp + 7) / 8;
+
+    // zero the padding of edge tiles
+    if (rows < o_tile_height || cols < o_tile_width)
+      memset(buf, 0, tile_row_bytes * o_tile_height);
+    
+    const uint8_t* src = raster + y * raster_row_bytes + x * bpp / 8;
+    for (uint64_t ty = 0; ty < rows; ty++) 
+      memcpy(buf + ty * tile_row_bytes, src + ty * raster_row_bytes, row_bytes);
+    
+    return 0;
+  };
 
-  // loop through the output image tiles and write the pixels
-  // from the raster
-  uint64_t x, y;
-
-  for (y = 0; y < m_height; y += o_tile_height) {
-    for (x = 0; x < m_width; x += o_tile_width) {
-      // Fill the tile buffer with data
-      for (uint64_t ty = 0; ty < o_tile_height; ty++) {
-	for (uint64_t tx = 0; tx < o_tile_width; tx++) {
-	  uint64_t xp = x + tx; // want 64 bits to be able to store really big d_pos, since this is the nth pixel
-	  uint64_t yp = y + ty;
-	  uint64_t d_pos = yp * m_width + xp; // index of pixel in the entire image
-	  uint64_t t_pos = ty * o_tile_width + tx; // index of pixel in this particular tile
-	  if (xp < m_width && yp < m_height) {
-	    switch(mode) {
-	    case 8:
-	      static_cast<uint8_t*>(buf)[t_pos] = ti.pixel(xp, yp, PIXEL_GRAY);
-	      break;
-	      //case 32:
-	      //static_cast<uint32_t*>(buf)[t_pos] = ti.pixel<uint32_t>(xp, yp, PIXEL_GRAY);
-	      //break;
-	    case 3:
-	      t_pos = t_pos * 3;
-	      static_cast<uint8_t*>(buf)[t_pos]     = ti.pixel(xp, yp, PIXEL_RED);
-	      static_cast<uint8_t*>(buf)[t_pos + 1] = ti.pixel(xp, yp, PIXEL_GREEN);
-	      static_cast<uint8_t*>(buf)[t_pos + 2] = ti.pixel(xp, yp, PIXEL_BLUE);
-	      break;
-	    }
-	  }
-	}
-      }
-
-      // Write the tile to the TIFF file
-      // this function will automatically calculate memory size from TIFF tags
-      if (TIFFWriteTile(m_tif.get(), buf, x, y, 0, 0) < 0) { 
-	fprintf(stderr, "Error writing tile at (%llu, %llu)\n", x, y);
-	return 1;
-      }
-    }
-  }
-
-  // Clean up
-  _TIFFfree(buf);
+  return WriteTilesParallel(m_tif.get(), fill, m_threads);
   
-  return 0;
 }
 
 void TiffWriter::MatchTagsToRaster(const TiffImage& ti) {
@@ -265,3 +267,182 @@ uint8_t TiffWriter::GetMode() const {
   return 0;
   
 }
+
+int WriteTilesParallel(TIFF* out, const TileFillFunc& fill, size_t threads,
+		       const TileSinkFunc& sink) {
+
+  assert(TIFFIsTiled(out));
+
+  uint32_t num_tiles = TIFFNumberOfTiles(out);
+  tmsize_t ts = TIFFTileSize(out);
+  if (ts <= 0) {
+    fprintf(stderr, "ERROR: unable to get tile size of writer\n");
+    return 1;
+  }
+
+  uint16_t compression = COMPRESSION_NONE;
+  TIFFGetField(out, TIFFTAG_COMPRESSION, &compression);
+  
+  // if we can't encode this ourselves, libtiff does it on the writing thread
+  bool encode = TiffCanEncodeTile(out);
+
+  // the deflate level libtiff would have used (Z_DEFAULT_COMPRESSION unless set)
+  int zip_level = -1;
+  if (compression == COMPRESSION_ADOBE_DEFLATE || compression == COMPRESSION_DEFLATE)
+    TIFFGetField(out, TIFFTAG_ZIPQUALITY, &zip_level);
+
+  threads = std::max<size_t>(threads, 1);
+  size_t batch = threads * 4;
+
+  // double buffered so one batch is written while the next is built
+  std::vector<TileBuffer> raw[2];
+  std::vector<std::vector<uint8_t>> enc[2];
+  for (int b = 0; b < 2; b++) {
+    for (size_t i = 0; i < batch; i++) {
+      raw[b].push_back(TileBufferPool::Global().Get(ts));
+      if (!raw[b].back())
+	return 1;
+    }
+    enc[b].resize(batch);
+  }
+
+  std::atomic<int> err(0);
+  
+  auto write_batch = [&](int b, uint32_t start, uint32_t n) {
+    for (uint32_t i = 0; i < n && !err; i++) {
+      // before libtiff gets a chance to encode the tile in place
+      if (sink && sink(start + i, raw[b][i].data())) {
+	err = 1;
+	break;
+      }
+      tmsize_t status;
+      if (!encode)
+	status = TIFFWriteEncodedTile(out, start + i, raw[b][i].data(), ts);
+      else if (compression == COMPRESSION_NONE)
+	status = TIFFWriteRawTile(out, start + i, raw[b][i].data(), ts);
+      else
+	status = TIFFWriteRawTile(out, start + i, enc[b][i].data(), enc[b][i].size());
+      if (status < 0) {
+	fprintf(stderr, "Error writing tile %u\n", start + i);
+	err = 1;
+      }
+    }
+  };
+
+  uint32_t prev_start = 0, prev_n = 0;
+  int b = 0;
+  for (uint32_t start = 0; start < num_tiles && !err; start += batch) {
+
+    uint32_t n = std::min<uint32_t>(batch, num_tiles - start);
+
+#pragma omp parallel num_threads(threads)
+    {
+      // one thread appends the previous batch while the others
+      // start on this one
+#pragma omp single nowait
+      write_batch(1 - b, prev_start, prev_n);
+      
+#pragma omp for schedule(dynamic, 1)
+      for (uint32_t i = 0; i < n; i++) {
+	if (err)
+	  continue;
+	TileBuffer& r = raw[b][i];
+	if (fill(start + i, r.data())) {
+	  err = 1;
+	  continue;
+	}
+	if (encode && compression != COMPRESSION_NONE &&
+	    TiffEncodeTile(compression, r.data(), ts, enc[b][i], zip_level))
+	  err = 1;
+      }
+    }
+    
+    prev_start = start;
+    prev_n = n;
+    b = 1 - b;
+  }
+
+  // last batch
+  write_batch(1 - b, prev_start, prev_n);
+
+  return err ? 1 : 0;
+}
+
+TiffPtr OpenTagHandle(const TiffReader& reader) {
+  TiffPtr tif(TIFFOpen(reader.filename().c_str(), "r"), TIFFClose);
+  if (!tif)
+    fprintf(stderr, "ERROR: unable to open %s\n", reader.filename().c_str());
+  return tif;
+}
+
+void KeepTileCompression(TIFF* out) {
+
+  uint16_t compression = COMPRESSION_NONE, bps = 8;
+  TIFFGetField(out, TIFFTAG_COMPRESSION, &compression);
+  TIFFGetField(out, TIFFTAG_BITSPERSAMPLE, &bps);
+
+  // JPEG only takes 8-bit samples, deflate is the nearest lossless
+  if (compression == COMPRESSION_JPEG && bps != 8) {
+    fprintf(stderr, "Warning: JPEG can't hold %u-bit samples, writing %s with deflate\n",
+	    bps, TIFFFileName(out));
+    TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+    return;
+  }
+  if (compression == COMPRESSION_NONE || TIFFIsCODECConfigured(compression))
+    return;
+
+  fprintf(stderr, "Warning: libtiff can't write compression %u, writing %s uncompressed\n",
+	  compression, TIFFFileName(out));
+  TIFFUnsetField(out, TIFFTAG_PREDICTOR);
+  TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+}
+
+int CopyTileTags(TIFF* in, TIFF* out, uint32_t tw, uint32_t th, uint16_t bps,
+		 std::unique_ptr<PyramidBuilder>& pyramid) {
+
+  pyramid.reset();
+  if (tiffcp(in, out, false)) {
+    fprintf(stderr, "ERROR: unable to copy the tags of %s\n", TIFFFileName(in));
+    return 1;
+  }
+
+  // tiffcp keeps the input's layout, the pixels are rewritten as tiles
+  TIFFUnsetField(out, TIFFTAG_ROWSPERSTRIP);
+  TIFFSetField(out, TIFFTAG_TILEWIDTH, tw);
+  TIFFSetField(out, TIFFTAG_TILELENGTH, th);
+  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+
+  uint16_t in_bps = 8, in_format = SAMPLEFORMAT_UINT;
+  TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &in_bps);
+  TIFFGetField(in, TIFFTAG_SAMPLEFORMAT, &in_format);
+  if (bps && (bps != in_bps || in_format != SAMPLEFORMAT_UINT)) {
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bps);
+    TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, static_cast<uint16_t>(SAMPLEFORMAT_UINT));
+    for (uint32_t tag : {TIFFTAG_MINSAMPLEVALUE, TIFFTAG_MAXSAMPLEVALUE,
+			 TIFFTAG_SMINSAMPLEVALUE, TIFFTAG_SMAXSAMPLEVALUE})
+      TIFFUnsetField(out, tag);
+  }
+
+  // the OME-XML (only on the first directory) declares the type of all
+  char* desc = NULL;
+  if (bps && TIFFGetField(in, TIFFTAG_IMAGEDESCRIPTION, &desc) && desc && IsOmeXml(desc)) {
+    std::string xml = SetOmePixelType(desc, "uint" + std::to_string(bps), bps);
+    TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, xml.c_str());
+  }
+
+  // a floating point predictor doesn't fit the unsigned samples
+  uint16_t predictor = PREDICTOR_NONE;
+  if (bps && TIFFGetField(out, TIFFTAG_PREDICTOR, &predictor) &&
+      predictor == PREDICTOR_FLOATINGPOINT)
+    TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+
+  KeepTileCompression(out);
+
+  // as many levels as the input had, from the new pixels
+  uint16_t num_sub = 0;
+  toff_t* sub = NULL;
+  if (TIFFGetField(in, TIFFTAG_SUBIFD, &num_sub, &sub) && num_sub)
+    pyramid.reset(new PyramidBuilder(out, num_sub));
+
+  return 0;
+}
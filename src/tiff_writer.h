@@ -3,10 +3,50 @@
 
 #include <string>
 #include <memory>
+#include <functional>
 #include "tiffio.h"
 #include "tiff_reader.h"
 #include "tiff_image.h"
 
+class PyramidBuilder;
+
+// fill the output tile with index tile (as from TIFFComputeTile) into buf,
+// which is TIFFTileSize bytes long. Return 0 on success
+typedef std::function<int(uint32_t tile, uint8_t* buf)> TileFillFunc;
+
+// called with each filled (unencoded) tile as it is written, in tile
+// order and on one thread at a time. Return 0 on success
+typedef std::function<int(uint32_t tile, const uint8_t* buf)> TileSinkFunc;
+
+// assemble and encode the tiles of the current directory of out in parallel,
+// then append the encoded tiles to the file sequentially in tile order.
+// If sink is set, it sees every tile as it is written
+int WriteTilesParallel(TIFF* out, const TileFillFunc& fill, size_t threads,
+		       const TileSinkFunc& sink = TileSinkFunc());
+
+typedef std::unique_ptr<TIFF, decltype(&TIFFClose)> TiffPtr;
+
+// a handle on reader's file of its own, for reading tags while the
+// reader's handles decode tiles. NULL (with an error printed) on failure
+TiffPtr OpenTagHandle(const TiffReader& reader);
+
+// keep the compression (and predictor) set on out, which
+// WriteTilesParallel encodes in parallel where it can and otherwise hands
+// to libtiff. JPEG of other than 8-bit samples becomes deflate, and a
+// codec libtiff can't write none, each with a warning
+void KeepTileCompression(TIFF* out);
+
+// tags of the current directory of in on out, through tiffcp, for a tile
+// by tile rewrite of its pixels: tw x th tiles, contiguous, and unsigned
+// bps-bit samples if bps is not 0 (with the Pixels Type of OME-XML set
+// to match). The compression and predictor are kept, see
+// KeepTileCompression.
+// If in has SubIFD levels, pyramid is set to rebuild as many from the
+// tiles written; pass its Sink() to WriteTilesParallel and call
+// WriteLevels after TIFFWriteDirectory. Returns 0 on success
+int CopyTileTags(TIFF* in, TIFF* out, uint32_t tw, uint32_t th, uint16_t bps,
+		 std::unique_ptr<PyramidBuilder>& pyramid);
+
 class TiffWriter {
 
  public:
@@ -39,6 +79,9 @@ class TiffWriter {
   void UpdateDims(const TiffImage& ti);
 
   TIFF* get() const { return m_tif.get(); }
+
+  // number of threads used to assemble and encode tiles
+  void setthreads(size_t threads) { m_threads = threads; }
   
  private:
 
@@ -48,6 +91,8 @@ class TiffWriter {
 
   bool m_verbose = true;
 
+  size_t m_threads = 1;
+
   int __tiled_write(const TiffImage& ti) const;
   int __lined_write(const TiffImage& ti) const;  
 
@@ -15,6 +15,25 @@
 #include "tiff_reader.h"
 #include "tiff_writer.h"
 #include "tiff_cp.h"
+#include "tiff_buffer_pool.h"
+#include "tiff_scale.h"
+#include "tiff_colorize.h"
+#include "tiff_encode.h"
+#include "tiff_sample.h"
+#include "tiff_overlay.h"
+#include "tiff_dzi.h"
+#include "tiff_serve.h"
+#include "tiff_quant.h"
+#include "tiff_neighbors.h"
+#include "tiff_csv.h"
+#include "tiff_table.h"
+#include "tiff_extract.h"
+#include "tiff_afsub.h"
+#include "tiff_flatfield.h"
+
+#include <chrono>
+#include <random>
+#include <atomic>
 
 namespace opt {
   static bool verbose = false;
@@ -24,124 +43,1235 @@ namespace opt {
   static std::string outfile;
   static std::string module;
 
-  static std::string redfile;
-  static std::string greenfile;
-  static std::string bluefile;
-  static int threads = 1;
+  static std::string redfile;
+  static std::string greenfile;
+  static std::string bluefile;
+  static int threads = 1;
+  static size_t tile_cache_mb = 0;
+  static bool huge_pages = false;
+}
+
+#define DEBUG(x) std::cerr << #x << " = " << (x) << std::endl
+
+#define TVERB(msg) \
+  if (opt::verbose) {		   \
+    std::cerr << msg << std::endl; \
+  }
+
+static const char* shortopts = "hvr:g:b:q:c:m:p:C:t:";
+static const struct option longopts[] = {
+  { "verbose",                    no_argument, NULL, 'v' },
+  { "red",                        required_argument, NULL, 'r' },
+  { "green",                      required_argument, NULL, 'g' },
+  { "blue",                       required_argument, NULL, 'b' },
+  { "quant-file",                 required_argument, NULL, 'q' },
+  { "marker-file",                required_argument, NULL, 'm' },  
+  { "threads",                    required_argument, NULL, 't' },
+  { "palette",                    required_argument, NULL, 'p' },
+  { "channels",                   required_argument, NULL, 'C' },  
+  { "pyramid",                    no_argument, NULL, 'P' },
+  { "quality",                    required_argument, NULL, 'Q' },
+  { "annotate",                   no_argument, NULL, 'a' },
+  { "um-per-pixel",               required_argument, NULL, 'u' },
+  { "tiles",                      no_argument, NULL, 'T' },
+  { "tile-cache",                 required_argument, NULL, 'K' },
+  { "huge-pages",                 no_argument, NULL, 'H' },
+  { "mode",                       no_argument, NULL, 'M' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *RUN_USAGE_MESSAGE =
+"Usage: tiffo [module] <options> infile outfile\n"
+"Modules:\n"
+"  compress - Zero out noise-only tiles for better compression\n"
+"  gray2rgb - Convert a 3-channel gray TIFF to a single RGB\n"
+"  colorize - Colorize select channels from a cycif tiff\n"
+"  mean - Give the mean pixel for each channel\n"
+"  info - Print the layout of each directory\n"
+"  scale - Downsample every channel by an integer factor\n"
+"  crop - Colorize a window of a cycif tiff straight to JPEG/PNG\n"
+"  sample - Colorize a batch of random non-empty crops\n"
+"  palette - Draw the swatch sheet of a palette file\n"
+"  dzi - Colorize straight to a Deep Zoom tile pyramid\n"
+"  serve - Serve colorized Deep Zoom tiles to a local viewer\n"
+"  quant - Per-cell mean intensities, centroids and areas from a label mask\n"
+"  neighbors - Radius or kNN spatial graph of a quantification table\n"
+"  table - Convert a quantification CSV to a memory-mappable column table\n"
+"  extract - Copy chosen channels to a new tiff without re-encoding\n"
+"  afsub - Subtract a scaled autofluorescence channel from chosen markers\n"
+"  flatfield - Correct the illumination shading of each field of view\n"
+  "\n";
+
+static int compress(int argc, char** argv);
+static int gray2rgb(int argc, char** argv);
+static int findmean(int argc, char** argv);
+static int colorize(int argc, char** argv);
+static int info(int argc, char** argv);
+static int scale(int argc, char** argv);
+static int crop(int argc, char** argv);
+static int sample(int argc, char** argv);
+static int palette(int argc, char** argv);
+static int dzi(int argc, char** argv);
+static int serve(int argc, char** argv);
+static int quant(int argc, char** argv);
+static int neighbors(int argc, char** argv);
+static int table(int argc, char** argv);
+static int extract(int argc, char** argv);
+static int afsub(int argc, char** argv);
+static int flatfield(int argc, char** argv);
+static void parseRunOptions(int argc, char** argv);
+
+// process in and outfile cmd arguments
+static bool in_out_process(int argc, char** argv);
+static bool in_only_process(int argc, char** argv);
+static bool check_readable(const std::string& filename);
+
+// size the shared decoded-tile cache from -K and back large tile
+// buffers with huge pages for -H, if given
+static void set_memory();
+
+// load the marker file, if one was given, into reader and turn a -c list
+// of directory numbers and channel names into directories
+static int select_channels(TiffReader& reader, const std::vector<std::string>& list,
+			   std::vector<int>& channels);
+
+/*
+  https://github.com/LuaDist/libtiff/blob/43d5bd6d2da90e9bf254cd42c377e4d99008f00b/libtiff/tiffio.h#L61
+  
+typedef	uint32 ttag_t;		// directory tag 
+typedef	uint16 tdir_t;		// directory index
+typedef	uint16 tsample_t;	// sample number
+typedef	uint32 tstrip_t;	// strip number
+typedef uint32 ttile_t;		// tile number
+typedef	int32 tsize_t;		// i/o size in bytes
+typedef	void* tdata_t;		// image data ref
+typedef	uint32 toff_t;		// file offset 
+
+ */
+
+int main(int argc, char **argv) {
+  
+  // Check if a command line argument was provided
+  if (argc < 2) {
+    std::cerr << RUN_USAGE_MESSAGE;
+    return 1;
+  }
+
+  parseRunOptions(argc, argv);
+  
+  // get the module
+  if (opt::module == "gray2rgb") {
+    return(gray2rgb(argc, argv));
+  } else if (opt::module == "compress") {
+    return(compress(argc, argv));
+  } else if (opt::module == "colorize") {
+    return(colorize(argc, argv));
+  } else if (opt::module == "mean") {
+    return(findmean(argc, argv));
+  } else if (opt::module == "info") {
+    return(info(argc, argv));
+  } else if (opt::module == "scale") {
+    return(scale(argc, argv));
+  } else if (opt::module == "crop") {
+    return(crop(argc, argv));
+  } else if (opt::module == "sample") {
+    return(sample(argc, argv));
+  } else if (opt::module == "palette") {
+    return(palette(argc, argv));
+  } else if (opt::module == "dzi") {
+    return(dzi(argc, argv));
+  } else if (opt::module == "serve") {
+    return(serve(argc, argv));
+  } else if (opt::module == "quant") {
+    return(quant(argc, argv));
+  } else if (opt::module == "neighbors") {
+    return(neighbors(argc, argv));
+  } else if (opt::module == "table") {
+    return(table(argc, argv));
+  } else if (opt::module == "extract") {
+    return(extract(argc, argv));
+  } else if (opt::module == "afsub") {
+    return(afsub(argc, argv));
+  } else if (opt::module == "flatfield") {
+    return(flatfield(argc, argv));
+  } else {
+    assert(false);
+  }
+  return 1;
+}
+
+static int findmean(int argc, char** argv) {
+
+  bool die = false;
+  const char* shortopts = "vK:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_only_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo findmean [tiff] <options>\n"
+      "  Print the mean pixel value of a TIFF\n"
+      "  -K, --tile-cache          Decoded tile cache in MB [512]\n"
+      "  -H, --huge-pages          Back large tile buffers with huge pages\n"
+      "  -v, --verbose             Increase output to stderr"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  // open a tiff
+  // the "m" keeps libtiff from memory mapping it, which for
+  // a single pass just causes memory overruns from the C memmap func.
+  // Uncompressed tiles are mapped by the reader, a few at a time
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+
+  // this routine will handle printing output to stdout
+  reader.print_means();
+
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+
+  return 0;
+}
+
+static int info(int argc, char** argv) {
+
+  bool die = false;
+  const char* shortopts = "v";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    default: die = true;
+    }
+  }
+
+  if (die || in_only_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo info [tiff] <options>\n"
+      "  Print the size, tiling, pixel type and compression of each directory\n"
+      "  -v, --verbose             Print the time spent opening the file\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  // only tags are read here, never tiles or tile offsets
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+
+  std::cout << "File: " << opt::infile << " Dirs: " << reader.NumDirs() << std::endl;
+  for (size_t i = 0; i < reader.NumDirs(); i++) {
+    const TiffIFD& ifd = reader.IFD(i);
+    std::cout << "Dir " << i << ": " << ifd.width << " x " << ifd.height;
+    if (ifd.tile_width)
+      std::cout << " tile " << ifd.tile_width << " x " << ifd.tile_height;
+    else
+      std::cout << " scanline";
+    std::cout << " samples " << ifd.samples_per_pixel << " bits " << ifd.bits_per_sample <<
+      " compression " << ifd.compression << " photometric " << ifd.photometric << std::endl;
+  }
+
+  if (opt::verbose)
+    reader.PrintOpenTiming(std::cerr);
+  
+  return 0;
+}
+
+static int scale(int argc, char** argv) {
+
+  bool die = false;
+  uint32_t factor = 2;
+  bool ismode = false;
+  
+  const char* shortopts = "vf:Mt:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'f' : arg >> factor; break;
+    case 'M' : ismode = true; break;
+    case 't' : arg >> opt::threads; break;
+    default: die = true;
+    }
+  }
+
+  if (die || factor == 0 || in_out_process(argc, argv)) {
+    
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo scale [tiff in] [tiff out] <options>\n"
+      "  Downsample every directory by an integer factor, tile by tile\n"
+      "  -f                        Factor to shrink by [2]\n"
+      "  -M, --mode                Take the most common value of each box (label images) instead of the mean\n"
+      "  -t, --threads             Number of threads [1]\n"
+      "  -K, --tile-cache          Decoded tile cache in MB [512]\n"
+      "  -H, --huge-pages          Back large tile buffers with huge pages\n"
+      "  -v, --verbose             Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+  
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+
+  for (size_t i = 0; i < reader.NumDirs(); i++) {
+    TVERB("...scaling directory " << i);
+    if (ScaleTiles(reader, i, otif, factor, ismode, opt::threads) ||
+	!TIFFWriteDirectory(otif)) {
+      fprintf(stderr, "Error scaling directory %zu\n", i);
+      TIFFClose(otif);
+      return 1;
+    }
+  }
+  
+  TIFFClose(otif);
+
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return 0;
+}
+
+static int crop(int argc, char** argv) {
+
+  bool die = false;
+  std::string palette;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  int64_t x = -1, y = -1;
+  uint64_t w = 0, h = 0;
+  int quality = ENCODE_JPEG_QUALITY;
+  bool annotate = false;
+  double um_per_pixel = 0;
+  
+  const char* shortopts = "vc:C:p:t:x:y:w:h:Q:au:m:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'x' : arg >> x; break;
+    case 'y' : arg >> y; break;
+    case 'w' : arg >> w; break;
+    case 'h' : arg >> h; break;
+    case 'Q' : arg >> quality; break;
+    case 'a' : annotate = true; break;
+    case 'u' : arg >> um_per_pixel; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || !w || !h || channel_list.empty() || palette.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo crop [16-bit tiff] [jpg/png out] <options>\n"
+      "  Colorize a window of a multichannel tiff, reading only the tiles under it\n"
+      "    -w, -h            Width and height of the crop\n"
+      "    -x, -y            Top left corner of the crop [random]\n"
+      "    -c                Comma-separated list of channels, by number or name (e.g. 0,1,4,5)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -a, --annotate    Draw a scale bar and a legend of the channel names\n"
+      "    -u                Microns per pixel for the scale bar [from the resolution tags]\n"
+      "    -Q, --quality     JPEG quality [85]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+
+  // palette rows by channel name, or row n for directory n, as in colorize
+  ChannelVector selected;
+  if (select_channels(reader, channel_list, channels) ||
+      SelectPaletteChannels(palette, channels, reader.NumDirs(), selected, reader.ChannelNames()))
+    return 1;
+  std::vector<size_t> dirs(channels.begin(), channels.end());
+
+  const TiffIFD& ifd = reader.IFD(dirs[0]);
+  if (w > ifd.width || h > ifd.height) {
+    fprintf(stderr, "Error: crop %llu x %llu is larger than the image %llu x %llu\n",
+	    w, h, ifd.width, ifd.height);
+    return 1;
+  }
+
+  // random origin that keeps the crop inside the image
+  std::mt19937_64 rng(std::random_device{}());
+  if (x < 0)
+    x = std::uniform_int_distribution<uint64_t>(0, ifd.width - w)(rng);
+  if (y < 0)
+    y = std::uniform_int_distribution<uint64_t>(0, ifd.height - h)(rng);
+  if (x + w > ifd.width || y + h > ifd.height) {
+    fprintf(stderr, "Error: crop %llu x %llu at (%lld, %lld) runs off the image %llu x %llu\n",
+	    w, h, x, y, ifd.width, ifd.height);
+    return 1;
+  }
+  TVERB("...cropping " << w << " x " << h << " at " << PAIRSTRING(x, y));
+  
+  TileBuffer rgb = TileBufferPool::Global().Get(w * h * 3);
+  if (!rgb)
+    return 1;
+  
+  ColorizeKernel kernel(selected);
+  if (ColorizeRegion(reader, dirs, kernel, x, y, w, h, rgb.data(), opt::threads))
+    return 1;
+
+  if (annotate) {
+    if (um_per_pixel <= 0)
+      um_per_pixel = ifd.MicronsPerPixel();
+    if (DrawScaleBar(rgb.data(), w, h, um_per_pixel))
+      std::cerr << "Warning: no pixel size in the resolution tags, skipping the scale bar. Set one with -u" << std::endl;
+    DrawLegend(rgb.data(), w, h, selected);
+  }
+  
+  if (WriteRGBImage(opt::outfile, rgb.data(), w, h, quality, opt::threads))
+    return 1;
+
+  if (opt::verbose) {
+    std::cerr << "...cropped in " << std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return 0;
+}
+
+// file with _n before the extension (crop.jpg -> crop_3.jpg)
+static std::string numbered_file(const std::string& file, size_t n) {
+  size_t dot = file.find_last_of('.');
+  size_t slash = file.find_last_of('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return file + "_" + std::to_string(n);
+  return file.substr(0, dot) + "_" + std::to_string(n) + file.substr(dot);
+}
+
+static int sample(int argc, char** argv) {
+
+  bool die = false;
+  std::string palette;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  size_t n = 1;
+  uint64_t w = 0, h = 0;
+  double min_fraction = 0.5;
+  double limit = 20;
+  int quality = ENCODE_JPEG_QUALITY;
+  uint64_t seed = std::random_device{}();
+  bool annotate = false;
+  double um_per_pixel = 0;
+  
+  const char* shortopts = "vc:C:p:t:n:w:h:f:d:m:Q:s:au:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'n' : arg >> n; break;
+    case 'w' : arg >> w; break;
+    case 'h' : arg >> h; break;
+    case 'f' : arg >> min_fraction; break;
+    case 'd' : arg >> limit; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 'Q' : arg >> quality; break;
+    case 's' : arg >> seed; break;
+    case 'a' : annotate = true; break;
+    case 'u' : arg >> um_per_pixel; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || !n || !w || !h || channel_list.empty() || palette.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo sample [16-bit tiff] [jpg/png out] <options>\n"
+      "  Colorize n random crops that are not empty. Candidates are checked against\n"
+      "  the tile index before anything is decoded. Crops go to out_0.jpg, out_1.jpg, ...\n"
+      "    -n                Number of crops [1]\n"
+      "    -w, -h            Width and height of each crop\n"
+      "    -c                Comma-separated list of channels, by number or name (e.g. 0,1,4,5)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -f                Least fraction of non-blank tiles under a candidate [0.5]\n"
+      "    -d                Drop crops with every RGB mean under this percent [20]\n"
+      "    -s                Random seed\n"
+      "    -a, --annotate    Draw a scale bar and a legend of the channel names\n"
+      "    -u                Microns per pixel for the scale bar [from the resolution tags]\n"
+      "    -Q, --quality     JPEG quality [85]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+
+  // palette rows by channel name, or row n for directory n, as in colorize
+  ChannelVector selected;
+  if (select_channels(reader, channel_list, channels) ||
+      SelectPaletteChannels(palette, channels, reader.NumDirs(), selected, reader.ChannelNames()))
+    return 1;
+  std::vector<size_t> dirs(channels.begin(), channels.end());
+  ColorizeKernel kernel(selected);
+
+  TileSignalIndex index(reader, dirs);
+  if (w > index.width() || h > index.height()) {
+    fprintf(stderr, "Error: crop %llu x %llu is larger than the image %llu x %llu\n",
+	    w, h, index.width(), index.height());
+    return 1;
+  }
+  
+  if (annotate && um_per_pixel <= 0) {
+    um_per_pixel = reader.IFD(dirs[0]).MicronsPerPixel();
+    if (um_per_pixel <= 0)
+      std::cerr << "Warning: no pixel size in the resolution tags, skipping the scale bar. Set one with -u" << std::endl;
+  }
+  
+  std::mt19937_64 rng(seed);
+  std::atomic<size_t> written(0);
+  std::atomic<size_t> dropped(0);
+  std::atomic<int> err(0);
+  size_t candidates = 0;
+  
+  // crops that turn out dark once colored are replaced in a later round
+  for (int round = 0; round < 4 && written < n && !err; round++) {
+
+    std::vector<CropWindow> windows =
+      SampleWindows(index, n - written, w, h, min_fraction, rng, 1000 * n);
+    candidates += windows.size();
+    if (windows.empty())
+      break;
+
+    // one crop per thread, top to bottom through the file
+#pragma omp parallel for num_threads(opt::threads) schedule(dynamic, 1)
+    for (size_t i = 0; i < windows.size(); i++) {
+
+      if (err)
+	continue;
+      const CropWindow& c = windows[i];
+      
+      TileBuffer rgb = TileBufferPool::Global().Get(c.w * c.h * 3);
+      if (!rgb || ColorizeRegion(reader, dirs, kernel, c.x, c.y, c.w, c.h, rgb.data(), 1)) {
+	err = 1;
+	continue;
+      }
+
+      // same test as crop_random.sh
+      uint64_t sum[3] = {0, 0, 0};
+      for (uint64_t p = 0; p < c.w * c.h; p++)
+	for (int k = 0; k < 3; k++)
+	  sum[k] += rgb.data()[p * 3 + k];
+      double mean[3];
+      for (int k = 0; k < 3; k++)
+	mean[k] = 100.0 * sum[k] / (255.0 * c.w * c.h);
+      if (mean[0] < limit && mean[1] < limit && mean[2] < limit) {
+	dropped++;
+	continue;
+      }
+
+      if (annotate) {
+	DrawScaleBar(rgb.data(), c.w, c.h, um_per_pixel);
+	DrawLegend(rgb.data(), c.w, c.h, selected);
+      }
+      
+      std::string file = numbered_file(opt::outfile, written++);
+      if (WriteRGBImage(file, rgb.data(), c.w, c.h, quality)) {
+	err = 1;
+	continue;
+      }
+#pragma omp critical
+      std::cout << file << "\t" << c.x << "\t" << c.y << "\t" << c.w << "\t" << c.h << "\t" <<
+	mean[0] << "\t" << mean[1] << "\t" << mean[2] << std::endl;
+    }
+  }
+
+  if (err)
+    return 1;
+  
+  if (written < n)
+    std::cerr << "Warning: only found " << written << " of " << n << " non-empty crops" << std::endl;
+
+  if (opt::verbose) {
+    std::cerr << "...sampled " << candidates << " candidates, dropped " << dropped <<
+      " as dark, wrote " << written << " in " << std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count() << " ms" << std::endl;
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return 0;
+}
+
+static int palette(int argc, char** argv) {
+
+  bool die = false;
+  uint64_t box_w = 800, box_h = 100;
+  
+  const char* shortopts = "vw:h:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'w' : arg >> box_w; break;
+    case 'h' : arg >> box_h; break;
+    default: die = true;
+    }
+  }
+
+  if (die || !box_w || !box_h || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo palette [palette csv] [png/jpg out] <options>\n"
+      "  Draw a labelled color box for each channel of a palette, top to bottom\n"
+      "    -w, -h            Width and height of each box [800 x 100]\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  ChannelVector pal;
+  if (ReadPalette(opt::infile, pal))
+    return 1;
+  if (pal.empty()) {
+    fprintf(stderr, "Error: no channels in palette %s\n", opt::infile.c_str());
+    return 1;
+  }
+
+  std::vector<uint8_t> rgb;
+  DrawPaletteSheet(pal, box_w, box_h, rgb);
+  TVERB("...drew " << pal.size() << " swatches");
+  
+  return WriteRGBImage(opt::outfile, rgb.data(), box_w, box_h * pal.size());
+}
+
+static int dzi(int argc, char** argv) {
+
+  bool die = false;
+  std::string palette;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  uint32_t tile_size = DZI_TILE_SIZE;
+  std::string ext = "jpg";
+  int quality = ENCODE_JPEG_QUALITY;
+  
+  const char* shortopts = "vc:C:p:t:s:e:Q:m:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 's' : arg >> tile_size; break;
+    case 'e' : arg >> ext; break;
+    case 'Q' : arg >> quality; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || channel_list.empty() || palette.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo dzi [16-bit tiff] [out.dzi] <options>\n"
+      "  Colorize a multichannel tiff into a Deep Zoom image (out.dzi and out_files/)\n"
+      "  in one pass, with no RGB tiff in between\n"
+      "    -c                Comma-separated list of channels, by number or name (e.g. 0,1,4,5)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -s                Tile size [256]\n"
+      "    -e                Tile format, jpg, png or webp [jpg]\n"
+      "    -Q, --quality     JPEG/WebP quality [85]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+
+  ChannelVector selected;
+  if (select_channels(reader, channel_list, channels) ||
+      SelectPaletteChannels(palette, channels, reader.NumDirs(), selected, reader.ChannelNames()))
+    return 1;
+  std::vector<size_t> dirs(channels.begin(), channels.end());
+
+  std::string outbase = opt::outfile;
+  if (outbase.size() > 4 && outbase.compare(outbase.size() - 4, 4, ".dzi") == 0)
+    outbase.resize(outbase.size() - 4);
+  
+  int status = WriteDeepZoom(reader, dirs, ColorizeKernel(selected), outbase, tile_size,
+			     ext, quality, opt::verbose, opt::threads);
+  
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return status;
+}
+
+static int serve(int argc, char** argv) {
+
+  bool die = false;
+  std::string palette;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  int port = SERVE_PORT;
+  uint32_t tile_size = DZI_TILE_SIZE;
+  std::string ext = "jpg";
+  int quality = ENCODE_JPEG_QUALITY;
+  size_t cache_mb = SERVE_CACHE_MB;
+  
+  const char* shortopts = "vc:C:p:t:l:s:e:Q:M:m:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'l' : arg >> port; break;
+    case 's' : arg >> tile_size; break;
+    case 'e' : arg >> ext; break;
+    case 'Q' : arg >> quality; break;
+    case 'M' : arg >> cache_mb; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || palette.empty() || in_only_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo serve [16-bit tiff] <options>\n"
+      "  Serve a multichannel tiff as a Deep Zoom image on http://127.0.0.1:<port>/image.dzi,\n"
+      "  colorizing tiles on demand. Tile URLs may carry their own palette:\n"
+      "    ?palette=0,DAPI,0,0,255,500,8000;3,CD8,0,255,0,200,3000  or  ?channels=0,CD8\n"
+      "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -c                Default channels, by number or name [every palette row]\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -l                Port to listen on [8080]\n"
+      "    -s                Tile size [256]\n"
+      "    -e                Tile format, jpg, png or webp [jpg]\n"
+      "    -Q, --quality     JPEG/WebP quality [85]\n"
+      "    -M                MB of rendered tiles to keep [256]\n"
+      "    -t, --threads     Number of connections served at once [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Log every request to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get() || select_channels(reader, channel_list, channels))
+    return 1;
+
+  return ServeTiles(reader, palette, channels, port, tile_size, ext, quality, cache_mb,
+		    opt::verbose, opt::threads);
+}
+
+static int quant(int argc, char** argv) {
+
+  bool die = false;
+  std::string maskfile;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  
+  const char* shortopts = "vc:C:k:m:t:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'k' : arg >> maskfile; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 't' : arg >> opt::threads; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || maskfile.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo quant [image tiff] [out.csv] -k [mask tiff] <options>\n"
+      "  Measure every cell of a label mask: the mean of each channel, centroid and area.\n"
+      "  Writes an MCMICRO quantification table (gzipped if out ends in .gz)\n"
+      "    -k                Label mask, same size as the image, 0 is background\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML, Channel_<n>]\n"
+      "    -c                Comma-separated list of channels, by number or name [all]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  set_memory();
+  TiffReader image(opt::infile.c_str());
+  if (!image.get())
+    return 1;
+  TiffReader mask(maskfile.c_str());
+  if (!mask.get())
+    return 1;
+
+  if (select_channels(image, channel_list, channels))
+    return 1;
+  if (channels.empty())
+    for (size_t d = 0; d < image.NumDirs(); d++)
+      channels.push_back(d);
+
+  // columns are named after the marker file or OME-XML channel names
+  const std::vector<std::string>& names = image.ChannelNames();
+  std::vector<size_t> dirs;
+  std::vector<std::string> markers;
+  for (auto c : channels) {
+    dirs.push_back(c);
+    markers.push_back(names.empty() || names[c].empty() ? "Channel_" + std::to_string(c) : names[c]);
+  }
+
+  CellTable table;
+  if (QuantifyCells(image, dirs, mask, markers, table, opt::verbose, opt::threads))
+    return 1;
+  
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return WriteCellTable(table, opt::outfile, opt::threads);
 }
 
-#define DEBUG(x) std::cerr << #x << " = " << (x) << std::endl
+static int neighbors(int argc, char** argv) {
 
-#define TVERB(msg) \
-  if (opt::verbose) {		   \
-    std::cerr << msg << std::endl; \
+  bool die = false;
+  double radius = 0;
+  size_t k = 0;
+  
+  const char* shortopts = "vr:k:t:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'r' : arg >> radius; break;
+    case 'k' : arg >> k; break;
+    case 't' : arg >> opt::threads; break;
+    default: die = true;
+    }
   }
 
-static const char* shortopts = "hvr:g:b:q:c:m:p:C:";
-static const struct option longopts[] = {
-  { "verbose",                    no_argument, NULL, 'v' },
-  { "red",                        required_argument, NULL, 'r' },
-  { "green",                      required_argument, NULL, 'g' },
-  { "blue",                       required_argument, NULL, 'b' },
-  { "quant-file",                 required_argument, NULL, 'q' },
-  { "marker-file",                required_argument, NULL, 'm' },  
-  { "threads",                    required_argument, NULL, 'c' },
-  { "palette",                    required_argument, NULL, 'p' },
-  { "channels",                   required_argument, NULL, 'C' },  
-  { NULL, 0, NULL, 0 }
-};
+  if (die || (radius > 0) == (k > 0) || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo neighbors [quant csv] [out.npz] <options>\n"
+      "  Spatial neighbour graph of the X_centroid/Y_centroid of a quantification table,\n"
+      "  as a CSR matrix of distances for scipy.sparse.load_npz. One of:\n"
+      "    -r                Every cell within this distance (pixels)\n"
+      "    -k                The k nearest cells\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
 
-static const char *RUN_USAGE_MESSAGE =
-"Usage: tiffo [module] <options> infile outfile\n"
-"Modules:\n"
-"  compress - Zero out noise-only tiles for better compression\n"
-"  gray2rgb - Convert a 3-channel gray TIFF to a single RGB\n"
-"  colorize - Colorize select channels from a cycif tiff\n"
-"  mean - Give the mean pixel for each channel\n"
-"  csv - <placeholder for csv processing>\n"
-  "\n";
+  auto start = std::chrono::steady_clock::now();
+  
+  std::vector<double> x, y;
+  if (ReadCentroids(opt::infile, x, y, opt::threads))
+    return 1;
+  TVERB("...read " << x.size() << " cells in " << std::chrono::duration<double>(
+	  std::chrono::steady_clock::now() - start).count() << " s");
 
-static int compress(int argc, char** argv);
-static int gray2rgb(int argc, char** argv);
-static int findmean(int argc, char** argv);
-static int colorize(int argc, char** argv);
-static void parseRunOptions(int argc, char** argv);
+  NeighborGraph graph;
+  int status = radius > 0 ? RadiusNeighbors(x, y, radius, graph, opt::threads) :
+    NearestNeighbors(x, y, k, graph, opt::threads);
+  if (status)
+    return 1;
+  TVERB("...found " << graph.indices.size() << " edges in " << std::chrono::duration<double>(
+	  std::chrono::steady_clock::now() - start).count() << " s");
 
-// process in and outfile cmd arguments
-static bool in_out_process(int argc, char** argv);
-static bool in_only_process(int argc, char** argv);
-static bool check_readable(const std::string& filename);
+  return WriteNeighborGraph(graph, opt::outfile);
+}
 
-/*
-  https://github.com/LuaDist/libtiff/blob/43d5bd6d2da90e9bf254cd42c377e4d99008f00b/libtiff/tiffio.h#L61
+static int table(int argc, char** argv) {
+
+  bool die = false;
+  bool doubles = false;
+  int zip_level = 0;
   
-typedef	uint32 ttag_t;		// directory tag 
-typedef	uint16 tdir_t;		// directory index
-typedef	uint16 tsample_t;	// sample number
-typedef	uint32 tstrip_t;	// strip number
-typedef uint32 ttile_t;		// tile number
-typedef	int32 tsize_t;		// i/o size in bytes
-typedef	void* tdata_t;		// image data ref
-typedef	uint32 toff_t;		// file offset 
+  const char* shortopts = "vDz:t:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'D' : doubles = true; break;
+    case 'z' : arg >> zip_level; break;
+    case 't' : arg >> opt::threads; break;
+    default: die = true;
+    }
+  }
 
- */
+  if (die || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo table [quant csv] [out.ctab] <options>\n"
+      "  Convert a quantification table (plain or gzipped CSV) to a column table that\n"
+      "  tiffo and py/tiffo_table.py open by mapping it. Integer columns are stored as\n"
+      "  int32/int64, the rest as float32\n"
+      "    -D                Store the non-integer columns as float64\n"
+      "    -z                zlib level for columns that compress, 0 for none [0]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
 
-int main(int argc, char **argv) {
+  auto start = std::chrono::steady_clock::now();
+
+  CsvTable csv;
+  if (ReadCsvTable(opt::infile, csv, std::vector<std::string>(), opt::threads))
+    return 1;
+  TVERB("...read " << csv.rows() << " rows of " << csv.columns.size() << " columns in " <<
+	std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s");
   
-  // Check if a command line argument was provided
-  if (argc < 2) {
-    std::cerr << RUN_USAGE_MESSAGE;
+  if (WriteColumnTable(csv, opt::outfile, doubles, zip_level, opt::threads))
+    return 1;
+  TVERB("...wrote " << opt::outfile << " in " <<
+	std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s");
+
+  return 0;
+}
+
+static int extract(int argc, char** argv) {
+
+  bool die = false;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  
+  const char* shortopts = "vc:C:m:";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
+  }
+
+  if (die || channel_list.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo extract [tiff in] [tiff out] -c 0,4,12 <options>\n"
+      "  Write the chosen channels, in the order given, to a new multichannel tiff.\n"
+      "  Tiles are copied as stored, without re-encoding, pyramid SubIFDs come along\n"
+      "  and the OME-XML channel list is cut down to match\n"
+      "    -c                Comma-separated list of channels, by number or name (e.g. 0,4,12)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
-  parseRunOptions(argc, argv);
+  // only to resolve the channel list, the copy works on the raw file
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get() || select_channels(reader, channel_list, channels))
+    return 1;
+  std::vector<size_t> dirs(channels.begin(), channels.end());
   
-  // get the module
-  if (opt::module == "gray2rgb") {
-    return(gray2rgb(argc, argv));
-  } else if (opt::module == "compress") {
-    return(compress(argc, argv));
-  } else if (opt::module == "colorize") {
-    return(colorize(argc, argv));
-  } else if (opt::module == "mean") {
-    return(findmean(argc, argv));
-  } else {
-    assert(false);
+  return ExtractChannels(opt::infile, dirs, opt::outfile, opt::verbose);
+}
+
+static int afsub(int argc, char** argv) {
+
+  bool die = false;
+  bool per_tile = false;
+  double scale = -1;
+  std::string af_channel;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  
+  const char* shortopts = "va:c:C:m:s:Tt:K:H";
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'a' : arg >> af_channel; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 's' : arg >> scale; break;
+    case 'T' : per_tile = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
+    default: die = true;
+    }
   }
-  return 1;
+
+  if (die || af_channel.empty() || channel_list.empty() || in_out_process(argc, argv)) {
+    const char *USAGE_MESSAGE =
+      "Usage: tiffo afsub [tiff in] [tiff out] -a AF -c CD3,CD8 <options>\n"
+      "  Subtract the autofluorescence (AF) channel, times a scale factor, from the chosen\n"
+      "  markers and write every channel to a new multichannel tiff, tile by tile.\n"
+      "  Each marker's factor is a robust fit (median of marker / AF over the brighter\n"
+      "  half of the AF channel) on pixels sampled across the image\n"
+      "    -a                AF channel, by number or name\n"
+      "    -c                Comma-separated list of markers to correct, by number or name\n"
+      "    -s                Scale factor for every marker, instead of fitting one\n"
+      "    -T, --tiles       Refit the factor on each tile (the global fit where a tile has too little AF)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
+      "\n";
+    std::cerr << USAGE_MESSAGE;
+    return 1;
+  }
+
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  std::vector<int> af;
+  if (!reader.get() || select_channels(reader, channel_list, channels) ||
+      reader.ResolveChannels({af_channel}, af))
+    return 1;
+  std::vector<size_t> markers(channels.begin(), channels.end());
+
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+
+  int status = SubtractAutofluorescence(reader, af[0], markers, otif, scale, per_tile,
+					opt::verbose, opt::threads);
+  TIFFClose(otif);
+  if (status)
+    return 1;
+
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return 0;
 }
 
-static int findmean(int argc, char** argv) {
+static int flatfield(int argc, char** argv) {
 
   bool die = false;
-  const char* shortopts = "v";
+  uint64_t fw = 0, fh = 0, ox = 0, oy = 0;
+  std::string flatfile, darkfile;
+  std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  
+  const char* shortopts = "vf:o:F:D:c:C:m:t:K:H";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'f' :
+      {
+      char x = 0;
+      arg >> fw;
+      if (arg >> x && x == 'x')
+	arg >> fh;
+      else
+	fh = fw;
+      }
+      break;
+    case 'o' :
+      {
+      char comma = 0;
+      arg >> ox >> comma >> oy;
+      }
+      break;
+    case 'F' : arg >> flatfile; break;
+    case 'D' : arg >> darkfile; break;
+    case 'm' : arg >> opt::markerfile; break;
+    case 't' : arg >> opt::threads; break;
+    case 'C' :
+    case 'c' : 
+      {
+      std::string token;
+      while (std::getline(arg, token, ',')) 
+	channel_list.push_back(token);
+      }
+      break;  
     default: die = true;
     }
   }
 
-  if (die || in_only_process(argc, argv)) {
-    
+  if (die || (!fw && flatfile.empty()) || in_out_process(argc, argv)) {
     const char *USAGE_MESSAGE =
-      "Usage: tiffo findmean [tiff] <options>\n"
-      "  Print the mean pixel value of a TIFF\n"
-      "  -v, --verbose             Increase output to stderr"
+      "Usage: tiffo flatfield [tiff in] [tiff out] -f 1280x1080 <options>\n"
+      "  Correct the illumination shading that repeats with every field of view of a\n"
+      "  stitched image, as (pixel - dark) / flat, and write every channel to a new\n"
+      "  16-bit tiff, tile by tile. Without -F, each channel's flat field is estimated\n"
+      "  from the brighter half of up to 256 fields of view sampled across the image.\n"
+      "  Fields of view that overlap: give the stitching step with -f, and a flat (and\n"
+      "  dark) field of the whole camera frame is trimmed evenly on each side to it\n"
+      "    -f                Field of view step, WxH or a single edge [flat field size]\n"
+      "    -o                Top left of a whole field of view, X,Y [0,0]\n"
+      "    -F                Flat field tiff, one plane per channel or one for all\n"
+      "    -D                Dark field tiff, one plane per channel or one for all\n"
+      "    -c                Comma-separated list of channels to correct, by number or name [all]\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
+      "    -v, --verbose     Increase output to stderr\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
-  // open a tiff
-  // the "m" keeps it from being memory mapped, which for
-  // a single pass just causes memory overruns from the C memmap func
+  set_memory();
   TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
+  std::vector<size_t> dirs;
+  if (channel_list.empty()) {
+    for (size_t d = 0; d < reader.NumDirs(); d++)
+      dirs.push_back(d);
+  } else {
+    if (select_channels(reader, channel_list, channels))
+      return 1;
+    dirs.assign(channels.begin(), channels.end());
+  }
 
-  // this routine will handle printing output to stdout
-  reader.print_means();
+  TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
+  if (otif == NULL) {
+    fprintf(stderr, "Error opening %s for writing\n", opt::outfile.c_str());
+    return 1;
+  }
+
+  int status = CorrectFlatField(reader, dirs, otif, flatfile, darkfile, fw, fh, ox, oy,
+				opt::verbose, opt::threads);
+  TIFFClose(otif);
+  if (status)
+    return 1;
 
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
   return 0;
 }
 
@@ -194,11 +1324,16 @@ static int gray2rgb(int argc, char** argv) {
 static int compress(int argc, char** argv) {
 
   bool die = false;
-  const char* shortopts = "v";
+  bool pyramid = false;
+  const char* shortopts = "vt:PK:H";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 't' : arg >> opt::threads; break;
+    case 'P' : pyramid = true; break;
     default: die = true;
     }
   }
@@ -208,15 +1343,22 @@ static int compress(int argc, char** argv) {
     const char *USAGE_MESSAGE =
       "Usage: tiffo compress [tiff in] [tiff out] <options>\n"
       "  Zero out tiles with low signal, to improve compression ratio\n"
+      "  -K, --tile-cache          Decoded tile cache in MB [512]\n"
+      "  -H, --huge-pages          Back large tile buffers with huge pages\n"
       "  -v, --verbose             Increase output to stderr\n"
+      "  -t, --threads             Number of threads [1]\n"
+      "  -P, --pyramid             Add 2x-reduced levels to each channel as SubIFDs\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
   
-  // open either the red channel or the 3-IFD file
-  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  // open the multi-IFD file
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  if (!reader.get())
+    return 1;
   
   // Open the output TIFF file
   TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
@@ -227,12 +1369,16 @@ static int compress(int argc, char** argv) {
   // copy all of the tags from in to out
     //tiffcp2(r_itif, otif, false);
 
-  Compress(r_itif, otif);
+  int status = Compress(reader, otif, opt::threads, pyramid);
   
-  TIFFClose(r_itif);
   TIFFClose(otif);
 
-  return 0;
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
+  
+  return status;
 
 }
 
@@ -241,18 +1387,30 @@ static int colorize(int argc, char** argv) {
   bool die = false;
   std::string palette;
   std::vector<int> channels;
+  std::vector<std::string> channel_list;
+  bool pyramid = false;
+  bool tiles = false;
+  int quality = ENCODE_JPEG_QUALITY;
   
-  const char* shortopts = "vc:p:";
+  const char* shortopts = "vc:C:p:t:PTQ:m:K:H";
   for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
     std::istringstream arg(optarg != NULL ? optarg : "");
     switch (c) {
     case 'v' : opt::verbose = true; break;
+    case 'K' : arg >> opt::tile_cache_mb; break;
+    case 'H' : opt::huge_pages = true; break;
+    case 'm' : arg >> opt::markerfile; break;
     case 'p' : arg >> palette; break;      
+    case 't' : arg >> opt::threads; break;
+    case 'P' : pyramid = true; break;
+    case 'T' : tiles = true; break;
+    case 'Q' : arg >> quality; break;
+    case 'C' :
     case 'c' : 
       {
       std::string token;
       while (std::getline(arg, token, ',')) 
-	channels.push_back(std::stoi(token));
+	channel_list.push_back(token);
       }
       break;  
       
@@ -263,17 +1421,44 @@ static int colorize(int argc, char** argv) {
 
   if (die || in_out_process(argc, argv)) {
     const char *USAGE_MESSAGE =
-      "Usage: tiffo colorize [16-bit tiff] [rgb tiff] <options>\n"
+      "Usage: tiffo colorize [16-bit tiff] [rgb tiff/jpg/png/webp] <options>\n"
       "  Color a 16-bit multichannel tiff to certain channels and with pre-specified palette\n"
-      "    -c                Comma-separated list of channels (e.g. 0,1,4,5)\n"
+      "    -c                Comma-separated list of channels, by number or name (e.g. 0,1,4,5)\n"
+      "    -m, --marker-file Marker names, markers.csv or one per line [OME-XML names]\n"
       "    -p                Palette file of format: number,name,r,g,b,lower,upper\n"
+      "    -t, --threads     Number of threads [1]\n"
+      "    -P, --pyramid     Add 2x-reduced levels as SubIFDs\n"
+      "    -T, --tiles       For jpg/png/webp output, write each tile to its own out_row_col file\n"
+      "    -Q, --quality     JPEG/WebP quality, 100 for lossless WebP [85]\n"
+      "    -K, --tile-cache  Decoded tile cache in MB [512]\n"
+      "    -H, --huge-pages  Back large tile buffers with huge pages\n"
       "\n";
     std::cerr << USAGE_MESSAGE;
     return 1;
   }
 
-  // open either the red channel or the 3-IFD file
-  TIFF *r_itif = TIFFOpen(opt::infile.c_str(), "rm");
+  // open the multi-IFD file
+  set_memory();
+  TiffReader reader(opt::infile.c_str());
+  TIFF *r_itif = reader.get();
+  if (r_itif == NULL || select_channels(reader, channel_list, channels))
+    return 1;
+
+  // encoded images skip the RGB TIFF altogether
+  if (IsRGBImageFile(opt::outfile)) {
+    ChannelVector selected;
+    if (SelectPaletteChannels(palette, channels, reader.NumDirs(), selected,
+			      reader.ChannelNames()))
+      return 1;
+    std::vector<size_t> dirs(channels.begin(), channels.end());
+    int status = ColorizeToImage(reader, dirs, ColorizeKernel(selected), opt::outfile,
+				 tiles, quality, opt::verbose, opt::threads);
+    if (opt::verbose) {
+      TileCache::Global().PrintStats(std::cerr);
+      TileBufferPool::Global().PrintStats(std::cerr);
+    }
+    return status;
+  }
 
   // Open the output TIFF file
   TIFF* otif = TIFFOpen(opt::outfile.c_str(), "w8");
@@ -322,12 +1507,16 @@ static int colorize(int argc, char** argv) {
   //std::cerr << tiffprint(otif) << std::endl;
   
   // if this is a single 3 IFD file
-  Colorize(r_itif, otif, palette, channels, opt::verbose);
+  int status = Colorize(reader, otif, palette, channels, opt::verbose, opt::threads, pyramid);
   
-  TIFFClose(r_itif);
   TIFFClose(otif);
+
+  if (opt::verbose) {
+    TileCache::Global().PrintStats(std::cerr);
+    TileBufferPool::Global().PrintStats(std::cerr);
+  }
   
-  return 0;
+  return status;
 }
 
 
@@ -382,7 +1571,12 @@ static void parseRunOptions(int argc, char** argv) {
   }
   */
   
-  if (! (opt::module == "gray2rgb" || opt::module == "mean" || opt::module == "compress" || opt::module == "debug" || opt::module == "colorize") ) {
+  if (! (opt::module == "gray2rgb" || opt::module == "mean" || opt::module == "compress" || opt::module == "debug" || opt::module == "colorize" ||
+	 opt::module == "info" || opt::module == "scale" || opt::module == "crop" ||
+	 opt::module == "sample" || opt::module == "palette" || opt::module == "dzi" ||
+	 opt::module == "serve" || opt::module == "quant" || opt::module == "neighbors" ||
+	 opt::module == "table" || opt::module == "extract" || opt::module == "afsub" ||
+	 opt::module == "flatfield") ) {
     std::cerr << "Module " << opt::module << " not implemented" << std::endl;
     die = true;
   }
@@ -465,6 +1659,28 @@ static bool in_out_process(int argc, char** argv) {
 }
 
 
+static int select_channels(TiffReader& reader, const std::vector<std::string>& list,
+			   std::vector<int>& channels) {
+  
+  if (!opt::markerfile.empty() && reader.LoadMarkerNames(opt::markerfile))
+    return 1;
+  
+  if (opt::verbose && !reader.ChannelNames().empty()) {
+    std::cerr << "...channels:";
+    for (size_t d = 0; d < reader.ChannelNames().size(); d++)
+      std::cerr << " " << d << ":" << reader.ChannelNames()[d];
+    std::cerr << std::endl;
+  }
+
+  return reader.ResolveChannels(list, channels);
+}
+
+static void set_memory() {
+  if (opt::tile_cache_mb)
+    TileCache::Global().SetBudget(opt::tile_cache_mb << 20);
+  TileBufferPool::Global().SetHugePages(opt::huge_pages);
+}
+
 static bool check_readable(const std::string& filename) {
 
   std::ifstream file(filename);